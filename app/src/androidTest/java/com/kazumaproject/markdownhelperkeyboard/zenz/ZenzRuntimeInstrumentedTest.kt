@@ -15,10 +15,12 @@ import java.io.File
 import java.io.FileOutputStream
 import java.util.concurrent.CountDownLatch
 import java.util.concurrent.TimeUnit
+import java.util.concurrent.atomic.AtomicBoolean
 import java.util.concurrent.atomic.AtomicInteger
 import java.util.concurrent.atomic.AtomicReference
 import org.junit.After
 import org.junit.Assert.assertEquals
+import org.junit.Assert.assertFalse
 import org.junit.Assert.assertNotEquals
 import org.junit.Assert.assertTrue
 import org.junit.Assume.assumeTrue
@@ -84,6 +86,7 @@ class ZenzRuntimeInstrumentedTest {
                 "",
                 "ナガイニュウリョクヲレンゾクシテキャンセルスル",
                 128,
+                0,
                 noOpCallback(),
             )
             service.cancel(requestId)
@@ -143,8 +146,9 @@ class ZenzRuntimeInstrumentedTest {
                     }
                 }
 
-                override fun onStringResult(requestId: Long, result: String) = Unit
-                override fun onScoresResult(requestId: Long, scores: FloatArray) = Unit
+                override fun onStringResult(requestId: Long, result: String, truncated: Boolean) = Unit
+                override fun onScoresResult(requestId: Long, scores: FloatArray, truncated: Boolean) = Unit
+                override fun onNBestResult(requestId: Long, texts: Array<String>, scores: FloatArray) = Unit
 
                 override fun onError(callbackRequestId: Long, message: String) {
                     if (callbackRequestId == requestId) {
@@ -162,6 +166,7 @@ class ZenzRuntimeInstrumentedTest {
     private fun generate(service: IZenzRuntime, requestId: Long, input: String): String {
         val completed = CountDownLatch(1)
         val result = AtomicReference<String?>(null)
+        val resultTruncated = AtomicBoolean(false)
         val error = AtomicReference<String?>(null)
         service.generate(
             requestId,
@@ -173,17 +178,20 @@ class ZenzRuntimeInstrumentedTest {
             "",
             input,
             32,
+            0,
             object : IZenzRuntimeCallback.Stub() {
                 override fun onReady(requestId: Long, processId: Int) = Unit
 
-                override fun onStringResult(callbackRequestId: Long, value: String) {
+                override fun onStringResult(callbackRequestId: Long, value: String, truncated: Boolean) {
                     if (callbackRequestId == requestId) {
                         result.set(value)
+                        resultTruncated.set(truncated)
                         completed.countDown()
                     }
                 }
 
-                override fun onScoresResult(requestId: Long, scores: FloatArray) = Unit
+                override fun onScoresResult(requestId: Long, scores: FloatArray, truncated: Boolean) = Unit
+                override fun onNBestResult(requestId: Long, texts: Array<String>, scores: FloatArray) = Unit
 
                 override fun onError(callbackRequestId: Long, message: String) {
                     if (callbackRequestId == requestId) {
@@ -195,6 +203,8 @@ class ZenzRuntimeInstrumentedTest {
         )
         assertTrue("Zenz generate timed out", completed.await(30, TimeUnit.SECONDS))
         check(error.get() == null) { "Zenz generate failed: ${error.get()}" }
+        // Without a deadline the request always runs to the end.
+        assertFalse("Zenz generate without a deadline was truncated", resultTruncated.get())
         return result.get().orEmpty()
     }
 
@@ -206,6 +216,7 @@ class ZenzRuntimeInstrumentedTest {
     ): FloatArray {
         val completed = CountDownLatch(1)
         val result = AtomicReference<FloatArray?>(null)
+        val resultTruncated = AtomicBoolean(false)
         val error = AtomicReference<String?>(null)
         service.score(
             requestId,
@@ -217,17 +228,21 @@ class ZenzRuntimeInstrumentedTest {
             "",
             input,
             candidates,
+            0,
             object : IZenzRuntimeCallback.Stub() {
                 override fun onReady(requestId: Long, processId: Int) = Unit
-                override fun onStringResult(requestId: Long, result: String) = Unit
+                override fun onStringResult(requestId: Long, result: String, truncated: Boolean) = Unit
 
-                override fun onScoresResult(callbackRequestId: Long, scores: FloatArray) {
+                override fun onScoresResult(callbackRequestId: Long, scores: FloatArray, truncated: Boolean) {
                     if (callbackRequestId == requestId) {
                         result.set(scores)
+                        resultTruncated.set(truncated)
                         completed.countDown()
                     }
                 }
 
+                override fun onNBestResult(requestId: Long, texts: Array<String>, scores: FloatArray) = Unit
+
                 override fun onError(callbackRequestId: Long, message: String) {
                     if (callbackRequestId == requestId) {
                         error.set(message)
@@ -238,14 +253,16 @@ class ZenzRuntimeInstrumentedTest {
         )
         assertTrue("Zenz score timed out", completed.await(30, TimeUnit.SECONDS))
         check(error.get() == null) { "Zenz score failed: ${error.get()}" }
+        assertFalse("Zenz score without a deadline was truncated", resultTruncated.get())
         return result.get() ?: FloatArray(0)
     }
 
     private fun noOpCallback(): IZenzRuntimeCallback {
         return object : IZenzRuntimeCallback.Stub() {
             override fun onReady(requestId: Long, processId: Int) = Unit
-            override fun onStringResult(requestId: Long, result: String) = Unit
-            override fun onScoresResult(requestId: Long, scores: FloatArray) = Unit
+            override fun onStringResult(requestId: Long, result: String, truncated: Boolean) = Unit
+            override fun onScoresResult(requestId: Long, scores: FloatArray, truncated: Boolean) = Unit
+            override fun onNBestResult(requestId: Long, texts: Array<String>, scores: FloatArray) = Unit
             override fun onError(requestId: Long, message: String) = Unit
         }
     }
@@ -1,11 +1,17 @@
 package com.kazumaproject.markdownhelperkeyboard.zenz.runtime
 
+import android.app.ActivityManager
 import android.app.Service
 import android.content.Intent
+import android.os.Build
 import android.os.IBinder
 import com.kazumaproject.zenz.ZenzEngine
+import java.util.concurrent.CountDownLatch
 import java.util.concurrent.Executors
+import java.util.concurrent.atomic.AtomicBoolean
 import java.util.concurrent.atomic.AtomicLong
+import java.util.concurrent.atomic.AtomicReference
+import kotlin.concurrent.thread
 import kotlinx.coroutines.CoroutineDispatcher
 import kotlinx.coroutines.CoroutineScope
 import kotlinx.coroutines.SupervisorJob
@@ -36,6 +42,10 @@ class ZenzRuntimeService : Service() {
     @Volatile
     private var initializedModelPath: String? = null
 
+    private val threadTuningPrefs by lazy {
+        getSharedPreferences(THREAD_TUNING_PREFS, MODE_PRIVATE)
+    }
+
     private val binder = object : IZenzRuntime.Stub() {
         override fun initialize(
             requestId: Long,
@@ -45,6 +55,28 @@ class ZenzRuntimeService : Service() {
             callback: IZenzRuntimeCallback,
         ) {
             submit(requestId, callback) {
+                // Apply the runtime config first, so the warmup started by initModel builds the
+                // context the requests will use instead of one that is replaced right away.
+                // q8_0 K/V with flash attention halves the KV cache and drops the n_ctx-wide
+                // attention matrix from the compute buffer, which keeps n_ctx=4096 clear of the
+                // low memory killer.
+                ZenzEngine.setContextConfig(
+                    nCtx,
+                    nThreads,
+                    0,
+                    CONTEXT_UBATCH,
+                    0,
+                    ZenzEngine.KV_CACHE_TYPE_Q8_0,
+                    ZenzEngine.KV_CACHE_TYPE_Q8_0,
+                    true
+                )
+                ZenzEngine.setContextSizing(true, contextMemoryCapBytes())
+                ZenzEngine.setThreadpoolConfig(
+                    ZenzEngine.getPerformanceCpus(),
+                    THREADPOOL_PRIORITY,
+                    THREADPOOL_POLL_LEVEL
+                )
+                restoreThreadTuning()
                 if (!initialized || initializedModelPath != modelPath) {
                     initialized = false
                     initializedModelPath = null
@@ -54,8 +86,11 @@ class ZenzRuntimeService : Service() {
                         return@submit
                     }
                     initializedModelPath = modelPath
+                    logWarmupWhenReady()
                 }
-                ZenzEngine.setRuntimeConfig(nCtx, nThreads)
+                // Superseded results are never delivered (see isLatest), but a later request with
+                // the same prompt continues from the aborted output instead of regenerating it.
+                ZenzEngine.setSoftCancelEnabled(true)
                 initialized = true
                 callback.safeReady(requestId, android.os.Process.myPid())
             }
@@ -71,10 +106,49 @@ class ZenzRuntimeService : Service() {
             rightContext: String,
             input: String,
             maxTokens: Int,
+            deadlineMs: Int,
+            callback: IZenzRuntimeCallback,
+        ) {
+            submitScheduled(
+                requestId,
+                callback,
+                deliver = { result, truncated ->
+                    callback.safeStringResult(requestId, result as String, truncated)
+                },
+            ) { nativeCallback ->
+                ZenzEngine.submitGenerateV32(
+                    requestId,
+                    profile,
+                    topic,
+                    style,
+                    preference,
+                    leftContext,
+                    rightContext,
+                    input,
+                    maxTokens,
+                    deadlineMs,
+                    nativeCallback,
+                )
+            }
+        }
+
+        override fun generateNBest(
+            requestId: Long,
+            profile: String,
+            topic: String,
+            style: String,
+            preference: String,
+            leftContext: String,
+            rightContext: String,
+            input: String,
+            maxTokens: Int,
+            beamWidth: Int,
+            nBest: Int,
             callback: IZenzRuntimeCallback,
         ) {
             submitInitialized(requestId, callback) {
-                val result = ZenzEngine.generateWithContextAndConditionsV32(
+                val scores = FloatArray(nBest.coerceAtLeast(0))
+                val texts = ZenzEngine.generateNBestV32(
                     profile,
                     topic,
                     style,
@@ -83,8 +157,12 @@ class ZenzRuntimeService : Service() {
                     rightContext,
                     input,
                     maxTokens,
+                    beamWidth,
+                    scores,
                 )
-                if (isLatest(requestId)) callback.safeStringResult(requestId, result)
+                if (isLatest(requestId)) {
+                    callback.safeNBestResult(requestId, texts, scores.copyOf(texts.size))
+                }
             }
         }
 
@@ -98,10 +176,47 @@ class ZenzRuntimeService : Service() {
             rightContext: String,
             input: String,
             candidate: String,
+            deadlineMs: Int,
+            callback: IZenzRuntimeCallback,
+        ) {
+            submitScheduled(
+                requestId,
+                callback,
+                deliver = { result, truncated ->
+                    callback.safeStringResult(requestId, result as String, truncated)
+                },
+            ) { nativeCallback ->
+                ZenzEngine.submitCandidateEvaluateV32(
+                    requestId,
+                    profile,
+                    topic,
+                    style,
+                    preference,
+                    leftContext,
+                    rightContext,
+                    input,
+                    candidate,
+                    deadlineMs,
+                    nativeCallback,
+                )
+            }
+        }
+
+        override fun evaluateAndComplete(
+            requestId: Long,
+            profile: String,
+            topic: String,
+            style: String,
+            preference: String,
+            leftContext: String,
+            rightContext: String,
+            input: String,
+            candidate: String,
+            maxTokens: Int,
             callback: IZenzRuntimeCallback,
         ) {
             submitInitialized(requestId, callback) {
-                val result = ZenzEngine.candidateEvaluateV32(
+                val result = ZenzEngine.candidateEvaluateAndCompleteV32(
                     profile,
                     topic,
                     style,
@@ -110,12 +225,13 @@ class ZenzRuntimeService : Service() {
                     rightContext,
                     input,
                     candidate,
+                    maxTokens,
                 )
-                if (isLatest(requestId)) callback.safeStringResult(requestId, result)
+                if (isLatest(requestId)) callback.safeStringResult(requestId, result, truncated = false)
             }
         }
 
-        override fun score(
+        override fun evaluateDrafts(
             requestId: Long,
             profile: String,
             topic: String,
@@ -125,10 +241,11 @@ class ZenzRuntimeService : Service() {
             rightContext: String,
             input: String,
             candidates: Array<String>,
+            maxTokens: Int,
             callback: IZenzRuntimeCallback,
         ) {
             submitInitialized(requestId, callback) {
-                val scores = ZenzEngine.scoreCandidatesV32(
+                val results = ZenzEngine.candidateEvaluateDraftsV32(
                     profile,
                     topic,
                     style,
@@ -137,11 +254,59 @@ class ZenzRuntimeService : Service() {
                     rightContext,
                     input,
                     candidates,
+                    maxTokens,
                 )
-                if (isLatest(requestId)) callback.safeScoresResult(requestId, scores)
+                if (isLatest(requestId)) {
+                    callback.safeStringResult(
+                        requestId,
+                        results.joinToString(ZenzRuntimeClient.DRAFT_RESULT_SEPARATOR),
+                        truncated = false,
+                    )
+                }
             }
         }
 
+        override fun score(
+            requestId: Long,
+            profile: String,
+            topic: String,
+            style: String,
+            preference: String,
+            leftContext: String,
+            rightContext: String,
+            input: String,
+            candidates: Array<String>,
+            deadlineMs: Int,
+            callback: IZenzRuntimeCallback,
+        ) {
+            submitScheduled(
+                requestId,
+                callback,
+                deliver = { result, truncated ->
+                    callback.safeScoresResult(requestId, result as FloatArray, truncated)
+                },
+            ) { nativeCallback ->
+                ZenzEngine.submitScoreCandidatesV32(
+                    requestId,
+                    profile,
+                    topic,
+                    style,
+                    preference,
+                    leftContext,
+                    rightContext,
+                    input,
+                    candidates,
+                    deadlineMs,
+                    nativeCallback,
+                )
+            }
+        }
+
+        override fun recordCommit(text: String) {
+            // Only appends to a native ring buffer, so it does not wait behind the actor.
+            ZenzEngine.recordCommittedText(text)
+        }
+
         override fun cancel(requestId: Long) {
             val cancelledQueuedRequest = latestRequestId.compareAndSet(requestId, NO_REQUEST)
             if (cancelledQueuedRequest || activeRequestId.get() == requestId) {
@@ -184,6 +349,78 @@ class ZenzRuntimeService : Service() {
         }
     }
 
+    /**
+     * Hands a request to the native scheduler instead of the actor, so the Binder thread returns
+     * at once and a newer keystroke preempts the running decode natively. Requests that arrive
+     * before the model is loaded wait behind initialization on the actor, as before.
+     * [deliver] runs on the native scheduler thread and receives the result with its truncated
+     * flag, which the client sees through the callback.
+     */
+    private fun submitScheduled(
+        requestId: Long,
+        callback: IZenzRuntimeCallback,
+        deliver: (Any?, Boolean) -> Unit,
+        schedule: (ZenzEngine.RequestCallback) -> Unit,
+    ) {
+        if (!initialized) {
+            submitInitialized(requestId, callback) {
+                val done = CountDownLatch(1)
+                val delivered = AtomicReference<Any?>()
+                val deliveredTruncated = AtomicBoolean(false)
+                schedule(object : ZenzEngine.RequestCallback {
+                    override fun onResult(requestId: Long, result: Any?, truncated: Boolean) {
+                        delivered.set(result)
+                        deliveredTruncated.set(truncated)
+                        done.countDown()
+                    }
+
+                    override fun onSuperseded(requestId: Long) {
+                        done.countDown()
+                    }
+                })
+                done.await()
+                val result = delivered.get()
+                if (result != null && isLatest(requestId)) deliver(result, deliveredTruncated.get())
+            }
+            return
+        }
+        latestRequestId.set(requestId)
+        val nativeCallback = object : ZenzEngine.RequestCallback {
+            override fun onResult(requestId: Long, result: Any?, truncated: Boolean) {
+                if (truncated) Timber.d("Zenz request %s hit its deadline", requestId)
+                try {
+                    if (isLatest(requestId)) deliver(result, truncated)
+                } catch (error: Throwable) {
+                    Timber.e(error, "Zenz runtime request failed: %s", requestId)
+                    callback.safeError(
+                        requestId,
+                        error.message?.takeIf { it.isNotBlank() }
+                            ?: error.javaClass.simpleName
+                            ?: "Unknown Zenz runtime error.",
+                    )
+                } finally {
+                    finishScheduled(requestId)
+                }
+            }
+
+            override fun onSuperseded(requestId: Long) {
+                finishScheduled(requestId)
+            }
+        }
+        runCatching { schedule(nativeCallback) }
+            .onFailure { error ->
+                Timber.e(error, "Failed to schedule Zenz request: %s", requestId)
+                finishScheduled(requestId)
+                callback.safeError(requestId, error.message ?: error.javaClass.simpleName)
+            }
+    }
+
+    private fun finishScheduled(requestId: Long) {
+        if (latestRequestId.compareAndSet(requestId, NO_REQUEST)) {
+            scheduleIdleMaintenance()
+        }
+    }
+
     private fun submit(
         requestId: Long,
         callback: IZenzRuntimeCallback,
@@ -206,11 +443,90 @@ class ZenzRuntimeService : Service() {
                 )
             } finally {
                 activeRequestId.compareAndSet(requestId, NO_REQUEST)
-                latestRequestId.compareAndSet(requestId, NO_REQUEST)
+                if (latestRequestId.compareAndSet(requestId, NO_REQUEST)) {
+                    scheduleIdleMaintenance()
+                }
+            }
+        }
+    }
+
+    /**
+     * Compacts the native KV cache once the actor has no pending request. Prompt-prefix reuse
+     * leaves holes in the cache, and filling them between keystrokes keeps them off the next
+     * request's critical path. The context is also resized to the batch sizes seen so far, and
+     * the ggml worker threads are paused so they do not keep polling while the keyboard is idle.
+     */
+    private fun scheduleIdleMaintenance() {
+        actorScope.launch {
+            if (!initialized || latestRequestId.get() != NO_REQUEST) return@launch
+            runCatching { ZenzEngine.defragSessionIfIdle() }
+                .onFailure { Timber.w(it, "Zenz idle KV defragmentation failed") }
+            runCatching { ZenzEngine.resizeContextIfIdle() }
+                .onFailure { Timber.w(it, "Zenz idle context resize failed") }
+            runCatching { ZenzEngine.pauseThreadpoolIfIdle() }
+                .onFailure { Timber.w(it, "Zenz idle threadpool pause failed") }
+            runCatching { saveThreadTuning() }
+                .onFailure { Timber.w(it, "Failed to save Zenz thread tuning") }
+        }
+    }
+
+    /** Caps the KV cache and compute buffer at a share of the device RAM. */
+    private fun contextMemoryCapBytes(): Long {
+        val memoryInfo = ActivityManager.MemoryInfo()
+        (getSystemService(ACTIVITY_SERVICE) as? ActivityManager)?.getMemoryInfo(memoryInfo)
+        return memoryInfo.totalMem / CONTEXT_MEMORY_RAM_DIVISOR
+    }
+
+    /** Logs how long the native warmup took, without holding the actor while it runs. */
+    private fun logWarmupWhenReady() {
+        thread(name = "ZenzWarmupLog", isDaemon = true) {
+            if (ZenzEngine.awaitWarmup(WARMUP_LOG_TIMEOUT_MS)) {
+                val (pageIn, context, decode, total) = ZenzEngine.getWarmupTimings().toList()
+                Timber.d(
+                    "Zenz warmup: page-in %d ms, context %d ms, decode %d ms, total %d ms",
+                    pageIn, context, decode, total
+                )
+                val memory = ZenzEngine.getContextMemoryStats()
+                Timber.d(
+                    "Zenz context: KV %d KiB, compute ~%d KiB (n_ctx=%d, n_ubatch=%d)",
+                    memory[0] / 1024, memory[1] / 1024, memory[2], memory[4]
+                )
             }
         }
     }
 
+    /**
+     * Seeds the native prefill/decode thread tuner with the counts learned on this device model,
+     * so a new process starts from them instead of measuring from the maximum again.
+     */
+    private fun restoreThreadTuning() {
+        ZenzEngine.setAdaptiveThreadCounts(
+            true,
+            threadTuningPrefs.getInt(threadTuningKey(PREFILL_THREADS_KEY), 0),
+            threadTuningPrefs.getInt(threadTuningKey(DECODE_THREADS_KEY), 0)
+        )
+    }
+
+    private fun saveThreadTuning() {
+        val (prefill, decode) = ZenzEngine.getAdaptiveThreadCounts().let { it[0] to it[1] }
+        val prefillKey = threadTuningKey(PREFILL_THREADS_KEY)
+        val decodeKey = threadTuningKey(DECODE_THREADS_KEY)
+        val editor = threadTuningPrefs.edit()
+        var changed = false
+        if (prefill > 0 && threadTuningPrefs.getInt(prefillKey, 0) != prefill) {
+            editor.putInt(prefillKey, prefill)
+            changed = true
+        }
+        if (decode > 0 && threadTuningPrefs.getInt(decodeKey, 0) != decode) {
+            editor.putInt(decodeKey, decode)
+            changed = true
+        }
+        if (changed) editor.apply()
+    }
+
+    private fun threadTuningKey(phase: String): String =
+        "${Build.MANUFACTURER}/${Build.MODEL}/$phase"
+
     private fun isLatest(requestId: Long): Boolean = latestRequestId.get() == requestId
 
     private fun closeNativeRuntime() {
@@ -225,12 +541,28 @@ class ZenzRuntimeService : Service() {
         runCatching { onReady(requestId, processId) }
     }
 
-    private fun IZenzRuntimeCallback.safeStringResult(requestId: Long, result: String) {
-        runCatching { onStringResult(requestId, result) }
+    private fun IZenzRuntimeCallback.safeStringResult(
+        requestId: Long,
+        result: String,
+        truncated: Boolean,
+    ) {
+        runCatching { onStringResult(requestId, result, truncated) }
     }
 
-    private fun IZenzRuntimeCallback.safeScoresResult(requestId: Long, scores: FloatArray) {
-        runCatching { onScoresResult(requestId, scores) }
+    private fun IZenzRuntimeCallback.safeScoresResult(
+        requestId: Long,
+        scores: FloatArray,
+        truncated: Boolean,
+    ) {
+        runCatching { onScoresResult(requestId, scores, truncated) }
+    }
+
+    private fun IZenzRuntimeCallback.safeNBestResult(
+        requestId: Long,
+        texts: Array<String>,
+        scores: FloatArray,
+    ) {
+        runCatching { onNBestResult(requestId, texts, scores) }
     }
 
     private fun IZenzRuntimeCallback.safeError(requestId: Long, message: String) {
@@ -245,5 +577,26 @@ class ZenzRuntimeService : Service() {
 
     companion object {
         private const val NO_REQUEST = -1L
+
+        // Normal priority: raising it needs privileges the keyboard process does not have.
+        private const val THREADPOOL_PRIORITY = 0
+
+        // Short polling keeps workers warm between the graphs of one request without spinning
+        // long after it ends.
+        private const val THREADPOOL_POLL_LEVEL = 10
+
+        private const val WARMUP_LOG_TIMEOUT_MS = 30_000L
+
+        // Physical batch of one graph: the compute buffer grows with it, and prompts in the IME
+        // rarely exceed it.
+        private const val CONTEXT_UBATCH = 256
+
+        // 128 MiB on a 4 GiB device: room for a q8_0 KV cache at n_ctx=4096 without the
+        // keyboard process becoming a low memory killer target.
+        private const val CONTEXT_MEMORY_RAM_DIVISOR = 32L
+
+        private const val THREAD_TUNING_PREFS = "zenz_thread_tuning"
+        private const val PREFILL_THREADS_KEY = "prefill_threads"
+        private const val DECODE_THREADS_KEY = "decode_threads"
     }
 }
@@ -1082,6 +1082,12 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
         pendingZeroQueryKeyAfterCommit = committedText
     }
 
+    /** 確定した文字列を Zenz の n-gram ドラフト用の履歴に渡す */
+    private fun rememberZenzCommittedText(committedText: String) {
+        if (zenzEnableStatePreference != true || isPrivateMode) return
+        zenzRuntimeClient.recordCommit(committedText)
+    }
+
     private fun cancelZeroQueryLookup() {
         zeroQueryLookupJob?.cancel()
         zeroQueryLookupJob = null
@@ -15252,7 +15258,7 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
                 rightContext = zenzContext.rightContext,
                 input = insertString.hiraganaToKatakana(),
                 maxTokens = zenzMaximumLetterSizePreference ?: 32
-            )
+            ).value
 
             // 生成後もチェック
             ensureActive()
@@ -15301,7 +15307,16 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
             ensureActive()
             val runtimeConfig = resolveZenzRuntimeConfig() ?: return@withContext emptyList()
 
-            val stringFromZenz = zenzRuntimeClient.evaluate(
+            // 辞書候補の上位をドラフトとしてまとめて検証し、最も長く受理されたものを採用する。
+            // FIX が必要な場合もランタイム側で検証済みの KV から生成を続けてもらい、
+            // generate による 2 回目の prefill を省く。
+            val drafts = suggesions
+                .take(nBest ?: 4)
+                .map { it.string }
+                .filter { it.isNotEmpty() }
+                .distinct()
+                .ifEmpty { listOf(firstCandidate) }
+            val stringsFromZenz = zenzRuntimeClient.evaluateDrafts(
                 config = runtimeConfig,
                 profile = zenzProfilePreference ?: "",
                 topic = "",
@@ -15310,14 +15325,20 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
                 leftContext = zenzContext.leftContext,
                 rightContext = zenzContext.rightContext,
                 input = insertString.hiraganaToKatakana(),
-                candidate = firstCandidate
+                candidates = drafts.toTypedArray(),
+                maxTokens = zenzMaximumLetterSizePreference ?: 32
             )
 
             ensureActive()
 
-            Timber.d("performZenzaiRequest: [$firstCandidate] result: [$stringFromZenz]")
+            Timber.d("performZenzaiRequest: $drafts result: $stringsFromZenz")
 
-            val zenzaiResultType = CandidateEvaluationResult.parse(stringFromZenz)
+            val selectedDraft = CandidateEvaluationResult.selectDraft(
+                drafts,
+                stringsFromZenz.map { CandidateEvaluationResult.parse(it) }
+            )
+            val acceptedCandidate = selectedDraft?.let { drafts.getOrNull(it.index) } ?: firstCandidate
+            val zenzaiResultType = selectedDraft?.value ?: CandidateEvaluationResult.Error
 
             var type = 33
             var parsedResultText = ""
@@ -15330,58 +15351,34 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
 
                 is CandidateEvaluationResult.FixRequired -> {
                     val prefix = zenzaiResultType.prefix
-                    // prefix と前方一致する candidate.string を suggesions から探す
-                    // 見つからなければ firstCandidate を採用
-
-                    val firstCandidateFromPrefix = suggesions
-                        .subList(0, (nBest ?: 4))
-                        .firstOrNull { it.string.startsWith(prefix) }
-                        ?.string
-
-                    Timber.d("CandidateEvaluationResult.FixRequired :[$firstCandidateFromPrefix] [$prefix] [$insertString] [${suggesions.map { it.string }}]")
-
-
-                    val firstCandidateFromKanakanjiEngine = ZenzCandidate(
-                        string = firstCandidateFromPrefix ?: firstCandidate,
-                        type = (37).toByte(),
-                        length = insertString.length.toUByte(),
-                        score = 2000,
-                        originalString = insertString
-                    )
-
-                    val secondCandidateFromZenz = ZenzCandidate(
-                        string = zenzRuntimeClient.generate(
-                            config = runtimeConfig,
-                            profile = zenzProfilePreference ?: "",
-                            topic = "",
-                            style = "",
-                            preference = "",
-                            leftContext = prefix,
-                            rightContext = zenzContext.rightContext,
-                            input = insertString.hiraganaToKatakana(),
-                            maxTokens = zenzMaximumLetterSizePreference ?: 32
-                        ),
-                        type = (40).toByte(),
-                        length = insertString.length.toUByte(),
-                        score = 2000,
-                        originalString = insertString
+                    Timber.d("CandidateEvaluationResult.FixRequired :[$prefix] [$insertString] [${suggesions.map { it.string }}]")
+                    val generated = zenzRuntimeClient.generate(
+                        config = runtimeConfig,
+                        profile = zenzProfilePreference ?: "",
+                        topic = "",
+                        style = "",
+                        preference = "",
+                        leftContext = prefix,
+                        rightContext = zenzContext.rightContext,
+                        input = insertString.hiraganaToKatakana(),
+                        maxTokens = zenzMaximumLetterSizePreference ?: 32
+                    ).value
+                    return@withContext listOf(
+                        selectFixedZenzCandidate(prefix, generated, insertString, suggesions)
                     )
+                }
 
-                    val candidates = listOf(
-                        secondCandidateFromZenz,
-                        firstCandidateFromKanakanjiEngine,
+                is CandidateEvaluationResult.FixCompleted -> {
+                    val prefix = zenzaiResultType.prefix
+                    Timber.d("CandidateEvaluationResult.FixCompleted :[$prefix] [${zenzaiResultType.result}] [$insertString]")
+                    return@withContext listOf(
+                        selectFixedZenzCandidate(prefix, zenzaiResultType.result, insertString, suggesions)
                     )
-
-                    val topCandidate = candidates
-                        .maxByOrNull { it.rank(prefix) }
-                        ?: secondCandidateFromZenz
-
-                    return@withContext listOfNotNull(topCandidate)
                 }
 
                 is CandidateEvaluationResult.Pass -> {
                     type = 36
-                    parsedResultText = firstCandidate
+                    parsedResultText = acceptedCandidate
                 }
 
                 is CandidateEvaluationResult.WholeResult -> {
@@ -15482,7 +15479,7 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
                 rightContext = plan.rightContext,
                 input = insertString.hiraganaToKatakana(),
                 candidates = plan.rerankTargets.map { it.value.string }.toTypedArray()
-            )
+            ).value
         }
 
         if (rawScores.size != plan.rerankTargets.size) {
@@ -15782,6 +15779,37 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
         return counts.values.sumOf { (it - 1).coerceAtLeast(0) } // 2回目以降の総数
     }
 
+    /**
+     * FIX になった変換で、Zenz が prefix から生成した結果と、prefix と前方一致する辞書の上位候補
+     * (無ければ 1 位の候補) のうち rank の高い方を返す。
+     */
+    private fun selectFixedZenzCandidate(
+        prefix: String,
+        zenzResult: String,
+        insertString: String,
+        suggesions: List<Candidate>,
+    ): ZenzCandidate {
+        val candidateFromPrefix = suggesions
+            .take(nBest ?: 4)
+            .firstOrNull { it.string.startsWith(prefix) }
+            ?.string
+        val fromKanaKanjiEngine = ZenzCandidate(
+            string = candidateFromPrefix ?: suggesions.firstOrNull()?.string.orEmpty(),
+            type = (37).toByte(),
+            length = insertString.length.toUByte(),
+            score = 2000,
+            originalString = insertString
+        )
+        val fromZenz = ZenzCandidate(
+            string = zenzResult,
+            type = (40).toByte(),
+            length = insertString.length.toUByte(),
+            score = 2000,
+            originalString = insertString
+        )
+        return listOf(fromZenz, fromKanaKanjiEngine).maxByOrNull { it.rank(prefix) } ?: fromZenz
+    }
+
     private fun ZenzCandidate.rank(prefix: String): Int {
         val prefixScore = commonPrefixLength(this.string, prefix) * 10
         val kanjiScore = this.string.kanjiCount() * 3
@@ -21304,6 +21332,7 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
         }
         if (candidateString.isNotBlank() && stringInTail.get().isEmpty()) {
             rememberZeroQueryKeyAfterCommit(candidateString)
+            rememberZenzCommittedText(candidateString)
         }
         _inputString.update { "" }
         commitText(candidateString, 1)
@@ -21457,6 +21486,7 @@ class IMEService : InputMethodService(), LifecycleOwner, InputConnection,
         }
         if (candidateString.isNotBlank() && stringInTail.get().isEmpty()) {
             rememberZeroQueryKeyAfterCommit(candidateString)
+            rememberZenzCommittedText(candidateString)
         }
         _inputString.update { "" }
         commitText(candidateString, 1)
@@ -13,13 +13,19 @@ sealed class CandidateEvaluationResult {
     /** EOSが先に出現した場合。resultはその位置までの結果 */
     data class WholeResult(val result: String) : CandidateEvaluationResult()
 
+    /** 不一致の位置からそのまま生成を続けた場合。prefixは FixRequired と同じ、resultは修正後の出力全体 */
+    data class FixCompleted(val prefix: String, val result: String) : CandidateEvaluationResult()
+
     companion object {
+        private const val COMPLETE_SEPARATOR = '\u001F'
+
         /**
          * JNI から返された文字列を解析して CandidateEvaluationResult に変換する
          * フォーマット:
          * - "PASS:<score>"
          * - "FIX:<prefix>"
          * - "WHOLE:<result>"
+         * - "COMPLETE:<prefix>\u001F<result>"
          * - "ERROR"
          */
         fun parse(raw: String?): CandidateEvaluationResult {
@@ -35,6 +41,19 @@ sealed class CandidateEvaluationResult {
                     FixRequired(prefix)
                 }
 
+                raw.startsWith("COMPLETE:") -> {
+                    val body = raw.removePrefix("COMPLETE:")
+                    val separator = body.indexOf(COMPLETE_SEPARATOR)
+                    if (separator < 0) {
+                        Error
+                    } else {
+                        FixCompleted(
+                            prefix = body.substring(0, separator),
+                            result = body.substring(separator + 1)
+                        )
+                    }
+                }
+
                 raw.startsWith("WHOLE:") -> {
                     val result = raw.removePrefix("WHOLE:")
                     WholeResult(result)
@@ -43,5 +62,38 @@ sealed class CandidateEvaluationResult {
                 else -> Error
             }
         }
+
+        /**
+         * 複数ドラフトの評価結果から採用するものを選ぶ。results[i] は drafts[i] の評価結果。
+         * PASS があれば最も長いドラフト (同じ長さならスコア最大) を選ぶ。PASS は候補の後ろに
+         * EOS を要求しないので、スコア (対数確率の和) で比べると項の少ない短い接頭辞
+         * (今日 と 今日は なら 今日) が常に勝ち、読みの残りが落ちてしまう。
+         * PASS がなければ生成を続けた FixCompleted、それもなければ受理された接頭辞が最も長いものを返す。
+         */
+        fun selectDraft(
+            drafts: List<String>,
+            results: List<CandidateEvaluationResult>
+        ): IndexedValue<CandidateEvaluationResult>? {
+            val indexed = results.withIndex()
+            indexed
+                .filter { it.value is Pass }
+                .maxWithOrNull(
+                    compareBy<IndexedValue<CandidateEvaluationResult>> {
+                        drafts.getOrNull(it.index)?.length ?: 0
+                    }.thenBy { (it.value as Pass).score }
+                )
+                ?.let { return it }
+            indexed.firstOrNull { it.value is FixCompleted }?.let { return it }
+            return indexed
+                .filter { it.value is FixRequired || it.value is WholeResult }
+                .maxByOrNull {
+                    when (val value = it.value) {
+                        is FixRequired -> value.prefix.length
+                        is WholeResult -> value.result.length
+                        else -> 0
+                    }
+                }
+                ?: indexed.firstOrNull()
+        }
     }
 }
@@ -25,6 +25,21 @@ data class ZenzRuntimeConfig(
 
 class ZenzProcessException(message: String) : IllegalStateException(message)
 
+/** One beam search result; [score] is the sum of the token log probabilities. */
+data class ZenzNBestCandidate(
+    val text: String,
+    val score: Float,
+)
+
+/**
+ * Result of a request that can run against a deadline. [truncated] is true when the runtime ran
+ * out of the deadline and [value] holds only the part it finished.
+ */
+data class ZenzTimedResult<T>(
+    val value: T,
+    val truncated: Boolean,
+)
+
 /**
  * Main-process facade for the Zenz native runtime hosted by [ZenzRuntimeService].
  *
@@ -38,8 +53,9 @@ class ZenzRuntimeClient @Inject constructor(
 ) {
     private sealed interface RuntimeResult {
         data class Ready(val processId: Int) : RuntimeResult
-        data class Text(val value: String) : RuntimeResult
-        data class Scores(val values: FloatArray) : RuntimeResult
+        data class Text(val value: String, val truncated: Boolean) : RuntimeResult
+        data class Scores(val values: FloatArray, val truncated: Boolean) : RuntimeResult
+        data class NBest(val texts: Array<String>, val scores: FloatArray) : RuntimeResult
     }
 
     private val connectionMutex = Mutex()
@@ -89,6 +105,10 @@ class ZenzRuntimeClient @Inject constructor(
         }
     }
 
+    /**
+     * With [deadlineMs] > 0 the runtime stops generating when the next token would miss the
+     * deadline and returns the text generated so far, marked as truncated.
+     */
     suspend fun generate(
         config: ZenzRuntimeConfig,
         profile: String,
@@ -99,7 +119,8 @@ class ZenzRuntimeClient @Inject constructor(
         rightContext: String,
         input: String,
         maxTokens: Int,
-    ): String = operationMutex.withLock {
+        deadlineMs: Int = NO_DEADLINE,
+    ): ZenzTimedResult<String> = operationMutex.withLock {
         val service = connect()
         ensureInitializedLocked(service, config)
         val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
@@ -113,13 +134,19 @@ class ZenzRuntimeClient @Inject constructor(
                 rightContext,
                 input,
                 maxTokens,
+                deadlineMs,
                 callback,
             )
         }
-        (result as? RuntimeResult.Text)?.value
+        val text = result as? RuntimeResult.Text
             ?: throw ZenzProcessException("Zenz returned an unexpected generate response.")
+        ZenzTimedResult(text.value, text.truncated)
     }
 
+    /**
+     * With [deadlineMs] > 0 a request that misses the deadline returns "ERROR" marked as
+     * truncated, which tells it apart from a candidate the runtime could not evaluate.
+     */
     suspend fun evaluate(
         config: ZenzRuntimeConfig,
         profile: String?,
@@ -130,7 +157,8 @@ class ZenzRuntimeClient @Inject constructor(
         rightContext: String?,
         input: String,
         candidate: String,
-    ): String = operationMutex.withLock {
+        deadlineMs: Int = NO_DEADLINE,
+    ): ZenzTimedResult<String> = operationMutex.withLock {
         val service = connect()
         ensureInitializedLocked(service, config)
         val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
@@ -144,6 +172,45 @@ class ZenzRuntimeClient @Inject constructor(
                 rightContext.orEmpty(),
                 input,
                 candidate,
+                deadlineMs,
+                callback,
+            )
+        }
+        val text = result as? RuntimeResult.Text
+            ?: throw ZenzProcessException("Zenz returned an unexpected evaluate response.")
+        ZenzTimedResult(text.value, text.truncated)
+    }
+
+    /**
+     * Evaluates [candidate] and, when it needs a fix, lets the runtime continue greedy decoding
+     * from the verified prefix in the same request instead of a separate [generate] call.
+     */
+    suspend fun evaluateAndComplete(
+        config: ZenzRuntimeConfig,
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String,
+        candidate: String,
+        maxTokens: Int,
+    ): String = operationMutex.withLock {
+        val service = connect()
+        ensureInitializedLocked(service, config)
+        val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
+            service.evaluateAndComplete(
+                requestId,
+                profile.orEmpty(),
+                topic.orEmpty(),
+                style.orEmpty(),
+                preference.orEmpty(),
+                leftContext.orEmpty(),
+                rightContext.orEmpty(),
+                input,
+                candidate,
+                maxTokens,
                 callback,
             )
         }
@@ -151,6 +218,90 @@ class ZenzRuntimeClient @Inject constructor(
             ?: throw ZenzProcessException("Zenz returned an unexpected evaluate response.")
     }
 
+    /**
+     * Runs one batched beam search of [beamWidth] beams and returns up to [nBest] distinct
+     * conversions, best first.
+     */
+    suspend fun generateNBest(
+        config: ZenzRuntimeConfig,
+        profile: String,
+        topic: String,
+        style: String,
+        preference: String,
+        leftContext: String,
+        rightContext: String,
+        input: String,
+        maxTokens: Int,
+        beamWidth: Int,
+        nBest: Int,
+    ): List<ZenzNBestCandidate> = operationMutex.withLock {
+        val service = connect()
+        ensureInitializedLocked(service, config)
+        val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
+            service.generateNBest(
+                requestId,
+                profile,
+                topic,
+                style,
+                preference,
+                leftContext,
+                rightContext,
+                input,
+                maxTokens,
+                beamWidth,
+                nBest,
+                callback,
+            )
+        }
+        val nBestResult = result as? RuntimeResult.NBest
+            ?: throw ZenzProcessException("Zenz returned an unexpected n-best response.")
+        nBestResult.texts.zip(nBestResult.scores.toList()) { text, score ->
+            ZenzNBestCandidate(text, score)
+        }
+    }
+
+    /**
+     * Verifies all [candidates] as speculative drafts in one runtime request. The returned
+     * evaluation strings follow the order of [candidates].
+     */
+    suspend fun evaluateDrafts(
+        config: ZenzRuntimeConfig,
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String,
+        candidates: Array<String>,
+        maxTokens: Int,
+    ): List<String> = operationMutex.withLock {
+        val service = connect()
+        ensureInitializedLocked(service, config)
+        val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
+            service.evaluateDrafts(
+                requestId,
+                profile.orEmpty(),
+                topic.orEmpty(),
+                style.orEmpty(),
+                preference.orEmpty(),
+                leftContext.orEmpty(),
+                rightContext.orEmpty(),
+                input,
+                candidates,
+                maxTokens,
+                callback,
+            )
+        }
+        val text = (result as? RuntimeResult.Text)?.value
+            ?: throw ZenzProcessException("Zenz returned an unexpected evaluate response.")
+        if (candidates.isEmpty()) emptyList() else text.split(DRAFT_RESULT_SEPARATOR)
+    }
+
+    /**
+     * With [deadlineMs] > 0 the runtime scores candidates in order while the scoring decode
+     * fits the deadline and returns NaN for the rest, marked as truncated.
+     */
     suspend fun score(
         config: ZenzRuntimeConfig,
         profile: String?,
@@ -161,7 +312,8 @@ class ZenzRuntimeClient @Inject constructor(
         rightContext: String?,
         input: String?,
         candidates: Array<String>,
-    ): FloatArray = operationMutex.withLock {
+        deadlineMs: Int = NO_DEADLINE,
+    ): ZenzTimedResult<FloatArray> = operationMutex.withLock {
         val service = connect()
         ensureInitializedLocked(service, config)
         val result = executeLocked(service, GENERATE_TIMEOUT_MS) { requestId, callback ->
@@ -175,11 +327,22 @@ class ZenzRuntimeClient @Inject constructor(
                 rightContext.orEmpty(),
                 input.orEmpty(),
                 candidates,
+                deadlineMs,
                 callback,
             )
         }
-        (result as? RuntimeResult.Scores)?.values
+        val scores = result as? RuntimeResult.Scores
             ?: throw ZenzProcessException("Zenz returned an unexpected score response.")
+        ZenzTimedResult(scores.values, scores.truncated)
+    }
+
+    /**
+     * Sends committed text to the runtime's n-gram drafting history. This is a best-effort
+     * one-way call and does nothing while the runtime is not connected.
+     */
+    fun recordCommit(text: String) {
+        if (text.isBlank()) return
+        runCatching { runtime?.recordCommit(text) }
     }
 
     fun cancelActive() {
@@ -259,15 +422,25 @@ class ZenzRuntimeClient @Inject constructor(
                 }
             }
 
-            override fun onStringResult(callbackRequestId: Long, result: String) {
+            override fun onStringResult(callbackRequestId: Long, result: String, truncated: Boolean) {
                 if (callbackRequestId == requestId && !completion.isCompleted) {
-                    completion.complete(RuntimeResult.Text(result))
+                    completion.complete(RuntimeResult.Text(result, truncated))
                 }
             }
 
-            override fun onScoresResult(callbackRequestId: Long, scores: FloatArray) {
+            override fun onScoresResult(callbackRequestId: Long, scores: FloatArray, truncated: Boolean) {
                 if (callbackRequestId == requestId && !completion.isCompleted) {
-                    completion.complete(RuntimeResult.Scores(scores))
+                    completion.complete(RuntimeResult.Scores(scores, truncated))
+                }
+            }
+
+            override fun onNBestResult(
+                callbackRequestId: Long,
+                texts: Array<String>,
+                scores: FloatArray,
+            ) {
+                if (callbackRequestId == requestId && !completion.isCompleted) {
+                    completion.complete(RuntimeResult.NBest(texts, scores))
                 }
             }
 
@@ -372,5 +545,11 @@ class ZenzRuntimeClient @Inject constructor(
         private const val BIND_TIMEOUT_MS = 10_000L
         private const val INITIALIZE_TIMEOUT_MS = 30_000L
         private const val GENERATE_TIMEOUT_MS = 30_000L
+
+        /** Passed as deadlineMs when a request may take as long as it needs. */
+        const val NO_DEADLINE = 0
+
+        /** Joins the per-draft results of evaluateDrafts into one string result. */
+        const val DRAFT_RESULT_SEPARATOR = "\u001E"
     }
 }
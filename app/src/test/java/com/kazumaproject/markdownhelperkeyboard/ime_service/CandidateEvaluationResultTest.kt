@@ -0,0 +1,71 @@
+package com.kazumaproject.markdownhelperkeyboard.ime_service
+
+import com.kazumaproject.markdownhelperkeyboard.ime_service.models.CandidateEvaluationResult
+import org.junit.Assert.assertEquals
+import org.junit.Assert.assertNull
+import org.junit.Test
+
+class CandidateEvaluationResultTest {
+    @Test
+    fun parse_readsEveryResultFormat() {
+        assertEquals(CandidateEvaluationResult.Pass(-1.5f), CandidateEvaluationResult.parse("PASS:-1.5"))
+        assertEquals(CandidateEvaluationResult.FixRequired("今日"), CandidateEvaluationResult.parse("FIX:今日"))
+        assertEquals(CandidateEvaluationResult.WholeResult("今日"), CandidateEvaluationResult.parse("WHOLE:今日"))
+        assertEquals(
+            CandidateEvaluationResult.FixCompleted("今", "今日は"),
+            CandidateEvaluationResult.parse("COMPLETE:今\u001F今日は")
+        )
+        assertEquals(CandidateEvaluationResult.Error, CandidateEvaluationResult.parse("COMPLETE:今"))
+        assertEquals(CandidateEvaluationResult.Error, CandidateEvaluationResult.parse(null))
+        assertEquals(CandidateEvaluationResult.Error, CandidateEvaluationResult.parse("ERROR"))
+    }
+
+    @Test
+    fun selectDraft_prefersTheLongestPassingDraftOverAHigherScoringPrefix() {
+        val selected = CandidateEvaluationResult.selectDraft(
+            listOf("今日", "今日は", "京は"),
+            listOf(
+                CandidateEvaluationResult.parse("PASS:-0.5"),
+                CandidateEvaluationResult.parse("PASS:-2.0"),
+                CandidateEvaluationResult.parse("FIX:今")
+            )
+        )
+
+        assertEquals(1, selected?.index)
+    }
+
+    @Test
+    fun selectDraft_breaksLengthTiesByScore() {
+        val selected = CandidateEvaluationResult.selectDraft(
+            listOf("今日は", "京都は"),
+            listOf(
+                CandidateEvaluationResult.parse("PASS:-3.0"),
+                CandidateEvaluationResult.parse("PASS:-1.0")
+            )
+        )
+
+        assertEquals(1, selected?.index)
+    }
+
+    @Test
+    fun selectDraft_fallsBackToCompletedThenLongestAcceptedPrefix() {
+        val completed = CandidateEvaluationResult.selectDraft(
+            listOf("今日", "京は"),
+            listOf(
+                CandidateEvaluationResult.parse("FIX:今日"),
+                CandidateEvaluationResult.parse("COMPLETE:今\u001F今日は")
+            )
+        )
+        assertEquals(1, completed?.index)
+
+        val prefix = CandidateEvaluationResult.selectDraft(
+            listOf("京は", "今日わ"),
+            listOf(
+                CandidateEvaluationResult.parse("FIX:今"),
+                CandidateEvaluationResult.parse("FIX:今日は")
+            )
+        )
+        assertEquals(1, prefix?.index)
+        assertNull(CandidateEvaluationResult.selectDraft(emptyList(), emptyList()))
+    }
+}
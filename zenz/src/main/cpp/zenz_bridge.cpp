@@ -5,8 +5,27 @@
 #include <atomic>
 #include <cstdint>
 #include <cmath>
+#include <algorithm>
+#include <set>
+#include <functional>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <android/log.h>
 #include "llama.h"
+#include "ggml-cpu.h"
+#include "zenz_logits.h"
+#include "zenz_cpu.h"
+#include "zenz_prefix.h"
 
 #define LOGI(...) __android_log_print(ANDROID_LOG_INFO,  "zenz-bridge", __VA_ARGS__)
 #define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, "zenz-bridge", __VA_ARGS__)
@@ -15,45 +34,181 @@
 // コンテキストはセッションで使い回す。
 static llama_model *g_model = nullptr;
 static const llama_vocab *g_vocab = nullptr;
+// 投機的デコーディング用の小さなドラフトモデル (任意)。語彙はメインモデルと同じものに限る。
+static llama_model *g_draft_model = nullptr;
 
 // ランタイム設定用パラメータ（Kotlin から変更可能）
 static int g_param_n_ctx = 512;
 static int g_param_n_threads = 4;
 static int g_param_n_threads_batch = 4;
 static int g_param_n_batch = 512;
+// 候補の一括採点で 1 候補 1 seq に分けるため、seq 0 (プロンプト) + 候補分の seq を確保する。
+static int g_param_n_seq_max = 16;
+// 1 回の計算グラフで処理する物理バッチ。計算バッファはこの幅で確保される。
+static int g_param_n_ubatch = 512;
+// KV キャッシュの型 (F16 / Q8_0 / Q4_0) と flash attention。量子化した V は flash attention が要る。
+static ggml_type g_param_type_k = GGML_TYPE_F16;
+static ggml_type g_param_type_v = GGML_TYPE_F16;
+static bool g_param_flash_attn = false;
+// ggml のスレッドプールを置く CPU (空なら affinity を指定しない)、優先度 (ggml_sched_priority)、
+// ポーリングの強さ (0-100)。
+static std::vector<int> g_param_threadpool_cpus;
+static int g_param_threadpool_priority = GGML_SCHED_PRIO_NORMAL;
+static int g_param_threadpool_poll = 50;
 static std::mutex g_param_mutex;   // 設定値の読み書き用
 static std::atomic<uint64_t> g_request_seq{0};
+static std::atomic<bool> g_batched_scoring_enabled{true};
+static std::atomic<bool> g_ngram_drafting_enabled{true};
+static std::atomic<bool> g_reading_constrained_decoding_enabled{false};
+static std::atomic<bool> g_head_scoring_enabled{true};
+static std::atomic<bool> g_vocab_shortlist_enabled{false};
+static std::atomic<bool> g_adaptive_threads_enabled{true};
+// プロンプトのプレフィルを分けるトークン数。0 なら分けない。
+static std::atomic<int> g_prefill_chunk_tokens{128};
+// 直近のプレフィルの進み具合 (デコード済みトークン数 / 全体)。
+static std::atomic<int> g_prefill_progress_done{0};
+static std::atomic<int> g_prefill_progress_total{0};
+// 割り込まれたリクエストの途中結果を捨てずに返し、同じプロンプトの次の生成に引き継ぐか
+static std::atomic<bool> g_soft_cancel_enabled{false};
+// スケジューラ経由の生成・検証・採点を 1 つのコンテキストで同時に進める (連続バッチング) か
+static std::atomic<bool> g_continuous_batching_enabled{false};
+static std::atomic<int> g_draft_model_max_tokens{4};
+// 自己投機的デコーディングで使う層数。0 なら無効、負なら自動で選ぶ。
+static std::atomic<int> g_layer_skip_layers{0};
+// 投機的デコーディングで提案したドラフトトークン数と、そのうち受理された数 (累計)。
+static std::atomic<uint64_t> g_spec_drafted_tokens{0};
+static std::atomic<uint64_t> g_spec_accepted_tokens{0};
+// 割り込まれたリクエストがどこまで進んだかの累計
+static std::atomic<uint64_t> g_aborted_requests{0};
+static std::atomic<uint64_t> g_aborted_prompt_tokens{0};     // KV に載せ終えていたプロンプトのトークン
+static std::atomic<uint64_t> g_aborted_generated_tokens{0};  // 確定していた出力のトークン
+static std::atomic<uint64_t> g_resumed_tokens{0};            // 次の生成が引き継いだ出力のトークン
 static bool g_backend_initialized = false;
 
 struct RuntimeConfig {
-    int n_ctx;
+    int n_ctx = 0;
+    int n_threads = 0;
+    int n_threads_batch = 0;
+    int n_batch = 0;
+    int n_seq_max = 0;
+    int n_ubatch = 0;
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    bool flash_attn = false;
+};
+
+// コンテキストが確保する KV キャッシュと計算バッファの大きさ (バイト)。
+struct ContextMemory {
+    uint64_t kv_bytes = 0;
+    uint64_t compute_bytes = 0;
+};
+
+struct ThreadpoolConfig {
     int n_threads;
-    int n_threads_batch;
-    int n_batch;
+    std::vector<int> cpus;
+    int priority;
+    int poll;
+
+    bool operator==(const ThreadpoolConfig &other) const {
+        return n_threads == other.n_threads && cpus == other.cpus &&
+               priority == other.priority && poll == other.poll;
+    }
 };
 
 struct ZenzSession {
     llama_context *ctx = nullptr;
-    RuntimeConfig config{0, 0, 0, 0};
+    RuntimeConfig config{};
+    ContextMemory memory{};
+    // seq 0 の KV キャッシュに現在載っているトークン列 (位置 i のトークンが kv_tokens[i])。
+    // 次のリクエストはこの列との最長共通接頭辞を再利用し、分岐した末尾だけをデコードし直す。
+    std::vector<llama_token> kv_tokens;
+    // seq_rm で KV に穴が空いたか。アイドル時のデフラグ対象かどうかの判定に使う。
+    bool kv_fragmented = false;
+    // 直前の変換で生成した出力。次の打鍵ではこれをドラフトとして出力タグの後ろに並べて検証する。
+    std::vector<llama_token> last_output_tokens;
+    // ドラフトモデルのコンテキストと、その seq 0 に載っているトークン列。
+    llama_context *draft_ctx = nullptr;
+    std::vector<llama_token> draft_kv_tokens;
+    // g_commit_history をトークン化したもの。version が変わったら作り直す。
+    std::vector<std::vector<llama_token>> commit_history_tokens;
+    uint64_t commit_history_version = 0;
+    // ctx と draft_ctx が共有する ggml のスレッドプール。リクエストごとにワーカーを作り直さないよう
+    // コンテキストと同じ寿命で持ち、アイドル中は pause して CPU を手放す。
+    ggml_threadpool *threadpool = nullptr;
+    ThreadpoolConfig threadpool_config{0, {}, 0, 0};
+    bool threadpool_paused = false;
+    // プレフィル中で、新しいリクエストが来ても abort せずに計算し切る (PrefillSafePointScope)。
+    bool defer_preemption = false;
+    // ソフトキャンセルで割り込まれた直前の生成のプロンプトと読み、それまでに確定した出力
+    // (aborted_prompt が空なら無し)。同じプロンプトと読みの次の生成はこの出力の続きから始める。
+    std::vector<llama_token> aborted_prompt;
+    std::string aborted_reading;
+    std::vector<llama_token> aborted_output;
     std::mutex mutex;
 };
 
 static ZenzSession g_session;
 
+// 最近確定された出力のリングバッファ (n-gram ドラフトの参照元)。
+// Binder スレッドからも書き込まれるので、セッションのロックとは別のロックで守る。
+static constexpr size_t kCommitHistoryCapacity = 32;
+static std::mutex g_commit_history_mutex;
+static std::deque<std::string> g_commit_history;
+static uint64_t g_commit_history_version = 0;
+
+// ------- 自己投機的デコーディング (レイヤースキップ) の状態 -------
+// llama.cpp には途中の層で打ち切る API がないので、cb_eval で "l_out-<N-1>" を観測した時点で
+// グラフの計算を打ち切り、その隠れ状態に最終正規化と出力層を自前で掛けてドラフトの logits を得る。
+// 最終正規化と出力層の重みは通常のデコードのグラフ ("result_output" とその入力) から拾う。
+// cb_eval はセッションのロックを持って llama_decode を呼んだスレッドで呼ばれる。
+struct LayerSkipNormStep {
+    ggml_op op;                 // GGML_OP_NORM / GGML_OP_RMS_NORM / GGML_OP_MUL / GGML_OP_ADD
+    const ggml_tensor *weight;  // MUL / ADD の右辺 (F32, n_embd 要素)
+    float eps;
+};
+
+struct LayerSkipState {
+    int exit_layer = 0;                     // > 0 ならこの層数で計算を打ち切る (ドラフト中のみ)
+    char exit_name[GGML_MAX_NAME] = {0};
+    std::vector<float> hidden;
+    bool hidden_ready = false;
+
+    bool head_captured = false;
+    const ggml_tensor *output = nullptr;    // [n_embd, n_vocab]
+    // 採点で隠れ状態だけを受け取るデコードの間は、最終正規化の直後で計算を打ち切る (出力層は自前で計算する)。
+    bool stop_after_norm = false;
+    std::vector<LayerSkipNormStep> norm_steps;
+
+    // 層数ごとの実測。自動選択で使う。
+    struct Stats {
+        uint64_t attempts = 0;              // 提案した回数 (空のドラフトも数える)
+        uint64_t drafted = 0;
+        uint64_t accepted = 0;
+        double draft_us = 0.0;
+    };
+    std::vector<Stats> stats;               // 添字は層数
+    double step_decode_us = 0.0;            // 通常の 1 ステップ (検証) のデコード時間の移動平均
+    std::atomic<int> auto_layers{0};        // JNI から読むのでロックなしで読めるようにする
+    uint64_t auto_calls = 0;
+};
+
+static LayerSkipState g_layer_skip;
+
 // 候補評価の結果タイプ
 enum class CandidateEvaluationResultType {
     ERROR,
     PASS,
     FIX_REQUIRED,
-    WHOLE_RESULT
+    WHOLE_RESULT,
+    FIX_COMPLETED
 };
 
 // 候補評価の結果
 struct CandidateEvaluationResult {
     CandidateEvaluationResultType type;
     float score;                // PASS の場合のスコア
-    std::string prefix;         // FIX_REQUIRED の場合の接頭辞
-    std::string whole_result;   // WHOLE_RESULT の場合の結果
+    std::string prefix;         // FIX_REQUIRED / FIX_COMPLETED の場合の接頭辞
+    std::string whole_result;   // WHOLE_RESULT / FIX_COMPLETED の場合の結果
 };
 
 // ------- JNI文字列変換（重要） -------
@@ -326,7 +481,22 @@ static RuntimeConfig get_runtime_config() {
             g_param_n_ctx,
             g_param_n_threads,
             g_param_n_threads_batch,
-            g_param_n_batch
+            g_param_n_batch,
+            g_param_n_seq_max,
+            g_param_n_ubatch,
+            g_param_type_k,
+            g_param_type_v,
+            g_param_flash_attn
+    };
+}
+
+static ThreadpoolConfig get_threadpool_config(const RuntimeConfig &config) {
+    std::lock_guard<std::mutex> lock(g_param_mutex);
+    return ThreadpoolConfig{
+            std::max(config.n_threads, config.n_threads_batch),
+            g_param_threadpool_cpus,
+            g_param_threadpool_priority,
+            g_param_threadpool_poll
     };
 }
 
@@ -334,10 +504,25 @@ static bool same_runtime_config(const RuntimeConfig &lhs, const RuntimeConfig &r
     return lhs.n_ctx == rhs.n_ctx &&
            lhs.n_threads == rhs.n_threads &&
            lhs.n_threads_batch == rhs.n_threads_batch &&
-           lhs.n_batch == rhs.n_batch;
+           lhs.n_batch == rhs.n_batch &&
+           lhs.n_seq_max == rhs.n_seq_max &&
+           lhs.n_ubatch == rhs.n_ubatch &&
+           lhs.type_k == rhs.type_k &&
+           lhs.type_v == rhs.type_v &&
+           lhs.flash_attn == rhs.flash_attn;
 }
 
+// スケジューラのワーカーが実行中のリクエストの世代と、スケジューラの世代カウンタ (実行中でなければ null)。
+// 実行は JNI の入口と同じく自分で g_request_seq を進めるので、取り出してから進めるまでの間に
+// 届いた新しいリクエストを seq だけでは見分けられない。世代が進んでいれば古いリクエストとして止める。
+static thread_local const std::atomic<uint64_t> *t_scheduler_generation = nullptr;
+static thread_local uint64_t t_scheduled_generation = 0;
+
 static bool is_request_stale(uint64_t request_seq) {
+    if (t_scheduler_generation &&
+        t_scheduler_generation->load(std::memory_order_acquire) != t_scheduled_generation) {
+        return true;
+    }
     return request_seq != g_request_seq.load(std::memory_order_relaxed);
 }
 
@@ -347,6 +532,9 @@ struct AbortRequestState {
 
 static bool abort_if_stale(void *data) {
     auto *state = static_cast<AbortRequestState *>(data);
+    if (g_session.defer_preemption) {
+        return false;
+    }
     return state && is_request_stale(state->request_seq);
 }
 
@@ -354,15 +542,472 @@ static bool never_abort(void * /*data*/) {
     return false;
 }
 
+// スケジューラのワーカースレッドで実行中か (ネイティブのリクエストスケジューラを参照)。
+static thread_local bool t_on_scheduler_worker = false;
+
+// スケジューラ経由のリクエストでは、プレフィルのバッチを新しいリクエストに割り込まれても途中で止めない。
+// 次の打鍵のプロンプトはほぼ同じ接頭辞を持つので、計算し切って KV に残せば次のリクエストがそのまま使える。
+// 止めるのはバッチの切れ目 (prefill_session_tokens_locked のチャンクの間かプレフィルの後) になる。
+class PrefillSafePointScope {
+public:
+    PrefillSafePointScope() : previous_(g_session.defer_preemption) {
+        g_session.defer_preemption = t_on_scheduler_worker;
+    }
+
+    ~PrefillSafePointScope() {
+        g_session.defer_preemption = previous_;
+    }
+
+    PrefillSafePointScope(const PrefillSafePointScope &) = delete;
+    PrefillSafePointScope &operator=(const PrefillSafePointScope &) = delete;
+
+private:
+    bool previous_;
+};
+
+// "result_output" (出力層の mul_mat) から最終正規化と出力層の重みをたどって覚えておく。
+// 想定外の形のグラフなら何も覚えず、レイヤースキップのドラフトは使われない。
+static void capture_layer_skip_head(LayerSkipState &state, const ggml_tensor *result_output) {
+    const ggml_tensor *output = result_output->src[0];
+    const ggml_tensor *x = result_output->src[1];
+    if (result_output->op != GGML_OP_MUL_MAT || !output || !x || output->op != GGML_OP_NONE) {
+        return;
+    }
+    const int64_t n_embd = output->ne[0];
+
+    std::vector<LayerSkipNormStep> steps;
+    while (x && (x->op == GGML_OP_MUL || x->op == GGML_OP_ADD)) {
+        const ggml_tensor *weight = x->src[1];
+        const ggml_tensor *rest = x->src[0];
+        if (weight && weight->op != GGML_OP_NONE && rest && rest->op == GGML_OP_NONE) {
+            std::swap(weight, rest);
+        }
+        if (!weight || weight->op != GGML_OP_NONE || weight->type != GGML_TYPE_F32 || weight->ne[0] != n_embd) {
+            return;
+        }
+        steps.push_back(LayerSkipNormStep{x->op, weight, 0.0f});
+        x = rest;
+    }
+    if (!x || (x->op != GGML_OP_NORM && x->op != GGML_OP_RMS_NORM)) {
+        return;
+    }
+    float eps;
+    memcpy(&eps, x->op_params, sizeof(float));
+    steps.push_back(LayerSkipNormStep{x->op, nullptr, eps});
+    std::reverse(steps.begin(), steps.end());
+
+    state.output = output;
+    state.norm_steps = std::move(steps);
+    state.head_captured = true;
+}
+
+static bool layer_skip_eval_callback(ggml_tensor *t, bool ask, void *user_data) {
+    auto *state = (LayerSkipState *) user_data;
+    if (state->stop_after_norm) {
+        // embeddings を要求すると llama.cpp は最終正規化の出力を "result_embd_pooled" に改名する。
+        if (ask) {
+            return strcmp(t->name, "result_norm") == 0 || strcmp(t->name, "result_embd_pooled") == 0;
+        }
+        return false;
+    }
+    if (ask) {
+        if (!state->head_captured && state->exit_layer == 0 && strcmp(t->name, "result_output") == 0) {
+            capture_layer_skip_head(*state, t);
+        }
+        return state->exit_layer > 0 && strcmp(t->name, state->exit_name) == 0;
+    }
+
+    // 打ち切る層の出力。最後の行 (ドラフトでは 1 トークンだけデコードする) を写して、残りの計算をやめる。
+    state->hidden_ready = false;
+    if (t->type == GGML_TYPE_F32 && t->data && t->ne[1] > 0) {
+        const auto *row = (const float *) ((const char *) t->data + (size_t) (t->ne[1] - 1) * t->nb[1]);
+        state->hidden.assign(row, row + t->ne[0]);
+        state->hidden_ready = true;
+    }
+    return false;
+}
+
+static void destroy_draft_context_locked() {
+    if (!g_session.draft_ctx) {
+        return;
+    }
+    llama_set_abort_callback(g_session.draft_ctx, never_abort, nullptr);
+    llama_synchronize(g_session.draft_ctx);
+    llama_free(g_session.draft_ctx);
+    g_session.draft_ctx = nullptr;
+    g_session.draft_kv_tokens.clear();
+}
+
+static void free_session_threadpool_locked() {
+    if (!g_session.threadpool) {
+        return;
+    }
+    if (g_session.ctx) {
+        llama_detach_threadpool(g_session.ctx);
+    }
+    if (g_session.draft_ctx) {
+        llama_detach_threadpool(g_session.draft_ctx);
+    }
+    ggml_threadpool_free(g_session.threadpool);
+    g_session.threadpool = nullptr;
+    g_session.threadpool_config = ThreadpoolConfig{0, {}, 0, 0};
+    g_session.threadpool_paused = false;
+}
+
 static void destroy_session_context_locked() {
+    destroy_draft_context_locked();
     if (!g_session.ctx) {
+        free_session_threadpool_locked();
         return;
     }
     llama_set_abort_callback(g_session.ctx, never_abort, nullptr);
     llama_synchronize(g_session.ctx);
     llama_free(g_session.ctx);
     g_session.ctx = nullptr;
-    g_session.config = RuntimeConfig{0, 0, 0, 0};
+    free_session_threadpool_locked();
+    g_session.config = RuntimeConfig{};
+    g_session.memory = ContextMemory{};
+    g_session.kv_tokens.clear();
+    g_session.kv_fragmented = false;
+    g_session.last_output_tokens.clear();
+    g_session.aborted_prompt.clear();
+    g_session.aborted_output.clear();
+    g_session.commit_history_tokens.clear();
+    g_session.commit_history_version = 0;
+    g_layer_skip.exit_layer = 0;
+    g_layer_skip.stop_after_norm = false;
+    g_layer_skip.head_captured = false;
+    g_layer_skip.output = nullptr;
+    g_layer_skip.norm_steps.clear();
+}
+
+// セッションのスレッドプールを設定に合わせて用意し、pause 中なら再開する。
+// 作れなかった場合は何も attach せず、llama.cpp が計算ごとに作るスレッドに任せる。
+static void ensure_session_threadpool_locked() {
+    if (!g_session.ctx) {
+        return;
+    }
+    const ThreadpoolConfig config = get_threadpool_config(g_session.config);
+    if (g_session.threadpool && g_session.threadpool_config == config) {
+        if (g_session.threadpool_paused) {
+            ggml_threadpool_resume(g_session.threadpool);
+            g_session.threadpool_paused = false;
+        }
+        return;
+    }
+    free_session_threadpool_locked();
+
+    ggml_threadpool_params tpp = ggml_threadpool_params_default(config.n_threads);
+    int n_cpus = 0;
+    for (int cpu: config.cpus) {
+        if (cpu >= 0 && cpu < GGML_MAX_N_THREADS && !tpp.cpumask[cpu]) {
+            tpp.cpumask[cpu] = true;
+            ++n_cpus;
+        }
+    }
+    // 1 スレッド 1 コアに固定できるだけのコアがあるときだけ厳密に割り当てる
+    tpp.strict_cpu = n_cpus > 0 && config.n_threads <= n_cpus;
+    tpp.prio = (ggml_sched_priority) config.priority;
+    tpp.poll = (uint32_t) config.poll;
+
+    g_session.threadpool = ggml_threadpool_new(&tpp);
+    if (!g_session.threadpool) {
+        LOGE("Failed to create ggml threadpool (n_threads=%d)", config.n_threads);
+        return;
+    }
+    g_session.threadpool_config = config;
+    g_session.threadpool_paused = false;
+    llama_attach_threadpool(g_session.ctx, g_session.threadpool, g_session.threadpool);
+    if (g_session.draft_ctx) {
+        llama_attach_threadpool(g_session.draft_ctx, g_session.threadpool, g_session.threadpool);
+    }
+    LOGI("ggml threadpool created: n_threads=%d, cpus=%d, strict=%d, prio=%d, poll=%d",
+         config.n_threads, n_cpus, tpp.strict_cpu ? 1 : 0, config.priority, config.poll);
+}
+
+// ------- KV キャッシュの型と計算バッファの見積もり -------
+// n_ctx=4096 では F16 の KV キャッシュと n_ubatch 幅の計算バッファ (flash attention なしなら
+// n_ubatch x n_ctx x n_head の KQ 行列を含む) が大きく、IME のプロセスごと low memory killer に
+// 落とされる。KV の量子化・flash attention・n_ubatch を設定できるようにし、読み込んだモデルで
+// 使えない組み合わせは作る前に F16 へ戻す。確保する大きさはモデルの形から見積もって報告する。
+
+static bool is_supported_kv_type(ggml_type type) {
+    return type == GGML_TYPE_F32 || type == GGML_TYPE_F16 || type == GGML_TYPE_Q8_0 || type == GGML_TYPE_Q4_0;
+}
+
+static bool is_quantized_kv_type(ggml_type type) {
+    return type != GGML_TYPE_F32 && type != GGML_TYPE_F16;
+}
+
+// "<architecture>.<key>" のメタデータを整数として読む。無い (層ごとの配列を含む) 場合は fallback。
+static int64_t model_meta_int(const llama_model *model, const char *key, int64_t fallback) {
+    char arch[64];
+    if (llama_model_meta_val_str(model, "general.architecture", arch, sizeof(arch)) <= 0) {
+        return fallback;
+    }
+    char full_key[128];
+    snprintf(full_key, sizeof(full_key), "%s.%s", arch, key);
+    char value[32];
+    if (llama_model_meta_val_str(model, full_key, value, sizeof(value)) <= 0) {
+        return fallback;
+    }
+    char *end = nullptr;
+    const long long parsed = std::strtoll(value, &end, 10);
+    return end != value && parsed > 0 ? (int64_t) parsed : fallback;
+}
+
+struct ModelShape {
+    int64_t n_layer;
+    int64_t n_embd;
+    int64_t n_head;
+    int64_t n_head_kv;
+    int64_t head_dim_k;
+    int64_t head_dim_v;
+    int64_t n_ff;
+    int64_t n_vocab;
+};
+
+static ModelShape get_model_shape(const llama_model *model) {
+    ModelShape shape{};
+    shape.n_layer = llama_model_n_layer(model);
+    shape.n_embd = llama_model_n_embd(model);
+    shape.n_head = std::max<int64_t>(llama_model_n_head(model), 1);
+    shape.n_head_kv = model_meta_int(model, "attention.head_count_kv", shape.n_head);
+    shape.head_dim_k = model_meta_int(model, "attention.key_length", shape.n_embd / shape.n_head);
+    shape.head_dim_v = model_meta_int(model, "attention.value_length", shape.n_embd / shape.n_head);
+    shape.n_ff = model_meta_int(model, "feed_forward_length", 4 * shape.n_embd);
+    shape.n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    return shape;
+}
+
+// 設定をモデルに合わせて直す。llama.cpp が受け付けない組み合わせ (量子化した V に flash attention
+// なし、ヘッド次元が量子化ブロックで割り切れない型、n_batch を超える n_ubatch) をここで F16 などに戻す。
+static RuntimeConfig fit_runtime_config_to_model(const llama_model *model, RuntimeConfig config) {
+    config.n_ubatch = std::min(std::max(config.n_ubatch, 1), std::max(config.n_batch, 1));
+    if (!is_supported_kv_type(config.type_k)) {
+        config.type_k = GGML_TYPE_F16;
+    }
+    if (!is_supported_kv_type(config.type_v)) {
+        config.type_v = GGML_TYPE_F16;
+    }
+    if (!model) {
+        return config;
+    }
+    const ModelShape shape = get_model_shape(model);
+    if (shape.head_dim_k % ggml_blck_size(config.type_k) != 0) {
+        config.type_k = GGML_TYPE_F16;
+    }
+    if (shape.head_dim_v % ggml_blck_size(config.type_v) != 0 ||
+        (is_quantized_kv_type(config.type_v) && !config.flash_attn)) {
+        config.type_v = GGML_TYPE_F16;
+    }
+    return config;
+}
+
+// n_kv_cells は実際に確保される KV のセル数 (llama.cpp が n_ctx を切り上げた後の llama_n_ctx)。
+// 計算バッファは CPU バックエンドで同時に生きる主なテンソルからの目安で、
+// 残差ストリームなどの活性に、KQ 行列・FFN の中間・出力 logits のうち最大のものを足す。
+static ContextMemory estimate_context_memory(const llama_model *model, const RuntimeConfig &config,
+                                             int64_t n_kv_cells) {
+    const ModelShape shape = get_model_shape(model);
+    ContextMemory memory;
+    memory.kv_bytes = (uint64_t) (shape.n_layer * n_kv_cells) *
+                      (uint64_t) (ggml_row_size(config.type_k, shape.head_dim_k * shape.n_head_kv) +
+                                  ggml_row_size(config.type_v, shape.head_dim_v * shape.n_head_kv));
+    const auto n_tokens = (uint64_t) config.n_ubatch;
+    const uint64_t f32 = sizeof(float);
+    const uint64_t activations = 4 * n_tokens * (uint64_t) shape.n_embd * f32;
+    const uint64_t attention = config.flash_attn ? 0 : 2 * n_tokens * (uint64_t) (n_kv_cells * shape.n_head) * f32;
+    const uint64_t ffn = 2 * n_tokens * (uint64_t) shape.n_ff * f32;
+    const uint64_t logits = n_tokens * (uint64_t) shape.n_vocab * f32;
+    memory.compute_bytes = activations + std::max({attention, ffn, logits});
+    return memory;
+}
+
+// コンテキストを作る前の見積もり用。llama.cpp と同じく flash attention なら 256、
+// それ以外は 32 の倍数にセル数を切り上げる。
+static int64_t padded_kv_cells(const RuntimeConfig &config) {
+    return GGML_PAD((int64_t) config.n_ctx, config.flash_attn ? 256 : 32);
+}
+
+static double to_mib(uint64_t bytes) {
+    return (double) bytes / (1024.0 * 1024.0);
+}
+
+// ------- ワークロードに合わせたバッファの大きさ -------
+// 計算バッファは n_ubatch トークン幅のグラフで確保されるが、実際のバッチはプレフィルの
+// チャンク (既定 128) と 64 未満の採点バッチがほとんどで、大半は 1 トークンのデコード。
+// llama_decode に渡したバッチの大きさをトークン数で重み付けした分布として数え、アイドル時に
+// トークンの 95% が 1 回のグラフに収まる n_ubatch でコンテキストを作り直す。呼び出し側が
+// メモリの上限を決めた場合は、KV と計算バッファの合計が収まるまで n_ubatch を、それでも
+// 足りなければ n_ctx を半分にしていく。n_ctx の下限はリクエストが要求した位置の数
+// (プロンプト + 生成・採点する最大のトークン数) の最大の 2 倍で、見たことのある最長のプロンプトより
+// 小さくはしない。要求はデコードの前に (失敗しても、縮めた n_ctx で打ち切られても) 数えるので、
+// 縮めた後に長いリクエストが来れば次の調整で n_ctx は大きくなる。
+// n_batch (1 回の llama_decode に渡せる数) は呼び出し側の値のまま渡す。n_ctx より大きい分は
+// llama.cpp が n_ctx に切り詰める。
+
+struct WorkloadSizing {
+    static constexpr size_t kBuckets = 13;            // (2^(b-1), 2^b] トークン、b = 0..12
+    static constexpr uint64_t kMinSamples = 32;       // 最初に合わせるまでのバッチ数
+    static constexpr uint64_t kRefitSamples = 256;    // 合わせ直す間隔 (バッチ数)
+    static constexpr uint64_t kMaxWeight = 1u << 16;  // これを超えたら重みを半分にして古い分布を薄める
+    static constexpr int kMinUbatch = 16;
+    static constexpr int kMinCtx = 256;
+
+    bool enabled = false;
+    uint64_t memory_cap = 0;  // KV と計算バッファの合計の上限 (バイト)。0 なら上限なし
+    uint64_t token_weight[kBuckets] = {};
+    uint64_t batches = 0;
+    uint64_t batches_since_fit = 0;
+    int64_t peak_positions = 0;   // 1 回のリクエストやバッチが要求した位置の数の最大
+    int64_t longest_prompt = 0;   // 統計用
+    // 分布から決めた値 (0 ならまだ決めていない)。アイドル時にだけ更新し、
+    // リクエストの途中でコンテキストが作り直されないようにする。
+    int target_ubatch = 0;
+    int target_ctx = 0;
+};
+
+static WorkloadSizing g_workload;  // g_session.mutex で保護
+
+static size_t batch_size_bucket(size_t n_tokens) {
+    size_t bucket = 0;
+    while (bucket + 1 < WorkloadSizing::kBuckets && ((size_t) 1 << bucket) < n_tokens) {
+        ++bucket;
+    }
+    return bucket;
+}
+
+static int round_up_pow2(int64_t n) {
+    int value = 1;
+    while (value < n && value < (1 << 30)) {
+        value <<= 1;
+    }
+    return value;
+}
+
+static bool workload_tracking_locked() {
+    return g_workload.enabled || g_workload.memory_cap > 0;
+}
+
+// リクエストが要求した長さを数える。n_ctx で打ち切る前の長さを渡す。
+static void record_workload_request_locked(size_t n_prompt, size_t n_extra) {
+    if (!workload_tracking_locked()) {
+        return;
+    }
+    g_workload.longest_prompt = std::max(g_workload.longest_prompt, (int64_t) n_prompt);
+    g_workload.peak_positions = std::max(g_workload.peak_positions, (int64_t) (n_prompt + n_extra));
+}
+
+static size_t longest_token_list(const std::vector<std::vector<llama_token>> &lists) {
+    size_t longest = 0;
+    for (const auto &tokens: lists) {
+        longest = std::max(longest, tokens.size());
+    }
+    return longest;
+}
+
+static void record_workload_batch_locked(const llama_batch &batch) {
+    if (!workload_tracking_locked()) {
+        return;
+    }
+    const size_t n_tokens = (size_t) batch.n_tokens;
+    g_workload.token_weight[batch_size_bucket(n_tokens)] += n_tokens;
+    ++g_workload.batches;
+    ++g_workload.batches_since_fit;
+    for (int32_t i = 0; batch.pos && i < batch.n_tokens; ++i) {
+        g_workload.peak_positions = std::max(g_workload.peak_positions, (int64_t) batch.pos[i] + 1);
+    }
+}
+
+// セッションのコンテキストの llama_decode はすべてここを通し、バッチの大きさと位置を数える。
+// 失敗したバッチも数える (n_ctx が足りずに失敗したなら、それこそ次の調整で広げる必要がある)。
+static int decode_batch_locked(llama_context *ctx, const llama_batch &batch) {
+    if (ctx == g_session.ctx) {
+        record_workload_batch_locked(batch);
+    }
+    return llama_decode(ctx, batch);
+}
+
+static uint64_t workload_total_weight_locked() {
+    uint64_t total = 0;
+    for (uint64_t weight: g_workload.token_weight) {
+        total += weight;
+    }
+    return total;
+}
+
+// トークンの 95% が 1 回のグラフに収まるバッチの大きさ (2 の冪)。まだ数えていなければ 0。
+static int workload_p95_batch_tokens_locked() {
+    const uint64_t total = workload_total_weight_locked();
+    uint64_t covered = 0;
+    for (size_t bucket = 0; total > 0 && bucket < WorkloadSizing::kBuckets; ++bucket) {
+        covered += g_workload.token_weight[bucket];
+        if (covered * 100 >= total * 95) {
+            return 1 << bucket;
+        }
+    }
+    return 0;
+}
+
+// 要求された長さから決める n_ctx の下限。peak_positions はプロンプトを含むので、
+// 最長のプロンプトの 2 倍より小さくはならない。
+static int workload_min_ctx_locked() {
+    return std::max(round_up_pow2(2 * g_workload.peak_positions), WorkloadSizing::kMinCtx);
+}
+
+// 分布から target_ubatch と target_ctx を決め直す。決め直したら true。
+// 今の target_ctx に収まらない要求があれば、バッチ数が溜まるのを待たずに決め直す。
+static bool refit_workload_targets_locked() {
+    const uint64_t needed = g_workload.target_ubatch == 0 ? WorkloadSizing::kMinSamples
+                                                          : WorkloadSizing::kRefitSamples;
+    const bool outgrown = g_workload.target_ctx > 0 && workload_min_ctx_locked() > g_workload.target_ctx;
+    if (g_workload.batches_since_fit < needed && !outgrown) {
+        return false;
+    }
+    if (g_workload.batches > 0) {
+        g_workload.target_ubatch = std::max(workload_p95_batch_tokens_locked(), WorkloadSizing::kMinUbatch);
+    }
+    g_workload.target_ctx = workload_min_ctx_locked();
+    g_workload.batches_since_fit = 0;
+    if (workload_total_weight_locked() > WorkloadSizing::kMaxWeight) {
+        for (uint64_t &weight: g_workload.token_weight) {
+            weight /= 2;
+        }
+    }
+    return true;
+}
+
+static uint64_t context_memory_total(const llama_model *model, const RuntimeConfig &config) {
+    const RuntimeConfig fitted = fit_runtime_config_to_model(model, config);
+    const ContextMemory memory = estimate_context_memory(model, fitted, padded_kv_cells(fitted));
+    return memory.kv_bytes + memory.compute_bytes;
+}
+
+// 設定値を分布とメモリの上限に合わせる。呼び出し側の n_ubatch と n_ctx は上限として扱い、
+// 大きくはしない。
+static RuntimeConfig fit_workload_config_locked(const llama_model *model, RuntimeConfig config) {
+    if (g_workload.enabled && g_workload.target_ubatch > 0) {
+        config.n_ubatch = std::min(config.n_ubatch, g_workload.target_ubatch);
+    }
+    const uint64_t cap = g_workload.memory_cap;
+    if (cap == 0 || !model) {
+        return config;
+    }
+    while (config.n_ubatch > WorkloadSizing::kMinUbatch && context_memory_total(model, config) > cap) {
+        config.n_ubatch = std::max(config.n_ubatch / 2, WorkloadSizing::kMinUbatch);
+    }
+    const int min_ctx = g_workload.target_ctx > 0 ? g_workload.target_ctx : config.n_ctx;
+    while (config.n_ctx / 2 >= min_ctx && context_memory_total(model, config) > cap) {
+        config.n_ctx /= 2;
+        config.n_ubatch = std::min(config.n_ubatch, config.n_ctx);
+    }
+    return config;
+}
+
+// 今の設定値から作るコンテキストの設定。
+static RuntimeConfig session_config_for_locked(const RuntimeConfig &requested) {
+    return fit_runtime_config_to_model(g_model, fit_workload_config_locked(g_model, requested));
 }
 
 static llama_context *ensure_session_context_locked() {
@@ -370,8 +1015,10 @@ static llama_context *ensure_session_context_locked() {
         return nullptr;
     }
 
-    const RuntimeConfig config = get_runtime_config();
+    const RuntimeConfig requested = get_runtime_config();
+    const RuntimeConfig config = session_config_for_locked(requested);
     if (g_session.ctx && same_runtime_config(g_session.config, config)) {
+        ensure_session_threadpool_locked();
         return g_session.ctx;
     }
 
@@ -382,6 +1029,19 @@ static llama_context *ensure_session_context_locked() {
     cparams.n_threads = config.n_threads;
     cparams.n_threads_batch = config.n_threads_batch;
     cparams.n_batch = config.n_batch;
+    cparams.n_ubatch = (uint32_t) config.n_ubatch;
+    cparams.n_seq_max = (uint32_t) config.n_seq_max;
+    cparams.type_k = config.type_k;
+    cparams.type_v = config.type_v;
+    cparams.flash_attn = config.flash_attn;
+    cparams.cb_eval = layer_skip_eval_callback;
+    cparams.cb_eval_user_data = &g_layer_skip;
+
+    if (config.type_k != requested.type_k || config.type_v != requested.type_v) {
+        LOGI("KV cache type %s/%s is not usable with this model (flash_attn=%d), using %s/%s",
+             ggml_type_name(requested.type_k), ggml_type_name(requested.type_v), config.flash_attn ? 1 : 0,
+             ggml_type_name(config.type_k), ggml_type_name(config.type_v));
+    }
 
     g_session.ctx = llama_init_from_model(g_model, cparams);
     if (!g_session.ctx) {
@@ -390,539 +1050,4539 @@ static llama_context *ensure_session_context_locked() {
     }
 
     g_session.config = config;
-    LOGI("llama_context created: n_ctx=%d, n_threads=%d, n_batch=%d",
-         cparams.n_ctx, cparams.n_threads, cparams.n_batch);
+    g_session.memory = estimate_context_memory(g_model, config, (int64_t) llama_n_ctx(g_session.ctx));
+    LOGI("llama_context created: n_ctx=%u, n_threads=%d, n_batch=%d, n_ubatch=%d, n_seq_max=%d, "
+         "kv=%s/%s, flash_attn=%d, kv_buffer=%.1f MiB, compute_buffer~%.1f MiB",
+         llama_n_ctx(g_session.ctx), cparams.n_threads, cparams.n_batch, cparams.n_ubatch, cparams.n_seq_max,
+         ggml_type_name(config.type_k), ggml_type_name(config.type_v), config.flash_attn ? 1 : 0,
+         to_mib(g_session.memory.kv_bytes), to_mib(g_session.memory.compute_bytes));
+    if (g_workload.memory_cap > 0 && g_session.memory.kv_bytes + g_session.memory.compute_bytes > g_workload.memory_cap) {
+        LOGI("llama_context exceeds the memory cap of %.1f MiB", to_mib(g_workload.memory_cap));
+    }
+    ensure_session_threadpool_locked();
     return g_session.ctx;
 }
 
-// Swift の pure_greedy_decoding 相当
-static std::string pure_greedy_decoding(
-        const std::string &leftSideContext,
-        int maxCount,
-        uint64_t request_seq
-) {
-    std::unique_lock<std::mutex> session_lock(g_session.mutex);
-    if (is_request_stale(request_seq)) {
-        return "";
+// ドラフトモデルのコンテキスト。メインのコンテキストと同じ設定で作り、設定が変われば一緒に作り直す。
+static llama_context *ensure_draft_context_locked() {
+    if (!g_draft_model || !g_session.ctx) {
+        return nullptr;
     }
-    if (!g_model || !g_vocab) {
-        return "[error] model not initialized";
+    if (g_session.draft_ctx) {
+        return g_session.draft_ctx;
     }
 
-    llama_context *ctx = ensure_session_context_locked();
-    if (!ctx) {
-        return "[error] failed to create context";
+    // 量子化できるかはドラフトモデルのヘッド次元でも変わるので、ドラフトモデルに合わせ直す
+    const RuntimeConfig config = fit_runtime_config_to_model(g_draft_model, g_session.config);
+    llama_context_params cparams = llama_context_default_params();
+    cparams.n_ctx = config.n_ctx;
+    cparams.n_threads = config.n_threads;
+    cparams.n_threads_batch = config.n_threads_batch;
+    cparams.n_batch = config.n_batch;
+    cparams.n_ubatch = (uint32_t) config.n_ubatch;
+    cparams.n_seq_max = 1;
+    cparams.type_k = config.type_k;
+    cparams.type_v = config.type_v;
+    cparams.flash_attn = config.flash_attn;
+
+    g_session.draft_ctx = llama_init_from_model(g_draft_model, cparams);
+    if (!g_session.draft_ctx) {
+        LOGE("Failed to create draft llama_context");
+        return nullptr;
     }
-    llama_kv_cache_clear(ctx);
-
-    AbortRequestState abort_state{request_seq};
-    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+    if (g_session.threadpool) {
+        llama_attach_threadpool(g_session.draft_ctx, g_session.threadpool, g_session.threadpool);
+    }
+    g_session.draft_kv_tokens.clear();
+    return g_session.draft_ctx;
+}
 
-    std::string pre = preprocess_text(leftSideContext);
-    auto prompt_tokens = tokenize_text(pre, /*add_bos=*/false, /*add_eos=*/false);
-    if (prompt_tokens.empty()) {
-        llama_set_abort_callback(ctx, never_abort, nullptr);
-        return "";
+// ------- プレフィルと 1 トークンずつのデコードのスレッド数の自動調整 -------
+// 幅の広いプレフィルは計算律速でコア数に比例して速くなるが、1 トークンずつのデコードは
+// メモリ律速で、big.LITTLE では LITTLE コアを混ぜると遅いコアを待つ分だけ遅くなる。
+// フェーズごとに実測した tokens/sec の移動平均を持ち、山登りで最速のスレッド数を探す。
+
+struct ThreadCountTuner {
+    static constexpr int kMaxThreads = 8;
+    static constexpr int kMinSamples = 2;
+    // 熱や負荷で最適値がずれるので、この回数ごとに隣のスレッド数を測り直す
+    static constexpr uint32_t kReprobeInterval = 64;
+    static constexpr double kAlpha = 0.3;
+
+    int max_threads = 0;
+    int seed = 0;
+    double tokens_per_sec[kMaxThreads + 1] = {};
+    int samples[kMaxThreads + 1] = {};
+    uint32_t picks = 0;
+
+    // 上限が変わったら測定をやり直す。seed は最初に試すスレッド数。
+    void reset(int n_max, int n_seed) {
+        *this = ThreadCountTuner{};
+        max_threads = std::max(1, std::min(n_max, kMaxThreads));
+        seed = std::max(1, std::min(n_seed > 0 ? n_seed : max_threads, max_threads));
     }
 
-    {
-        llama_batch batch = llama_batch_get_one(
-                prompt_tokens.data(),
-                (int32_t) prompt_tokens.size()
-        );
-        int rc = llama_decode(ctx, batch);
-        if (rc != 0) {
-            LOGE("llama_decode(prompt) failed: %d", rc);
-            if (is_request_stale(request_seq)) {
-                LOGI("pure_greedy_decoding aborted while decoding prompt");
+    // 測定済みで最も速いスレッド数 (同じならスレッドの少ない方)。未測定なら seed。
+    int best() const {
+        int best_n = 0;
+        for (int n = 1; n <= max_threads; ++n) {
+            if (samples[n] > 0 && (best_n == 0 || tokens_per_sec[n] > tokens_per_sec[best_n])) {
+                best_n = n;
             }
-            llama_set_abort_callback(ctx, never_abort, nullptr);
-            return "";
         }
+        return best_n == 0 ? seed : best_n;
     }
 
-    std::vector<llama_token> generated;
-    generated.reserve(maxCount);
-
-    const llama_token eos = llama_vocab_eos(g_vocab);
-    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
-
-    for (int i = 0; i < maxCount; ++i) {
-        float *logits = llama_get_logits_ith(ctx, -1);
-        if (!logits) {
-            LOGE("logits is null");
-            break;
+    int choose() {
+        const int best_n = best();
+        for (int n: {best_n, best_n - 1, best_n + 1}) {
+            if (n >= 1 && n <= max_threads && samples[n] < kMinSamples) {
+                return n;
+            }
         }
-
-        int best_id = 0;
-        float best_logit = logits[0];
-        for (int32_t tid = 1; tid < n_vocab; ++tid) {
-            if (logits[tid] > best_logit) {
-                best_logit = logits[tid];
-                best_id = tid;
+        if (++picks % kReprobeInterval == 0) {
+            const int n = (picks / kReprobeInterval) % 2 == 0 ? best_n - 1 : best_n + 1;
+            if (n >= 1 && n <= max_threads) {
+                return n;
             }
         }
+        return best_n;
+    }
 
-        llama_token next = (llama_token) best_id;
-        if (next == eos) {
-            break;
+    void record(int n_threads, double tps) {
+        if (n_threads < 1 || n_threads > max_threads || !(tps > 0.0)) {
+            return;
         }
+        tokens_per_sec[n_threads] = samples[n_threads] == 0
+                                    ? tps
+                                    : (1.0 - kAlpha) * tokens_per_sec[n_threads] + kAlpha * tps;
+        ++samples[n_threads];
+    }
+};
 
-        generated.push_back(next);
-
-        llama_batch next_batch = llama_batch_get_one(&next, 1);
-        int rc = llama_decode(ctx, next_batch);
-        if (rc != 0) {
-            if (is_request_stale(request_seq)) {
-                LOGI("pure_greedy_decoding aborted during token generation");
-                llama_set_abort_callback(ctx, never_abort, nullptr);
-                return "";
-            } else {
-                LOGE("llama_decode(step) failed: %d", rc);
+static std::mutex g_thread_tuner_mutex;
+static ThreadCountTuner g_prefill_tuner;
+static ThreadCountTuner g_decode_tuner;
+// Kotlin から渡された前回の学習結果 (0 なら未指定)。上限が変わって作り直すときの初期値にする。
+static int g_thread_tuner_seed_prefill = 0;
+static int g_thread_tuner_seed_decode = 0;
+
+// この件数未満のバッチや生成は tokens/sec がぶれるので測定に使わない
+static constexpr size_t kMinTunedPrefillTokens = 8;
+static constexpr size_t kMinTunedDecodeTokens = 4;
+
+// 1 リクエストの間、プレフィルとデコードでスレッド数を切り替えて tokens/sec を記録する。
+// 抜けるときは (デコード, プレフィル) の組に戻すので、採点など他の経路も学習したスレッド数を使う。
+class AdaptiveThreadScope {
+public:
+    explicit AdaptiveThreadScope(llama_context *ctx) : ctx_(ctx) {
+        if (!g_adaptive_threads_enabled.load(std::memory_order_relaxed)) {
+            return;
+        }
+        const int n_max = std::max(g_session.config.n_threads, g_session.config.n_threads_batch);
+        {
+            std::lock_guard<std::mutex> lock(g_thread_tuner_mutex);
+            if (g_prefill_tuner.max_threads != std::min(n_max, ThreadCountTuner::kMaxThreads)) {
+                g_prefill_tuner.reset(n_max, g_thread_tuner_seed_prefill);
+                g_decode_tuner.reset(n_max, g_thread_tuner_seed_decode);
             }
-            break;
+            prefill_threads_ = g_prefill_tuner.choose();
+            decode_threads_ = g_decode_tuner.choose();
         }
+        active_ = true;
+        llama_set_n_threads(ctx_, prefill_threads_, prefill_threads_);
+        phase_started_ = std::chrono::steady_clock::now();
     }
 
-    std::string out;
-    for (auto t: generated) {
-        if (llama_vocab_is_control(g_vocab, t)) {
-            continue;
+    ~AdaptiveThreadScope() {
+        if (active_) {
+            llama_set_n_threads(ctx_, decode_threads_, prefill_threads_);
         }
-        out += token_to_piece_str(t);
     }
 
-    llama_set_abort_callback(ctx, never_abort, nullptr);
-    return out;
-}
-
-// Swift の evaluate_candidate 相当
-static CandidateEvaluationResult candidate_evaluate(
-        const std::string &prompt,
-        const std::string &candidate_text,
-        uint64_t request_seq
-) {
-    CandidateEvaluationResult result;
-    result.type = CandidateEvaluationResultType::ERROR;
-    result.score = 0.0f;
+    AdaptiveThreadScope(const AdaptiveThreadScope &) = delete;
+    AdaptiveThreadScope &operator=(const AdaptiveThreadScope &) = delete;
 
-    std::unique_lock<std::mutex> session_lock(g_session.mutex);
-    if (is_request_stale(request_seq)) {
-        return result;
+    // プレフィルが終わった。n_tokens 個を 1 回でデコードした時間を記録し、デコード用に切り替える。
+    // ドラフトの検証も数トークンのメモリ律速なバッチなので、以降はすべてデコード側のスレッド数で回す。
+    void begin_decode(size_t n_prefill_tokens) {
+        if (!active_) {
+            return;
+        }
+        const auto now = std::chrono::steady_clock::now();
+        if (n_prefill_tokens >= kMinTunedPrefillTokens) {
+            record(g_prefill_tuner, prefill_threads_, n_prefill_tokens, now);
+        }
+        llama_set_n_threads(ctx_, decode_threads_, decode_threads_);
+        phase_started_ = now;
     }
-    if (!g_model || !g_vocab) {
-        LOGE("candidate_evaluate: model not initialized");
-        return result;
+
+    // デコードが終わった。n_tokens 個を生成するのにかかった時間を記録する。
+    void end_decode(size_t n_generated_tokens) {
+        if (active_ && n_generated_tokens >= kMinTunedDecodeTokens) {
+            record(g_decode_tuner, decode_threads_, n_generated_tokens, std::chrono::steady_clock::now());
+        }
     }
 
-    llama_context *ctx = ensure_session_context_locked();
-    if (!ctx) {
-        LOGE("candidate_evaluate: failed to create context");
-        return result;
+private:
+    void record(ThreadCountTuner &tuner, int n_threads, size_t n_tokens,
+                std::chrono::steady_clock::time_point now) const {
+        const double seconds = std::chrono::duration<double>(now - phase_started_).count();
+        if (seconds <= 0.0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(g_thread_tuner_mutex);
+        tuner.record(n_threads, (double) n_tokens / seconds);
     }
-    llama_kv_cache_clear(ctx);
 
-    AbortRequestState abort_state{request_seq};
-    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+    llama_context *ctx_;
+    bool active_ = false;
+    int prefill_threads_ = 0;
+    int decode_threads_ = 0;
+    std::chrono::steady_clock::time_point phase_started_;
+};
 
-    std::string pre_prompt = preprocess_text(prompt);
-    std::string pre_candidate = preprocess_text(candidate_text);
+// ------- リクエストごとの締め切り -------
+// IME が 1 打鍵で待てるのは 50 ms 程度しかない。スケジューラ経由のリクエストには締め切りを付けられ、
+// 実測したデコードの所要時間から、締め切りまでに収まる分だけ生成・検証・採点して打ち切る。
+// 打ち切ったリクエストも終わった分を返し、truncated を立てる。
 
-    auto prompt_tokens = tokenize_text(pre_prompt, /*add_bos=*/false, /*add_eos=*/false);
-    auto candidate_tokens = tokenize_text(pre_candidate, /*add_bos=*/false, /*add_eos=*/false);
+// llama_decode 1 回の所要時間の移動平均。3 つの形のバッチを別々に測る。
+struct DecodeCostModel {
+    static constexpr size_t kMinBatchTokens = 8;  // これ以上はプレフィルとして 1 トークンあたりで測る
+    static constexpr double kAlpha = 0.2;
 
-    if (prompt_tokens.empty()) {
-        LOGE("candidate_evaluate: prompt tokens empty");
-        llama_set_abort_callback(ctx, never_abort, nullptr);
-        return result;
+    double step_us = 0.0;         // 1 トークンのデコード
+    double draft_token_us = 0.0;  // 数トークンのバッチ (ドラフトの検証) で 1 トークン増えるごとの追加分
+    double batch_token_us = 0.0;  // プレフィルの 1 トークンあたり
+
+    static void update(double &value, double sample) {
+        value = value == 0.0 ? sample : (1.0 - kAlpha) * value + kAlpha * sample;
     }
 
-    std::vector<llama_token> all_tokens = prompt_tokens;
-    all_tokens.insert(all_tokens.end(), candidate_tokens.begin(), candidate_tokens.end());
-
-    // ★ 512固定だと長文で overflow するので必要量で確保
-    const int32_t cap = (int32_t) all_tokens.size();
-    llama_batch batch = llama_batch_init(cap, 0, 1);
-
-    // プロンプト部分: logits不要（最後のトークンを除く）
-    for (size_t i = 0; i + 1 < prompt_tokens.size(); ++i) {
-        batch.token[batch.n_tokens] = prompt_tokens[i];
-        batch.pos[batch.n_tokens] = (llama_pos) i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens][0] = 0;
-        batch.logits[batch.n_tokens] = 0;
-        batch.n_tokens++;
-    }
-
-    // プロンプトの最後のトークンから候補の最後のトークンまで: logits必要
-    size_t logits_start_pos = prompt_tokens.size() - 1;
-    for (size_t i = logits_start_pos; i < all_tokens.size(); ++i) {
-        batch.token[batch.n_tokens] = all_tokens[i];
-        batch.pos[batch.n_tokens] = (llama_pos) i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens][0] = 0;
-        batch.logits[batch.n_tokens] = 1;
-        batch.n_tokens++;
-    }
-
-    int rc = llama_decode(ctx, batch);
-    if (rc != 0) {
-        if (is_request_stale(request_seq)) {
-            LOGI("candidate_evaluate aborted");
+    void record(size_t n_tokens, double us) {
+        if (n_tokens == 1) {
+            update(step_us, us);
+        } else if (n_tokens < kMinBatchTokens) {
+            update(draft_token_us, std::max(0.0, us - step_us) / (double) (n_tokens - 1));
         } else {
-            LOGE("candidate_evaluate: llama_decode failed: %d", rc);
+            update(batch_token_us, us / (double) n_tokens);
         }
-        llama_batch_free(batch);
-        llama_set_abort_callback(ctx, never_abort, nullptr);
-        return result;
-    }
-
-    const llama_token eos = llama_vocab_eos(g_vocab);
-    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
-
-    float *all_logits = llama_get_logits(ctx);
-    if (!all_logits) {
-        LOGE("candidate_evaluate: all_logits is null");
-        llama_batch_free(batch);
-        llama_set_abort_callback(ctx, never_abort, nullptr);
-        return result;
     }
 
-    float total_score = 0.0f;
-
-    for (size_t i = prompt_tokens.size(); i < all_tokens.size(); ++i) {
-        llama_token expected_token = all_tokens[i];
-
-        size_t logits_offset = (i - 1 - logits_start_pos) * (size_t) n_vocab;
-        float *logits = all_logits + logits_offset;
-
-        int32_t max_id = 0;
-        float max_logit = logits[0];
-        for (int32_t tid = 1; tid < n_vocab; ++tid) {
-            if (logits[tid] > max_logit) {
-                max_logit = logits[tid];
-                max_id = tid;
-            }
-        }
-
-        llama_token max_token = (llama_token) max_id;
-
-        float sum_exp = 0.0f;
-        for (int32_t tid = 0; tid < n_vocab; ++tid) {
-            sum_exp += expf(logits[tid] - max_logit);
+    // 未測定の形は 0 とみなす (測るまでは打ち切らない)。
+    double estimate_us(size_t n_tokens) const {
+        if (n_tokens == 0) {
+            return 0.0;
         }
-        float log_prob = logits[expected_token] - max_logit - logf(sum_exp);
-        total_score += log_prob;
-
-        if (max_token != expected_token) {
-            if (max_token == eos) {
-                std::string partial;
-                for (size_t j = prompt_tokens.size(); j < i; ++j) {
-                    llama_token t = all_tokens[j];
-                    if (!llama_vocab_is_control(g_vocab, t)) {
-                        partial += token_to_piece_str(t);
-                    }
-                }
-                result.type = CandidateEvaluationResultType::WHOLE_RESULT;
-                result.whole_result = partial;
-                LOGI("candidate_evaluate: WHOLE_RESULT at pos %zu, result=%s", i, partial.c_str());
-                llama_batch_free(batch);
-                llama_set_abort_callback(ctx, never_abort, nullptr);
-                return result;
-            } else {
-                std::string prefix;
-                for (size_t j = prompt_tokens.size(); j < i; ++j) {
-                    llama_token t = all_tokens[j];
-                    if (!llama_vocab_is_control(g_vocab, t)) {
-                        prefix += token_to_piece_str(t);
-                    }
-                }
-                if (!llama_vocab_is_control(g_vocab, max_token)) {
-                    prefix += token_to_piece_str(max_token);
-                }
-                result.type = CandidateEvaluationResultType::FIX_REQUIRED;
-                result.prefix = prefix;
-                LOGI("candidate_evaluate: FIX_REQUIRED at pos %zu, prefix=%s", i, prefix.c_str());
-                llama_batch_free(batch);
-                llama_set_abort_callback(ctx, never_abort, nullptr);
-                return result;
-            }
+        if (n_tokens < kMinBatchTokens) {
+            return step_us + (double) (n_tokens - 1) * draft_token_us;
         }
+        return std::max(step_us, (double) n_tokens * batch_token_us);
     }
+};
 
-    result.type = CandidateEvaluationResultType::PASS;
-    result.score = total_score;
-    LOGI("candidate_evaluate: PASS, score=%f", total_score);
+static DecodeCostModel g_decode_cost;  // g_session.mutex で保護
 
-    llama_batch_free(batch);
-    llama_set_abort_callback(ctx, never_abort, nullptr);
-    return result;
-}
+struct RequestDeadline {
+    std::chrono::steady_clock::time_point at;
+    bool truncated = false;
+};
 
-static bool prefill_prompt_prefix_locked(
-        llama_context *ctx,
-        const std::vector<llama_token> &prompt_tokens
-) {
-    llama_kv_cache_clear(ctx);
+// 実行中のリクエストの締め切り (締め切りがなければ null)。run_scheduled_request が設定する。
+static thread_local RequestDeadline *t_request_deadline = nullptr;
 
-    if (prompt_tokens.size() <= 1) {
+// n_tokens 個を 1 回でデコードする時間が締め切りまでに残っているか。
+// 残っていなければリクエストを打ち切られたものとして記録する。
+static bool deadline_allows_decode_locked(size_t n_tokens) {
+    if (!t_request_deadline) {
         return true;
     }
-
-    const int32_t cap = (int32_t) (prompt_tokens.size() - 1);
-    llama_batch batch = llama_batch_init(cap, 0, 1);
-    for (size_t i = 0; i + 1 < prompt_tokens.size(); ++i) {
-        batch.token[batch.n_tokens] = prompt_tokens[i];
-        batch.pos[batch.n_tokens] = (llama_pos) i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens][0] = 0;
-        batch.logits[batch.n_tokens] = 0;
-        batch.n_tokens++;
+    const double remaining_us = std::chrono::duration<double, std::micro>(
+            t_request_deadline->at - std::chrono::steady_clock::now()).count();
+    if (g_decode_cost.estimate_us(n_tokens) <= remaining_us) {
+        return true;
     }
-
-    const int rc = llama_decode(ctx, batch);
-    llama_batch_free(batch);
-    return rc == 0;
+    t_request_deadline->truncated = true;
+    return false;
 }
 
-static float score_candidate_avg_logprob_reuse_prompt_locked(
-        llama_context *ctx,
-        const std::vector<llama_token> &prompt_tokens,
-        const std::vector<llama_token> &candidate_tokens,
-        uint64_t request_seq
-) {
-    if (is_request_stale(request_seq)) {
-        return -INFINITY;
+// base_tokens に足して 1 回のデコードに載せても締め切りに収まるトークン数 (max_extra まで)。
+// 投機的デコーディングのドラフトをどこまで検証するかに使う。打ち切りとしては記録しない。
+static size_t deadline_extra_token_allowance_locked(size_t base_tokens, size_t max_extra) {
+    if (!t_request_deadline) {
+        return max_extra;
     }
-    if (prompt_tokens.empty() || candidate_tokens.empty()) {
-        return -INFINITY;
+    const double remaining_us = std::chrono::duration<double, std::micro>(
+            t_request_deadline->at - std::chrono::steady_clock::now()).count();
+    size_t n_extra = max_extra;
+    while (n_extra > 0 && g_decode_cost.estimate_us(base_tokens + n_extra) > remaining_us) {
+        --n_extra;
     }
+    return n_extra;
+}
 
-    const llama_pos suffix_start = (llama_pos) (prompt_tokens.size() - 1);
-    llama_kv_cache_seq_rm(ctx, 0, suffix_start, -1);
-
-    const int32_t cap = (int32_t) (1 + candidate_tokens.size());
-    llama_batch batch = llama_batch_init(cap, 0, 1);
+// ------- セッション KV キャッシュの再利用 -------
+// build_zenz_prompt は条件・左文脈・右文脈を入力より前に置くため、1 打鍵ごとに伸びるのは
+// プロンプトの末尾だけになる。seq 0 に載っているトークン列を覚えておき、共通接頭辞の KV を使い回す。
 
-    batch.token[batch.n_tokens] = prompt_tokens.back();
-    batch.pos[batch.n_tokens] = suffix_start;
+static void batch_add_token(
+        llama_batch &batch,
+        llama_token token,
+        llama_pos pos,
+        llama_seq_id seq_id,
+        bool logits
+) {
+    batch.token[batch.n_tokens] = token;
+    batch.pos[batch.n_tokens] = pos;
     batch.n_seq_id[batch.n_tokens] = 1;
-    batch.seq_id[batch.n_tokens][0] = 0;
-    batch.logits[batch.n_tokens] = 1;
+    batch.seq_id[batch.n_tokens][0] = seq_id;
+    batch.logits[batch.n_tokens] = logits ? 1 : 0;
     batch.n_tokens++;
+}
 
-    for (size_t i = 0; i < candidate_tokens.size(); ++i) {
-        batch.token[batch.n_tokens] = candidate_tokens[i];
-        batch.pos[batch.n_tokens] = suffix_start + 1 + (llama_pos) i;
-        batch.n_seq_id[batch.n_tokens] = 1;
-        batch.seq_id[batch.n_tokens][0] = 0;
-        batch.logits[batch.n_tokens] = 1;
-        batch.n_tokens++;
-    }
+static_assert(std::is_same<llama_token, int32_t>::value, "zenz_prefix は llama_token を int32_t として扱う");
 
-    const int rc = llama_decode(ctx, batch);
-    if (rc != 0) {
-        if (!is_request_stale(request_seq)) {
-            LOGE("score_candidate_avg_logprob_reuse_prompt_locked: llama_decode failed: %d", rc);
-        }
-        llama_batch_free(batch);
-        return -INFINITY;
+// seq 0 の KV を先頭 keep トークンまで残し、それ以降を捨てる。
+static void truncate_session_kv_locked(llama_context *ctx, size_t keep) {
+    if (keep >= g_session.kv_tokens.size()) {
+        return;
+    }
+    if (!llama_kv_cache_seq_rm(ctx, 0, (llama_pos) keep, -1)) {
+        // 部分削除できないキャッシュ (recurrent 系) は全消去して作り直す。
+        llama_kv_cache_clear(ctx);
+        g_session.kv_tokens.clear();
+        g_session.kv_fragmented = false;
+        return;
     }
+    g_session.kv_tokens.resize(keep);
+    g_session.kv_fragmented = true;
+}
 
-    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
-    float *all_logits = llama_get_logits(ctx);
-    if (!all_logits) {
-        LOGE("score_candidate_avg_logprob_reuse_prompt_locked: all_logits is null");
-        llama_batch_free(batch);
-        return -INFINITY;
+// tokens と KV 上のトークン列の最長共通接頭辞 (最大 max_reuse) だけを残す (zenz_plan_prefix_reuse)。
+// 戻り値は再利用できたトークン数で、呼び出し側は tokens[戻り値..] をデコードすればよい。
+// 部分削除できないキャッシュでは KV ごと捨てるので、戻り値は計画の keep より小さくなることがある。
+static size_t reuse_session_prefix_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &tokens,
+        size_t max_reuse
+) {
+    const ZenzPrefixReuse plan = zenz_plan_prefix_reuse(g_session.kv_tokens, tokens, max_reuse);
+    if (plan.trim) {
+        truncate_session_kv_locked(ctx, plan.keep);
     }
+    return g_session.kv_tokens.size();
+}
 
-    float total_score = 0.0f;
-    for (size_t i = 0; i < candidate_tokens.size(); ++i) {
-        llama_token expected_token = candidate_tokens[i];
-        float *logits = all_logits + ((size_t) i * (size_t) n_vocab);
+// tokens を ctx の seq 0 の末尾 (位置 kv_tokens.size() から) に追加デコードする。
+// logits_from 番目以降のトークンについてのみ logits を要求する。
+// 失敗時は KV をデコード前の状態まで巻き戻す。
+static int decode_tokens_at_end(
+        llama_context *ctx,
+        std::vector<llama_token> &kv_tokens,
+        const llama_token *tokens,
+        size_t n_tokens,
+        size_t logits_from
+) {
+    if (n_tokens == 0) {
+        return 0;
+    }
 
-        float max_logit = logits[0];
-        for (int32_t tid = 1; tid < n_vocab; ++tid) {
-            if (logits[tid] > max_logit) {
-                max_logit = logits[tid];
-            }
-        }
+    const size_t n_past = kv_tokens.size();
+    llama_batch batch = llama_batch_init((int32_t) n_tokens, 0, 1);
+    for (size_t i = 0; i < n_tokens; ++i) {
+        batch_add_token(batch, tokens[i], (llama_pos) (n_past + i), 0, i >= logits_from);
+    }
 
-        double sum_exp = 0.0;
-        for (int32_t tid = 0; tid < n_vocab; ++tid) {
-            sum_exp += exp((double) logits[tid] - (double) max_logit);
+    const int rc = decode_batch_locked(ctx, batch);
+    llama_batch_free(batch);
+    if (rc != 0) {
+        // 中断時は一部のセルが書き込まれている可能性があるので明示的に捨てる。
+        if (!llama_kv_cache_seq_rm(ctx, 0, (llama_pos) n_past, -1)) {
+            llama_kv_cache_clear(ctx);
+            kv_tokens.clear();
         }
-        total_score += logits[expected_token] - max_logit - (float) log(sum_exp);
+        return rc;
     }
 
-    llama_batch_free(batch);
-    return total_score / (float) candidate_tokens.size();
+    kv_tokens.insert(kv_tokens.end(), tokens, tokens + n_tokens);
+    return 0;
 }
 
-// ------- JNI: モデル初期化・キャンセル・解放 -------
-// package com.kazumaproject.zenz; class ZenzEngine
-
-extern "C"
-JNIEXPORT jboolean JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_initModel(
-        JNIEnv *env,
-        jobject /* thiz */,
-        jstring jModelPath
+static int decode_session_tokens_locked(
+        llama_context *ctx,
+        const llama_token *tokens,
+        size_t n_tokens,
+        size_t logits_from
 ) {
-    if (!jModelPath) {
-        LOGE("initModel: model path is null");
-        return JNI_FALSE;
+    const auto started = std::chrono::steady_clock::now();
+    const int rc = decode_tokens_at_end(ctx, g_session.kv_tokens, tokens, n_tokens, logits_from);
+    if (rc != 0) {
+        g_session.kv_fragmented = true;
+    } else if (n_tokens > 0) {
+        g_decode_cost.record(n_tokens, std::chrono::duration<double, std::micro>(
+                std::chrono::steady_clock::now() - started).count());
     }
+    return rc;
+}
 
-    const char *c_model_path = env->GetStringUTFChars(jModelPath, nullptr);
-    if (!c_model_path) {
-        LOGE("initModel: failed to read model path");
-        return JNI_FALSE;
-    }
-    LOGI("initModel: %s", c_model_path);
+// ------- 長いプロンプトのチャンク分割プレフィル -------
+// カーソル移動や文脈の変更の直後は、数百から数千トークンのプロンプトを丸ごとデコードすることになる。
+// 出力の要らない前半を g_prefill_chunk_tokens ずつに分けてデコードし、チャンクの間で古いリクエストに
+// なっていないかを確かめる。古いリクエストが計算を握る時間は 1 チャンク分で済み、終わったチャンクは KV と
+// g_session.kv_tokens に残るので、次のリクエストが共通接頭辞として使い回す。
 
-    // A reload must also stop a decode that currently owns the session mutex.
-    g_request_seq.fetch_add(1, std::memory_order_relaxed);
-    std::lock_guard<std::mutex> lock(g_session.mutex);
-    destroy_session_context_locked();
+// スケジューラ経由のリクエストなら進み具合をコールバックでも知らせる (スケジューラの節で定義)。
+static void notify_scheduled_prefill_progress(size_t done, size_t total);
 
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        g_vocab = nullptr;
-    }
+static void report_prefill_progress(size_t done, size_t total) {
+    g_prefill_progress_done.store((int) done, std::memory_order_relaxed);
+    g_prefill_progress_total.store((int) total, std::memory_order_relaxed);
+    notify_scheduled_prefill_progress(done, total);
+}
 
-    if (!g_backend_initialized) {
-        llama_backend_init();
-        g_backend_initialized = true;
+// decode_session_tokens_locked と同じく tokens を KV の末尾に足す。logits_from より前は出力なしの
+// チャンクに分け、残り (logits_from 以降を含む最後のバッチ) は 1 回でデコードする。
+// 成功したら first_row に、最後のバッチで tokens[logits_from] が何番目の行になったかを入れる
+// (llama_get_logits_ith / llama_get_embeddings_ith にはこの行番号から渡す)。
+// チャンクの間で古いリクエストになっていれば、そこで止めて 2 (llama_decode の中断と同じ値) を返す。
+// 2 つ目以降のチャンクや最後のバッチが締め切りに間に合わないときも 2 を返す。最初のバッチは必ず
+// デコードするので、締め切りに収まらない長いプロンプトも打鍵のたびに KV に積み上がっていく。
+static int prefill_session_tokens_locked(
+        llama_context *ctx,
+        const llama_token *tokens,
+        size_t n_tokens,
+        size_t logits_from,
+        uint64_t request_seq,
+        size_t &first_row
+) {
+    const size_t chunk = (size_t) std::max(0, g_prefill_chunk_tokens.load(std::memory_order_relaxed));
+    size_t done = 0;
+    while (chunk > 0 && logits_from > done + chunk) {
+        if (is_request_stale(request_seq) || (done > 0 && !deadline_allows_decode_locked(chunk))) {
+            return 2;
+        }
+        int rc;
+        {
+            PrefillSafePointScope safe_point;
+            rc = decode_session_tokens_locked(ctx, tokens + done, chunk, chunk);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+        done += chunk;
+        report_prefill_progress(done, n_tokens);
     }
-
-    llama_model_params mparams = llama_model_default_params();
-    mparams.n_gpu_layers = 0;
-    mparams.use_mmap = true;
-
-    g_model = llama_model_load_from_file(c_model_path, mparams);
-    if (!g_model) {
-        LOGE("Failed to load model");
-        env->ReleaseStringUTFChars(jModelPath, c_model_path);
-        return JNI_FALSE;
+    if (done > 0 && (is_request_stale(request_seq) || !deadline_allows_decode_locked(n_tokens - done))) {
+        return 2;
     }
 
-    g_vocab = llama_model_get_vocab(g_model);
-    if (!g_vocab) {
-        LOGE("Failed to get vocab");
-        llama_model_free(g_model);
-        g_model = nullptr;
-        env->ReleaseStringUTFChars(jModelPath, c_model_path);
-        return JNI_FALSE;
+    int rc;
+    {
+        PrefillSafePointScope safe_point;
+        rc = decode_session_tokens_locked(ctx, tokens + done, n_tokens - done, logits_from - std::min(logits_from, done));
     }
-
-    env->ReleaseStringUTFChars(jModelPath, c_model_path);
-    return JNI_TRUE;
+    if (rc == 0) {
+        first_row = logits_from - std::min(logits_from, done);
+        if (done > 0) {
+            report_prefill_progress(n_tokens, n_tokens);
+        }
+    }
+    return rc;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_cancelCurrent(
-        JNIEnv * /*env*/,
-        jobject /*thiz*/
-) {
-    // Do not take g_session.mutex here. This method must remain callable from a Binder thread
-    // while the actor thread is blocked inside llama_decode with that mutex held.
-    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+// 制御トークンを除いてトークン列を UTF-8 (不正あり得る) に戻す。
+static std::string tokens_to_text(const std::vector<llama_token> &tokens) {
+    std::string out;
+    for (auto t: tokens) {
+        if (llama_vocab_is_control(g_vocab, t)) {
+            continue;
+        }
+        out += token_to_piece_str(t);
+    }
+    return out;
 }
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_closeModel(
-        JNIEnv * /*env*/,
-        jobject /*thiz*/
-) {
-    g_request_seq.fetch_add(1, std::memory_order_relaxed);
-    std::lock_guard<std::mutex> lock(g_session.mutex);
-    destroy_session_context_locked();
+// logits 1 行の argmax (同値なら ID の小さい方)。
+static llama_token argmax_token(const float *logits, int32_t n_vocab) {
+    return (llama_token) zenz_logit_argmax(logits, n_vocab);
+}
 
-    if (g_model) {
-        llama_model_free(g_model);
-        g_model = nullptr;
-        g_vocab = nullptr;
-    }
+// logits 1 行 (n_vocab 個) の log-sum-exp。logits[t] からこれを引くと t の対数確率になる。
+static float logits_log_normalizer(const float *logits, int32_t n_vocab) {
+    return zenz_logit_stats(logits, n_vocab).log_sum_exp;
+}
 
-    if (g_backend_initialized) {
-        llama_backend_free();
-        g_backend_initialized = false;
+// all_logits の連続した n_rows 行をまとめて要約する (行数が多ければ推論と同じスレッド数で分担する)。
+static std::vector<ZenzLogitStats> logit_rows_stats(const float *all_logits, size_t n_rows, int32_t n_vocab) {
+    std::vector<const float *> rows(n_rows);
+    for (size_t i = 0; i < n_rows; ++i) {
+        rows[i] = all_logits + i * (size_t) n_vocab;
     }
+    std::vector<ZenzLogitStats> stats(n_rows);
+    zenz_logit_stats_rows(rows.data(), n_rows, n_vocab, stats.data(), get_runtime_config().n_threads);
+    return stats;
 }
 
-// ------- JNI: ランタイム設定 (n_ctx / n_threads) -------
+// ------- 出力層から先をグラフで計算する採点 -------
+// 採点に要るのは各位置の「期待するトークンの対数確率・argmax・log-sum-exp」だけなので、語彙数 x 行数の
+// logits をホストに写して走査し直す必要はない。採点のデコードでは llama_set_embeddings で最終正規化後の
+// 隠れ状態 (n_embd 個/行) だけを受け取り、cb_eval で出力層の前に計算を打ち切る。出力層の mul_mat に
+// argmax・gather・log-sum-exp をつないだ小さな ggml グラフを自前で計算し、行ごとにスカラーだけを取り出す。
+// 出力層の重みは自己投機的デコーディングと同じく "result_output" から拾ったものを使う
+// (通常のデコードを 1 回済ませるまでは使えないので、呼び出し側は logits の経路にフォールバックする)。
 
-extern "C"
-JNIEXPORT void JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_setRuntimeConfig(
-        JNIEnv * /*env*/,
-        jobject /*thiz*/,
-        jint jNCtx,
-        jint jNThreads
-) {
-    int n_ctx = jNCtx > 0 ? jNCtx : 512;
-    int n_threads = jNThreads > 0 ? jNThreads : 4;
+static constexpr size_t kHeadScoreChunkRows = 32;  // 1 回のグラフで扱う行数 (作業メモリを抑える)
 
-    if (n_ctx < 128) n_ctx = 128;
-    if (n_ctx > 4096) n_ctx = 4096;
+struct HeadScoreScratch {
+    std::vector<uint8_t> mem;
+    std::vector<uint8_t> work;
+};
 
-    if (n_threads < 1) n_threads = 1;
-    if (n_threads > 8) n_threads = 8;
+static HeadScoreScratch g_head_score_scratch;  // g_session.mutex で保護
 
-    RuntimeConfig new_config{
-            n_ctx,
-            n_threads,
-            n_threads,
-            n_ctx
-    };
+static bool head_scoring_available_locked() {
+    return g_head_scoring_enabled.load(std::memory_order_relaxed) && g_layer_skip.head_captured &&
+           g_layer_skip.output->ne[0] == llama_model_n_embd(g_model) &&
+           g_layer_skip.output->ne[1] == llama_vocab_n_tokens(g_vocab);
+}
 
-    {
-        std::lock_guard<std::mutex> lock(g_param_mutex);
-        g_param_n_ctx = new_config.n_ctx;
-        g_param_n_threads = new_config.n_threads;
-        g_param_n_threads_batch = new_config.n_threads_batch;
-        g_param_n_batch = new_config.n_batch;
+// この間のデコードは logits の代わりに最終正規化後の隠れ状態を返し、出力層を計算しない。
+class HiddenOutputScope {
+public:
+    // enabled が false なら何もしない (logits を返す通常のデコードのまま)。
+    HiddenOutputScope(llama_context *ctx, bool enabled) : ctx_(enabled ? ctx : nullptr) {
+        if (ctx_) {
+            llama_set_embeddings(ctx_, true);
+            g_layer_skip.stop_after_norm = true;
+        }
     }
 
-    {
-        std::lock_guard<std::mutex> session_lock(g_session.mutex);
-        if (g_session.ctx && !same_runtime_config(g_session.config, new_config)) {
-            destroy_session_context_locked();
+    ~HiddenOutputScope() {
+        if (ctx_) {
+            g_layer_skip.stop_after_norm = false;
+            llama_set_embeddings(ctx_, false);
         }
     }
 
-    LOGI("setRuntimeConfig: n_ctx=%d, n_threads=%d", n_ctx, n_threads);
-}
+    HiddenOutputScope(const HiddenOutputScope &) = delete;
+    HiddenOutputScope &operator=(const HiddenOutputScope &) = delete;
 
-// ------- JNI: 「後半の変換結果」を返す（v1 型） -------
+private:
+    llama_context *ctx_;
+};
 
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_generate(
+// ------- 語彙を絞った出力層 (任意) -------
+// 変換の出力はほぼ かな・漢字・和文の記号 だけなので、それ以外の文字を含むトークンを除いた語彙
+// (g_shortlist_tokens、モデルの読み込み時に build_vocab_shortlist_locked で作る) の行だけを出力層の
+// 重みから写した短い出力層を用意し、貪欲生成と採点の出力層をそれで置き換える。貪欲生成では
+// 短い出力層の argmax を後で全語彙の出力層でまとめて確かめる (greedy_decode_continue_locked)。
+// 必要なトークン (採点するトークン、貪欲生成ではプロンプトのトークン) が語彙の外にある場合は
+// 全語彙の出力層を使う。短縮した語彙の中で正規化するので、採点の値は全語彙の場合よりわずかに高い。
+// 値を比べる候補どうしで出力層が混ざらないよう、採点の出力層は 1 回のリクエストで 1 つに決める。
+struct OutputHead {
+    ggml_context *ctx = nullptr;        // weight を持つ
+    ggml_tensor *weight = nullptr;      // [n_embd, tokens.size()]
+    std::vector<llama_token> tokens;    // 行 -> トークン ID
+    std::vector<int32_t> rows;          // トークン ID -> 行 (語彙の外なら -1)
+};
+
+static std::vector<bool> g_shortlist_tokens;  // g_session.mutex で保護 (空なら短縮しない)
+static OutputHead g_shortlist_head;           // g_session.mutex で保護
+
+static void free_vocab_shortlist_locked() {
+    if (g_shortlist_head.ctx) {
+        ggml_free(g_shortlist_head.ctx);
+    }
+    g_shortlist_head = OutputHead{};
+    g_shortlist_tokens.clear();
+}
+
+// 出力層の重みを拾った後で、短縮した語彙の行だけを写した出力層を作る。
+static const OutputHead *ensure_shortlist_head_locked() {
+    if (!g_vocab_shortlist_enabled.load(std::memory_order_relaxed) || !head_scoring_available_locked()) {
+        return nullptr;
+    }
+    if (g_shortlist_head.weight) {
+        return &g_shortlist_head;
+    }
+    if (g_shortlist_tokens.empty()) {
+        return nullptr;
+    }
+
+    const ggml_tensor *output = g_layer_skip.output;
+    const size_t row_size = ggml_row_size(output->type, output->ne[0]);
+    if (row_size != output->nb[1]) {
+        return nullptr;
+    }
+    OutputHead head;
+    head.rows.assign((size_t) output->ne[1], -1);
+    for (size_t t = 0; t < g_shortlist_tokens.size() && t < head.rows.size(); ++t) {
+        if (g_shortlist_tokens[t]) {
+            head.rows[t] = (int32_t) head.tokens.size();
+            head.tokens.push_back((llama_token) t);
+        }
+    }
+    ggml_init_params params{row_size * head.tokens.size() + ggml_tensor_overhead() + GGML_MEM_ALIGN, nullptr, false};
+    head.ctx = ggml_init(params);
+    if (!head.ctx) {
+        return nullptr;
+    }
+    head.weight = ggml_new_tensor_2d(head.ctx, output->type, output->ne[0], (int64_t) head.tokens.size());
+    for (size_t r = 0; r < head.tokens.size(); ++r) {
+        memcpy((char *) head.weight->data + r * row_size,
+               (const char *) output->data + (size_t) head.tokens[r] * output->nb[1], row_size);
+    }
+    LOGI("vocab shortlist head: %zu / %lld tokens", head.tokens.size(), (long long) output->ne[1]);
+    g_shortlist_head = std::move(head);
+    return &g_shortlist_head;
+}
+
+// tokens がすべて短縮した語彙に入っていればその出力層を返す。使えなければ nullptr (全語彙)。
+static const OutputHead *shortlist_head_for_locked(const llama_token *tokens, size_t n_tokens) {
+    const OutputHead *head = ensure_shortlist_head_locked();
+    if (!head) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || (size_t) tokens[i] >= head->rows.size() || head->rows[(size_t) tokens[i]] < 0) {
+            return nullptr;
+        }
+    }
+    return head;
+}
+
+// 1 回のリクエストで採点する候補がすべて短縮した語彙に入っていればその出力層を返す。
+// 1 つでも外れていれば全候補を全語彙の出力層 (nullptr) で採点する。
+static const OutputHead *shortlist_head_for_candidates_locked(
+        const std::vector<const std::vector<llama_token> *> &candidates
+) {
+    const OutputHead *head = ensure_shortlist_head_locked();
+    for (size_t i = 0; head && i < candidates.size(); ++i) {
+        if (!shortlist_head_for_locked(candidates[i]->data(), candidates[i]->size())) {
+            return nullptr;
+        }
+    }
+    return head;
+}
+
+// 隠れ状態の各行に出力層を掛け、行ごとの要約 (stats) と targets の対数確率 (target_log_probs) を求める。
+// targets と target_log_probs は行ごとに n_targets 個ずつ並べる (行 r の j 番目は r * n_targets + j)。
+// targets が nullptr なら argmax だけを求める (stats の他の値は NaN)。
+// head が nullptr なら全語彙の出力層を使う。短縮した出力層なら targets はすべてその語彙に入っていること。
+static bool head_score_rows_locked(
+        const OutputHead *head,
+        const float *const *hidden_rows,
+        size_t n_rows,
+        const llama_token *targets,
+        size_t n_targets,
+        ZenzLogitStats *stats,
+        float *target_log_probs
+) {
+    const ggml_tensor *output = head ? head->weight : g_layer_skip.output;
+    const int64_t n_embd = output->ne[0];
+    const int64_t n_vocab = output->ne[1];
+    // llama_decode と同じセッションのスレッドプールで計算し、呼び出しごとにスレッドを作らない。
+    ggml_threadpool *threadpool = g_session.threadpool;
+    int n_threads = get_runtime_config().n_threads;
+    if (threadpool) {
+        if (g_session.threadpool_paused) {
+            ggml_threadpool_resume(threadpool);
+            g_session.threadpool_paused = false;
+        }
+        n_threads = std::min(n_threads, g_session.threadpool_config.n_threads);
+    }
+    auto &scratch = g_head_score_scratch;
+
+    for (size_t row0 = 0; row0 < n_rows; row0 += kHeadScoreChunkRows) {
+        const int64_t n = (int64_t) std::min(kHeadScoreChunkRows, n_rows - row0);
+        const int64_t k = targets ? (int64_t) n_targets : 0;
+
+        // logits と exp の 2 枚が大半。残りは行数程度の小さなテンソルとグラフの管理領域。
+        const size_t mem_size = 2 * (size_t) (n_vocab * n * sizeof(float)) +
+                                (size_t) (n_embd * n + 8 * n * (k + 1)) * sizeof(float) +
+                                32 * (ggml_tensor_overhead() + GGML_MEM_ALIGN) + ggml_graph_overhead();
+        if (scratch.mem.size() < mem_size) {
+            scratch.mem.resize(mem_size);
+        }
+        ggml_init_params params{scratch.mem.size(), scratch.mem.data(), false};
+        ggml_context *gctx = ggml_init(params);
+        if (!gctx) {
+            return false;
+        }
+
+        ggml_tensor *w = ggml_view_tensor(gctx, const_cast<ggml_tensor *>(output));
+        ggml_tensor *h = ggml_new_tensor_2d(gctx, GGML_TYPE_F32, n_embd, n);
+        for (int64_t r = 0; r < n; ++r) {
+            memcpy((char *) h->data + (size_t) r * h->nb[1], hidden_rows[row0 + (size_t) r], (size_t) n_embd * sizeof(float));
+        }
+
+        ggml_tensor *logits = ggml_mul_mat(gctx, w, h);                          // [n_vocab, n]
+        ggml_tensor *best = ggml_argmax(gctx, logits);                           // [n] (I32)
+        ggml_cgraph *gf = ggml_new_graph(gctx);
+        ggml_build_forward_expand(gf, best);
+
+        ggml_tensor *best_logit = nullptr;
+        ggml_tensor *lse = nullptr;
+        ggml_tensor *log_prob = nullptr;
+        if (k > 0) {
+            ggml_tensor *tgt = ggml_new_tensor_2d(gctx, GGML_TYPE_I32, k, n);
+            auto *tgt_data = (int32_t *) tgt->data;
+            for (int64_t i = 0; i < n * k; ++i) {
+                const llama_token t = targets[row0 * n_targets + (size_t) i];
+                tgt_data[i] = head ? head->rows[(size_t) t] : t;
+            }
+            ggml_tensor *logits3 = ggml_reshape_3d(gctx, logits, 1, n_vocab, n);
+            best_logit = ggml_reshape_2d(gctx, ggml_get_rows(gctx, logits3, ggml_reshape_2d(gctx, best, 1, n)), 1, n);
+            ggml_tensor *exps = ggml_exp_inplace(gctx, ggml_sub(gctx, logits, best_logit));
+            lse = ggml_add(gctx, ggml_log(gctx, ggml_sum_rows(gctx, exps)), best_logit);  // [1, n]
+            ggml_tensor *target_logit = ggml_get_rows(gctx, logits3, tgt);           // [1, k, n]
+            log_prob = ggml_sub(gctx, target_logit, ggml_reshape_3d(gctx, lse, 1, 1, n));
+            ggml_build_forward_expand(gf, log_prob);
+        }
+
+        ggml_cplan plan = ggml_graph_plan(gf, n_threads, threadpool);
+        if (scratch.work.size() < plan.work_size) {
+            scratch.work.resize(plan.work_size);
+        }
+        plan.work_data = scratch.work.data();
+        const ggml_status status = ggml_graph_compute(gf, &plan);
+        if (status != GGML_STATUS_SUCCESS) {
+            LOGE("head_score_rows_locked: ggml_graph_compute failed: %d", (int) status);
+            ggml_free(gctx);
+            return false;
+        }
+
+        for (int64_t r = 0; r < n; ++r) {
+            const size_t row = row0 + (size_t) r;
+            const int32_t best_row = ((const int32_t *) best->data)[r];
+            stats[row].argmax = head ? head->tokens[(size_t) best_row] : best_row;
+            stats[row].max_logit = best_logit ? ((const float *) best_logit->data)[r] : NAN;
+            stats[row].log_sum_exp = lse ? ((const float *) lse->data)[r] : NAN;
+            if (log_prob) {
+                memcpy(target_log_probs + row * n_targets, (const float *) log_prob->data + r * k, (size_t) k * sizeof(float));
+            }
+        }
+        ggml_free(gctx);
+    }
+    return true;
+}
+
+// バッチの first_index 番目から targets.size() 行の隠れ状態について、行の要約と targets[i] の対数確率を求める。
+// head は head_score_rows_locked と同じ (リクエストの初めに決めたものを渡す)。
+static bool head_score_batch_rows_locked(
+        llama_context *ctx,
+        int32_t first_index,
+        const OutputHead *head,
+        const std::vector<llama_token> &targets,
+        std::vector<ZenzLogitStats> &stats,
+        std::vector<float> &log_probs
+) {
+    std::vector<const float *> hidden_rows(targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        hidden_rows[i] = llama_get_embeddings_ith(ctx, first_index + (int32_t) i);
+        if (!hidden_rows[i]) {
+            LOGE("head_score_batch_rows_locked: hidden state of output %zu is null", i);
+            return false;
+        }
+    }
+    stats.resize(targets.size());
+    log_probs.resize(targets.size());
+    return head_score_rows_locked(head, hidden_rows.data(), targets.size(), targets.data(), 1,
+                                  stats.data(), log_probs.data());
+}
+
+// バッチの first_index 番目から n_rows 行の隠れ状態について、短縮した出力層で各行の argmax を求める (貪欲生成用)。
+static bool shortlist_argmax_rows_locked(
+        llama_context *ctx,
+        int32_t first_index,
+        size_t n_rows,
+        std::vector<llama_token> &argmax
+) {
+    const OutputHead *head = ensure_shortlist_head_locked();
+    std::vector<const float *> hidden_rows(n_rows);
+    for (size_t i = 0; i < n_rows; ++i) {
+        hidden_rows[i] = llama_get_embeddings_ith(ctx, first_index + (int32_t) i);
+        if (!head || !hidden_rows[i]) {
+            return false;
+        }
+    }
+    std::vector<ZenzLogitStats> stats(n_rows);
+    if (!head_score_rows_locked(head, hidden_rows.data(), n_rows, nullptr, 0, stats.data(), nullptr)) {
+        return false;
+    }
+    argmax.resize(n_rows);
+    for (size_t i = 0; i < n_rows; ++i) {
+        argmax[i] = (llama_token) stats[i].argmax;
+    }
+    return true;
+}
+
+// ------- 読みによる制約付きデコーディング -------
+// 各トークンの文字列を「カナ (カタカナに揃える)」と「読みの分からない文字 (漢字・記号など)」に分け、
+// 入力の読みのどこまでを消費し得るかを追いながら、続きとして矛盾しないトークンだけで argmax を取る。
+// 読みの分からない文字は 1〜kMaxKanaPerWildcard 文字の読みを消費し得るものとして扱う。
+// バイト単位の BPE ではトークンが UTF-8 の文字の途中で切れることがあるので、未完の文字のバイト列を
+// 次のトークンまで持ち越す。
+
+static constexpr char32_t kReadingWildcard = 0;
+static constexpr size_t kMaxKanaPerWildcard = 5;  // 「承 (うけたまわ)」「詔 (みことのり)」など
+
+struct TokenReading {
+    std::string head;             // 前のトークンの途中の文字の続き (UTF-8 の継続バイト)
+    std::vector<char32_t> chars;  // 完結した文字 (カナ、または kReadingWildcard)
+    std::string tail;             // 次のトークンに続く未完の文字のバイト列
+};
+
+struct ReadingIndex {
+    std::vector<TokenReading> tokens;                               // トークン ID 順
+    std::vector<std::pair<char32_t, llama_token>> by_first_kana;    // (先頭のカナ, ID) の昇順
+    std::vector<llama_token> wildcard_first;  // 先頭が読みの分からない文字、または未完の文字だけのトークン
+    std::vector<llama_token> continuation;    // head を持つトークン
+};
+
+static ReadingIndex g_reading_index;  // g_session.mutex で保護 (モデルの読み込み時に作る)
+
+// ひらがなはカタカナに揃え、カナ以外はそのまま返す。
+static char32_t normalize_reading_char(char32_t cp) {
+    if ((cp >= 0x3041 && cp <= 0x3096) || cp == 0x309D || cp == 0x309E) {
+        return cp + 0x60;
+    }
+    return cp;
+}
+
+static bool is_reading_kana(char32_t cp) {
+    return (cp >= 0x30A1 && cp <= 0x30FA) || (cp >= 0x30FC && cp <= 0x30FE);
+}
+
+// s[pos] から始まる UTF-8 の 1 文字の長さ。バイト列が途中で切れていれば 0、不正なら 1 (U+FFFD 扱い)。
+static size_t decode_utf8_char(const std::string &s, size_t pos, char32_t &cp) {
+    const auto c0 = (uint8_t) s[pos];
+    size_t len;
+    if (c0 < 0x80) {
+        cp = c0;
+        return 1;
+    } else if ((c0 & 0xE0) == 0xC0) {
+        len = 2;
+        cp = c0 & 0x1F;
+    } else if ((c0 & 0xF0) == 0xE0) {
+        len = 3;
+        cp = c0 & 0x0F;
+    } else if ((c0 & 0xF8) == 0xF0) {
+        len = 4;
+        cp = c0 & 0x07;
+    } else {
+        cp = 0xFFFD;
+        return 1;
+    }
+    for (size_t i = 1; i < len; ++i) {
+        if (pos + i >= s.size()) {
+            return 0;
+        }
+        const auto c = (uint8_t) s[pos + i];
+        if ((c & 0xC0) != 0x80) {
+            cp = 0xFFFD;
+            return 1;
+        }
+        cp = (cp << 6) | (c & 0x3F);
+    }
+    return len;
+}
+
+static char32_t reading_class(char32_t cp) {
+    cp = normalize_reading_char(cp);
+    return is_reading_kana(cp) ? cp : kReadingWildcard;
+}
+
+static std::u32string reading_from_text(const std::string &text) {
+    std::u32string reading;
+    for (size_t pos = 0; pos < text.size();) {
+        char32_t cp;
+        const size_t len = decode_utf8_char(text, pos, cp);
+        if (len == 0) {
+            break;
+        }
+        reading.push_back(normalize_reading_char(cp));
+        pos += len;
+    }
+    return reading;
+}
+
+static void build_reading_index_locked() {
+    g_reading_index = ReadingIndex{};
+    if (!g_vocab) {
+        return;
+    }
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    auto &index = g_reading_index;
+    index.tokens.resize((size_t) n_vocab);
+    for (llama_token t = 0; t < n_vocab; ++t) {
+        if (llama_vocab_is_control(g_vocab, t) || llama_vocab_is_eog(g_vocab, t)) {
+            continue;
+        }
+        const std::string piece = token_to_piece_str(t);
+        if (piece.empty()) {
+            continue;
+        }
+        auto &entry = index.tokens[(size_t) t];
+        size_t pos = 0;
+        while (pos < piece.size() && pos < 3 && ((uint8_t) piece[pos] & 0xC0) == 0x80) {
+            ++pos;
+        }
+        entry.head = piece.substr(0, pos);
+        while (pos < piece.size()) {
+            char32_t cp;
+            const size_t len = decode_utf8_char(piece, pos, cp);
+            if (len == 0) {
+                entry.tail = piece.substr(pos);
+                break;
+            }
+            entry.chars.push_back(reading_class(cp));
+            pos += len;
+        }
+
+        if (!entry.head.empty()) {
+            index.continuation.push_back(t);
+        } else if (!entry.chars.empty() && entry.chars.front() != kReadingWildcard) {
+            index.by_first_kana.emplace_back(entry.chars.front(), t);
+        } else {
+            index.wildcard_first.push_back(t);
+        }
+    }
+    std::sort(index.by_first_kana.begin(), index.by_first_kana.end());
+    LOGI("build_reading_index: kana-first=%zu wildcard-first=%zu continuation=%zu",
+         index.by_first_kana.size(), index.wildcard_first.size(), index.continuation.size());
+}
+
+// 変換の出力に現れ得る文字か (語彙の短縮用)。
+static bool is_conversion_output_char(char32_t cp) {
+    return (cp >= 0x20 && cp <= 0x7E) ||      // ASCII
+           (cp >= 0xA0 && cp <= 0xFF) ||      // Latin-1 の記号 (× ÷ ° など)
+           (cp >= 0x0391 && cp <= 0x03C9) ||  // ギリシャ文字
+           (cp >= 0x2010 && cp <= 0x27BF) ||  // 句読点・矢印・数学記号・囲み文字・罫線・図形
+           (cp >= 0x3000 && cp <= 0x33FF) ||  // 和文の句読点・かな・CJK の囲み文字と単位
+           (cp >= 0x3400 && cp <= 0x4DBF) ||  // CJK 統合漢字拡張 A
+           (cp >= 0x4E00 && cp <= 0x9FFF) ||  // CJK 統合漢字
+           (cp >= 0xE000 && cp <= 0xF8FF) ||  // 私用領域 (プロンプトのタグ)
+           (cp >= 0xF900 && cp <= 0xFAFF) ||  // CJK 互換漢字
+           (cp >= 0xFF00 && cp <= 0xFFEF);    // 全角・半角形
+}
+
+// 短縮した語彙を決める。制御トークンと、文字列が変換の出力に現れ得る文字だけからなるトークンを残す。
+// UTF-8 の文字の途中で切れたバイト列 (バイト単位の BPE の断片) は、どの文字の一部か分からないので残す。
+static void build_vocab_shortlist_locked() {
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    g_shortlist_tokens.assign((size_t) n_vocab, false);
+    size_t n_kept = 0;
+    for (llama_token t = 0; t < n_vocab; ++t) {
+        bool keep = true;
+        if (!llama_vocab_is_control(g_vocab, t) && !llama_vocab_is_eog(g_vocab, t)) {
+            const std::string piece = token_to_piece_str(t);
+            size_t pos = 0;
+            while (pos < piece.size() && ((uint8_t) piece[pos] & 0xC0) == 0x80) {
+                ++pos;
+            }
+            while (keep && pos < piece.size()) {
+                char32_t cp;
+                const size_t len = decode_utf8_char(piece, pos, cp);
+                if (len == 0) {
+                    break;
+                }
+                keep = is_conversion_output_char(cp);
+                pos += len;
+            }
+        }
+        g_shortlist_tokens[(size_t) t] = keep;
+        n_kept += keep ? 1 : 0;
+    }
+    LOGI("vocab shortlist: %zu / %d tokens", n_kept, n_vocab);
+}
+
+// 入力の読みのうち、ここまでの出力で消費し得た文字数の集合と、持ち越し中の未完の文字。
+class ReadingConstraint {
+public:
+    explicit ReadingConstraint(const std::string &reading_text)
+            : reading_(reading_from_text(reading_text)),
+              reachable_(reading_.size() + 1, 0) {
+        reachable_[0] = 1;
+        active_ = !reading_.empty() && !g_reading_index.tokens.empty();
+    }
+
+    bool active() const {
+        return active_;
+    }
+
+    // 読みをすべて消費し、これ以上どの文字も出力できない状態。
+    bool finished() const {
+        if (!active_ || !pending_.empty()) {
+            return false;
+        }
+        for (size_t p = 0; p < reading_.size(); ++p) {
+            if (reachable_[p]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // 読みと矛盾しないトークンの中で logits が最大のもの (同値なら ID の小さい方)。
+    // 続けられるトークンがなければ制約を外して全語彙の argmax に戻る。
+    llama_token pick(const float *logits, int32_t n_vocab, llama_token eos) {
+        if (!active_) {
+            return argmax_token(logits, n_vocab);
+        }
+        if (finished()) {
+            return eos;
+        }
+        llama_token best = -1;
+        float best_logit = -INFINITY;
+        auto consider = [&](llama_token t) {
+            if (logits[t] < best_logit || (logits[t] == best_logit && t > best)) {
+                return;
+            }
+            if (!advance(g_reading_index.tokens[(size_t) t], scratch_reachable_, scratch_pending_)) {
+                return;
+            }
+            best = t;
+            best_logit = logits[t];
+        };
+
+        if (pending_.empty()) {
+            if (reachable_[reading_.size()] && eos >= 0 && eos < n_vocab) {
+                best = eos;
+                best_logit = logits[eos];
+            }
+            const auto &by_first = g_reading_index.by_first_kana;
+            char32_t seen[8];
+            size_t n_seen = 0;
+            for (size_t p = 0; p < reading_.size(); ++p) {
+                const char32_t c = reading_[p];
+                if (!reachable_[p] || !is_reading_kana(c) ||
+                    std::find(seen, seen + n_seen, c) != seen + n_seen) {
+                    continue;
+                }
+                if (n_seen < sizeof(seen) / sizeof(seen[0])) {
+                    seen[n_seen++] = c;
+                }
+                auto it = std::lower_bound(by_first.begin(), by_first.end(), std::make_pair(c, (llama_token) -1));
+                for (; it != by_first.end() && it->first == c; ++it) {
+                    consider(it->second);
+                }
+            }
+            for (llama_token t: g_reading_index.wildcard_first) {
+                consider(t);
+            }
+        } else {
+            for (llama_token t: g_reading_index.continuation) {
+                consider(t);
+            }
+        }
+
+        if (best < 0) {
+            LOGI("ReadingConstraint: no token continues the reading, falling back to unconstrained decoding");
+            active_ = false;
+            return argmax_token(logits, n_vocab);
+        }
+        return best;
+    }
+
+    void accept(llama_token token) {
+        if (!active_ || token < 0 || (size_t) token >= g_reading_index.tokens.size()) {
+            return;
+        }
+        if (!advance(g_reading_index.tokens[(size_t) token], scratch_reachable_, scratch_pending_)) {
+            active_ = false;
+            return;
+        }
+        reachable_.swap(scratch_reachable_);
+        pending_.swap(scratch_pending_);
+    }
+
+private:
+    // 現在の状態に token を足した状態を out_* に書く。読みと矛盾すれば false。
+    bool advance(const TokenReading &token, std::vector<uint8_t> &out_reachable, std::string &out_pending) const {
+        const size_t n = reading_.size();
+        out_reachable = reachable_;
+        out_pending.clear();
+
+        auto step = [&](char32_t c) {
+            next_.assign(n + 1, 0);
+            bool any = false;
+            for (size_t p = 0; p < n; ++p) {
+                if (!out_reachable[p]) {
+                    continue;
+                }
+                if (c != kReadingWildcard) {
+                    if (reading_[p] == c) {
+                        next_[p + 1] = 1;
+                        any = true;
+                    }
+                } else {
+                    const size_t end = std::min(n, p + kMaxKanaPerWildcard);
+                    for (size_t q = p + 1; q <= end; ++q) {
+                        next_[q] = 1;
+                    }
+                    any = true;
+                }
+            }
+            out_reachable.swap(next_);
+            return any;
+        };
+
+        if (pending_.empty()) {
+            if (!token.head.empty()) {
+                return false;
+            }
+        } else {
+            std::string joined = pending_ + token.head;
+            char32_t cp;
+            const size_t len = decode_utf8_char(joined, 0, cp);
+            if (len == 0) {
+                // まだ文字が完結しない
+                if (!token.chars.empty() || !token.tail.empty()) {
+                    return false;
+                }
+                out_pending = std::move(joined);
+                return true;
+            }
+            if (len != joined.size() || !step(reading_class(cp))) {
+                return false;
+            }
+        }
+        for (char32_t c: token.chars) {
+            if (!step(c)) {
+                return false;
+            }
+        }
+        if (token.head.empty() && token.chars.empty() && token.tail.empty()) {
+            // 制御トークンなど、文字を出力しないトークン
+            return false;
+        }
+        out_pending = token.tail;
+        return true;
+    }
+
+    std::u32string reading_;
+    std::vector<uint8_t> reachable_;
+    std::string pending_;
+    bool active_ = false;
+    std::vector<uint8_t> scratch_reachable_;
+    std::string scratch_pending_;
+    mutable std::vector<uint8_t> next_;
+};
+
+// ------- 投機的デコーディング -------
+// ドラフトの提案関数。propose の history は KV に載っているトークン列に次のトークンを足したもので、
+// その続きとして最大 max_draft 個のトークンを返す (空なら 1 トークンずつ生成する)。
+// on_verified (任意) には検証ステップごとに提案数・受理数・そのデコード時間 (us) が渡される。
+struct DraftProposer {
+    std::function<std::vector<llama_token>(const std::vector<llama_token> &history, size_t max_draft)> propose;
+    std::function<void(size_t n_drafted, size_t n_accepted, double step_us)> on_verified;
+
+    explicit operator bool() const {
+        return (bool) propose;
+    }
+};
+
+static constexpr size_t kMaxNgramSize = 3;
+static constexpr size_t kMaxDraftTokens = 8;
+
+// source の中で history の末尾 n トークンと一致する最も後ろの位置を探し、その続きを draft に入れる。
+// 続きのトークンがない位置 (source が history 自身なら末尾の n-gram そのもの) には一致させない。
+static bool ngram_lookup_in(
+        const std::vector<llama_token> &source,
+        const std::vector<llama_token> &history,
+        size_t n,
+        size_t max_draft,
+        std::vector<llama_token> &draft
+) {
+    if (source.size() <= n || history.size() < n) {
+        return false;
+    }
+    const auto pattern = history.end() - (ptrdiff_t) n;
+    for (size_t start = source.size() - n; start-- > 0;) {
+        if (std::equal(pattern, history.end(), source.begin() + (ptrdiff_t) start)) {
+            const size_t from = start + n;
+            const size_t to = std::min(source.size(), from + max_draft);
+            draft.assign(source.begin() + (ptrdiff_t) from, source.begin() + (ptrdiff_t) to);
+            return true;
+        }
+    }
+    return false;
+}
+
+// プロンプト (左文脈を含む) と生成済みトークン、最近の確定出力の中から、
+// 生成中の末尾 n-gram と同じ並びを探してその続きをドラフトにする。長い n-gram を優先する。
+static std::vector<llama_token> ngram_draft_locked(const std::vector<llama_token> &history, size_t max_draft) {
+    std::vector<llama_token> draft;
+    if (max_draft == 0) {
+        return draft;
+    }
+    for (size_t n = std::min(kMaxNgramSize, history.size()); n >= 1; --n) {
+        if (ngram_lookup_in(history, history, n, max_draft, draft)) {
+            return draft;
+        }
+        for (auto it = g_session.commit_history_tokens.rbegin(); it != g_session.commit_history_tokens.rend(); ++it) {
+            if (ngram_lookup_in(*it, history, n, max_draft, draft)) {
+                return draft;
+            }
+        }
+    }
+    return draft;
+}
+
+// n-gram ドラフトが有効ならその提案関数を返す。確定出力のトークン化もここで更新する。
+static DraftProposer make_ngram_draft_proposer_locked() {
+    if (!g_ngram_drafting_enabled.load(std::memory_order_relaxed)) {
+        return {};
+    }
+    std::vector<std::string> texts;
+    {
+        std::lock_guard<std::mutex> lock(g_commit_history_mutex);
+        if (g_commit_history_version != g_session.commit_history_version) {
+            texts.assign(g_commit_history.begin(), g_commit_history.end());
+            g_session.commit_history_version = g_commit_history_version;
+            g_session.commit_history_tokens.clear();
+        }
+    }
+    for (const auto &text: texts) {
+        g_session.commit_history_tokens.push_back(
+                tokenize_text(preprocess_text(text), /*add_bos=*/false, /*add_eos=*/false));
+    }
+    return DraftProposer{ngram_draft_locked, {}};
+}
+
+// ドラフトモデルで history の続きを最大 max_draft トークン貪欲に生成する。
+// ドラフトモデルの KV も history との共通接頭辞を使い回し、差分だけをデコードする。
+static std::vector<llama_token> draft_model_propose_locked(
+        const std::vector<llama_token> &history,
+        size_t max_draft,
+        uint64_t request_seq
+) {
+    std::vector<llama_token> draft;
+    llama_context *ctx = ensure_draft_context_locked();
+    max_draft = std::min(max_draft, (size_t) std::max(g_draft_model_max_tokens.load(std::memory_order_relaxed), 0));
+    if (!ctx || history.empty() || max_draft == 0) {
+        return draft;
+    }
+
+    auto &kv_tokens = g_session.draft_kv_tokens;
+    const size_t keep = std::min(zenz_common_prefix_length(kv_tokens, history), history.size() - 1);
+    if (keep < kv_tokens.size()) {
+        if (llama_kv_cache_seq_rm(ctx, 0, (llama_pos) keep, -1)) {
+            kv_tokens.resize(keep);
+        } else {
+            llama_kv_cache_clear(ctx);
+            kv_tokens.clear();
+        }
+    }
+    const size_t n_ctx = llama_n_ctx(ctx);
+    if (history.size() - kv_tokens.size() > llama_n_batch(ctx) || history.size() + max_draft > n_ctx) {
+        return draft;
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+    const size_t n_new = history.size() - kv_tokens.size();
+    int rc = decode_tokens_at_end(ctx, kv_tokens, history.data() + kv_tokens.size(), n_new, n_new - 1);
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    while (rc == 0 && draft.size() < max_draft) {
+        const float *logits = llama_get_logits_ith(ctx, -1);
+        if (!logits) {
+            break;
+        }
+        const llama_token next = argmax_token(logits, n_vocab);
+        if (next == eos) {
+            break;
+        }
+        draft.push_back(next);
+        if (draft.size() < max_draft) {
+            rc = decode_tokens_at_end(ctx, kv_tokens, &next, 1, 0);
+        }
+    }
+
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+    return draft;
+}
+
+// 覚えておいた最終正規化を隠れ状態に掛け、出力層の argmax を求める。最終正規化は n_embd 要素の
+// ベクトル演算だけなのでここで行い、n_vocab x n_embd の出力層は head_score_rows_locked の
+// mul_mat グラフで (セッションのスレッドプールを使って) 掛ける。
+static bool layer_skip_head_argmax_locked(const LayerSkipState &state, llama_token &token) {
+    const ggml_tensor *output = state.output;
+    const int64_t n_embd = output->ne[0];
+    if ((int64_t) state.hidden.size() != n_embd) {
+        return false;
+    }
+
+    std::vector<float> x = state.hidden;
+    for (const auto &step: state.norm_steps) {
+        const auto *w = step.weight ? (const float *) step.weight->data : nullptr;
+        if (step.op == GGML_OP_NORM || step.op == GGML_OP_RMS_NORM) {
+            double mean = 0.0;
+            if (step.op == GGML_OP_NORM) {
+                for (float v: x) mean += v;
+                mean /= (double) n_embd;
+            }
+            double var = 0.0;
+            for (float v: x) var += ((double) v - mean) * ((double) v - mean);
+            const double scale = 1.0 / sqrt(var / (double) n_embd + step.eps);
+            for (float &v: x) v = (float) (((double) v - mean) * scale);
+        } else if (step.op == GGML_OP_MUL) {
+            for (int64_t i = 0; i < n_embd; ++i) x[i] *= w[i];
+        } else {
+            for (int64_t i = 0; i < n_embd; ++i) x[i] += w[i];
+        }
+    }
+
+    const float *row = x.data();
+    ZenzLogitStats stats{};
+    if (!head_score_rows_locked(nullptr, &row, 1, nullptr, 0, &stats, nullptr)) {
+        return false;
+    }
+    token = (llama_token) stats.argmax;
+    return true;
+}
+
+// 自動選択の対象にする層数 (全層の 1/4, 1/3, 1/2, 2/3)。
+static std::vector<int> layer_skip_candidates() {
+    const int n_layer = llama_model_n_layer(g_model);
+    std::vector<int> out;
+    const int fractions[][2] = {{1, 4}, {1, 3}, {1, 2}, {2, 3}};
+    for (const auto &f: fractions) {
+        const int n = std::max(1, n_layer * f[0] / f[1]);
+        if (n < n_layer && std::find(out.begin(), out.end(), n) == out.end()) {
+            out.push_back(n);
+        }
+    }
+    return out;
+}
+
+// 自動選択: 各候補を一定数試した後は、ドラフト 1 トークンあたりの節約時間
+// (受理率 x 検証 1 ステップの時間 - ドラフト 1 トークンの時間) が最大の層数を使う。
+// 節約できない場合はドラフトしないが、ときどき最良の候補を試して実測を更新する。
+static int choose_layer_skip_layers_locked() {
+    const int configured = g_layer_skip_layers.load(std::memory_order_relaxed);
+    if (configured >= 0) {
+        return std::min(configured, llama_model_n_layer(g_model) - 1);
+    }
+
+    auto &state = g_layer_skip;
+    const auto candidates = layer_skip_candidates();
+    if (candidates.empty()) {
+        return 0;
+    }
+    state.stats.resize((size_t) llama_model_n_layer(g_model));
+    ++state.auto_calls;
+
+    // 空のドラフトしか出さない層数でも先へ進めるよう、トークン数ではなく提案回数で探索を打ち切る。
+    constexpr uint64_t kExploreAttempts = 16;
+    for (int n: candidates) {
+        if (state.stats[(size_t) n].attempts < kExploreAttempts) {
+            state.auto_layers.store(n, std::memory_order_relaxed);
+            return n;
+        }
+    }
+
+    int best = 0;
+    double best_gain = 0.0;
+    int best_any = candidates.front();
+    double best_any_gain = -INFINITY;
+    for (int n: candidates) {
+        // 1 回の提案あたりに省けるデコード時間。ドラフトが空なら提案の時間だけ損になる。
+        const auto &st = state.stats[(size_t) n];
+        const double gain = ((double) st.accepted * state.step_decode_us - st.draft_us) / (double) st.attempts;
+        if (gain > best_any_gain) {
+            best_any_gain = gain;
+            best_any = n;
+        }
+        if (gain > best_gain) {
+            best_gain = gain;
+            best = n;
+        }
+    }
+    if (best == 0 && state.auto_calls % 32 == 0) {
+        best = best_any;
+    }
+    state.auto_layers.store(best, std::memory_order_relaxed);
+    return best;
+}
+
+// 同じモデルの先頭 n_layers 層だけを使い、history の続きを最大 max_draft トークン貪欲に生成する。
+// 検証済みの seq 0 を seq 1 に共有し、ドラフトのトークンは seq 1 だけに書いて最後に捨てる。
+// 打ち切った層より後ろの KV は書かれないので、seq 0 には影響しない。
+static std::vector<llama_token> layer_skip_propose_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &history,
+        size_t max_draft,
+        int &used_layers
+) {
+    std::vector<llama_token> draft;
+    auto &state = g_layer_skip;
+    const int n_layers = choose_layer_skip_layers_locked();
+    used_layers = 0;
+    if (n_layers <= 0 || !state.head_captured || llama_n_seq_max(ctx) < 2 || history.empty() ||
+        history.size() != g_session.kv_tokens.size() + 1) {
+        return draft;
+    }
+
+    constexpr llama_seq_id kDraftSeq = 1;
+    llama_kv_cache_seq_rm(ctx, kDraftSeq, -1, -1);
+    llama_kv_cache_seq_cp(ctx, 0, kDraftSeq, -1, -1);
+    state.exit_layer = n_layers;
+    snprintf(state.exit_name, sizeof(state.exit_name), "l_out-%d", n_layers - 1);
+
+    const auto started = std::chrono::steady_clock::now();
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    llama_token token = history.back();
+    llama_batch batch = llama_batch_init(1, 0, 1);
+    while (draft.size() < max_draft) {
+        batch.n_tokens = 0;
+        batch_add_token(batch, token, (llama_pos) (history.size() - 1 + draft.size()), kDraftSeq, true);
+        state.hidden_ready = false;
+        if (decode_batch_locked(ctx, batch) != 0 || !state.hidden_ready ||
+            state.output->ne[1] != llama_vocab_n_tokens(g_vocab) ||
+            !layer_skip_head_argmax_locked(state, token)) {
+            break;
+        }
+        if (token == eos) {
+            break;
+        }
+        draft.push_back(token);
+    }
+    llama_batch_free(batch);
+
+    state.exit_layer = 0;
+    llama_kv_cache_seq_rm(ctx, kDraftSeq, -1, -1);
+    g_session.kv_fragmented = true;
+
+    used_layers = n_layers;
+    if ((size_t) n_layers < state.stats.size()) {
+        const double elapsed = (double) std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - started).count();
+        state.stats[(size_t) n_layers].draft_us += elapsed;
+    }
+    return draft;
+}
+
+// レイヤースキップのドラフトの受理結果を層数ごとの実測に加える。空のドラフトも 1 回の提案として数える。
+// 古い実測は徐々に忘れる。
+static void record_layer_skip_result_locked(int n_layers, size_t n_drafted, size_t n_accepted, double step_us) {
+    auto &state = g_layer_skip;
+    state.step_decode_us = state.step_decode_us > 0.0 ? state.step_decode_us * 0.9 + step_us * 0.1 : step_us;
+    auto &stats = state.stats;
+    if (n_layers <= 0 || (size_t) n_layers >= stats.size()) {
+        return;
+    }
+    auto &st = stats[(size_t) n_layers];
+    ++st.attempts;
+    st.drafted += n_drafted;
+    st.accepted += n_accepted;
+    if (st.drafted > 256 || st.attempts > 256) {
+        st.attempts /= 2;
+        st.drafted /= 2;
+        st.accepted /= 2;
+        st.draft_us /= 2.0;
+    }
+}
+
+// 生成に使うドラフトの提案関数を選ぶ。ドラフトモデル、レイヤースキップ (有効な場合)、
+// n-gram ドラフト (有効な場合) の順に使う。
+static DraftProposer make_draft_proposer_locked(uint64_t request_seq) {
+    if (g_draft_model && ensure_draft_context_locked()) {
+        return DraftProposer{
+                [request_seq](const std::vector<llama_token> &history, size_t max_draft) {
+                    return draft_model_propose_locked(history, max_draft, request_seq);
+                },
+                {}
+        };
+    }
+    if (g_layer_skip_layers.load(std::memory_order_relaxed) != 0 && g_session.ctx) {
+        auto n_layers = std::make_shared<int>(0);
+        return DraftProposer{
+                [n_layers](const std::vector<llama_token> &history, size_t max_draft) {
+                    return layer_skip_propose_locked(g_session.ctx, history, max_draft, *n_layers);
+                },
+                [n_layers](size_t n_drafted, size_t n_accepted, double step_us) {
+                    record_layer_skip_result_locked(*n_layers, n_drafted, n_accepted, step_us);
+                }
+        };
+    }
+    return make_ngram_draft_proposer_locked();
+}
+
+// ------- 割り込まれたリクエストの途中結果 (ソフトキャンセル) -------
+// 速く打つと大半のリクエストは次の打鍵に割り込まれて終わる。割り込まれたリクエストがどこまで進んだかを
+// 記録し、ソフトキャンセルが有効なら途中までの出力や点数を捨てずに返す。貪欲生成の途中までの出力は
+// そのプロンプトの出力の接頭辞そのものなので、同じプロンプトの次の生成は検証せずにその続きから始める。
+
+// 割り込まれたリクエストが KV に載せ終えていたプロンプトの長さと、確定していた出力の長さを記録する。
+static void record_aborted_request_locked(const char *what, const std::vector<llama_token> &prompt, size_t n_output) {
+    const size_t n_prompt_done = zenz_common_prefix_length(g_session.kv_tokens, prompt);
+    g_aborted_requests.fetch_add(1, std::memory_order_relaxed);
+    g_aborted_prompt_tokens.fetch_add(n_prompt_done, std::memory_order_relaxed);
+    g_aborted_generated_tokens.fetch_add(n_output, std::memory_order_relaxed);
+    LOGI("%s aborted: prompt %zu/%zu tokens in KV, %zu output tokens", what, n_prompt_done, prompt.size(), n_output);
+}
+
+// ソフトキャンセルが有効で、同じプロンプトと読みの生成が直前に割り込まれていれば、その出力を
+// (max_count 個まで) 引き継いで返す。引き継げるものがなければ空。
+static std::vector<llama_token> take_aborted_generation_locked(
+        const std::vector<llama_token> &prompt_tokens,
+        const std::string &reading,
+        int max_count
+) {
+    std::vector<llama_token> resumed;
+    if (g_soft_cancel_enabled.load(std::memory_order_relaxed) &&
+        g_session.aborted_prompt == prompt_tokens && g_session.aborted_reading == reading) {
+        resumed.swap(g_session.aborted_output);
+        resumed.resize(std::min(resumed.size(), (size_t) std::max(max_count, 0)));
+        g_resumed_tokens.fetch_add(resumed.size(), std::memory_order_relaxed);
+    }
+    g_session.aborted_prompt.clear();
+    g_session.aborted_output.clear();
+    return resumed;
+}
+
+// 割り込まれた生成を記録する。tokens はプロンプト (先頭 n_prompt 個) と引き継いだ出力、output は
+// そこから確定した出力。ソフトキャンセルが有効なら次の生成のために残し、引き継いだ分を含む出力全体を返す。
+static std::string abort_generation_locked(
+        const std::vector<llama_token> &tokens,
+        size_t n_prompt,
+        const std::string &reading,
+        const std::vector<llama_token> &output
+) {
+    std::vector<llama_token> prompt(tokens.begin(), tokens.begin() + (ptrdiff_t) n_prompt);
+    std::vector<llama_token> all_output(tokens.begin() + (ptrdiff_t) n_prompt, tokens.end());
+    all_output.insert(all_output.end(), output.begin(), output.end());
+    record_aborted_request_locked("generation", prompt, all_output.size());
+    if (!g_soft_cancel_enabled.load(std::memory_order_relaxed)) {
+        return "";
+    }
+    g_session.aborted_prompt = std::move(prompt);
+    g_session.aborted_reading = reading;
+    g_session.aborted_output = all_output;
+    return tokens_to_text(all_output);
+}
+
+// 直前にデコードしたトークンの logits から貪欲に生成を続け、generated に追記する。
+// generated が max_count 個になるか EOS が出たら終わる。古いリクエストとして中断された場合は false。
+// propose_draft があれば、次のトークンと一緒にドラフトを 1 回でデコードし、argmax が一致した
+// ところまでをまとめて受理する。受理しなかったドラフトの KV は捨てるので、出力は常に
+// 1 トークンずつ貪欲に生成した場合と同じになる。
+// constraint があれば読みと矛盾しないトークンの中で argmax を取り、読みを消費し切った時点で止める。
+// 締め切りのあるリクエストでは、次のデコードが間に合わなければそこまでで止め、ドラフトも間に合う分だけ検証する。
+// 呼び出し時点で generated はすべて KV に入っていること。
+static bool greedy_decode_continue_locked(
+        llama_context *ctx,
+        std::vector<llama_token> &generated,
+        int max_count,
+        uint64_t request_seq,
+        const DraftProposer &propose_draft = {},
+        ReadingConstraint *constraint = nullptr
+) {
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    const size_t n_batch = llama_n_batch(ctx);
+    const size_t n_ctx = llama_n_ctx(ctx);
+    size_t n_drafted = 0;
+    size_t n_accepted = 0;
+
+    const float *last_logits = llama_get_logits_ith(ctx, -1);
+    if (!last_logits) {
+        LOGE("logits is null");
+        return true;
+    }
+    auto select = [&](const float *logits) {
+        return constraint ? constraint->pick(logits, n_vocab, eos) : argmax_token(logits, n_vocab);
+    };
+    llama_token next = select(last_logits);
+
+    // プロンプトに短縮した語彙の外のトークンがなければ、各ステップの argmax は短縮した出力層で取る
+    // (読みの制約は全語彙の logits を使うので対象外)。短縮した出力層で選んだトークンは選んだ行の
+    // 隠れ状態と一緒に覚えておき、最後に全語彙の出力層でまとめて (1 回のグラフで) argmax を取り直す。
+    // 食い違った位置があれば、そこまで戻して全語彙の argmax から全語彙の出力層で生成し直すので、
+    // 出力は全語彙で貪欲に生成した場合と同じになる。
+    bool shortlisted = !constraint &&
+                       shortlist_head_for_locked(g_session.kv_tokens.data(), g_session.kv_tokens.size()) != nullptr;
+    std::vector<llama_token> row_argmax;
+    const size_t n_base = g_session.kv_tokens.size() - std::min(g_session.kv_tokens.size(), generated.size());
+    const size_t n_embd = (size_t) llama_model_n_embd(g_model);
+    std::vector<size_t> picked_index;       // 短縮した出力層で選んだトークンの generated での位置
+    std::vector<llama_token> picked_token;
+    std::vector<float> picked_hidden;       // 選んだ行の隠れ状態 (n_embd 個ずつ)
+
+    bool ok = true;
+    for (;;) {
+        while (next != eos && (int) generated.size() < max_count) {
+            generated.push_back(next);
+            if (constraint) {
+                constraint->accept(next);
+                if (constraint->finished()) {
+                    break;
+                }
+            }
+
+            if ((int) generated.size() < max_count && !deadline_allows_decode_locked(1)) {
+                break;
+            }
+
+            std::vector<llama_token> step_tokens{next};
+            if (propose_draft && (int) generated.size() < max_count) {
+                const size_t n_past = g_session.kv_tokens.size();
+                const size_t max_draft = deadline_extra_token_allowance_locked(1, std::min({
+                        kMaxDraftTokens,
+                        (size_t) (max_count - (int) generated.size()),
+                        n_batch - 1,
+                        n_ctx > n_past + 1 ? n_ctx - n_past - 1 : 0
+                }));
+                std::vector<llama_token> history = g_session.kv_tokens;
+                history.push_back(next);
+                auto draft = propose_draft.propose(history, max_draft);
+                if (draft.size() > max_draft) {
+                    draft.resize(max_draft);
+                }
+                step_tokens.insert(step_tokens.end(), draft.begin(), draft.end());
+            }
+
+            const size_t n_past = g_session.kv_tokens.size();
+            const auto step_started = std::chrono::steady_clock::now();
+            int rc;
+            {
+                HiddenOutputScope hidden_scope(ctx, shortlisted);
+                rc = decode_session_tokens_locked(ctx, step_tokens.data(), step_tokens.size(), 0);
+            }
+            if (rc == 0 && shortlisted && !shortlist_argmax_rows_locked(ctx, 0, step_tokens.size(), row_argmax)) {
+                LOGE("shortlist head failed");
+                break;
+            }
+            const double step_us = (double) std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - step_started).count();
+            if (rc != 0) {
+                if (is_request_stale(request_seq)) {
+                    ok = false;
+                    break;
+                }
+                LOGE("llama_decode(step) failed: %d", rc);
+                break;
+            }
+
+            // 行 i は step_tokens[0..i] の次を予測する。ドラフトと一致する限り受理する。
+            const size_t n_draft = step_tokens.size() - 1;
+            size_t n_step_accepted = 0;
+            next = eos;
+            for (size_t i = 0; i <= n_draft; ++i) {
+                const float *logits = shortlisted ? nullptr : llama_get_logits_ith(ctx, (int32_t) i);
+                if (!shortlisted && !logits) {
+                    LOGE("logits is null");
+                    next = eos;
+                    break;
+                }
+                next = shortlisted ? row_argmax[i] : select(logits);
+                if (shortlisted && (int) generated.size() < max_count) {
+                    const float *hidden = llama_get_embeddings_ith(ctx, (int32_t) i);
+                    picked_index.push_back(generated.size());
+                    picked_token.push_back(next);
+                    picked_hidden.insert(picked_hidden.end(), hidden, hidden + n_embd);
+                }
+                if (i == n_draft || next != step_tokens[i + 1] || (int) generated.size() >= max_count) {
+                    break;
+                }
+                generated.push_back(next);
+                ++n_step_accepted;
+                if (constraint) {
+                    constraint->accept(next);
+                }
+            }
+            n_drafted += n_draft;
+            n_accepted += n_step_accepted;
+            if (propose_draft.on_verified) {
+                propose_draft.on_verified(n_draft, n_step_accepted, step_us);
+            }
+            if (n_step_accepted < n_draft) {
+                truncate_session_kv_locked(ctx, n_past + 1 + n_step_accepted);
+                if (g_session.kv_tokens.size() != n_past + 1 + n_step_accepted) {
+                    break;
+                }
+            }
+        }
+        if (!shortlisted || picked_index.empty()) {
+            break;
+        }
+
+        // 短縮した出力層の argmax を全語彙の出力層で確かめる。
+        std::vector<const float *> picked_rows(picked_index.size());
+        for (size_t j = 0; j < picked_rows.size(); ++j) {
+            picked_rows[j] = picked_hidden.data() + j * n_embd;
+        }
+        std::vector<ZenzLogitStats> full_stats(picked_rows.size());
+        if (!head_score_rows_locked(nullptr, picked_rows.data(), picked_rows.size(), nullptr, 0,
+                                    full_stats.data(), nullptr)) {
+            LOGE("greedy_decode_continue_locked: full head check failed");
+            break;
+        }
+        size_t m = 0;
+        while (m < picked_token.size() && (llama_token) full_stats[m].argmax == picked_token[m]) {
+            ++m;
+        }
+        if (m == picked_token.size()) {
+            break;
+        }
+        const size_t k = picked_index[m];
+        LOGI("greedy_decode_continue_locked: shortlist argmax differs at %zu, continuing with the full head", k);
+        generated.resize(std::min(generated.size(), k));
+        truncate_session_kv_locked(ctx, n_base + generated.size());
+        if (!ok || g_session.kv_tokens.size() != n_base + generated.size()) {
+            // 割り込まれた場合は、確かめた位置までの出力だけを残す。
+            break;
+        }
+        next = (llama_token) full_stats[m].argmax;
+        shortlisted = false;
+        picked_index.clear();
+        picked_token.clear();
+        picked_hidden.clear();
+    }
+
+    if (n_drafted > 0) {
+        g_spec_drafted_tokens.fetch_add(n_drafted, std::memory_order_relaxed);
+        g_spec_accepted_tokens.fetch_add(n_accepted, std::memory_order_relaxed);
+        LOGI("greedy_decode_continue_locked: accepted %zu/%zu drafted tokens", n_accepted, n_drafted);
+    }
+    return ok;
+}
+
+// Swift の pure_greedy_decoding 相当
+// reading が空でなければ、その読みと矛盾しないトークンだけで生成する (ReadingConstraint)。
+static std::string pure_greedy_decoding(
+        const std::string &leftSideContext,
+        int maxCount,
+        uint64_t request_seq,
+        const std::string &reading = std::string()
+) {
+    std::unique_lock<std::mutex> session_lock(g_session.mutex);
+    if (is_request_stale(request_seq)) {
+        return "";
+    }
+    if (!g_model || !g_vocab) {
+        return "[error] model not initialized";
+    }
+
+    llama_context *ctx = ensure_session_context_locked();
+    if (!ctx) {
+        return "[error] failed to create context";
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+    std::string pre = preprocess_text(leftSideContext);
+    auto prompt_tokens = tokenize_text(pre, /*add_bos=*/false, /*add_eos=*/false);
+    if (prompt_tokens.empty()) {
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return "";
+    }
+    record_workload_request_locked(prompt_tokens.size(), (size_t) std::max(maxCount, 0));
+    AdaptiveThreadScope thread_scope(ctx);
+
+    // 直前の出力をドラフトとしてプロンプトの後ろに並べ、プロンプトの差分と一緒に 1 回でデコードする。
+    // 各位置の argmax とドラフトを突き合わせ、最初に外れた位置から貪欲生成を続ける。
+    // argmax が一致する限り 1 トークンずつ生成した場合と同じ出力になる。
+    // 最後のプロンプトトークンは logits を得るため必ずデコードし直す。
+    // ソフトキャンセルで割り込まれた同じプロンプトの生成があれば、その出力もプロンプトの続きとして扱う。
+    // KV に残っている分はデコードし直さず、maxCount は残りの個数にする。
+    const size_t n_prompt = prompt_tokens.size();
+    const std::vector<llama_token> resumed = take_aborted_generation_locked(prompt_tokens, reading, maxCount);
+    prompt_tokens.insert(prompt_tokens.end(), resumed.begin(), resumed.end());
+    maxCount -= (int) resumed.size();
+    const size_t n_reused = reuse_session_prefix_locked(ctx, prompt_tokens, prompt_tokens.size() - 1);
+    const size_t n_new = prompt_tokens.size() - n_reused;
+    const size_t n_batch = llama_n_batch(ctx);
+    const size_t n_ctx = llama_n_ctx(ctx);
+    std::vector<llama_token> draft = g_session.last_output_tokens;
+    if (!resumed.empty()) {
+        // 直前の出力のうち、引き継いだ出力より後ろだけをドラフトにする。
+        draft = zenz_common_prefix_length(draft, resumed) == resumed.size()
+                ? std::vector<llama_token>(draft.begin() + (ptrdiff_t) resumed.size(), draft.end())
+                : std::vector<llama_token>();
+    }
+    draft.resize(deadline_extra_token_allowance_locked(n_new, std::min({
+            draft.size(),
+            (size_t) std::max(maxCount, 0),
+            n_batch > n_new ? n_batch - n_new : 0,
+            n_ctx > prompt_tokens.size() ? n_ctx - prompt_tokens.size() : 0
+    })));
+
+    ReadingConstraint reading_constraint(preprocess_text(reading));
+    ReadingConstraint *constraint = reading_constraint.active() ? &reading_constraint : nullptr;
+    for (llama_token token: resumed) {
+        if (constraint) {
+            constraint->accept(token);
+        }
+    }
+
+    // プロンプトとドラフトの行は全語彙の logits で受け取る。これらの行の argmax は後で確かめる機会が
+    // ないので、短縮した出力層は greedy_decode_continue_locked のステップ (最後にまとめて確かめる) だけで使う。
+    std::vector<llama_token> batch_tokens(prompt_tokens.begin() + (ptrdiff_t) n_reused, prompt_tokens.end());
+    batch_tokens.insert(batch_tokens.end(), draft.begin(), draft.end());
+    size_t first_row = 0;
+    int rc = prefill_session_tokens_locked(
+            ctx, batch_tokens.data(), batch_tokens.size(), n_new - 1, request_seq, first_row);
+    if (rc != 0) {
+        LOGE("llama_decode(prompt) failed: %d", rc);
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        if (is_request_stale(request_seq)) {
+            LOGI("pure_greedy_decoding aborted while decoding prompt");
+            return abort_generation_locked(prompt_tokens, n_prompt, reading, {});
+        }
+        return "";
+    }
+
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    std::vector<llama_token> generated;
+    generated.reserve(maxCount);
+
+    llama_token next = eos;
+    for (size_t i = 0; i <= draft.size() && (int) generated.size() < maxCount; ++i) {
+        const float *logits = llama_get_logits_ith(ctx, (int32_t) (first_row + i));
+        if (!logits) {
+            LOGE("logits is null");
+            next = eos;
+            break;
+        }
+        next = constraint ? constraint->pick(logits, n_vocab, eos) : argmax_token(logits, n_vocab);
+        if (i == draft.size() || next != draft[i]) {
+            break;
+        }
+        generated.push_back(next);
+        if (constraint) {
+            constraint->accept(next);
+        }
+    }
+    if (!draft.empty()) {
+        g_spec_drafted_tokens.fetch_add(draft.size(), std::memory_order_relaxed);
+        g_spec_accepted_tokens.fetch_add(generated.size(), std::memory_order_relaxed);
+        LOGI("pure_greedy_decoding: accepted %zu/%zu draft tokens", generated.size(), draft.size());
+    }
+
+    // 受理されなかったドラフトの KV を捨て、外れた位置の argmax から生成を続ける。
+    truncate_session_kv_locked(ctx, prompt_tokens.size() + generated.size());
+    thread_scope.begin_decode(batch_tokens.size());
+    const size_t n_prefill_generated = generated.size();
+    bool completed = true;
+    if (next != eos && (int) generated.size() < maxCount &&
+        g_session.kv_tokens.size() == prompt_tokens.size() + generated.size()) {
+        generated.push_back(next);
+        if (constraint) {
+            constraint->accept(next);
+        }
+        if (constraint && constraint->finished()) {
+            // 読みを消費し切ったので、最後のトークンはデコードせずに終える。
+        } else if ((int) generated.size() < maxCount && !deadline_allows_decode_locked(1)) {
+            // 締め切りに間に合わないので、ここまでの出力を返す。
+        } else if ((rc = decode_session_tokens_locked(ctx, &next, 1, 0)) == 0) {
+            completed = greedy_decode_continue_locked(
+                    ctx, generated, maxCount, request_seq, make_draft_proposer_locked(request_seq), constraint);
+        } else if (is_request_stale(request_seq)) {
+            completed = false;
+        } else {
+            LOGE("llama_decode(step) failed: %d", rc);
+        }
+    }
+    if (!completed) {
+        LOGI("pure_greedy_decoding aborted during token generation");
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return abort_generation_locked(prompt_tokens, n_prompt, reading, generated);
+    }
+    thread_scope.end_decode(generated.size() - n_prefill_generated);
+
+    generated.insert(generated.begin(), resumed.begin(), resumed.end());
+    g_session.last_output_tokens = generated;
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+    return tokens_to_text(generated);
+}
+
+// Swift の evaluate_candidate 相当
+// complete_max_tokens > 0 の場合、不一致の位置までの検証済み KV を残したまま argmax トークンを
+// 追加して貪欲生成を続け、修正後の出力全体を FIX_COMPLETED として返す (generate をやり直さない)。
+// 同じリクエストの複数のドラフトを 1 件ずつ検証する場合は、shortlist_allowed にすべてのドラフトが
+// 短縮した語彙に入るかを渡し、ドラフトどうしで採点の出力層をそろえる。
+static CandidateEvaluationResult candidate_evaluate(
+        const std::string &prompt,
+        const std::string &candidate_text,
+        int complete_max_tokens,
+        uint64_t request_seq,
+        bool shortlist_allowed = true
+) {
+    CandidateEvaluationResult result;
+    result.type = CandidateEvaluationResultType::ERROR;
+    result.score = 0.0f;
+
+    std::unique_lock<std::mutex> session_lock(g_session.mutex);
+    if (is_request_stale(request_seq)) {
+        return result;
+    }
+    if (!g_model || !g_vocab) {
+        LOGE("candidate_evaluate: model not initialized");
+        return result;
+    }
+
+    llama_context *ctx = ensure_session_context_locked();
+    if (!ctx) {
+        LOGE("candidate_evaluate: failed to create context");
+        return result;
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+    std::string pre_prompt = preprocess_text(prompt);
+    std::string pre_candidate = preprocess_text(candidate_text);
+
+    auto prompt_tokens = tokenize_text(pre_prompt, /*add_bos=*/false, /*add_eos=*/false);
+    auto candidate_tokens = tokenize_text(pre_candidate, /*add_bos=*/false, /*add_eos=*/false);
+
+    if (prompt_tokens.empty()) {
+        LOGE("candidate_evaluate: prompt tokens empty");
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return result;
+    }
+    record_workload_request_locked(prompt_tokens.size(),
+                                   std::max(candidate_tokens.size(), (size_t) std::max(complete_max_tokens, 0)));
+
+    std::vector<llama_token> all_tokens = prompt_tokens;
+    all_tokens.insert(all_tokens.end(), candidate_tokens.begin(), candidate_tokens.end());
+
+    // プロンプトの最後のトークンから候補の最後のトークンまで: logits必要。
+    // それより前は KV に残っている共通接頭辞を再利用し、差分だけをデコードする。
+    size_t logits_start_pos = prompt_tokens.size() - 1;
+    const size_t n_reused = reuse_session_prefix_locked(ctx, all_tokens, logits_start_pos);
+    const bool head_scored = head_scoring_available_locked();
+    int rc;
+    size_t first_row = 0;
+    {
+        HiddenOutputScope hidden_scope(ctx, head_scored);
+        rc = prefill_session_tokens_locked(
+                ctx,
+                all_tokens.data() + n_reused,
+                all_tokens.size() - n_reused,
+                logits_start_pos - n_reused,
+                request_seq,
+                first_row
+        );
+    }
+    if (rc != 0) {
+        if (is_request_stale(request_seq)) {
+            record_aborted_request_locked("candidate_evaluate", prompt_tokens, 0);
+        } else {
+            LOGE("candidate_evaluate: llama_decode failed: %d", rc);
+        }
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return result;
+    }
+
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+
+    // 候補の各位置の argmax・log-sum-exp と、期待するトークンの対数確率。
+    std::vector<ZenzLogitStats> row_stats;
+    std::vector<float> log_probs;
+    if (head_scored) {
+        const OutputHead *head = shortlist_allowed ? shortlist_head_for_candidates_locked({&candidate_tokens}) : nullptr;
+        if (!head_score_batch_rows_locked(ctx, (int32_t) first_row, head, candidate_tokens, row_stats, log_probs)) {
+            LOGE("candidate_evaluate: in-graph scoring failed");
+            llama_set_abort_callback(ctx, never_abort, nullptr);
+            return result;
+        }
+    } else {
+        float *all_logits = llama_get_logits(ctx);
+        if (!all_logits) {
+            LOGE("candidate_evaluate: all_logits is null");
+            llama_set_abort_callback(ctx, never_abort, nullptr);
+            return result;
+        }
+        // 1 パスのカーネルでまとめて求める。
+        const float *candidate_logits = all_logits + (prompt_tokens.size() - 1 - logits_start_pos) * (size_t) n_vocab;
+        row_stats = logit_rows_stats(candidate_logits, candidate_tokens.size(), n_vocab);
+        log_probs.resize(candidate_tokens.size());
+        for (size_t i = 0; i < candidate_tokens.size(); ++i) {
+            log_probs[i] = candidate_logits[i * (size_t) n_vocab + (size_t) candidate_tokens[i]] - row_stats[i].log_sum_exp;
+        }
+    }
+
+    float total_score = 0.0f;
+
+    for (size_t i = prompt_tokens.size(); i < all_tokens.size(); ++i) {
+        llama_token expected_token = all_tokens[i];
+
+        const ZenzLogitStats &stats = row_stats[i - prompt_tokens.size()];
+
+        llama_token max_token = (llama_token) stats.argmax;
+
+        float log_prob = log_probs[i - prompt_tokens.size()];
+        total_score += log_prob;
+
+        if (max_token != expected_token) {
+            if (max_token == eos) {
+                std::string partial;
+                for (size_t j = prompt_tokens.size(); j < i; ++j) {
+                    llama_token t = all_tokens[j];
+                    if (!llama_vocab_is_control(g_vocab, t)) {
+                        partial += token_to_piece_str(t);
+                    }
+                }
+                result.type = CandidateEvaluationResultType::WHOLE_RESULT;
+                result.whole_result = partial;
+                LOGI("candidate_evaluate: WHOLE_RESULT at pos %zu, result=%s", i, partial.c_str());
+                llama_set_abort_callback(ctx, never_abort, nullptr);
+                return result;
+            } else {
+                std::string prefix;
+                for (size_t j = prompt_tokens.size(); j < i; ++j) {
+                    llama_token t = all_tokens[j];
+                    if (!llama_vocab_is_control(g_vocab, t)) {
+                        prefix += token_to_piece_str(t);
+                    }
+                }
+                if (!llama_vocab_is_control(g_vocab, max_token)) {
+                    prefix += token_to_piece_str(max_token);
+                }
+                result.type = CandidateEvaluationResultType::FIX_REQUIRED;
+                result.prefix = prefix;
+                LOGI("candidate_evaluate: FIX_REQUIRED at pos %zu, prefix=%s", i, prefix.c_str());
+
+                if (complete_max_tokens > 0) {
+                    // 位置 i までは検証済みなので、それ以降の KV だけを捨てて生成を続ける。
+                    truncate_session_kv_locked(ctx, i);
+                    std::vector<llama_token> generated(all_tokens.begin() + (ptrdiff_t) prompt_tokens.size(),
+                                                       all_tokens.begin() + (ptrdiff_t) i);
+                    bool completed = g_session.kv_tokens.size() == i;
+                    if (completed && (int) generated.size() < complete_max_tokens) {
+                        generated.push_back(max_token);
+                        completed = decode_session_tokens_locked(ctx, &max_token, 1, 0) == 0 &&
+                                    greedy_decode_continue_locked(ctx, generated, complete_max_tokens, request_seq,
+                                                                  make_draft_proposer_locked(request_seq));
+                    }
+                    if (completed) {
+                        result.type = CandidateEvaluationResultType::FIX_COMPLETED;
+                        result.whole_result = tokens_to_text(generated);
+                        g_session.last_output_tokens = generated;
+                        LOGI("candidate_evaluate: FIX_COMPLETED, result=%s", result.whole_result.c_str());
+                    } else if (is_request_stale(request_seq)) {
+                        // ソフトキャンセルなら、検証済みの接頭辞と修正 (FIX_REQUIRED) までは返す。
+                        record_aborted_request_locked("candidate_evaluate", prompt_tokens, generated.size());
+                        if (!g_soft_cancel_enabled.load(std::memory_order_relaxed)) {
+                            result.type = CandidateEvaluationResultType::ERROR;
+                        }
+                    }
+                }
+                llama_set_abort_callback(ctx, never_abort, nullptr);
+                return result;
+            }
+        }
+    }
+
+    result.type = CandidateEvaluationResultType::PASS;
+    result.score = total_score;
+    LOGI("candidate_evaluate: PASS, score=%f", total_score);
+
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+    return result;
+}
+
+static bool prefill_prompt_prefix_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt_tokens,
+        uint64_t request_seq
+) {
+    if (prompt_tokens.size() <= 1) {
+        reuse_session_prefix_locked(ctx, prompt_tokens, 0);
+        return true;
+    }
+
+    // 最後のトークンは候補ごとに logits 付きでデコードするので、ここでは手前までを揃える。
+    const size_t prefix_len = prompt_tokens.size() - 1;
+    const size_t n_reused = reuse_session_prefix_locked(ctx, prompt_tokens, prefix_len);
+    size_t first_row = 0;
+    const int rc = prefill_session_tokens_locked(
+            ctx,
+            prompt_tokens.data() + n_reused,
+            prefix_len - n_reused,
+            prefix_len - n_reused,
+            request_seq,
+            first_row
+    );
+    return rc == 0;
+}
+
+// head は全候補について shortlist_head_for_candidates_locked で 1 回だけ決めたものを渡す。
+static float score_candidate_avg_logprob_reuse_prompt_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt_tokens,
+        const std::vector<llama_token> &candidate_tokens,
+        const OutputHead *head,
+        uint64_t request_seq
+) {
+    if (is_request_stale(request_seq)) {
+        return -INFINITY;
+    }
+    if (prompt_tokens.empty() || candidate_tokens.empty()) {
+        return -INFINITY;
+    }
+
+    const size_t suffix_start = prompt_tokens.size() - 1;
+    truncate_session_kv_locked(ctx, suffix_start);
+    if (g_session.kv_tokens.size() != suffix_start) {
+        LOGE("score_candidate_avg_logprob_reuse_prompt_locked: prompt prefix is not cached");
+        return -INFINITY;
+    }
+
+    std::vector<llama_token> suffix_tokens;
+    suffix_tokens.reserve(1 + candidate_tokens.size());
+    suffix_tokens.push_back(prompt_tokens.back());
+    suffix_tokens.insert(suffix_tokens.end(), candidate_tokens.begin(), candidate_tokens.end());
+
+    const bool head_scored = head_scoring_available_locked();
+    int rc;
+    {
+        HiddenOutputScope hidden_scope(ctx, head_scored);
+        rc = decode_session_tokens_locked(ctx, suffix_tokens.data(), suffix_tokens.size(), 0);
+    }
+    if (rc != 0) {
+        if (!is_request_stale(request_seq)) {
+            LOGE("score_candidate_avg_logprob_reuse_prompt_locked: llama_decode failed: %d", rc);
+        }
+        return -INFINITY;
+    }
+
+    float total_score = 0.0f;
+    if (head_scored) {
+        std::vector<ZenzLogitStats> row_stats;
+        std::vector<float> log_probs;
+        if (!head_score_batch_rows_locked(ctx, 0, head, candidate_tokens, row_stats, log_probs)) {
+            return -INFINITY;
+        }
+        for (float log_prob: log_probs) {
+            total_score += log_prob;
+        }
+        return total_score / (float) candidate_tokens.size();
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    float *all_logits = llama_get_logits(ctx);
+    if (!all_logits) {
+        LOGE("score_candidate_avg_logprob_reuse_prompt_locked: all_logits is null");
+        return -INFINITY;
+    }
+
+    const auto row_stats = logit_rows_stats(all_logits, candidate_tokens.size(), n_vocab);
+    for (size_t i = 0; i < candidate_tokens.size(); ++i) {
+        const float *logits = all_logits + ((size_t) i * (size_t) n_vocab);
+        total_score += logits[candidate_tokens[i]] - row_stats[i].log_sum_exp;
+    }
+
+    return total_score / (float) candidate_tokens.size();
+}
+
+static bool token_list_less(const std::vector<llama_token> *lhs, const std::vector<llama_token> *rhs) {
+    return *lhs < *rhs;
+}
+
+// 空でない候補トークン列を辞書順に並べ、重複を除いた一覧を返す。
+static std::vector<const std::vector<llama_token> *> unique_candidate_token_lists(
+        const std::vector<std::vector<llama_token>> &candidate_tokens_list
+) {
+    std::vector<const std::vector<llama_token> *> unique_tokens;
+    for (const auto &tokens: candidate_tokens_list) {
+        if (!tokens.empty()) {
+            unique_tokens.push_back(&tokens);
+        }
+    }
+    std::sort(unique_tokens.begin(), unique_tokens.end(), token_list_less);
+    unique_tokens.erase(
+            std::unique(unique_tokens.begin(), unique_tokens.end(),
+                        [](const std::vector<llama_token> *lhs, const std::vector<llama_token> *rhs) {
+                            return *lhs == *rhs;
+                        }),
+            unique_tokens.end());
+    return unique_tokens;
+}
+
+// unique_candidate_token_lists の結果の中で tokens が何番目かを返す。
+static size_t unique_candidate_index(
+        const std::vector<const std::vector<llama_token> *> &unique_tokens,
+        const std::vector<llama_token> &tokens
+) {
+    const auto it = std::lower_bound(unique_tokens.begin(), unique_tokens.end(), &tokens, token_list_less);
+    return (size_t) (it - unique_tokens.begin());
+}
+
+// トライで 1 回デコードした結果のうち、1 候補ぶんの logits 行。
+// rows[i] は tokens[i] を予測する行 (rows[0] はプロンプト最後のトークンの行) で、
+// 行の log-sum-exp は節点ごとに 1 回だけ計算して共有する。
+// 出力層から先をグラフで計算した場合は rows を持たず、log_probs[i] に tokens[i] の対数確率だけが入る。
+struct CandidateLogitRows {
+    std::vector<const float *> rows;
+    std::vector<float *> log_norms;  // NaN は未計算
+    std::vector<float> log_probs;
+
+    float log_norm(size_t i, int32_t n_vocab) const {
+        if (std::isnan(*log_norms[i])) {
+            *log_norms[i] = logits_log_normalizer(rows[i], n_vocab);
+        }
+        return *log_norms[i];
+    }
+
+    // tokens[i] の対数確率。行が取れなかった位置は -inf。
+    float log_prob(size_t i, llama_token token, int32_t n_vocab) const {
+        if (!log_probs.empty()) {
+            return log_probs[i];
+        }
+        return rows[i] ? rows[i][token] - log_norm(i, n_vocab) : -INFINITY;
+    }
+};
+
+using CandidateRowsVisitor = std::function<void(size_t unique_index, const CandidateLogitRows &rows)>;
+
+// 候補をトークントライにまとめ、1 回の llama_decode で各候補の logits 行を求める。
+// prefill 済みのプロンプト (seq 0) を候補ごとの seq に llama_kv_cache_seq_cp でフォークし、
+// 共通接頭辞 (トライの節点) はそこを通る候補すべての seq_id を持つ 1 トークンとして 1 回だけ
+// デコードする。プロンプト最後のトークンは全 seq で共有し、候補の最後のトークンは次を予測
+// しないのでデコードしない。
+// seq 数やバッチ・KV の容量に収まらない分は複数回のデコードに分け、デコードのたびに
+// そのバッチの候補について visitor を呼ぶ (行はそのデコードの間だけ有効)。
+// unique_tokens は unique_candidate_token_lists の結果 (辞書順・重複なし) を渡す。
+// head_scored が true なら logits 行の代わりに各トークンの対数確率だけを求めて渡す
+// (head_scoring_available_locked() が true のときだけ指定できる)。
+// 戻り値が false の場合、呼び出し側は逐次処理にフォールバックする。
+static bool decode_candidate_token_trie_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt_tokens,
+        const std::vector<const std::vector<llama_token> *> &unique_tokens,
+        const CandidateRowsVisitor &visitor,
+        uint64_t request_seq,
+        bool head_scored = false
+) {
+    if (prompt_tokens.empty()) {
+        return false;
+    }
+
+    const size_t prompt_len = prompt_tokens.size();
+    if (g_session.kv_tokens.size() != prompt_len - 1) {
+        return false;
+    }
+
+    const int32_t max_parallel = (int32_t) llama_n_seq_max(ctx) - 1;
+    if (max_parallel < 1) {
+        return false;
+    }
+    if (unique_tokens.empty()) {
+        return true;
+    }
+
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    const size_t n_batch = llama_n_batch(ctx);
+    const size_t n_ctx = llama_n_ctx(ctx);
+    const size_t token_budget = std::min(n_batch, n_ctx > prompt_len ? n_ctx - prompt_len : 0);
+    const llama_pos tail_pos = (llama_pos) (prompt_len - 1);
+
+    const OutputHead *head = head_scored ? shortlist_head_for_candidates_locked(unique_tokens) : nullptr;
+    std::vector<float> first_logits;  // head_scored なら隠れ状態 (n_embd 個)
+    float first_log_norm = NAN;
+    bool prompt_tail_decoded = false;
+    size_t total_candidate_tokens = 0;
+    size_t total_decoded_nodes = 0;
+
+    // トライの節点。候補 tokens[0..depth] の接頭辞を表し、tokens[depth] をデコードする。
+    struct TrieNode {
+        llama_token token;
+        llama_pos pos;
+        std::vector<llama_seq_id> seq_ids;
+        int32_t batch_index;
+    };
+
+    size_t next = 0;
+    while (next < unique_tokens.size()) {
+        if (is_request_stale(request_seq)) {
+            return true;
+        }
+
+        // 今回のバッチに載せる候補を決める。辞書順なので直前の候補との共通接頭辞だけが共有節点になる。
+        std::vector<size_t> members;
+        size_t n_tokens = prompt_tail_decoded ? 0 : 1;
+        while (next < unique_tokens.size() && (int32_t) members.size() < max_parallel) {
+            const auto &tokens = *unique_tokens[next];
+            const size_t n_nodes = tokens.size() - 1;
+            if (n_nodes + (prompt_tail_decoded ? 0 : 1) > token_budget) {
+                // 単独でも収まらない候補は評価しない。
+                ++next;
+                continue;
+            }
+            size_t n_shared = 0;
+            if (!members.empty()) {
+                const auto &prev = *unique_tokens[members.back()];
+                n_shared = std::min(zenz_common_prefix_length(prev, tokens), std::min(prev.size(), tokens.size()) - 1);
+            }
+            if (n_tokens + (n_nodes - n_shared) > token_budget) {
+                break;
+            }
+            members.push_back(next);
+            n_tokens += n_nodes - n_shared;
+            ++next;
+        }
+        if (members.empty()) {
+            continue;
+        }
+
+        // 節点を作り、各候補の経路 (depth -> 節点番号) を記録する。
+        std::vector<TrieNode> nodes;
+        std::vector<std::vector<int32_t>> paths(members.size());
+        for (size_t m = 0; m < members.size(); ++m) {
+            const auto &tokens = *unique_tokens[members[m]];
+            const llama_seq_id seq_id = (llama_seq_id) (m + 1);
+            size_t n_shared = 0;
+            if (m > 0) {
+                const auto &prev = *unique_tokens[members[m - 1]];
+                n_shared = std::min(zenz_common_prefix_length(prev, tokens), std::min(prev.size(), tokens.size()) - 1);
+            }
+            for (size_t depth = 0; depth + 1 < tokens.size(); ++depth) {
+                int32_t node_id;
+                if (depth < n_shared) {
+                    node_id = paths[m - 1][depth];
+                } else {
+                    node_id = (int32_t) nodes.size();
+                    nodes.push_back(TrieNode{tokens[depth], tail_pos + 1 + (llama_pos) depth, {}, -1});
+                }
+                nodes[(size_t) node_id].seq_ids.push_back(seq_id);
+                paths[m].push_back(node_id);
+            }
+        }
+
+        for (size_t m = 0; m < members.size(); ++m) {
+            llama_kv_cache_seq_cp(ctx, 0, (llama_seq_id) (m + 1), -1, -1);
+        }
+
+        llama_batch batch = llama_batch_init((int32_t) n_tokens, 0, (int32_t) members.size() + 1);
+        if (!prompt_tail_decoded) {
+            batch_add_token(batch, prompt_tokens.back(), tail_pos, 0, true);
+            batch.n_seq_id[0] = (int32_t) members.size() + 1;
+            for (size_t m = 0; m < members.size(); ++m) {
+                batch.seq_id[0][m + 1] = (llama_seq_id) (m + 1);
+            }
+        }
+        for (auto &node: nodes) {
+            node.batch_index = batch.n_tokens;
+            batch_add_token(batch, node.token, node.pos, node.seq_ids[0], true);
+            batch.n_seq_id[node.batch_index] = (int32_t) node.seq_ids.size();
+            for (size_t k = 1; k < node.seq_ids.size(); ++k) {
+                batch.seq_id[node.batch_index][k] = node.seq_ids[k];
+            }
+        }
+
+        int rc;
+        {
+            HiddenOutputScope hidden_scope(ctx, head_scored);
+            rc = decode_batch_locked(ctx, batch);
+        }
+        llama_batch_free(batch);
+
+        if (rc == 0) {
+            if (!prompt_tail_decoded) {
+                if (head_scored) {
+                    const float *tail_hidden = llama_get_embeddings_ith(ctx, 0);
+                    if (tail_hidden) {
+                        first_logits.assign(tail_hidden, tail_hidden + llama_model_n_embd(g_model));
+                    }
+                } else {
+                    const float *tail_logits = llama_get_logits_ith(ctx, 0);
+                    if (tail_logits) {
+                        first_logits.assign(tail_logits, tail_logits + n_vocab);
+                    }
+                }
+                if (!first_logits.empty()) {
+                    g_session.kv_tokens.push_back(prompt_tokens.back());
+                    prompt_tail_decoded = true;
+                }
+            }
+            if (prompt_tail_decoded && head_scored) {
+                // 行 0 はプロンプト最後のトークン、行 1 + j は節点 j。各行で採点するトークン
+                // (その行を通る候補の次のトークン) を重複なしで集め、1 回のグラフでまとめて求める。
+                std::vector<const float *> hidden_rows(nodes.size() + 1, first_logits.data());
+                for (size_t j = 0; j < nodes.size(); ++j) {
+                    hidden_rows[j + 1] = llama_get_embeddings_ith(ctx, nodes[j].batch_index);
+                }
+                std::vector<std::vector<llama_token>> row_targets(hidden_rows.size());
+                size_t n_targets = 1;
+                for (size_t m = 0; m < members.size(); ++m) {
+                    const auto &tokens = *unique_tokens[members[m]];
+                    for (size_t i = 0; i < tokens.size(); ++i) {
+                        auto &targets = row_targets[i == 0 ? 0 : (size_t) paths[m][i - 1] + 1];
+                        if (std::find(targets.begin(), targets.end(), tokens[i]) == targets.end()) {
+                            targets.push_back(tokens[i]);
+                            n_targets = std::max(n_targets, targets.size());
+                        }
+                    }
+                }
+                // 行ごとの個数をそろえるため、足りない分は先頭のトークンで埋める (空の行は行 0 のトークン。
+                // 短縮した出力層でも語彙に入っている)。
+                const llama_token pad = row_targets[0].front();
+                std::vector<llama_token> flat_targets(hidden_rows.size() * n_targets, pad);
+                for (size_t r = 0; r < row_targets.size(); ++r) {
+                    for (size_t j = 0; j < n_targets; ++j) {
+                        flat_targets[r * n_targets + j] = row_targets[r].empty() ? pad : row_targets[r][std::min(j, row_targets[r].size() - 1)];
+                    }
+                }
+                std::vector<ZenzLogitStats> row_stats(hidden_rows.size());
+                std::vector<float> target_log_probs(flat_targets.size(), -INFINITY);
+                const bool rows_ok = std::find(hidden_rows.begin(), hidden_rows.end(), nullptr) == hidden_rows.end() &&
+                                     head_score_rows_locked(head, hidden_rows.data(), hidden_rows.size(),
+                                                            flat_targets.data(), n_targets,
+                                                            row_stats.data(), target_log_probs.data());
+                for (size_t m = 0; m < members.size(); ++m) {
+                    const auto &tokens = *unique_tokens[members[m]];
+                    CandidateLogitRows rows;
+                    rows.log_probs.assign(tokens.size(), -INFINITY);
+                    for (size_t i = 0; rows_ok && i < tokens.size(); ++i) {
+                        const size_t r = i == 0 ? 0 : (size_t) paths[m][i - 1] + 1;
+                        const auto &targets = row_targets[r];
+                        const auto j = (size_t) (std::find(targets.begin(), targets.end(), tokens[i]) - targets.begin());
+                        rows.log_probs[i] = target_log_probs[r * n_targets + j];
+                    }
+                    visitor(members[m], rows);
+                    total_candidate_tokens += tokens.size() - 1;
+                }
+                total_decoded_nodes += nodes.size();
+            } else if (prompt_tail_decoded) {
+                std::vector<float> node_log_norm(nodes.size(), NAN);
+                for (size_t m = 0; m < members.size(); ++m) {
+                    const auto &tokens = *unique_tokens[members[m]];
+                    CandidateLogitRows rows;
+                    rows.rows.reserve(tokens.size());
+                    rows.log_norms.reserve(tokens.size());
+                    rows.rows.push_back(first_logits.data());
+                    rows.log_norms.push_back(&first_log_norm);
+                    for (size_t i = 1; i < tokens.size(); ++i) {
+                        const auto node_id = (size_t) paths[m][i - 1];
+                        rows.rows.push_back(llama_get_logits_ith(ctx, nodes[node_id].batch_index));
+                        rows.log_norms.push_back(&node_log_norm[node_id]);
+                    }
+                    visitor(members[m], rows);
+                    total_candidate_tokens += tokens.size() - 1;
+                }
+                total_decoded_nodes += nodes.size();
+            }
+        }
+
+        for (size_t m = 0; m < members.size(); ++m) {
+            llama_kv_cache_seq_rm(ctx, (llama_seq_id) (m + 1), -1, -1);
+        }
+        g_session.kv_fragmented = true;
+
+        if (rc != 0 || !prompt_tail_decoded) {
+            // 中断されたバッチの書きかけセルも含めて、プロンプト接頭辞の状態に戻す。
+            if (!llama_kv_cache_seq_rm(ctx, 0, tail_pos, -1)) {
+                llama_kv_cache_clear(ctx);
+                g_session.kv_tokens.clear();
+            } else {
+                g_session.kv_tokens.resize(std::min(g_session.kv_tokens.size(), prompt_len - 1));
+            }
+            if (!is_request_stale(request_seq)) {
+                LOGE("decode_candidate_token_trie_locked: llama_decode failed: %d", rc);
+            }
+            return is_request_stale(request_seq);
+        }
+    }
+
+    LOGI("decode_candidate_token_trie_locked: %zu candidates, decoded %zu trie nodes for %zu candidate tokens",
+         unique_tokens.size(), total_decoded_nodes, total_candidate_tokens);
+    return true;
+}
+
+// 候補をトークントライにまとめ、1 回の llama_decode で平均対数確率を採点する。
+// 同じトークン列になる候補は 1 回だけ評価する。
+static bool score_candidates_token_trie_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt_tokens,
+        const std::vector<std::vector<llama_token>> &candidate_tokens_list,
+        std::vector<jfloat> &scores,
+        uint64_t request_seq
+) {
+    const auto unique_tokens = unique_candidate_token_lists(candidate_tokens_list);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    std::vector<float> unique_scores(unique_tokens.size(), -INFINITY);
+    std::vector<bool> unique_scored(unique_tokens.size(), false);
+
+    const bool ok = decode_candidate_token_trie_locked(
+            ctx,
+            prompt_tokens,
+            unique_tokens,
+            [&](size_t u, const CandidateLogitRows &rows) {
+                const auto &tokens = *unique_tokens[u];
+                float total_score = 0.0f;
+                for (size_t i = 0; i < tokens.size(); ++i) {
+                    total_score += rows.log_prob(i, tokens[i], n_vocab);
+                }
+                unique_scores[u] = total_score / (float) tokens.size();
+                unique_scored[u] = true;
+            },
+            request_seq,
+            head_scoring_available_locked()
+    );
+    // ソフトキャンセルなら、割り込まれるまでに採点し終えた候補の点数を返し、残りは NaN にする。
+    const bool partial = !ok && is_request_stale(request_seq) && g_soft_cancel_enabled.load(std::memory_order_relaxed);
+    if (!ok && !partial) {
+        return false;
+    }
+
+    size_t n_scored = 0;
+    for (size_t i = 0; i < candidate_tokens_list.size(); ++i) {
+        const auto &tokens = candidate_tokens_list[i];
+        if (!tokens.empty()) {
+            const size_t u = unique_candidate_index(unique_tokens, tokens);
+            scores[i] = unique_scored[u] || !partial ? unique_scores[u] : NAN;
+            n_scored += unique_scored[u] ? 1 : 0;
+        }
+    }
+    if (partial) {
+        record_aborted_request_locked("scoreCandidates", prompt_tokens, 0);
+        LOGI("scoreCandidates: returning %zu scores finished before the abort", n_scored);
+    }
+    return true;
+}
+
+// 1 つのドラフトを logits 行と突き合わせる。candidate_evaluate と同じ基準で
+// PASS / FIX_REQUIRED / WHOLE_RESULT を決め、accepted に一致したトークン数、
+// correction に不一致位置でのモデルの argmax を返す。
+static CandidateEvaluationResult verify_draft_rows(
+        const std::vector<llama_token> &tokens,
+        const CandidateLogitRows &rows,
+        int32_t n_vocab,
+        size_t &accepted,
+        llama_token &correction
+) {
+    CandidateEvaluationResult result;
+    result.type = CandidateEvaluationResultType::ERROR;
+    result.score = 0.0f;
+    accepted = 0;
+    correction = -1;
+
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    float total_score = 0.0f;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const float *logits = rows.rows[i];
+        if (!logits) {
+            return result;
+        }
+
+        // 行の log-sum-exp が未計算なら argmax と一緒に 1 パスで求めて共有する。
+        llama_token max_token;
+        if (std::isnan(*rows.log_norms[i])) {
+            const ZenzLogitStats stats = zenz_logit_stats(logits, n_vocab);
+            *rows.log_norms[i] = stats.log_sum_exp;
+            max_token = (llama_token) stats.argmax;
+        } else {
+            max_token = argmax_token(logits, n_vocab);
+        }
+        total_score += logits[tokens[i]] - rows.log_norm(i, n_vocab);
+
+        if (max_token != tokens[i]) {
+            const std::vector<llama_token> verified(tokens.begin(), tokens.begin() + (ptrdiff_t) i);
+            accepted = i;
+            correction = max_token;
+            if (max_token == eos) {
+                result.type = CandidateEvaluationResultType::WHOLE_RESULT;
+                result.whole_result = tokens_to_text(verified);
+            } else {
+                result.type = CandidateEvaluationResultType::FIX_REQUIRED;
+                result.prefix = tokens_to_text(verified);
+                if (!llama_vocab_is_control(g_vocab, max_token)) {
+                    result.prefix += token_to_piece_str(max_token);
+                }
+            }
+            return result;
+        }
+    }
+
+    accepted = tokens.size();
+    result.type = CandidateEvaluationResultType::PASS;
+    result.score = total_score;
+    return result;
+}
+
+// 複数のドラフト (辞書候補の上位 N 件など) を 1 回のトライデコードでまとめて検証する。
+// 結果は drafts と同じ並びで、各要素は candidate_evaluate と同じ基準の PASS / FIX / WHOLE。
+// complete_max_tokens > 0 かつ PASS が 1 つもない場合は、最も長く受理された FIX のドラフトだけ
+// 検証済みトークンと修正トークンから貪欲生成を続け、FIX_COMPLETED にする。
+// バッチ検証が使えない場合は has_batched_result を false にして空を返す (呼び出し側が逐次に戻る)。
+static std::vector<CandidateEvaluationResult> candidate_evaluate_drafts(
+        const std::string &prompt,
+        const std::vector<std::string> &drafts,
+        int complete_max_tokens,
+        uint64_t request_seq,
+        bool &has_batched_result
+) {
+    CandidateEvaluationResult error_result;
+    error_result.type = CandidateEvaluationResultType::ERROR;
+    error_result.score = 0.0f;
+    std::vector<CandidateEvaluationResult> results(drafts.size(), error_result);
+    has_batched_result = true;
+
+    std::unique_lock<std::mutex> session_lock(g_session.mutex);
+    if (is_request_stale(request_seq)) {
+        return results;
+    }
+    if (!g_model || !g_vocab) {
+        LOGE("candidate_evaluate_drafts: model not initialized");
+        return results;
+    }
+
+    llama_context *ctx = ensure_session_context_locked();
+    if (!ctx) {
+        LOGE("candidate_evaluate_drafts: failed to create context");
+        return results;
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+    auto prompt_tokens = tokenize_text(preprocess_text(prompt), /*add_bos=*/false, /*add_eos=*/false);
+    if (prompt_tokens.empty()) {
+        LOGE("candidate_evaluate_drafts: prompt tokens empty");
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return results;
+    }
+    if (!prefill_prompt_prefix_locked(ctx, prompt_tokens, request_seq)) {
+        if (!is_request_stale(request_seq)) {
+            LOGE("candidate_evaluate_drafts: failed to prefill prompt prefix");
+        }
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return results;
+    }
+
+    std::vector<std::vector<llama_token>> draft_tokens_list(drafts.size());
+    for (size_t i = 0; i < drafts.size(); ++i) {
+        if (!drafts[i].empty()) {
+            draft_tokens_list[i] = tokenize_text(preprocess_text(drafts[i]), /*add_bos=*/false, /*add_eos=*/false);
+        }
+    }
+    record_workload_request_locked(prompt_tokens.size(), std::max(longest_token_list(draft_tokens_list),
+                                                                  (size_t) std::max(complete_max_tokens, 0)));
+
+    const auto unique_tokens = unique_candidate_token_lists(draft_tokens_list);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    std::vector<CandidateEvaluationResult> unique_results(unique_tokens.size(), error_result);
+    std::vector<size_t> unique_accepted(unique_tokens.size(), 0);
+    std::vector<llama_token> unique_correction(unique_tokens.size(), -1);
+
+    const bool decoded = decode_candidate_token_trie_locked(
+            ctx,
+            prompt_tokens,
+            unique_tokens,
+            [&](size_t u, const CandidateLogitRows &rows) {
+                unique_results[u] = verify_draft_rows(
+                        *unique_tokens[u],
+                        rows,
+                        n_vocab,
+                        unique_accepted[u],
+                        unique_correction[u]
+                );
+            },
+            request_seq
+    );
+    if (!decoded) {
+        has_batched_result = false;
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return {};
+    }
+    if (is_request_stale(request_seq)) {
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return results;
+    }
+
+    // PASS がなければ、最も長く受理されたドラフトの修正位置から生成を続ける。
+    bool any_pass = false;
+    size_t best = unique_tokens.size();
+    for (size_t u = 0; u < unique_tokens.size(); ++u) {
+        const auto type = unique_results[u].type;
+        any_pass = any_pass || type == CandidateEvaluationResultType::PASS;
+        if (type == CandidateEvaluationResultType::FIX_REQUIRED &&
+            (best == unique_tokens.size() || unique_accepted[u] > unique_accepted[best])) {
+            best = u;
+        }
+    }
+    if (complete_max_tokens > 0 && !any_pass && best < unique_tokens.size() &&
+        g_session.kv_tokens.size() == prompt_tokens.size()) {
+        const auto &tokens = *unique_tokens[best];
+        std::vector<llama_token> generated(tokens.begin(), tokens.begin() + (ptrdiff_t) unique_accepted[best]);
+        bool completed = true;
+        if ((int) generated.size() < complete_max_tokens) {
+            generated.push_back(unique_correction[best]);
+            completed = decode_session_tokens_locked(ctx, generated.data(), generated.size(), generated.size() - 1) == 0 &&
+                        greedy_decode_continue_locked(ctx, generated, complete_max_tokens, request_seq,
+                                                                  make_draft_proposer_locked(request_seq));
+        }
+        if (completed) {
+            unique_results[best].type = CandidateEvaluationResultType::FIX_COMPLETED;
+            unique_results[best].whole_result = tokens_to_text(generated);
+            g_session.last_output_tokens = generated;
+        }
+    }
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+
+    for (size_t i = 0; i < drafts.size(); ++i) {
+        if (!draft_tokens_list[i].empty()) {
+            results[i] = unique_results[unique_candidate_index(unique_tokens, draft_tokens_list[i])];
+        }
+    }
+    return results;
+}
+
+// 上位 top_k 件の候補だけを求める分枝限定探索。
+// 候補をトークン 1 つずつ (生存候補全体で 1 ステップ 1 回の llama_decode) 延ばしながら採点する。
+// 対数確率は 0 以下なので、途中までの合計を候補の全トークン数で割った値が最終スコア
+// (平均対数確率) の上界になる。上界が現在の top_k 番目の確定スコアを下回った候補は延長をやめる。
+// 各候補はプロンプト (seq 0) を seq_cp した専用の seq を持ち、上界の高い順に seq を割り当てる。
+// 打ち切った候補のスコアは NaN、空の候補は -INFINITY になる。上位 top_k 件のスコアは
+// scoreCandidates と同じ値になる。
+// 戻り値が false の場合、呼び出し側は全候補の採点にフォールバックする。
+static bool rank_candidates_branch_and_bound_locked(
+        llama_context *ctx,
+        const std::vector<llama_token> &prompt_tokens,
+        const std::vector<std::vector<llama_token>> &candidate_tokens_list,
+        int32_t top_k,
+        std::vector<jfloat> &scores,
+        uint64_t request_seq
+) {
+    if (prompt_tokens.empty() || top_k <= 0) {
+        return false;
+    }
+
+    const size_t prompt_len = prompt_tokens.size();
+    if (g_session.kv_tokens.size() != prompt_len - 1) {
+        return false;
+    }
+
+    const int32_t max_parallel = (int32_t) llama_n_seq_max(ctx) - 1;
+    if (max_parallel < 1) {
+        return false;
+    }
+
+    const auto unique_tokens = unique_candidate_token_lists(candidate_tokens_list);
+    if (unique_tokens.empty()) {
+        return true;
+    }
+
+    // 採点の出力層は全候補について 1 回だけ決め、1 トークン目から全ステップで同じものを使う。
+    // 候補ごとに正規化が混ざらず、上位 top_k 件は scoreCandidates と同じ出力層の値になる。
+    const bool head_scored = head_scoring_available_locked();
+    const OutputHead *head = head_scored ? shortlist_head_for_candidates_locked(unique_tokens) : nullptr;
+
+    // プロンプト最後のトークンの出力で全候補の 1 トークン目を一度に採点する。
+    int rc_tail;
+    {
+        HiddenOutputScope hidden_scope(ctx, head_scored);
+        rc_tail = decode_session_tokens_locked(ctx, &prompt_tokens.back(), 1, 0);
+    }
+    if (rc_tail != 0) {
+        return is_request_stale(request_seq);
+    }
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    std::vector<float> first_log_probs(unique_tokens.size(), -INFINITY);
+    if (head_scored) {
+        const float *tail_hidden = llama_get_embeddings_ith(ctx, 0);
+        std::vector<llama_token> first_tokens;
+        first_tokens.reserve(unique_tokens.size());
+        for (const auto *tokens: unique_tokens) {
+            first_tokens.push_back((*tokens)[0]);
+        }
+        ZenzLogitStats tail_stats{};
+        if (!tail_hidden || !head_score_rows_locked(head, &tail_hidden, 1, first_tokens.data(), first_tokens.size(),
+                                                    &tail_stats, first_log_probs.data())) {
+            return false;
+        }
+    } else {
+        const float *tail_logits = llama_get_logits_ith(ctx, -1);
+        if (!tail_logits) {
+            return false;
+        }
+        const float tail_log_norm = logits_log_normalizer(tail_logits, n_vocab);
+        for (size_t u = 0; u < unique_tokens.size(); ++u) {
+            first_log_probs[u] = tail_logits[(*unique_tokens[u])[0]] - tail_log_norm;
+        }
+    }
+
+    struct RankState {
+        float sum;          // 採点済みトークンの対数確率の合計
+        size_t depth;       // 採点済みトークン数
+        llama_seq_id seq_id;
+    };
+
+    std::vector<RankState> states(unique_tokens.size());
+    std::vector<float> unique_scores(unique_tokens.size(), NAN);
+    for (size_t u = 0; u < unique_tokens.size(); ++u) {
+        states[u] = RankState{first_log_probs[u], 1, -1};
+    }
+
+    auto upper_bound = [&](size_t u) {
+        return states[u].sum / (float) unique_tokens[u]->size();
+    };
+
+    // 確定スコアの上位 top_k 件。top_k 件そろえば先頭が足切り値になる。
+    std::multiset<float> top_scores;
+    auto cut_off = [&]() {
+        return (int32_t) top_scores.size() >= top_k ? *top_scores.begin() : -INFINITY;
+    };
+    auto finish = [&](size_t u) {
+        const float score = upper_bound(u);
+        unique_scores[u] = score;
+        top_scores.insert(score);
+        if ((int32_t) top_scores.size() > top_k) {
+            top_scores.erase(top_scores.begin());
+        }
+    };
+
+    // 1 トークン候補はこの時点で確定する。残りは上界の高い順に待たせる。
+    std::vector<size_t> pending;
+    for (size_t u = 0; u < unique_tokens.size(); ++u) {
+        if (unique_tokens[u]->size() == 1) {
+            finish(u);
+        } else {
+            pending.push_back(u);
+        }
+    }
+    std::stable_sort(pending.begin(), pending.end(), [&](size_t lhs, size_t rhs) {
+        return upper_bound(lhs) > upper_bound(rhs);
+    });
+
+    std::vector<llama_seq_id> free_seqs;
+    for (int32_t seq = max_parallel; seq >= 1; --seq) {
+        free_seqs.push_back((llama_seq_id) seq);
+    }
+
+    std::vector<size_t> live;
+    size_t next_pending = 0;
+    size_t decoded_tokens = 0;
+    size_t pruned = 0;
+    bool ok = true;
+
+    while (true) {
+        // 上界が足切り値を下回った候補は延長しない。
+        for (auto it = live.begin(); it != live.end();) {
+            if (upper_bound(*it) < cut_off()) {
+                llama_kv_cache_seq_rm(ctx, states[*it].seq_id, -1, -1);
+                free_seqs.push_back(states[*it].seq_id);
+                ++pruned;
+                it = live.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        while (next_pending < pending.size() && !free_seqs.empty()) {
+            const size_t u = pending[next_pending++];
+            if (upper_bound(u) < cut_off()) {
+                ++pruned;
+                continue;
+            }
+            states[u].seq_id = free_seqs.back();
+            free_seqs.pop_back();
+            llama_kv_cache_seq_cp(ctx, 0, states[u].seq_id, -1, -1);
+            live.push_back(u);
+        }
+        if (live.empty()) {
+            break;
+        }
+        if (is_request_stale(request_seq)) {
+            break;
+        }
+
+        // 生存候補それぞれの次のトークンを 1 つのバッチでデコードする。
+        llama_batch batch = llama_batch_init((int32_t) live.size(), 0, 1);
+        for (size_t u: live) {
+            const auto &tokens = *unique_tokens[u];
+            const size_t depth = states[u].depth;
+            batch_add_token(batch, tokens[depth - 1], (llama_pos) (prompt_len - 1 + depth), states[u].seq_id, true);
+        }
+        int rc;
+        {
+            HiddenOutputScope hidden_scope(ctx, head_scored);
+            rc = decode_batch_locked(ctx, batch);
+        }
+        llama_batch_free(batch);
+        if (rc != 0) {
+            if (!is_request_stale(request_seq)) {
+                LOGE("rank_candidates_branch_and_bound_locked: llama_decode failed: %d", rc);
+                ok = false;
+            }
+            break;
+        }
+        decoded_tokens += live.size();
+
+        std::vector<float> step_log_probs;
+        if (head_scored) {
+            std::vector<llama_token> targets;
+            targets.reserve(live.size());
+            for (size_t u: live) {
+                targets.push_back((*unique_tokens[u])[states[u].depth]);
+            }
+            std::vector<ZenzLogitStats> step_stats;
+            if (!head_score_batch_rows_locked(ctx, 0, head, targets, step_stats, step_log_probs)) {
+                step_log_probs.assign(live.size(), -INFINITY);
+            }
+        }
+        for (auto it = live.begin(); it != live.end();) {
+            const size_t u = *it;
+            const auto &tokens = *unique_tokens[u];
+            const auto index = (size_t) (it - live.begin());
+            const float *logits = head_scored ? nullptr : llama_get_logits_ith(ctx, (int32_t) index);
+            if (head_scored) {
+                states[u].sum += step_log_probs[index];
+            } else if (logits) {
+                states[u].sum += logits[tokens[states[u].depth]] - logits_log_normalizer(logits, n_vocab);
+            } else {
+                states[u].sum = -INFINITY;
+            }
+            states[u].depth++;
+            ++it;
+        }
+        for (auto it = live.begin(); it != live.end();) {
+            const size_t u = *it;
+            if (states[u].depth == unique_tokens[u]->size()) {
+                finish(u);
+                llama_kv_cache_seq_rm(ctx, states[u].seq_id, -1, -1);
+                free_seqs.push_back(states[u].seq_id);
+                it = live.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (size_t u: live) {
+        llama_kv_cache_seq_rm(ctx, states[u].seq_id, -1, -1);
+    }
+    g_session.kv_fragmented = true;
+    if (!ok) {
+        return false;
+    }
+
+    for (size_t i = 0; i < candidate_tokens_list.size(); ++i) {
+        const auto &tokens = candidate_tokens_list[i];
+        if (!tokens.empty()) {
+            scores[i] = unique_scores[unique_candidate_index(unique_tokens, tokens)];
+        }
+    }
+
+    LOGI("rank_candidates_branch_and_bound_locked: top_k=%d, %zu candidates, pruned %zu, decoded %zu tokens",
+         top_k, unique_tokens.size(), pruned, decoded_tokens);
+    return true;
+}
+
+// ------- n-best ビームサーチ -------
+
+struct BeamHypothesis {
+    std::vector<llama_token> tokens;
+    float score = 0.0f;  // 対数確率の和
+};
+
+// logits 1 行の上位 k トークンを (対数確率, ID) の降順で out に入れる (同値なら ID の小さい方が先)。
+static void top_k_log_probs(
+        const float *logits,
+        int32_t n_vocab,
+        size_t k,
+        std::vector<std::pair<float, llama_token>> &out
+) {
+    out.clear();
+    if (k == 0) {
+        return;
+    }
+    for (int32_t tid = 0; tid < n_vocab; ++tid) {
+        const float value = logits[tid];
+        if (out.size() == k && value <= out.back().first) {
+            continue;
+        }
+        const auto it = std::upper_bound(
+                out.begin(), out.end(), value,
+                [](float v, const std::pair<float, llama_token> &entry) { return v > entry.first; });
+        out.insert(it, {value, (llama_token) tid});
+        if (out.size() > k) {
+            out.pop_back();
+        }
+    }
+    const float log_norm = logits_log_normalizer(logits, n_vocab);
+    for (auto &entry: out) {
+        entry.first -= log_norm;
+    }
+}
+
+// プロンプトの続きをビーム幅 beam_width で探索し、EOS で終わった仮説 (max_tokens に達したものを含む) を
+// スコアの降順で返す。プロンプトは seq 0 に prefill して再利用し、各ビームは seq 1..beam_width に
+// llama_kv_cache_seq_cp でフォークする (KV のセルは共有される)。1 ステップで全ビームの最新トークンを
+// 1 回の llama_decode にまとめる。子を残さなかったビームの seq は llama_kv_cache_seq_rm で捨て、
+// 2 番目以降の子の seq に使い回す。
+// 対数確率は 0 以下なので、EOS で終わった (文字列の違う) 上位 n_best 個を生きているビームが
+// 上回れなくなった時点で打ち切る。
+static std::vector<BeamHypothesis> beam_search_n_best(
+        const std::string &prompt,
+        int max_tokens,
+        int beam_width,
+        int n_best,
+        uint64_t request_seq
+) {
+    std::unique_lock<std::mutex> session_lock(g_session.mutex);
+    std::vector<BeamHypothesis> finished;
+    if (is_request_stale(request_seq) || !g_model || !g_vocab || max_tokens <= 0 || n_best <= 0) {
+        return finished;
+    }
+
+    llama_context *ctx = ensure_session_context_locked();
+    if (!ctx) {
+        return finished;
+    }
+    const size_t width = (size_t) std::min(std::max(beam_width, 1), (int) llama_n_seq_max(ctx) - 1);
+    if (width < 1) {
+        LOGE("beam_search_n_best: the context has no spare sequence for beams");
+        return finished;
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+    const auto prompt_tokens = tokenize_text(preprocess_text(prompt), /*add_bos=*/false, /*add_eos=*/false);
+    if (prompt_tokens.empty()) {
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return finished;
+    }
+    record_workload_request_locked(prompt_tokens.size(), (size_t) max_tokens);
+    const size_t n_reused = reuse_session_prefix_locked(ctx, prompt_tokens, prompt_tokens.size() - 1);
+    const size_t n_new = prompt_tokens.size() - n_reused;
+    size_t first_row = 0;
+    int rc = prefill_session_tokens_locked(ctx, prompt_tokens.data() + n_reused, n_new, n_new - 1, request_seq, first_row);
+    const float *prompt_logits = rc == 0 ? llama_get_logits_ith(ctx, (int32_t) first_row) : nullptr;
+    if (!prompt_logits) {
+        if (!is_request_stale(request_seq)) {
+            LOGE("beam_search_n_best: llama_decode(prompt) failed: %d", rc);
+        }
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+        return finished;
+    }
+
+    const llama_token eos = llama_vocab_eos(g_vocab);
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    const size_t prompt_len = prompt_tokens.size();
+    const size_t n_ctx = llama_n_ctx(ctx);
+    // 1 ステップで最大 width 個のセルを使うので、KV に収まるステップ数までに抑える。
+    const size_t max_steps = std::min((size_t) max_tokens, n_ctx > prompt_len ? (n_ctx - prompt_len) / width : 0);
+
+    struct Beam {
+        BeamHypothesis hyp;
+        llama_seq_id seq_id;
+    };
+    struct Expansion {
+        float score;
+        size_t parent;  // beams の添字 (最初のステップではプロンプト)
+        llama_token token;
+    };
+    std::vector<Beam> beams;
+    std::vector<Expansion> expansions;
+    std::vector<std::pair<float, llama_token>> top;
+    size_t decoded_tokens = 0;
+
+    for (llama_seq_id s = 1; s <= (llama_seq_id) width; ++s) {
+        llama_kv_cache_seq_rm(ctx, s, -1, -1);
+    }
+
+    // 違うトークン列でも同じ文字列になることがあり、呼び出し側は文字列で重複を除く。
+    // 打ち切りの判定が n_best 個の違う文字列で行われるよう、同じ文字列はスコアの高い方だけを残す。
+    std::vector<std::string> finished_texts;  // finished と同じ並び
+    auto add_finished = [&](BeamHypothesis hyp) {
+        std::string text = tokens_to_text(hyp.tokens);
+        const auto dup = std::find(finished_texts.begin(), finished_texts.end(), text);
+        if (dup != finished_texts.end()) {
+            const auto index = dup - finished_texts.begin();
+            if (finished[(size_t) index].score >= hyp.score) {
+                return;
+            }
+            finished.erase(finished.begin() + index);
+            finished_texts.erase(dup);
+        }
+        const auto it = std::upper_bound(
+                finished.begin(), finished.end(), hyp.score,
+                [](float v, const BeamHypothesis &h) { return v > h.score; });
+        finished_texts.insert(finished_texts.begin() + (it - finished.begin()), std::move(text));
+        finished.insert(it, std::move(hyp));
+    };
+
+    bool ok = true;
+    bool beams_unexpanded = false;  // beams に展開していない (結果に入れるべき) 仮説が残っている
+    for (size_t step = 0; step < max_steps; ++step) {
+        // 各ビームの上位 width + 1 個 (EOS が含まれても width 個のビームを残せる数) を展開する。
+        expansions.clear();
+        const size_t n_parents = step == 0 ? 1 : beams.size();
+        for (size_t i = 0; i < n_parents; ++i) {
+            const float *logits = step == 0 ? prompt_logits : llama_get_logits_ith(ctx, (int32_t) i);
+            if (!logits) {
+                continue;
+            }
+            const float base = step == 0 ? 0.0f : beams[i].hyp.score;
+            top_k_log_probs(logits, n_vocab, width + 1, top);
+            for (const auto &entry: top) {
+                expansions.push_back(Expansion{base + entry.first, i, entry.second});
+            }
+        }
+        std::stable_sort(expansions.begin(), expansions.end(),
+                         [](const Expansion &lhs, const Expansion &rhs) { return lhs.score > rhs.score; });
+
+        std::vector<Expansion> kept;
+        for (const auto &e: expansions) {
+            if (kept.size() >= width) {
+                break;
+            }
+            if (e.token == eos) {
+                BeamHypothesis hyp = step == 0 ? BeamHypothesis{} : beams[e.parent].hyp;
+                hyp.score = e.score;
+                add_finished(std::move(hyp));
+                continue;
+            }
+            kept.push_back(e);
+        }
+        if (kept.empty()) {
+            break;
+        }
+        if (finished.size() >= (size_t) n_best && finished[(size_t) n_best - 1].score >= kept.front().score) {
+            break;
+        }
+
+        // 子に seq を割り当てる。最初の子は親の seq をそのまま使い、残りは空いた seq にコピーする。
+        std::vector<Beam> next_beams;
+        next_beams.reserve(kept.size());
+        if (step == 0) {
+            for (size_t j = 0; j < kept.size(); ++j) {
+                const auto seq_id = (llama_seq_id) (j + 1);
+                llama_kv_cache_seq_cp(ctx, 0, seq_id, -1, -1);
+                next_beams.push_back(Beam{BeamHypothesis{{kept[j].token}, kept[j].score}, seq_id});
+            }
+        } else {
+            std::vector<size_t> n_children(beams.size(), 0);
+            for (const auto &e: kept) {
+                n_children[e.parent]++;
+            }
+            std::vector<bool> seq_in_use(width + 1, false);
+            for (size_t i = 0; i < beams.size(); ++i) {
+                if (n_children[i] > 0) {
+                    seq_in_use[(size_t) beams[i].seq_id] = true;
+                } else {
+                    llama_kv_cache_seq_rm(ctx, beams[i].seq_id, -1, -1);
+                }
+            }
+            std::vector<llama_seq_id> free_seqs;
+            for (size_t s = width; s >= 1; --s) {
+                if (!seq_in_use[s]) {
+                    free_seqs.push_back((llama_seq_id) s);
+                }
+            }
+            std::vector<bool> parent_seq_taken(beams.size(), false);
+            for (const auto &e: kept) {
+                Beam child{beams[e.parent].hyp, beams[e.parent].seq_id};
+                child.hyp.tokens.push_back(e.token);
+                child.hyp.score = e.score;
+                if (parent_seq_taken[e.parent]) {
+                    child.seq_id = free_seqs.back();
+                    free_seqs.pop_back();
+                    llama_kv_cache_seq_cp(ctx, beams[e.parent].seq_id, child.seq_id, -1, -1);
+                }
+                parent_seq_taken[e.parent] = true;
+                next_beams.push_back(std::move(child));
+            }
+        }
+        beams = std::move(next_beams);
+        beams_unexpanded = true;
+
+        if (step + 1 == max_steps) {
+            // 長さの上限に達したビームはデコードせずに結果に入れる。
+            break;
+        }
+
+        llama_batch batch = llama_batch_init((int32_t) beams.size(), 0, 1);
+        for (const auto &beam: beams) {
+            batch_add_token(batch, beam.hyp.tokens.back(), (llama_pos) (prompt_len + step), beam.seq_id, true);
+        }
+        rc = decode_batch_locked(ctx, batch);
+        llama_batch_free(batch);
+        if (rc != 0) {
+            ok = false;
+            if (!is_request_stale(request_seq)) {
+                LOGE("beam_search_n_best: llama_decode(step) failed: %d", rc);
+            }
+            break;
+        }
+        decoded_tokens += beams.size();
+        beams_unexpanded = false;
+    }
+
+    for (llama_seq_id s = 1; s <= (llama_seq_id) width; ++s) {
+        llama_kv_cache_seq_rm(ctx, s, -1, -1);
+    }
+    g_session.kv_fragmented = true;
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+
+    if (!ok && is_request_stale(request_seq)) {
+        return {};
+    }
+    // 長さの上限で EOS まで届かなかったビームも結果に含める (貪欲生成が maxTokens で打ち切るのと同じ)。
+    if (beams_unexpanded) {
+        for (auto &beam: beams) {
+            add_finished(std::move(beam.hyp));
+        }
+    }
+    LOGI("beam_search_n_best: width=%zu, %zu hypotheses, decoded %zu beam tokens",
+         width, finished.size(), decoded_tokens);
+    return finished;
+}
+
+// ------- ネイティブのリクエストスケジューラ (状態) -------
+// submit* で受け付けたリクエストを専用のワーカースレッドで 1 件ずつ実行し、結果を JNI のコールバックで返す。
+// 受け口は 1 件だけの郵便受けで、新しいリクエストはまだ始まっていない古いリクエストを置き換える (latest wins)。
+// 実行中のリクエストは g_request_seq を進めて止めさせ、プレフィルだけは計算し切って KV に残す。
+// 連続バッチングが有効なら郵便受けと世代を種類ごとに分け、置き換えるのは同じ種類のリクエストだけにする。
+
+enum class ScheduledKind {
+    Generate,
+    Evaluate,
+    Score,
+};
+
+static constexpr size_t kScheduledKinds = 3;
+
+struct ScheduledRequest {
+    ScheduledKind kind;
+    jlong request_id;
+    jobject callback;           // グローバル参照
+    std::vector<jobject> args;  // 引数の jstring / jobjectArray のグローバル参照 (null もある)
+    jint int_arg;
+    jint deadline_ms;  // 投函からの締め切り (0 以下なら締め切りなし)
+    std::chrono::steady_clock::time_point submitted_at;
+    uint64_t generation = 0;  // 投函時に進めた後の世代 (連続バッチングでは種類ごとの世代)
+};
+
+struct RequestScheduler {
+    std::atomic<ScheduledRequest *> mailbox{nullptr};
+    // 投函と取り消しのたびに進める。実行の前後で変わっていれば、そのリクエストは割り込まれた。
+    std::atomic<uint64_t> generation{0};
+    // 連続バッチング用の種類ごとの郵便受けと世代 (添字は ScheduledKind)
+    std::atomic<ScheduledRequest *> kind_mailboxes[kScheduledKinds]{};
+    std::atomic<uint64_t> kind_generations[kScheduledKinds]{};
+    // ワーカーを寝かせるためだけのロック。郵便受けの受け渡しには使わない。
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+    std::once_flag started;
+    JavaVM *vm = nullptr;
+    // ワーカースレッドだけが触る: 実行中のリクエストとワーカーの JNIEnv
+    ScheduledRequest *running = nullptr;
+    JNIEnv *worker_env = nullptr;
+};
+
+// ワーカースレッドは detach したまま終わらないので、終了時にデストラクタが走らないようにヒープに置く。
+static RequestScheduler &g_scheduler = *new RequestScheduler();
+
+// 結果をコールバックに渡し、リクエストを解放する。truncated は締め切りで打ち切った結果であること。
+// 割り込まれた (superseded) リクエストに result があれば、ソフトキャンセルの途中結果として先に渡す。
+static void finish_scheduled_request(
+        JNIEnv *env,
+        ScheduledRequest *request,
+        jobject result,
+        bool superseded,
+        bool truncated = false
+) {
+    jclass callback_class = env->GetObjectClass(request->callback);
+    if (superseded && result) {
+        jmethodID partial = env->GetMethodID(callback_class, "onPartialResult", "(JLjava/lang/Object;)V");
+        if (partial) {
+            env->CallVoidMethod(request->callback, partial, request->request_id, result);
+        }
+        if (env->ExceptionCheck()) {
+            env->ExceptionClear();
+        }
+    }
+    jmethodID method = superseded
+                       ? env->GetMethodID(callback_class, "onSuperseded", "(J)V")
+                       : env->GetMethodID(callback_class, "onResult", "(JLjava/lang/Object;Z)V");
+    env->DeleteLocalRef(callback_class);
+    if (method) {
+        if (superseded) {
+            env->CallVoidMethod(request->callback, method, request->request_id);
+        } else {
+            env->CallVoidMethod(request->callback, method, request->request_id, result, (jboolean) truncated);
+        }
+    }
+    if (env->ExceptionCheck()) {
+        LOGE("scheduler: callback threw for request %lld", (long long) request->request_id);
+        env->ExceptionClear();
+    }
+    for (jobject arg: request->args) {
+        if (arg) {
+            env->DeleteGlobalRef(arg);
+        }
+    }
+    env->DeleteGlobalRef(request->callback);
+    delete request;
+}
+
+static void notify_scheduled_prefill_progress(size_t done, size_t total) {
+    if (!t_on_scheduler_worker || !g_scheduler.running) {
+        return;
+    }
+    JNIEnv *env = g_scheduler.worker_env;
+    ScheduledRequest *request = g_scheduler.running;
+    jclass callback_class = env->GetObjectClass(request->callback);
+    jmethodID method = env->GetMethodID(callback_class, "onPrefillProgress", "(JII)V");
+    env->DeleteLocalRef(callback_class);
+    if (method) {
+        env->CallVoidMethod(request->callback, method, request->request_id, (jint) done, (jint) total);
+    }
+    if (env->ExceptionCheck()) {
+        env->ExceptionClear();
+    }
+}
+
+// まだ始まっていないリクエストを取り消し、実行中のリクエストを割り込まれた扱いにする。
+static void cancel_scheduled_requests(JNIEnv *env) {
+    g_scheduler.generation.fetch_add(1, std::memory_order_acq_rel);
+    ScheduledRequest *pending = g_scheduler.mailbox.exchange(nullptr, std::memory_order_acq_rel);
+    if (pending) {
+        finish_scheduled_request(env, pending, nullptr, true);
+    }
+    for (size_t kind = 0; kind < kScheduledKinds; ++kind) {
+        g_scheduler.kind_generations[kind].fetch_add(1, std::memory_order_acq_rel);
+        pending = g_scheduler.kind_mailboxes[kind].exchange(nullptr, std::memory_order_acq_rel);
+        if (pending) {
+            finish_scheduled_request(env, pending, nullptr, true);
+        }
+    }
+}
+
+// ------- 読み込み直後のウォームアップ -------
+// モデルは mmap で読み込み、コンテキストは最初のリクエストで作るので、:zenz プロセスを起動した直後の
+// 最初の打鍵が、重み全体のページフォールトと計算バッファの確保とグラフの構築をまとめて払うことになる。
+// initModel はモデルを読み込んだらウォームアップ用のスレッドを起こしてすぐに戻る。スレッドはモデル
+// ファイルの先読みを頼み、コンテキストを作って典型的な形のプレフィルと 1 トークンのデコードを 1 回ずつ
+// 流し、KV を空に戻す。本物のリクエストが来たら (g_request_seq が進んだら) デコードはそこで止める。
+// 重みの常駐のさせ方は、何もしない・ファイルを POSIX_FADV_WILLNEED で先読みして全ページが載るまで待つ・mlock で固定する
+// (llama.cpp の use_mlock。ロックは読み込み中に行うので initModel の中で終わる) から選ぶ。
+
+enum class WeightResidency {
+    None = 0,
+    WillNeed = 1,
+    Lock = 2,
+};
+
+static constexpr size_t kWarmupPrefillTokens = 64;  // 左文脈つきのプロンプトの典型的な長さ
+
+struct WarmupState {
+    std::mutex mutex;
+    std::condition_variable finished_cv;
+    bool enabled = true;
+    WeightResidency residency = WeightResidency::WillNeed;
+    uint64_t generation = 0;  // initModel と closeModel のたびに進める
+    bool loaded = false;      // generation のモデルが読み込まれているか
+    bool finished = false;    // generation のウォームアップが終わったか (無効なら読み込んだ時点で true)
+    // 各段階の所要時間 (ms)。行わなかった段階は -1。page_in_ms はモデルファイルの全ページが載るまで。
+    long long page_in_ms = -1;
+    long long context_ms = -1;
+    long long decode_ms = -1;
+    long long total_ms = -1;
+};
+
+static WarmupState g_warmup;
+
+static long long elapsed_ms_since(std::chrono::steady_clock::time_point started) {
+    return (long long) std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started).count();
+}
+
+static constexpr size_t kPageInChunkBytes = 16u << 20;  // 世代を確かめる間隔
+
+// モデルファイル全体をページキャッシュに先読みするよう頼み、全ページが載るまで待つ。
+// fadvise は読み込みを始めさせるだけなので、ファイルを読み取り専用で mmap し、各ページを 1 バイトずつ
+// 触って載り切るのを待つ (既に載っているページはマイナーフォールトだけで済む)。
+// 途中でモデルが閉じられたり読み込み直されたり (generation が進んだり) したら false。
+static bool page_in_model_file(const std::string &path, uint64_t generation) {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) != 0) {
+        close(fd);
+        return false;
+    }
+    const auto size = (size_t) st.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    const auto page = (size_t) std::max(4096L, sysconf(_SC_PAGESIZE));
+    const auto *bytes = static_cast<const volatile unsigned char *>(mapped);
+    bool completed = true;
+    unsigned char sink = 0;
+    for (size_t chunk = 0; chunk < size && completed; chunk += kPageInChunkBytes) {
+        {
+            std::lock_guard<std::mutex> lock(g_warmup.mutex);
+            completed = g_warmup.generation == generation;
+        }
+        const size_t end = std::min(size, chunk + kPageInChunkBytes);
+        for (size_t offset = chunk; completed && offset < end; offset += page) {
+            sink ^= bytes[offset];
+        }
+    }
+    (void) sink;
+    munmap(mapped, size);
+    return completed;
+}
+
+// 典型的な形のプレフィルと 1 トークンのデコードを流して KV を空に戻す。
+// 本物のリクエストに割り込まれたら false。
+static bool run_warmup_decode_locked(llama_context *ctx, uint64_t request_seq) {
+    auto tokens = tokenize_text(preprocess_text(build_zenz_prompt("", "", "", "", "", "", "にほんご")),
+                                /*add_bos=*/false, /*add_eos=*/false);
+    if (tokens.empty()) {
+        return true;
+    }
+    const size_t n_prefill = std::min({kWarmupPrefillTokens, (size_t) llama_n_batch(ctx), (size_t) llama_n_ctx(ctx) - 1});
+    std::vector<llama_token> prompt;
+    while (prompt.size() < n_prefill) {
+        prompt.push_back(tokens[prompt.size() % tokens.size()]);
+    }
+
+    AbortRequestState abort_state{request_seq};
+    llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+    truncate_session_kv_locked(ctx, 0);
+    // g_decode_cost にはウォームアップの (ページフォールト込みの) 時間を入れない。
+    int rc = decode_tokens_at_end(ctx, g_session.kv_tokens, prompt.data(), prompt.size(), prompt.size() - 1);
+    if (rc == 0) {
+        const llama_token next = argmax_token(llama_get_logits_ith(ctx, -1), llama_vocab_n_tokens(g_vocab));
+        rc = decode_tokens_at_end(ctx, g_session.kv_tokens, &next, 1, 0);
+    }
+    llama_set_abort_callback(ctx, never_abort, nullptr);
+    llama_kv_cache_clear(ctx);
+    g_session.kv_tokens.clear();
+    g_session.kv_fragmented = false;
+    return rc == 0;
+}
+
+static void warmup_thread_main(uint64_t generation, uint64_t request_seq, std::string model_path, WeightResidency residency) {
+    const auto started = std::chrono::steady_clock::now();
+    long long page_in_ms = -1;
+    long long context_ms = -1;
+    long long decode_ms = -1;
+    if (residency == WeightResidency::WillNeed) {
+        const auto page_in_started = std::chrono::steady_clock::now();
+        if (page_in_model_file(model_path, generation)) {
+            page_in_ms = elapsed_ms_since(page_in_started);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> session_lock(g_session.mutex);
+        const bool current = [generation] {
+            std::lock_guard<std::mutex> lock(g_warmup.mutex);
+            return g_warmup.generation == generation;
+        }();
+        if (current && g_model && g_vocab && !is_request_stale(request_seq)) {
+            const auto context_started = std::chrono::steady_clock::now();
+            llama_context *ctx = ensure_session_context_locked();
+            if (ctx) {
+                context_ms = elapsed_ms_since(context_started);
+                const auto decode_started = std::chrono::steady_clock::now();
+                if (run_warmup_decode_locked(ctx, request_seq)) {
+                    decode_ms = elapsed_ms_since(decode_started);
+                }
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(g_warmup.mutex);
+    if (g_warmup.generation != generation) {
+        return;
+    }
+    g_warmup.finished = true;
+    g_warmup.page_in_ms = page_in_ms;
+    g_warmup.context_ms = context_ms;
+    g_warmup.decode_ms = decode_ms;
+    g_warmup.total_ms = elapsed_ms_since(started);
+    g_warmup.finished_cv.notify_all();
+    LOGI("warmup: page-in %lld ms, context %lld ms, decode %lld ms, total %lld ms%s",
+         page_in_ms, context_ms, decode_ms, g_warmup.total_ms,
+         decode_ms < 0 ? " (interrupted)" : "");
+}
+
+// 読み込み (または解放) したモデルのウォームアップの状態を初めからにする。戻り値は新しい世代。
+static uint64_t reset_warmup_state(bool loaded) {
+    std::lock_guard<std::mutex> lock(g_warmup.mutex);
+    ++g_warmup.generation;
+    g_warmup.loaded = loaded;
+    g_warmup.finished = loaded && !g_warmup.enabled;
+    g_warmup.page_in_ms = -1;
+    g_warmup.context_ms = -1;
+    g_warmup.decode_ms = -1;
+    g_warmup.total_ms = -1;
+    g_warmup.finished_cv.notify_all();
+    return g_warmup.generation;
+}
+
+// ------- JNI: モデル初期化・キャンセル・解放 -------
+// package com.kazumaproject.zenz; class ZenzEngine
+
+// ドラフトモデルはメインモデルの語彙に依存するので、メインモデルの読み直しや解放と一緒に捨てる。
+static void free_draft_model_locked() {
+    destroy_draft_context_locked();
+    if (g_draft_model) {
+        llama_model_free(g_draft_model);
+        g_draft_model = nullptr;
+    }
+}
+
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_initModel(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jModelPath
+) {
+    if (!jModelPath) {
+        LOGE("initModel: model path is null");
+        return JNI_FALSE;
+    }
+
+    const char *c_model_path = env->GetStringUTFChars(jModelPath, nullptr);
+    if (!c_model_path) {
+        LOGE("initModel: failed to read model path");
+        return JNI_FALSE;
+    }
+    LOGI("initModel: %s", c_model_path);
+
+    // A reload must also stop a decode that currently owns the session mutex.
+    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    destroy_session_context_locked();
+    free_draft_model_locked();
+    g_reading_index = ReadingIndex{};
+    free_vocab_shortlist_locked();
+
+    if (g_model) {
+        llama_model_free(g_model);
+        g_model = nullptr;
+        g_vocab = nullptr;
+    }
+
+    if (!g_backend_initialized) {
+        llama_backend_init();
+        g_backend_initialized = true;
+    }
+
+    reset_warmup_state(false);
+    bool warmup_enabled;
+    WeightResidency residency;
+    {
+        std::lock_guard<std::mutex> warmup_lock(g_warmup.mutex);
+        warmup_enabled = g_warmup.enabled;
+        residency = g_warmup.residency;
+    }
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    mparams.use_mmap = true;
+    mparams.use_mlock = residency == WeightResidency::Lock;
+
+    g_model = llama_model_load_from_file(c_model_path, mparams);
+    if (!g_model) {
+        LOGE("Failed to load model");
+        env->ReleaseStringUTFChars(jModelPath, c_model_path);
+        return JNI_FALSE;
+    }
+
+    g_vocab = llama_model_get_vocab(g_model);
+    if (!g_vocab) {
+        LOGE("Failed to get vocab");
+        llama_model_free(g_model);
+        g_model = nullptr;
+        env->ReleaseStringUTFChars(jModelPath, c_model_path);
+        return JNI_FALSE;
+    }
+
+    const std::string model_path(c_model_path);
+    env->ReleaseStringUTFChars(jModelPath, c_model_path);
+    build_reading_index_locked();
+    build_vocab_shortlist_locked();
+
+    // ウォームアップはセッションのロックを取るので、このロックを外した後に始まる。
+    const uint64_t generation = reset_warmup_state(true);
+    if (warmup_enabled) {
+        const uint64_t request_seq = g_request_seq.load(std::memory_order_relaxed);
+        std::thread(warmup_thread_main, generation, request_seq, model_path, residency).detach();
+    }
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_cancelCurrent(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    // Do not take g_session.mutex here. This method must remain callable from a Binder thread
+    // while the actor thread is blocked inside llama_decode with that mutex held.
+    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+    cancel_scheduled_requests(env);
+}
+
+// ソフトキャンセル: 割り込まれたリクエストは空文字列や ERROR の代わりに途中までの出力・点数を返し、
+// 同じプロンプトの次の生成はその出力の続きから始める。既定は無効。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setSoftCancelEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_soft_cancel_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setSoftCancelEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// スケジューラ経由の生成・検証・採点を、種類ごとに latest wins で受け付けて 1 つのコンテキストで
+// 同時に進める (連続バッチング)。既定は無効。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setContinuousBatchingEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_continuous_batching_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setContinuousBatchingEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 割り込まれたリクエストの累計 [件数, KV に載せ終えていたプロンプトのトークン数,
+// 確定していた出力のトークン数, 次の生成が引き継いだトークン数] を返す。
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getAbortStats(
+        JNIEnv *env,
+        jobject /*thiz*/,
+        jboolean jReset
+) {
+    std::atomic<uint64_t> *counters[] = {
+            &g_aborted_requests, &g_aborted_prompt_tokens, &g_aborted_generated_tokens, &g_resumed_tokens};
+    jlong values[4];
+    for (size_t i = 0; i < 4; ++i) {
+        values[i] = (jlong) (jReset == JNI_TRUE ? counters[i]->exchange(0, std::memory_order_relaxed)
+                                                : counters[i]->load(std::memory_order_relaxed));
+    }
+    jlongArray result = env->NewLongArray(4);
+    if (result) {
+        env->SetLongArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+// リクエスト間のアイドル時間に KV キャッシュをデフラグする。
+// 接頭辞再利用で seq_rm を繰り返すと KV に穴が空くため、次の打鍵の前に詰めておく。
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_defragSessionIfIdle(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/
+) {
+    // 実行中のリクエストがあればアイドルではないので何もしない。
+    std::unique_lock<std::mutex> lock(g_session.mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return JNI_FALSE;
+    }
+    if (!g_session.ctx || !g_session.kv_fragmented) {
+        return JNI_FALSE;
+    }
+
+    llama_kv_cache_defrag(g_session.ctx);
+    llama_kv_cache_update(g_session.ctx);
+    g_session.kv_fragmented = false;
+    return JNI_TRUE;
+}
+
+// アイドル時に、数えたバッチの大きさの分布とメモリの上限からコンテキストの n_ubatch と n_ctx を
+// 決め直し、今のコンテキストと違えば作り直す (setContextSizing)。作り直したら true。
+// KV は捨てるので、次のリクエストはプロンプトを最初からデコードする。
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_resizeContextIfIdle(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/
+) {
+    std::unique_lock<std::mutex> lock(g_session.mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return JNI_FALSE;
+    }
+    if (!g_session.ctx || !refit_workload_targets_locked()) {
+        return JNI_FALSE;
+    }
+    const RuntimeConfig config = session_config_for_locked(get_runtime_config());
+    if (same_runtime_config(g_session.config, config)) {
+        return JNI_FALSE;
+    }
+    LOGI("resizeContextIfIdle: n_ctx %d -> %d, n_ubatch %d -> %d",
+         g_session.config.n_ctx, config.n_ctx, g_session.config.n_ubatch, config.n_ubatch);
+    destroy_session_context_locked();
+    return ensure_session_context_locked() ? JNI_TRUE : JNI_FALSE;
+}
+
+// アイドル中はスレッドプールのワーカーを止め、ポーリングで CPU を使い続けないようにする。
+// 次のリクエストで ensure_session_context_locked が再開する。
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_pauseThreadpoolIfIdle(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/
+) {
+    std::unique_lock<std::mutex> lock(g_session.mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return JNI_FALSE;
+    }
+    if (!g_session.threadpool || g_session.threadpool_paused) {
+        return JNI_FALSE;
+    }
+    ggml_threadpool_pause(g_session.threadpool);
+    g_session.threadpool_paused = true;
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_closeModel(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+    cancel_scheduled_requests(env);
+    reset_warmup_state(false);
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    destroy_session_context_locked();
+    free_draft_model_locked();
+    g_reading_index = ReadingIndex{};
+    free_vocab_shortlist_locked();
+
+    if (g_model) {
+        llama_model_free(g_model);
+        g_model = nullptr;
+        g_vocab = nullptr;
+    }
+
+    if (g_backend_initialized) {
+        llama_backend_free();
+        g_backend_initialized = false;
+    }
+}
+
+// 次の initModel からのウォームアップの有無と重みの常駐のさせ方 (0: なし, 1: 先読み, 2: mlock)。
+// 既定はウォームアップ有効・先読み。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setWarmupConfig(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled,
+        jint jWeightResidency
+) {
+    const auto residency = (WeightResidency) std::min(std::max((int) jWeightResidency, 0), 2);
+    std::lock_guard<std::mutex> lock(g_warmup.mutex);
+    g_warmup.enabled = jEnabled == JNI_TRUE;
+    g_warmup.residency = residency;
+    LOGI("setWarmupConfig: enabled=%d, residency=%d", jEnabled == JNI_TRUE ? 1 : 0, (int) residency);
+}
+
+// 読み込んだモデルのウォームアップが終わるまで最大 timeoutMs ミリ秒待つ (0 なら待たずに調べる)。
+// モデルが読み込まれていて、ウォームアップが終わっていれば (無効なら読み込んだ時点で) true。
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_awaitWarmup(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jlong jTimeoutMs
+) {
+    std::unique_lock<std::mutex> lock(g_warmup.mutex);
+    const uint64_t generation = g_warmup.generation;
+    g_warmup.finished_cv.wait_for(lock, std::chrono::milliseconds(std::max<jlong>(jTimeoutMs, 0)), [generation] {
+        return g_warmup.generation != generation || !g_warmup.loaded || g_warmup.finished;
+    });
+    return g_warmup.generation == generation && g_warmup.loaded && g_warmup.finished ? JNI_TRUE : JNI_FALSE;
+}
+
+// 直近のウォームアップの [先読み, コンテキスト作成, デコード, 全体] の所要時間 (ms) を返す。
+// 行わなかった (割り込まれた) 段階とまだ終わっていない場合は -1。
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getWarmupTimings(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    jlong values[4];
+    {
+        std::lock_guard<std::mutex> lock(g_warmup.mutex);
+        values[0] = (jlong) g_warmup.page_in_ms;
+        values[1] = (jlong) g_warmup.context_ms;
+        values[2] = (jlong) g_warmup.decode_ms;
+        values[3] = (jlong) g_warmup.total_ms;
+    }
+    jlongArray result = env->NewLongArray(4);
+    if (result) {
+        env->SetLongArrayRegion(result, 0, 4, values);
+    }
+    return result;
+}
+
+// 投機的デコーディング用のドラフトモデルを読み込む。initModel の後に呼ぶ。
+// 語彙がメインモデルと一致しない場合は読み込まない。ドラフトモデルは 1 回の検証ごとに
+// 最大 maxDraftTokens トークンを提案し、メインモデルがそれを 1 回の llama_decode で検証する。
+extern "C"
+JNIEXPORT jboolean JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_initDraftModel(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jModelPath,
+        jint jMaxDraftTokens
+) {
+    const std::string model_path = jstring_to_string(env, jModelPath);
+    if (model_path.empty()) {
+        LOGE("initDraftModel: model path is empty");
+        return JNI_FALSE;
+    }
+    LOGI("initDraftModel: %s", model_path.c_str());
+
+    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    free_draft_model_locked();
+    if (!g_model || !g_vocab) {
+        LOGE("initDraftModel: main model not initialized");
+        return JNI_FALSE;
+    }
+
+    llama_model_params mparams = llama_model_default_params();
+    mparams.n_gpu_layers = 0;
+    mparams.use_mmap = true;
+
+    llama_model *draft_model = llama_model_load_from_file(model_path.c_str(), mparams);
+    if (!draft_model) {
+        LOGE("Failed to load draft model");
+        return JNI_FALSE;
+    }
+
+    // 検証はトークン ID の一致で行うので、語彙が同じでなければ使えない。
+    const llama_vocab *draft_vocab = llama_model_get_vocab(draft_model);
+    if (!draft_vocab ||
+        llama_vocab_type(draft_vocab) != llama_vocab_type(g_vocab) ||
+        llama_vocab_n_tokens(draft_vocab) != llama_vocab_n_tokens(g_vocab) ||
+        llama_vocab_eos(draft_vocab) != llama_vocab_eos(g_vocab)) {
+        LOGE("initDraftModel: draft vocab does not match the main model");
+        llama_model_free(draft_model);
+        return JNI_FALSE;
+    }
+
+    g_draft_model = draft_model;
+    g_draft_model_max_tokens.store(jMaxDraftTokens > 0 ? jMaxDraftTokens : 4, std::memory_order_relaxed);
+    return JNI_TRUE;
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_closeDraftModel(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/
+) {
+    g_request_seq.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    free_draft_model_locked();
+}
+
+// ------- JNI: ランタイム設定 (n_ctx / n_threads) -------
+
+// 設定値を差し替え、今のコンテキストと (モデルに合わせた後で) 食い違えば作り直させる。
+static void apply_runtime_config(const RuntimeConfig &config) {
+    {
+        std::lock_guard<std::mutex> lock(g_param_mutex);
+        g_param_n_ctx = config.n_ctx;
+        g_param_n_threads = config.n_threads;
+        g_param_n_threads_batch = config.n_threads_batch;
+        g_param_n_batch = config.n_batch;
+        g_param_n_seq_max = config.n_seq_max;
+        g_param_n_ubatch = config.n_ubatch;
+        g_param_type_k = config.type_k;
+        g_param_type_v = config.type_v;
+        g_param_flash_attn = config.flash_attn;
+    }
+
+    std::lock_guard<std::mutex> session_lock(g_session.mutex);
+    if (g_session.ctx && !same_runtime_config(g_session.config, session_config_for_locked(config))) {
+        destroy_session_context_locked();
+    }
+}
+
+static int clamp_runtime_n_ctx(jint jNCtx) {
+    const int n_ctx = jNCtx > 0 ? jNCtx : 512;
+    return std::min(std::max(n_ctx, 128), 4096);
+}
+
+static int clamp_runtime_n_threads(jint jNThreads) {
+    const int n_threads = jNThreads > 0 ? jNThreads : 4;
+    return std::min(std::max(n_threads, 1), 8);
+}
+
+// n_ctx と n_threads だけを変える。n_batch は n_ctx に揃え、n_ubatch・KV の型・flash attention・
+// n_seq_max はそのまま引き継ぐ。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setRuntimeConfig(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jint jNCtx,
+        jint jNThreads
+) {
+    const int n_ctx = clamp_runtime_n_ctx(jNCtx);
+    const int n_threads = clamp_runtime_n_threads(jNThreads);
+
+    RuntimeConfig new_config = get_runtime_config();
+    new_config.n_ctx = n_ctx;
+    new_config.n_threads = n_threads;
+    new_config.n_threads_batch = n_threads;
+    new_config.n_batch = n_ctx;
+    apply_runtime_config(new_config);
+
+    LOGI("setRuntimeConfig: n_ctx=%d, n_threads=%d", n_ctx, n_threads);
+}
+
+// コンテキストのメモリに効く設定をまとめて変える。0 以下の nBatch は n_ctx、nUbatch は
+// min(512, n_batch)、nSeqMax は 16。KV の型は ggml_type の値で F32 / F16 / Q8_0 / Q4_0 のみ
+// (それ以外は F16)。モデルで使えない組み合わせは次にコンテキストを作るときに F16 へ戻す。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setContextConfig(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jint jNCtx,
+        jint jNThreads,
+        jint jNBatch,
+        jint jNUbatch,
+        jint jNSeqMax,
+        jint jTypeK,
+        jint jTypeV,
+        jboolean jFlashAttn
+) {
+    RuntimeConfig new_config;
+    new_config.n_ctx = clamp_runtime_n_ctx(jNCtx);
+    new_config.n_threads = clamp_runtime_n_threads(jNThreads);
+    new_config.n_threads_batch = new_config.n_threads;
+    new_config.n_batch = jNBatch > 0 ? std::min(std::max((int) jNBatch, 32), new_config.n_ctx) : new_config.n_ctx;
+    new_config.n_ubatch = jNUbatch > 0 ? std::min((int) jNUbatch, new_config.n_batch)
+                                       : std::min(512, new_config.n_batch);
+    new_config.n_seq_max = jNSeqMax > 0 ? std::min((int) jNSeqMax, 64) : 16;
+    new_config.type_k = is_supported_kv_type((ggml_type) jTypeK) ? (ggml_type) jTypeK : GGML_TYPE_F16;
+    new_config.type_v = is_supported_kv_type((ggml_type) jTypeV) ? (ggml_type) jTypeV : GGML_TYPE_F16;
+    new_config.flash_attn = jFlashAttn == JNI_TRUE;
+    apply_runtime_config(new_config);
+
+    LOGI("setContextConfig: n_ctx=%d, n_threads=%d, n_batch=%d, n_ubatch=%d, n_seq_max=%d, kv=%s/%s, flash_attn=%d",
+         new_config.n_ctx, new_config.n_threads, new_config.n_batch, new_config.n_ubatch, new_config.n_seq_max,
+         ggml_type_name(new_config.type_k), ggml_type_name(new_config.type_v), new_config.flash_attn ? 1 : 0);
+}
+
+// [KV キャッシュ (バイト), 計算バッファの目安 (バイト), n_ctx, n_batch, n_ubatch, n_seq_max,
+//  K の型, V の型, flash attention (0/1)] を返す。コンテキストがあればその実際の設定、
+// 無ければ今の設定をモデルに合わせたもの。モデルが無ければ大きさは -1。
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getContextMemoryStats(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    RuntimeConfig config;
+    ContextMemory memory;
+    bool has_model = false;
+    {
+        std::lock_guard<std::mutex> lock(g_session.mutex);
+        has_model = g_model != nullptr;
+        if (g_session.ctx) {
+            config = g_session.config;
+            memory = g_session.memory;
+        } else {
+            config = session_config_for_locked(get_runtime_config());
+            if (has_model) {
+                memory = estimate_context_memory(g_model, config, padded_kv_cells(config));
+            }
+        }
+    }
+    jlong values[9] = {
+            has_model ? (jlong) memory.kv_bytes : -1,
+            has_model ? (jlong) memory.compute_bytes : -1,
+            config.n_ctx,
+            config.n_batch,
+            config.n_ubatch,
+            config.n_seq_max,
+            (jlong) config.type_k,
+            (jlong) config.type_v,
+            config.flash_attn ? 1 : 0
+    };
+    jlongArray result = env->NewLongArray(9);
+    if (result) {
+        env->SetLongArrayRegion(result, 0, 9, values);
+    }
+    return result;
+}
+
+// バッチの大きさに合わせた n_ubatch の調整の有無と、KV と計算バッファの合計の上限
+// (バイト、0 以下なら上限なし)。上限は調整を切っていても守る。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setContextSizing(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled,
+        jlong jMemoryCapBytes
+) {
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    g_workload.enabled = jEnabled == JNI_TRUE;
+    g_workload.memory_cap = jMemoryCapBytes > 0 ? (uint64_t) jMemoryCapBytes : 0;
+    if (g_session.ctx && !same_runtime_config(g_session.config, session_config_for_locked(get_runtime_config()))) {
+        destroy_session_context_locked();
+    }
+    LOGI("setContextSizing: enabled=%d, memory_cap=%.1f MiB", jEnabled == JNI_TRUE ? 1 : 0,
+         to_mib(g_workload.memory_cap));
+}
+
+// [数えたバッチ数, トークンの 95% が収まるバッチの大きさ, 要求された位置の数の最大,
+//  分布から決めた n_ubatch, n_ctx の下限, 最長のプロンプトのトークン数] を返す。決めていない値は 0。
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getContextSizingStats(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    jlong values[6];
+    {
+        std::lock_guard<std::mutex> lock(g_session.mutex);
+        values[0] = (jlong) g_workload.batches;
+        values[1] = workload_p95_batch_tokens_locked();
+        values[2] = (jlong) g_workload.peak_positions;
+        values[3] = g_workload.target_ubatch;
+        values[4] = g_workload.target_ctx;
+        values[5] = (jlong) g_workload.longest_prompt;
+    }
+    jlongArray result = env->NewLongArray(6);
+    if (result) {
+        env->SetLongArrayRegion(result, 0, 6, values);
+    }
+    return result;
+}
+
+// ------- JNI: スレッドプール -------
+
+// 性能コア (最大周波数が最も低いクラスタ以外) の CPU 番号。読めなければ空の配列。
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getPerformanceCpus(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    const std::vector<int> cpus = zenz_performance_cpus("/sys");
+    jintArray out = env->NewIntArray((jsize) cpus.size());
+    if (out && !cpus.empty()) {
+        std::vector<jint> values(cpus.begin(), cpus.end());
+        env->SetIntArrayRegion(out, 0, (jsize) values.size(), values.data());
+    }
+    return out;
+}
+
+// スレッドプールを置く CPU・優先度・ポーリングの強さを設定する。次のリクエストで作り直す。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setThreadpoolConfig(
+        JNIEnv *env,
+        jobject /*thiz*/,
+        jintArray jCpus,
+        jint jPriority,
+        jint jPollLevel
+) {
+    std::vector<int> cpus;
+    if (jCpus) {
+        const jsize n = env->GetArrayLength(jCpus);
+        std::vector<jint> values((size_t) n);
+        env->GetIntArrayRegion(jCpus, 0, n, values.data());
+        for (jint cpu: values) {
+            if (cpu >= 0 && cpu < GGML_MAX_N_THREADS) {
+                cpus.push_back(cpu);
+            }
+        }
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    }
+    const int priority = std::max((int) GGML_SCHED_PRIO_NORMAL,
+                                  std::min((int) jPriority, (int) GGML_SCHED_PRIO_REALTIME));
+    const int poll = std::max(0, std::min((int) jPollLevel, 100));
+
+    {
+        std::lock_guard<std::mutex> lock(g_param_mutex);
+        g_param_threadpool_cpus = cpus;
+        g_param_threadpool_priority = priority;
+        g_param_threadpool_poll = poll;
+    }
+    LOGI("setThreadpoolConfig: cpus=%zu, prio=%d, poll=%d", cpus.size(), priority, poll);
+}
+
+// 生成のプレフィルとデコードのスレッド数を、それぞれ setRuntimeConfig の nThreads を上限に自動で調整する。
+// prefillThreads / decodeThreads は前回の学習結果 (0 なら未指定) で、最初に試すスレッド数になる。
+// 無効にすると setRuntimeConfig のスレッド数に戻す。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setAdaptiveThreadCounts(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled,
+        jint jPrefillThreads,
+        jint jDecodeThreads
+) {
+    {
+        std::lock_guard<std::mutex> lock(g_thread_tuner_mutex);
+        g_thread_tuner_seed_prefill = std::max(0, (int) jPrefillThreads);
+        g_thread_tuner_seed_decode = std::max(0, (int) jDecodeThreads);
+        g_prefill_tuner = ThreadCountTuner{};
+        g_decode_tuner = ThreadCountTuner{};
+    }
+    g_adaptive_threads_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    if (jEnabled != JNI_TRUE) {
+        std::lock_guard<std::mutex> session_lock(g_session.mutex);
+        if (g_session.ctx) {
+            llama_set_n_threads(g_session.ctx, g_session.config.n_threads, g_session.config.n_threads_batch);
+        }
+    }
+}
+
+// 学習したスレッド数 [プレフィル, デコード]。まだ測定していないフェーズは 0。
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getAdaptiveThreadCounts(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    jint values[2] = {0, 0};
+    {
+        std::lock_guard<std::mutex> lock(g_thread_tuner_mutex);
+        const ThreadCountTuner *tuners[2] = {&g_prefill_tuner, &g_decode_tuner};
+        for (int i = 0; i < 2; ++i) {
+            const ThreadCountTuner &tuner = *tuners[i];
+            bool measured = false;
+            for (int n = 1; n <= tuner.max_threads; ++n) {
+                measured = measured || tuner.samples[n] > 0;
+            }
+            values[i] = measured ? tuner.best() : 0;
+        }
+    }
+    jintArray out = env->NewIntArray(2);
+    if (out) {
+        env->SetIntArrayRegion(out, 0, 2, values);
+    }
+    return out;
+}
+
+// プロンプトのプレフィルを tokens トークンずつに分ける (0 なら分けない)。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setPrefillChunkSize(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jint jTokens
+) {
+    g_prefill_chunk_tokens.store(std::max(0, (int) jTokens), std::memory_order_relaxed);
+}
+
+// 直近のプレフィルの進み具合 [デコード済みトークン数, 全体のトークン数]。
+// 実行中のリクエストを止めずに読めるよう、セッションのロックは取らない。
+extern "C"
+JNIEXPORT jintArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getPrefillProgress(
+        JNIEnv *env,
+        jobject /*thiz*/
+) {
+    const jint values[2] = {
+            g_prefill_progress_done.load(std::memory_order_relaxed),
+            g_prefill_progress_total.load(std::memory_order_relaxed)
+    };
+    jintArray out = env->NewIntArray(2);
+    if (out) {
+        env->SetIntArrayRegion(out, 0, 2, values);
+    }
+    return out;
+}
+
+// scoreCandidates の一括採点 (複数 seq を 1 回の llama_decode で評価) を切り替える。
+// 無効にすると候補ごとに逐次デコードする従来の経路を使う。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setBatchedScoringEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_batched_scoring_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setBatchedScoringEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 候補の採点で logits を取り出さず、出力層から先 (argmax・gather・log-sum-exp) を自前のグラフで計算するかどうか。
+// 既定は有効。無効にすると従来どおり全 logits をホストに写して走査する。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setInGraphScoringEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_head_scoring_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setInGraphScoringEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 貪欲生成と採点の出力層を、変換の出力に現れ得るトークンだけに絞ったものに置き換えるかどうか。既定は無効。
+// 必要なトークンが絞った語彙の外にある場合は全語彙の出力層を使う。貪欲生成は最後に全語彙の出力層で
+// argmax を確かめるので出力は変わらない。採点の値は絞った語彙で正規化した値になる。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setVocabShortlistEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_vocab_shortlist_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setVocabShortlistEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 左文脈・生成済みトークン・確定出力の n-gram から続きを推測するドラフトの有効/無効。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setNgramDraftingEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_ngram_drafting_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setNgramDraftingEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 入力の読みと矛盾するトークンを除いて生成する (読みを消費し切った時点で止める) かどうか。既定は無効。
+// generateWithContext* の生成にだけ効く。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setReadingConstrainedDecodingEnabled(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jboolean jEnabled
+) {
+    g_reading_constrained_decoding_enabled.store(jEnabled == JNI_TRUE, std::memory_order_relaxed);
+    LOGI("setReadingConstrainedDecodingEnabled: %d", jEnabled == JNI_TRUE ? 1 : 0);
+}
+
+// 自己投機的デコーディング (同じモデルの先頭 N 層だけでドラフトし、全層で検証する) の層数。
+// 0 で無効 (既定)、正の値でその層数に固定、負の値で実測から自動で選ぶ。
+// ドラフトモデルが読み込まれている場合はそちらを優先する。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_setSelfSpeculativeLayers(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/,
+        jint jLayers
+) {
+    g_layer_skip_layers.store(jLayers < 0 ? -1 : jLayers, std::memory_order_relaxed);
+    LOGI("setSelfSpeculativeLayers: %d", jLayers);
+}
+
+// 現在ドラフトに使っている層数を返す (無効、または自動選択で節約できないと判断した場合は 0)。
+extern "C"
+JNIEXPORT jint JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getSelfSpeculativeLayers(
+        JNIEnv * /*env*/,
+        jobject /*thiz*/
+) {
+    const int configured = g_layer_skip_layers.load(std::memory_order_relaxed);
+    if (configured >= 0) {
+        return configured;
+    }
+    return g_layer_skip.auto_layers.load(std::memory_order_relaxed);
+}
+
+// 確定された出力を n-gram ドラフト用のリングバッファに追加する。
+// トークン化は次の生成時にセッションのロック内で行うので、ここではデコード中でも待たない。
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_recordCommittedText(
+        JNIEnv *env,
+        jobject /*thiz*/,
+        jstring jText
+) {
+    std::string text = jstring_to_string(env, jText);
+    if (text.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(g_commit_history_mutex);
+    g_commit_history.push_back(std::move(text));
+    while (g_commit_history.size() > kCommitHistoryCapacity) {
+        g_commit_history.pop_front();
+    }
+    ++g_commit_history_version;
+}
+
+// 投機的デコーディングの累計 [提案したドラフトトークン数, 受理された数] を返す。
+// reset が true なら読み出した後に 0 に戻す。
+extern "C"
+JNIEXPORT jlongArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_getSpeculativeStats(
+        JNIEnv *env,
+        jobject /*thiz*/,
+        jboolean jReset
+) {
+    jlong values[2];
+    if (jReset == JNI_TRUE) {
+        values[0] = (jlong) g_spec_drafted_tokens.exchange(0, std::memory_order_relaxed);
+        values[1] = (jlong) g_spec_accepted_tokens.exchange(0, std::memory_order_relaxed);
+    } else {
+        values[0] = (jlong) g_spec_drafted_tokens.load(std::memory_order_relaxed);
+        values[1] = (jlong) g_spec_accepted_tokens.load(std::memory_order_relaxed);
+    }
+    jlongArray result = env->NewLongArray(2);
+    if (result) {
+        env->SetLongArrayRegion(result, 0, 2, values);
+    }
+    return result;
+}
+
+// ------- JNI: 「後半の変換結果」を返す（v1 型） -------
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_generate(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jPrompt,
+        jint maxTokens
+) {
+    const char *c_prompt = env->GetStringUTFChars(jPrompt, nullptr);
+    std::string prompt(c_prompt ? c_prompt : "");
+    env->ReleaseStringUTFChars(jPrompt, c_prompt);
+
+    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::string result = pure_greedy_decoding(prompt, /*maxCount=*/maxTokens, request_seq);
+
+    // ★ NewStringUTFは禁止（不正UTF-8の可能性）
+    return toJString(env, result);
+}
+
+// ------- JNI: 文脈 + 読み で変換 -------
+
+static jstring generate_with_context_and_conditions(
+        JNIEnv *env,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jint maxTokens
+) {
+    std::string profile = jstring_to_string(env, jProfile);
+    std::string topic = jstring_to_string(env, jTopic);
+    std::string style = jstring_to_string(env, jStyle);
+    std::string preference = jstring_to_string(env, jPreference);
+    std::string left = jstring_to_string(env, jLeftContext);
+    std::string right = jstring_to_string(env, jRightContext);
+    std::string input = jstring_to_string(env, jInput);
+
+    std::string prompt = build_zenz_prompt(
+            profile,
+            topic,
+            style,
+            preference,
+            left,
+            right,
+            input
+    );
+
+    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    const bool constrained = g_reading_constrained_decoding_enabled.load(std::memory_order_relaxed);
+    std::string result = pure_greedy_decoding(
+            prompt, /*maxCount=*/maxTokens, request_seq, constrained ? input : std::string());
+    return toJString(env, result);
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_generateWithContext(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jLeftContext,
+        jstring jInput,
+        jint maxTokens
+) {
+    return generate_with_context_and_conditions(
+            env,
+            nullptr,
+            nullptr,
+            nullptr,
+            nullptr,
+            jLeftContext,
+            nullptr,
+            jInput,
+            maxTokens
+    );
+}
+
+// ------- JNI: 条件 + 文脈 + 読み で変換 -------
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditions(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jInput,
+        jint maxTokens
+) {
+    return generate_with_context_and_conditions(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            nullptr,
+            jInput,
+            maxTokens
+    );
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditionsV32(
         JNIEnv *env,
         jobject /* thiz */,
-        jstring jPrompt,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
         jint maxTokens
 ) {
-    const char *c_prompt = env->GetStringUTFChars(jPrompt, nullptr);
-    std::string prompt(c_prompt ? c_prompt : "");
-    env->ReleaseStringUTFChars(jPrompt, c_prompt);
+    return generate_with_context_and_conditions(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            jRightContext,
+            jInput,
+            maxTokens
+    );
+}
+
+// ------- JNI: n-best ビームサーチ -------
+
+// ビームサーチで変換し、スコア (対数確率の和) の高い順に最大 jScores の長さ個の文字列を返す。
+// 各文字列のスコアは jScores の先頭から順に書き込む。同じ文字列になる仮説は最良のものだけを返す。
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_generateNBestV32(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jint maxTokens,
+        jint beamWidth,
+        jfloatArray jScores
+) {
+    const jsize n_best = jScores ? env->GetArrayLength(jScores) : 0;
+    std::string prompt = build_zenz_prompt(
+            jstring_to_string(env, jProfile),
+            jstring_to_string(env, jTopic),
+            jstring_to_string(env, jStyle),
+            jstring_to_string(env, jPreference),
+            jstring_to_string(env, jLeftContext),
+            jstring_to_string(env, jRightContext),
+            jstring_to_string(env, jInput)
+    );
 
     uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
-    std::string result = pure_greedy_decoding(prompt, /*maxCount=*/maxTokens, request_seq);
+    const auto hypotheses = beam_search_n_best(prompt, maxTokens, beamWidth, (int) n_best, request_seq);
 
-    // ★ NewStringUTFは禁止（不正UTF-8の可能性）
-    return toJString(env, result);
+    std::vector<std::string> texts;
+    std::vector<jfloat> scores;
+    for (const auto &hyp: hypotheses) {
+        if ((jsize) texts.size() >= n_best) {
+            break;
+        }
+        std::string text = tokens_to_text(hyp.tokens);
+        if (std::find(texts.begin(), texts.end(), text) != texts.end()) {
+            continue;
+        }
+        texts.push_back(std::move(text));
+        scores.push_back(hyp.score);
+    }
+
+    jclass string_class = env->FindClass("java/lang/String");
+    if (!string_class) {
+        return nullptr;
+    }
+    jobjectArray result_array = env->NewObjectArray((jsize) texts.size(), string_class, nullptr);
+    env->DeleteLocalRef(string_class);
+    if (!result_array) {
+        return nullptr;
+    }
+    for (size_t i = 0; i < texts.size(); ++i) {
+        jstring value = toJString(env, texts[i]);
+        env->SetObjectArrayElement(result_array, (jsize) i, value);
+        env->DeleteLocalRef(value);
+    }
+    if (!scores.empty()) {
+        env->SetFloatArrayRegion(jScores, 0, (jsize) scores.size(), scores.data());
+    }
+    return result_array;
 }
 
-// ------- JNI: 文脈 + 読み で変換 -------
+// ------- JNI: 投機的デコーディングによる候補評価 -------
 
-static jstring generate_with_context_and_conditions(
+// CandidateEvaluationResult を Kotlin 側の CandidateEvaluationResult.parse が読む形式にする。
+static std::string candidate_result_to_string(const CandidateEvaluationResult &eval_result) {
+    switch (eval_result.type) {
+        case CandidateEvaluationResultType::PASS:
+            return "PASS:" + std::to_string(eval_result.score);
+        case CandidateEvaluationResultType::FIX_REQUIRED:
+            return "FIX:" + eval_result.prefix;          // ここも不正UTF-8が混ざり得るので toJString 必須
+        case CandidateEvaluationResultType::WHOLE_RESULT:
+            return "WHOLE:" + eval_result.whole_result;  // 同上
+        case CandidateEvaluationResultType::FIX_COMPLETED:
+            // 接頭辞と修正後の出力全体を U+001F (Unit Separator) で区切る。
+            return "COMPLETE:" + eval_result.prefix + "\x1F" + eval_result.whole_result;
+        case CandidateEvaluationResultType::ERROR:
+        default:
+            return "ERROR";
+    }
+}
+
+static jstring candidate_evaluate_with_context(
         JNIEnv *env,
         jstring jProfile,
         jstring jTopic,
@@ -931,8 +5591,239 @@ static jstring generate_with_context_and_conditions(
         jstring jLeftContext,
         jstring jRightContext,
         jstring jInput,
-        jint maxTokens
+        jstring jCandidate,
+        jint jCompleteMaxTokens
+) {
+    std::string profile = jstring_to_string(env, jProfile);
+    std::string topic = jstring_to_string(env, jTopic);
+    std::string style = jstring_to_string(env, jStyle);
+    std::string preference = jstring_to_string(env, jPreference);
+    std::string left = jstring_to_string(env, jLeftContext);
+    std::string right = jstring_to_string(env, jRightContext);
+    std::string input = jstring_to_string(env, jInput);
+    std::string candidate = jstring_to_string(env, jCandidate);
+
+    if (candidate.empty()) {
+        return toJString(env, "ERROR");
+    }
+
+    std::string prompt = build_zenz_prompt(
+            profile,
+            topic,
+            style,
+            preference,
+            left,
+            right,
+            input
+    );
+
+    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    CandidateEvaluationResult eval_result = candidate_evaluate(prompt, candidate, jCompleteMaxTokens, request_seq);
+
+    return toJString(env, candidate_result_to_string(eval_result));
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluate(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jInput,
+        jstring jCandidate
+) {
+    return candidate_evaluate_with_context(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            nullptr,
+            jInput,
+            jCandidate,
+            /*jCompleteMaxTokens=*/0
+    );
+}
+
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluateV32(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jstring jCandidate
+) {
+    return candidate_evaluate_with_context(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            jRightContext,
+            jInput,
+            jCandidate,
+            /*jCompleteMaxTokens=*/0
+    );
+}
+
+// FIX_REQUIRED の場合に同じ呼び出しの中で生成を続ける版。
+// candidateEvaluateV32 の戻り値に加え、"COMPLETE:<prefix>\u001F<result>" を返し得る。
+extern "C"
+JNIEXPORT jstring JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluateAndCompleteV32(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jstring jCandidate,
+        jint jMaxTokens
+) {
+    return candidate_evaluate_with_context(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            jRightContext,
+            jInput,
+            jCandidate,
+            jMaxTokens > 0 ? jMaxTokens : 1
+    );
+}
+
+// 複数のドラフトをまとめて検証する版。戻り値は jCandidates と同じ並びで、各要素は
+// 1 件ずつ検証するドラフトがすべて短縮した語彙に入るか。入らなければどのドラフトも全語彙の出力層で採点する。
+static bool drafts_fit_shortlist(const std::vector<std::string> &drafts) {
+    std::lock_guard<std::mutex> lock(g_session.mutex);
+    if (!g_vocab || !ensure_shortlist_head_locked()) {
+        return false;
+    }
+    std::vector<std::vector<llama_token>> draft_tokens_list;
+    for (const auto &draft: drafts) {
+        draft_tokens_list.push_back(tokenize_text(preprocess_text(draft), /*add_bos=*/false, /*add_eos=*/false));
+    }
+    return shortlist_head_for_candidates_locked(unique_candidate_token_lists(draft_tokens_list)) != nullptr;
+}
+
+// candidateEvaluateAndCompleteV32 と同じ形式 (COMPLETE は PASS がない場合に最長受理の 1 件だけ)。
+extern "C"
+JNIEXPORT jobjectArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluateDraftsV32(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jobjectArray jCandidates,
+        jint jMaxTokens
+) {
+    const jsize candidate_count = jCandidates ? env->GetArrayLength(jCandidates) : 0;
+    jclass string_class = env->FindClass("java/lang/String");
+    if (!string_class) {
+        return nullptr;
+    }
+    jobjectArray result_array = env->NewObjectArray(candidate_count, string_class, nullptr);
+    env->DeleteLocalRef(string_class);
+    if (!result_array || candidate_count <= 0) {
+        return result_array;
+    }
+
+    std::vector<std::string> drafts((size_t) candidate_count);
+    for (jsize i = 0; i < candidate_count; ++i) {
+        auto *j_candidate = (jstring) env->GetObjectArrayElement(jCandidates, i);
+        if (!j_candidate) {
+            continue;
+        }
+        drafts[(size_t) i] = jstring_to_string(env, j_candidate);
+        env->DeleteLocalRef(j_candidate);
+    }
+
+    std::string prompt = build_zenz_prompt(
+            jstring_to_string(env, jProfile),
+            jstring_to_string(env, jTopic),
+            jstring_to_string(env, jStyle),
+            jstring_to_string(env, jPreference),
+            jstring_to_string(env, jLeftContext),
+            jstring_to_string(env, jRightContext),
+            jstring_to_string(env, jInput)
+    );
+
+    const int complete_max_tokens = jMaxTokens > 0 ? jMaxTokens : 0;
+    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    bool has_batched_result = false;
+    std::vector<CandidateEvaluationResult> results;
+    if (g_batched_scoring_enabled.load(std::memory_order_relaxed)) {
+        results = candidate_evaluate_drafts(prompt, drafts, complete_max_tokens, request_seq, has_batched_result);
+    }
+    if (!has_batched_result) {
+        // バッチ検証が使えない場合は 1 件ずつ検証する (生成の継続は先頭のドラフトだけ)。
+        results.clear();
+        const bool shortlist_allowed = drafts_fit_shortlist(drafts);
+        for (size_t i = 0; i < drafts.size(); ++i) {
+            CandidateEvaluationResult result;
+            result.type = CandidateEvaluationResultType::ERROR;
+            result.score = 0.0f;
+            if (!drafts[i].empty() && !is_request_stale(request_seq)) {
+                result = candidate_evaluate(prompt, drafts[i], i == 0 ? complete_max_tokens : 0, request_seq,
+                                            shortlist_allowed);
+            }
+            results.push_back(result);
+        }
+    }
+
+    for (jsize i = 0; i < candidate_count; ++i) {
+        jstring value = toJString(env, candidate_result_to_string(results[(size_t) i]));
+        env->SetObjectArrayElement(result_array, i, value);
+        env->DeleteLocalRef(value);
+    }
+    return result_array;
+}
+
+static jfloatArray score_candidates_with_context(
+        JNIEnv *env,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jobjectArray jCandidates,
+        jint jTopK
 ) {
+    const jsize candidate_count = jCandidates ? env->GetArrayLength(jCandidates) : 0;
+    jfloatArray result_array = env->NewFloatArray(candidate_count);
+    if (!result_array) {
+        return nullptr;
+    }
+
+    std::vector<jfloat> scores((size_t) candidate_count, -INFINITY);
+    if (candidate_count <= 0) {
+        return result_array;
+    }
+
     std::string profile = jstring_to_string(env, jProfile);
     std::string topic = jstring_to_string(env, jTopic);
     std::string style = jstring_to_string(env, jStyle);
@@ -951,38 +5842,165 @@ static jstring generate_with_context_and_conditions(
             input
     );
 
+    const std::string pre_prompt = preprocess_text(prompt);
     uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
-    std::string result = pure_greedy_decoding(prompt, /*maxCount=*/maxTokens, request_seq);
-    return toJString(env, result);
-}
 
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_generateWithContext(
-        JNIEnv *env,
-        jobject /* thiz */,
-        jstring jLeftContext,
-        jstring jInput,
-        jint maxTokens
-) {
-    return generate_with_context_and_conditions(
-            env,
-            nullptr,
-            nullptr,
-            nullptr,
-            nullptr,
-            jLeftContext,
-            nullptr,
-            jInput,
-            maxTokens
-    );
-}
+    std::vector<std::string> candidate_strings((size_t) candidate_count);
+    for (jsize i = 0; i < candidate_count; ++i) {
+        auto *j_candidate = (jstring) env->GetObjectArrayElement(jCandidates, i);
+        if (!j_candidate) {
+            continue;
+        }
+        candidate_strings[(size_t) i] = jstring_to_string(env, j_candidate);
+        env->DeleteLocalRef(j_candidate);
+    }
 
-// ------- JNI: 条件 + 文脈 + 読み で変換 -------
+    {
+        std::unique_lock<std::mutex> session_lock(g_session.mutex);
+        if (!g_model || !g_vocab) {
+            LOGE("scoreCandidates: model not initialized");
+            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
+            return result_array;
+        }
+
+        llama_context *ctx = ensure_session_context_locked();
+        if (!ctx) {
+            LOGE("scoreCandidates: failed to create context");
+            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
+            return result_array;
+        }
+
+        AbortRequestState abort_state{request_seq};
+        llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+
+        auto prompt_tokens = tokenize_text(pre_prompt, /*add_bos=*/false, /*add_eos=*/false);
+        if (prompt_tokens.empty()) {
+            llama_set_abort_callback(ctx, never_abort, nullptr);
+            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
+            return result_array;
+        }
+
+        if (!prefill_prompt_prefix_locked(ctx, prompt_tokens, request_seq)) {
+            if (is_request_stale(request_seq)) {
+                record_aborted_request_locked("scoreCandidates", prompt_tokens, 0);
+                if (g_soft_cancel_enabled.load(std::memory_order_relaxed)) {
+                    std::fill(scores.begin(), scores.end(), NAN);
+                }
+            } else {
+                LOGE("scoreCandidates: failed to prefill prompt prefix");
+            }
+            llama_set_abort_callback(ctx, never_abort, nullptr);
+            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
+            return result_array;
+        }
+
+        std::vector<std::vector<llama_token>> candidate_tokens_list((size_t) candidate_count);
+        for (jsize i = 0; i < candidate_count; ++i) {
+            if (candidate_strings[(size_t) i].empty()) {
+                continue;
+            }
+            candidate_tokens_list[(size_t) i] = tokenize_text(
+                    preprocess_text(candidate_strings[(size_t) i]),
+                    /*add_bos=*/false,
+                    /*add_eos=*/false
+            );
+        }
+        record_workload_request_locked(prompt_tokens.size(), longest_token_list(candidate_tokens_list));
+
+        // 締め切りのあるリクエストでは、並び順に候補を足していき、1 回の採点のデコードが間に合う分だけを
+        // 採点する (先頭の候補は必ず採点する)。採点しなかった候補には NaN を返す。
+        std::vector<bool> unscored((size_t) candidate_count, false);
+        if (t_request_deadline) {
+            size_t n_batch_tokens = 1;  // 候補の 1 トークン目を予測するプロンプトの最後のトークン
+            bool fits = true;
+            for (jsize i = 0; i < candidate_count; ++i) {
+                auto &tokens = candidate_tokens_list[(size_t) i];
+                if (tokens.empty()) {
+                    continue;
+                }
+                fits = fits && (n_batch_tokens == 1 || deadline_allows_decode_locked(n_batch_tokens + tokens.size()));
+                if (fits) {
+                    n_batch_tokens += tokens.size();
+                } else {
+                    unscored[(size_t) i] = true;
+                    tokens.clear();
+                }
+            }
+        }
+
+        // top_k > 0 なら上位 top_k 件だけを分枝限定で求め、失敗したら全候補の採点に戻る。
+        const bool ranked = jTopK > 0 &&
+                            rank_candidates_branch_and_bound_locked(
+                                    ctx,
+                                    prompt_tokens,
+                                    candidate_tokens_list,
+                                    jTopK,
+                                    scores,
+                                    request_seq
+                            );
+        if (!ranked && jTopK > 0) {
+            truncate_session_kv_locked(ctx, prompt_tokens.size() - 1);
+        }
+
+        const bool batched = ranked ||
+                             (g_batched_scoring_enabled.load(std::memory_order_relaxed) &&
+                              score_candidates_token_trie_locked(
+                                      ctx,
+                                      prompt_tokens,
+                                      candidate_tokens_list,
+                                      scores,
+                                      request_seq
+                              ));
+
+        jsize n_finished = candidate_count;  // 割り込まれる前に採点し終えた候補の数
+        const OutputHead *head = batched ? nullptr
+                                         : shortlist_head_for_candidates_locked(
+                                                 unique_candidate_token_lists(candidate_tokens_list));
+        for (jsize i = 0; i < candidate_count && !batched; ++i) {
+            if (is_request_stale(request_seq)) {
+                n_finished = i;
+                break;
+            }
+            if (candidate_tokens_list[(size_t) i].empty()) {
+                scores[(size_t) i] = -INFINITY;
+                continue;
+            }
+
+            const float score = score_candidate_avg_logprob_reuse_prompt_locked(
+                    ctx,
+                    prompt_tokens,
+                    candidate_tokens_list[(size_t) i],
+                    head,
+                    request_seq
+            );
+            if (is_request_stale(request_seq)) {
+                n_finished = i;
+                break;
+            }
+            scores[(size_t) i] = score;
+        }
+        if (n_finished < candidate_count) {
+            // ソフトキャンセルなら採点し終えた候補の点数を返し、残りは NaN にする。
+            record_aborted_request_locked("scoreCandidates", prompt_tokens, 0);
+            if (g_soft_cancel_enabled.load(std::memory_order_relaxed)) {
+                std::fill(scores.begin() + n_finished, scores.end(), NAN);
+            }
+        }
+        for (jsize i = 0; i < candidate_count; ++i) {
+            if (unscored[(size_t) i]) {
+                scores[(size_t) i] = NAN;
+            }
+        }
+        llama_set_abort_callback(ctx, never_abort, nullptr);
+    }
+
+    env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
+    return result_array;
+}
 
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditions(
+JNIEXPORT jfloatArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_scoreCandidates(
         JNIEnv *env,
         jobject /* thiz */,
         jstring jProfile,
@@ -991,9 +6009,9 @@ Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditions(
         jstring jPreference,
         jstring jLeftContext,
         jstring jInput,
-        jint maxTokens
+        jobjectArray jCandidates
 ) {
-    return generate_with_context_and_conditions(
+    return score_candidates_with_context(
             env,
             jProfile,
             jTopic,
@@ -1002,13 +6020,14 @@ Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditions(
             jLeftContext,
             nullptr,
             jInput,
-            maxTokens
+            jCandidates,
+            /*jTopK=*/0
     );
 }
 
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditionsV32(
+JNIEXPORT jfloatArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_scoreCandidatesV32(
         JNIEnv *env,
         jobject /* thiz */,
         jstring jProfile,
@@ -1018,9 +6037,9 @@ Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditionsV32(
         jstring jLeftContext,
         jstring jRightContext,
         jstring jInput,
-        jint maxTokens
+        jobjectArray jCandidates
 ) {
-    return generate_with_context_and_conditions(
+    return score_candidates_with_context(
             env,
             jProfile,
             jTopic,
@@ -1029,72 +6048,42 @@ Java_com_kazumaproject_zenz_ZenzEngine_generateWithContextAndConditionsV32(
             jLeftContext,
             jRightContext,
             jInput,
-            maxTokens
+            jCandidates,
+            /*jTopK=*/0
     );
 }
 
-// ------- JNI: 投機的デコーディングによる候補評価 -------
-
-static jstring candidate_evaluate_with_context(
+extern "C"
+JNIEXPORT jfloatArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_rankCandidates(
         JNIEnv *env,
+        jobject /* thiz */,
         jstring jProfile,
         jstring jTopic,
         jstring jStyle,
         jstring jPreference,
         jstring jLeftContext,
-        jstring jRightContext,
         jstring jInput,
-        jstring jCandidate
+        jobjectArray jCandidates,
+        jint jTopK
 ) {
-    std::string profile = jstring_to_string(env, jProfile);
-    std::string topic = jstring_to_string(env, jTopic);
-    std::string style = jstring_to_string(env, jStyle);
-    std::string preference = jstring_to_string(env, jPreference);
-    std::string left = jstring_to_string(env, jLeftContext);
-    std::string right = jstring_to_string(env, jRightContext);
-    std::string input = jstring_to_string(env, jInput);
-    std::string candidate = jstring_to_string(env, jCandidate);
-
-    if (candidate.empty()) {
-        return toJString(env, "ERROR");
-    }
-
-    std::string prompt = build_zenz_prompt(
-            profile,
-            topic,
-            style,
-            preference,
-            left,
-            right,
-            input
+    return score_candidates_with_context(
+            env,
+            jProfile,
+            jTopic,
+            jStyle,
+            jPreference,
+            jLeftContext,
+            nullptr,
+            jInput,
+            jCandidates,
+            jTopK > 0 ? jTopK : 1
     );
-
-    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
-    CandidateEvaluationResult eval_result = candidate_evaluate(prompt, candidate, request_seq);
-
-    std::string result_str;
-    switch (eval_result.type) {
-        case CandidateEvaluationResultType::PASS:
-            result_str = "PASS:" + std::to_string(eval_result.score);
-            break;
-        case CandidateEvaluationResultType::FIX_REQUIRED:
-            result_str = "FIX:" + eval_result.prefix;          // ここも不正UTF-8が混ざり得るので toJString 必須
-            break;
-        case CandidateEvaluationResultType::WHOLE_RESULT:
-            result_str = "WHOLE:" + eval_result.whole_result;  // 同上
-            break;
-        case CandidateEvaluationResultType::ERROR:
-        default:
-            result_str = "ERROR";
-            break;
-    }
-
-    return toJString(env, result_str);
 }
 
 extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluate(
+JNIEXPORT jfloatArray JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_rankCandidatesV32(
         JNIEnv *env,
         jobject /* thiz */,
         jstring jProfile,
@@ -1102,200 +6091,835 @@ Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluate(
         jstring jStyle,
         jstring jPreference,
         jstring jLeftContext,
+        jstring jRightContext,
         jstring jInput,
-        jstring jCandidate
+        jobjectArray jCandidates,
+        jint jTopK
 ) {
-    return candidate_evaluate_with_context(
+    return score_candidates_with_context(
             env,
             jProfile,
             jTopic,
             jStyle,
             jPreference,
             jLeftContext,
-            nullptr,
+            jRightContext,
             jInput,
-            jCandidate
+            jCandidates,
+            jTopK > 0 ? jTopK : 1
     );
 }
 
-extern "C"
-JNIEXPORT jstring JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_candidateEvaluateV32(
+// ------- JNI: ネイティブのリクエストスケジューラ -------
+// Binder のアクターで同期的に待つ代わりに、submit* はすぐに戻り、結果はワーカースレッドから
+// callback.onResult(requestId, result, truncated) で返る。新しいリクエストに置き換えられたり cancelCurrent で
+// 取り消されたりしたリクエストには callback.onSuperseded(requestId) を呼ぶ。
+
+static jobject run_scheduled_kind(JNIEnv *env, const ScheduledRequest &request) {
+    const auto arg = [&request](size_t i) { return (jstring) request.args[i]; };
+    switch (request.kind) {
+        case ScheduledKind::Generate:
+            return generate_with_context_and_conditions(
+                    env, arg(0), arg(1), arg(2), arg(3), arg(4), arg(5), arg(6), request.int_arg);
+        case ScheduledKind::Evaluate:
+            return candidate_evaluate_with_context(
+                    env, arg(0), arg(1), arg(2), arg(3), arg(4), arg(5), arg(6), arg(7),
+                    /*jCompleteMaxTokens=*/0);
+        case ScheduledKind::Score:
+            return score_candidates_with_context(
+                    env, arg(0), arg(1), arg(2), arg(3), arg(4), arg(5), arg(6), (jobjectArray) request.args[7],
+                    /*jTopK=*/0);
+    }
+    return nullptr;
+}
+
+// 締め切りがあれば t_request_deadline に設定して実行し、打ち切ったかを truncated に返す。
+static jobject run_scheduled_request(JNIEnv *env, const ScheduledRequest &request, bool &truncated) {
+    RequestDeadline deadline{request.submitted_at + std::chrono::milliseconds(request.deadline_ms)};
+    t_request_deadline = request.deadline_ms > 0 ? &deadline : nullptr;
+    jobject result = run_scheduled_kind(env, request);
+    t_request_deadline = nullptr;
+    truncated = deadline.truncated;
+    if (truncated) {
+        LOGI("scheduler: request %lld truncated at its %d ms deadline",
+             (long long) request.request_id, (int) request.deadline_ms);
+    }
+    return result;
+}
+
+// ------- 連続バッチング -------
+// IME は 1 打鍵の間に変換 (生成) と候補の検証・採点を並べて投げるが、1 件ずつ実行すると採点は生成が
+// 終わるまで待たされる。連続バッチングが有効なら、種類の違うリクエストを同じ llama_context で同時に進める。
+// 各リクエストは seq 0 (プロンプト接頭辞の KV) から llama_kv_cache_seq_cp でフォークした自分の seq を持ち、
+// llama_decode 1 回のバッチに、プレフィル中のプロンプトのチャンクと、実行中のリクエストすべての次の
+// トークン (生成の 1 ステップ、検証する候補、採点する候補) を並べる。プロンプトが同じリクエスト同士は
+// 接頭辞の KV を 1 回分しかデコードしない。
+// 行からの選び方は 1 件ずつの経路と同じ (貪欲生成の argmax と読みの制約、candidate_evaluate の基準、
+// 平均対数確率) だが、ドラフト・短縮した出力層・出力層のグラフ内計算は使わず、全語彙の logits から求める。
+// デコードに失敗したとき (KV の空きが足りないなど) は、残りのリクエストを 1 件ずつの経路で実行し直す。
+
+// 採点の候補 1 件に割り当てた seq と、バッチの中で候補の 1 トークン目を入力した行。
+struct BatchedLane {
+    size_t candidate;
+    llama_seq_id seq;
+    int32_t first_row;
+};
+
+struct BatchedRequest {
+    enum class Stage {
+        Prefill,  // プロンプト接頭辞を seq 0 に載せている (または順番待ち)
+        Ready,    // seq 0 がプロンプト接頭辞と一致していて、フォークを待っている
+        Running,  // 自分の seq にフォークした
+    };
+
+    ScheduledRequest *request;  // コールバックに渡し終えたら null
+    uint64_t generation;        // 受け付けた時点の種類ごとの世代
+    Stage stage = Stage::Prefill;
+    bool prefill_started = false;
+    size_t prefill_from = 0;  // プレフィルを始めたときに seq 0 に残っていたトークン数
+    std::vector<llama_token> prompt;
+    llama_seq_id seq = -1;    // 生成・検証はこの seq にデコードし、採点は候補の seq をここからフォークする
+    size_t n_decoded = 0;     // seq にプロンプト接頭辞より後ろをデコードしたトークン数
+    int32_t row = -1;         // 今回のバッチで seq に入れた最初のトークンの行 (入れていなければ -1)
+    RequestDeadline deadline{};
+    bool has_deadline = false;
+    // 生成
+    int max_count = 0;
+    std::string reading;  // 読みの制約が有効なら入力の読み
+    std::unique_ptr<ReadingConstraint> constraint;
+    std::vector<llama_token> generated;
+    // 検証 (candidates[0]) と採点
+    std::vector<std::vector<llama_token>> candidates;
+    std::string evaluation = "ERROR";
+    std::vector<float> first_logits;  // 採点: プロンプト最後のトークンの行
+    float first_log_norm = NAN;
+    std::vector<float> scores;        // 採点: まだ採点していない候補は NaN
+    size_t next_candidate = 0;
+    std::vector<BatchedLane> lanes;
+};
+
+// 連続バッチング用の郵便受けにリクエストが届いているか。
+static bool batched_requests_pending() {
+    for (const auto &mailbox: g_scheduler.kind_mailboxes) {
+        if (mailbox.load(std::memory_order_acquire) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// リクエストの引数からプロンプトと候補をトークン化する。
+static std::unique_ptr<BatchedRequest> make_batched_request_locked(
         JNIEnv *env,
-        jobject /* thiz */,
-        jstring jProfile,
-        jstring jTopic,
-        jstring jStyle,
-        jstring jPreference,
-        jstring jLeftContext,
-        jstring jRightContext,
-        jstring jInput,
-        jstring jCandidate
+        ScheduledRequest *request,
+        uint64_t generation
+) {
+    auto batched = std::make_unique<BatchedRequest>();
+    batched->request = request;
+    batched->generation = generation;
+    batched->deadline.at = request->submitted_at + std::chrono::milliseconds(request->deadline_ms);
+    batched->has_deadline = request->deadline_ms > 0;
+
+    const auto arg = [env, request](size_t i) { return jstring_to_string(env, (jstring) request->args[i]); };
+    const std::string input = arg(6);
+    const std::string prompt = build_zenz_prompt(arg(0), arg(1), arg(2), arg(3), arg(4), arg(5), input);
+    batched->prompt = tokenize_text(preprocess_text(prompt), /*add_bos=*/false, /*add_eos=*/false);
+
+    switch (request->kind) {
+        case ScheduledKind::Generate:
+            batched->max_count = request->int_arg;
+            if (g_reading_constrained_decoding_enabled.load(std::memory_order_relaxed)) {
+                batched->reading = input;
+                auto constraint = std::make_unique<ReadingConstraint>(preprocess_text(input));
+                if (constraint->active()) {
+                    batched->constraint = std::move(constraint);
+                }
+            }
+            break;
+        case ScheduledKind::Evaluate: {
+            const std::string candidate = arg(7);
+            if (!candidate.empty()) {
+                batched->candidates.push_back(
+                        tokenize_text(preprocess_text(candidate), /*add_bos=*/false, /*add_eos=*/false));
+            }
+            break;
+        }
+        case ScheduledKind::Score: {
+            auto *array = (jobjectArray) request->args[7];
+            const jsize count = array ? env->GetArrayLength(array) : 0;
+            batched->candidates.resize((size_t) count);
+            batched->scores.assign((size_t) count, NAN);
+            for (jsize i = 0; i < count; ++i) {
+                auto *value = (jstring) env->GetObjectArrayElement(array, i);
+                const std::string candidate = jstring_to_string(env, value);
+                if (value) {
+                    env->DeleteLocalRef(value);
+                }
+                if (!candidate.empty()) {
+                    batched->candidates[(size_t) i] = tokenize_text(
+                            preprocess_text(candidate), /*add_bos=*/false, /*add_eos=*/false);
+                }
+                if (batched->candidates[(size_t) i].empty()) {
+                    batched->scores[(size_t) i] = -INFINITY;
+                }
+            }
+            break;
+        }
+    }
+    if (!batched->prompt.empty()) {
+        record_workload_request_locked(batched->prompt.size(),
+                                       request->kind == ScheduledKind::Generate
+                                       ? (size_t) std::max(batched->max_count, 0)
+                                       : longest_token_list(batched->candidates));
+    }
+    return batched;
+}
+
+// デコードせずに結果が決まるリクエスト (空のプロンプトや候補) なら true。
+static bool batched_request_trivial(BatchedRequest &batched) {
+    if (batched.prompt.empty()) {
+        std::fill(batched.scores.begin(), batched.scores.end(), -INFINITY);
+        return true;
+    }
+    switch (batched.request->kind) {
+        case ScheduledKind::Generate:
+            return batched.max_count <= 0;
+        case ScheduledKind::Evaluate:
+            return batched.candidates.empty();
+        case ScheduledKind::Score:
+            return std::all_of(batched.candidates.begin(), batched.candidates.end(),
+                               [](const std::vector<llama_token> &tokens) { return tokens.empty(); });
+    }
+    return true;
+}
+
+// 締め切りまでに n_tokens 個を 1 回でデコードできるか。間に合わなければ打ち切りとして記録する。
+static bool batched_deadline_allows_locked(BatchedRequest &batched, size_t n_tokens) {
+    if (!batched.has_deadline) {
+        return true;
+    }
+    t_request_deadline = &batched.deadline;
+    const bool allowed = deadline_allows_decode_locked(n_tokens);
+    t_request_deadline = nullptr;
+    return allowed;
+}
+
+static void release_batched_seqs_locked(
+        llama_context *ctx,
+        BatchedRequest &batched,
+        std::vector<llama_seq_id> &free_seqs
 ) {
-    return candidate_evaluate_with_context(
-            env,
-            jProfile,
-            jTopic,
-            jStyle,
-            jPreference,
-            jLeftContext,
-            jRightContext,
-            jInput,
-            jCandidate
-    );
+    for (const auto &lane: batched.lanes) {
+        llama_kv_cache_seq_rm(ctx, lane.seq, -1, -1);
+        free_seqs.push_back(lane.seq);
+    }
+    batched.lanes.clear();
+    if (batched.seq >= 0) {
+        llama_kv_cache_seq_rm(ctx, batched.seq, -1, -1);
+        free_seqs.push_back(batched.seq);
+        batched.seq = -1;
+        g_session.kv_fragmented = true;
+    }
 }
 
-static jfloatArray score_candidates_with_context(
+// seq を空けて結果をコールバックに渡す。割り込まれたリクエストはソフトキャンセルなら途中結果を渡す。
+static void finish_batched_request_locked(
         JNIEnv *env,
-        jstring jProfile,
-        jstring jTopic,
-        jstring jStyle,
-        jstring jPreference,
-        jstring jLeftContext,
-        jstring jRightContext,
-        jstring jInput,
-        jobjectArray jCandidates
+        llama_context *ctx,
+        BatchedRequest &batched,
+        bool superseded,
+        std::vector<llama_seq_id> &free_seqs
 ) {
-    const jsize candidate_count = jCandidates ? env->GetArrayLength(jCandidates) : 0;
-    jfloatArray result_array = env->NewFloatArray(candidate_count);
-    if (!result_array) {
-        return nullptr;
+    release_batched_seqs_locked(ctx, batched, free_seqs);
+    const bool soft_cancel = g_soft_cancel_enabled.load(std::memory_order_relaxed);
+    jobject result = nullptr;
+    switch (batched.request->kind) {
+        case ScheduledKind::Generate:
+            if (superseded) {
+                const std::string partial = abort_generation_locked(
+                        batched.prompt, batched.prompt.size(), batched.reading, batched.generated);
+                result = soft_cancel ? toJString(env, partial) : nullptr;
+            } else {
+                g_session.last_output_tokens = batched.generated;
+                result = toJString(env, tokens_to_text(batched.generated));
+            }
+            break;
+        case ScheduledKind::Evaluate:
+            if (superseded) {
+                record_aborted_request_locked("candidate_evaluate", batched.prompt, 0);
+            } else {
+                result = toJString(env, batched.evaluation);
+            }
+            break;
+        case ScheduledKind::Score:
+            if (superseded) {
+                record_aborted_request_locked("scoreCandidates", batched.prompt, 0);
+            }
+            if (!superseded || soft_cancel) {
+                jfloatArray scores = env->NewFloatArray((jsize) batched.scores.size());
+                if (scores && !batched.scores.empty()) {
+                    env->SetFloatArrayRegion(scores, 0, (jsize) batched.scores.size(), batched.scores.data());
+                }
+                result = scores;
+            }
+            break;
     }
+    if (batched.deadline.truncated) {
+        LOGI("continuous batching: request %lld truncated at its %d ms deadline",
+             (long long) batched.request->request_id, (int) batched.request->deadline_ms);
+    }
+    finish_scheduled_request(env, batched.request, result, superseded, batched.deadline.truncated);
+    if (result) {
+        env->DeleteLocalRef(result);
+    }
+    batched.request = nullptr;
+}
 
-    std::vector<jfloat> scores((size_t) candidate_count, -INFINITY);
-    if (candidate_count <= 0) {
-        return result_array;
+// 実行中のリクエストの次のトークンをバッチに足す。バッチに収まらなければ今回は足さない。
+// 足せないまま終わることが決まったリクエストは true を返す。
+static bool add_batched_request_tokens_locked(
+        llama_context *ctx,
+        BatchedRequest &batched,
+        llama_batch &batch,
+        size_t n_batch,
+        std::vector<llama_seq_id> &free_seqs
+) {
+    const auto tail_pos = (llama_pos) (batched.prompt.size() - 1);
+    const auto room = (size_t) (n_batch - (size_t) batch.n_tokens);
+    switch (batched.request->kind) {
+        case ScheduledKind::Generate: {
+            if (room < 1) {
+                return false;
+            }
+            const llama_token token = batched.n_decoded == 0 ? batched.prompt.back()
+                                                             : batched.generated[batched.n_decoded - 1];
+            batched.row = batch.n_tokens;
+            batch_add_token(batch, token, tail_pos + (llama_pos) batched.n_decoded, batched.seq, true);
+            return false;
+        }
+        case ScheduledKind::Evaluate: {
+            // プロンプト最後のトークンと、候補の最後以外のトークン。行 i が候補の i 番目を予測する。
+            const auto &tokens = batched.candidates[0];
+            const size_t n_tokens = std::max<size_t>(tokens.size(), 1);
+            if (n_tokens > n_batch) {
+                return true;
+            }
+            if (n_tokens > room) {
+                return false;
+            }
+            batched.row = batch.n_tokens;
+            batch_add_token(batch, batched.prompt.back(), tail_pos, batched.seq, true);
+            for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+                batch_add_token(batch, tokens[i], tail_pos + 1 + (llama_pos) i, batched.seq, true);
+            }
+            return false;
+        }
+        case ScheduledKind::Score:
+            break;
     }
 
-    std::string profile = jstring_to_string(env, jProfile);
-    std::string topic = jstring_to_string(env, jTopic);
-    std::string style = jstring_to_string(env, jStyle);
-    std::string preference = jstring_to_string(env, jPreference);
-    std::string left = jstring_to_string(env, jLeftContext);
-    std::string right = jstring_to_string(env, jRightContext);
-    std::string input = jstring_to_string(env, jInput);
+    // 採点: 最初のバッチでプロンプト最後のトークンを基点の seq と候補の seq すべてに入れ、以後の候補は
+    // 基点の seq からフォークする。1 トークンの候補はプロンプト最後のトークンの行だけで採点する。
+    const bool tail_pending = batched.first_logits.empty();
+    size_t n_tokens = tail_pending ? 1 : 0;
+    if (n_tokens > room) {
+        return false;
+    }
+    std::vector<size_t> wave;
+    while (batched.next_candidate < batched.candidates.size() && wave.size() < free_seqs.size()) {
+        const auto &tokens = batched.candidates[batched.next_candidate];
+        if (tokens.size() < 2) {
+            ++batched.next_candidate;
+            continue;
+        }
+        const size_t n_nodes = tokens.size() - 1;
+        if (n_nodes + 1 > n_batch) {
+            // 単独でも収まらない候補は評価しない。
+            batched.scores[batched.next_candidate++] = -INFINITY;
+            continue;
+        }
+        if (n_tokens + n_nodes > room) {
+            break;
+        }
+        // 締め切りがあれば間に合う分だけ採点する (最初の候補は必ず採点する)。残りは NaN のまま返す。
+        if ((!tail_pending || !wave.empty()) &&
+            !batched_deadline_allows_locked(batched, (size_t) batch.n_tokens + n_tokens + n_nodes)) {
+            batched.next_candidate = batched.candidates.size();
+            break;
+        }
+        wave.push_back(batched.next_candidate++);
+        n_tokens += n_nodes;
+    }
 
-    std::string prompt = build_zenz_prompt(
-            profile,
-            topic,
-            style,
-            preference,
-            left,
-            right,
-            input
-    );
+    if (tail_pending) {
+        batched.row = batch.n_tokens;
+        batch_add_token(batch, batched.prompt.back(), tail_pos, batched.seq, true);
+        batch.n_seq_id[batched.row] = (int32_t) wave.size() + 1;
+    }
+    for (size_t candidate: wave) {
+        const llama_seq_id seq = free_seqs.back();
+        free_seqs.pop_back();
+        llama_kv_cache_seq_cp(ctx, batched.seq, seq, -1, -1);
+        if (tail_pending) {
+            batch.seq_id[batched.row][batched.lanes.size() + 1] = seq;
+        }
+        batched.lanes.push_back(BatchedLane{candidate, seq, batch.n_tokens});
+        const auto &tokens = batched.candidates[candidate];
+        for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+            batch_add_token(batch, tokens[i], tail_pos + 1 + (llama_pos) i, seq, true);
+        }
+    }
+    return !tail_pending && batched.lanes.empty() && batched.next_candidate >= batched.candidates.size();
+}
 
-    const std::string pre_prompt = preprocess_text(prompt);
-    uint64_t request_seq = g_request_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+// デコードした行を読み、リクエストが終わったら true を返す。
+static bool read_batched_request_rows_locked(
+        llama_context *ctx,
+        BatchedRequest &batched,
+        size_t last_batch_tokens,
+        std::vector<llama_seq_id> &free_seqs
+) {
+    const int32_t n_vocab = llama_vocab_n_tokens(g_vocab);
+    switch (batched.request->kind) {
+        case ScheduledKind::Generate: {
+            if (batched.row < 0) {
+                return false;
+            }
+            ++batched.n_decoded;
+            const float *logits = llama_get_logits_ith(ctx, batched.row);
+            if (!logits) {
+                LOGE("continuous batching: logits is null");
+                return true;
+            }
+            const llama_token eos = llama_vocab_eos(g_vocab);
+            const llama_token next = batched.constraint ? batched.constraint->pick(logits, n_vocab, eos)
+                                                        : argmax_token(logits, n_vocab);
+            if (next == eos) {
+                return true;
+            }
+            batched.generated.push_back(next);
+            if (batched.constraint) {
+                batched.constraint->accept(next);
+                if (batched.constraint->finished()) {
+                    return true;
+                }
+            }
+            return (int) batched.generated.size() >= batched.max_count ||
+                   batched.prompt.size() + batched.generated.size() >= llama_n_ctx(ctx) ||
+                   !batched_deadline_allows_locked(batched, last_batch_tokens);
+        }
+        case ScheduledKind::Evaluate: {
+            if (batched.row < 0) {
+                return false;
+            }
+            const auto &tokens = batched.candidates[0];
+            CandidateLogitRows rows;
+            std::vector<float> log_norms(tokens.size(), NAN);
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                rows.rows.push_back(llama_get_logits_ith(ctx, batched.row + (int32_t) i));
+                rows.log_norms.push_back(&log_norms[i]);
+            }
+            size_t accepted = 0;
+            llama_token correction = -1;
+            batched.evaluation = candidate_result_to_string(
+                    verify_draft_rows(tokens, rows, n_vocab, accepted, correction));
+            return true;
+        }
+        case ScheduledKind::Score:
+            break;
+    }
 
-    std::vector<std::string> candidate_strings((size_t) candidate_count);
-    for (jsize i = 0; i < candidate_count; ++i) {
-        auto *j_candidate = (jstring) env->GetObjectArrayElement(jCandidates, i);
-        if (!j_candidate) {
-            continue;
+    if (batched.row >= 0) {
+        const float *tail_logits = llama_get_logits_ith(ctx, batched.row);
+        if (!tail_logits) {
+            LOGE("continuous batching: logits is null");
+            return true;
         }
-        candidate_strings[(size_t) i] = jstring_to_string(env, j_candidate);
-        env->DeleteLocalRef(j_candidate);
+        batched.first_logits.assign(tail_logits, tail_logits + n_vocab);
+        batched.first_log_norm = logits_log_normalizer(tail_logits, n_vocab);
+        for (size_t i = 0; i < batched.candidates.size(); ++i) {
+            if (batched.candidates[i].size() == 1) {
+                batched.scores[i] = batched.first_logits[(size_t) batched.candidates[i][0]] - batched.first_log_norm;
+            }
+        }
+    }
+    for (const auto &lane: batched.lanes) {
+        const auto &tokens = batched.candidates[lane.candidate];
+        CandidateLogitRows rows;
+        std::vector<float> log_norms(tokens.size(), NAN);
+        rows.rows.push_back(batched.first_logits.data());
+        rows.log_norms.push_back(&batched.first_log_norm);
+        for (size_t i = 1; i < tokens.size(); ++i) {
+            rows.rows.push_back(llama_get_logits_ith(ctx, lane.first_row + (int32_t) (i - 1)));
+            rows.log_norms.push_back(&log_norms[i]);
+        }
+        float total = 0.0f;
+        for (size_t i = 0; i < tokens.size(); ++i) {
+            total += rows.log_prob(i, tokens[i], n_vocab);
+        }
+        batched.scores[lane.candidate] = total / (float) tokens.size();
+        llama_kv_cache_seq_rm(ctx, lane.seq, -1, -1);
+        free_seqs.push_back(lane.seq);
     }
+    batched.lanes.clear();
+    return !batched.first_logits.empty() && batched.next_candidate >= batched.candidates.size();
+}
 
+// 連続バッチング用の郵便受けが空になり、実行中のリクエストがなくなるまで、届いたリクエストを
+// 同じバッチで進める。
+static void run_batched_requests(JNIEnv *env) {
+    std::vector<std::unique_ptr<BatchedRequest>> live;
+    std::vector<std::unique_ptr<BatchedRequest>> fallback;  // 1 件ずつの経路で実行し直すリクエスト
+    size_t n_admitted = 0;
+    size_t n_decodes = 0;
+    size_t n_decoded_tokens = 0;
     {
         std::unique_lock<std::mutex> session_lock(g_session.mutex);
-        if (!g_model || !g_vocab) {
-            LOGE("scoreCandidates: model not initialized");
-            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
-            return result_array;
+        llama_context *ctx = g_model && g_vocab ? ensure_session_context_locked() : nullptr;
+        // seq 0 と、3 種類のリクエストの seq と、採点の候補の seq が 1 つ以上要る。
+        const int32_t n_seq = ctx ? (int32_t) llama_n_seq_max(ctx) : 0;
+        const bool batching = n_seq >= (int32_t) kScheduledKinds + 2;
+        const size_t n_batch = ctx ? llama_n_batch(ctx) : 0;
+        const size_t chunk = (size_t) std::max(0, g_prefill_chunk_tokens.load(std::memory_order_relaxed));
+        std::vector<llama_seq_id> free_seqs;
+        for (llama_seq_id seq = n_seq - 1; seq >= 1; --seq) {
+            free_seqs.push_back(seq);
         }
-
-        llama_context *ctx = ensure_session_context_locked();
-        if (!ctx) {
-            LOGE("scoreCandidates: failed to create context");
-            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
-            return result_array;
+        llama_batch batch{};
+        if (batching) {
+            batch = llama_batch_init((int32_t) n_batch, 0, n_seq);
         }
+        size_t last_batch_tokens = 1;
+
+        const auto erase_finished = [&live] {
+            live.erase(std::remove_if(live.begin(), live.end(),
+                                      [](const std::unique_ptr<BatchedRequest> &batched) {
+                                          return batched->request == nullptr;
+                                      }),
+                       live.end());
+        };
+        // seq 0 がプロンプト接頭辞と一致しているリクエストはフォークできる。
+        const auto mark_ready = [&live] {
+            for (auto &batched: live) {
+                const size_t prefix_len = batched->prompt.size() - 1;
+                if (batched->stage == BatchedRequest::Stage::Prefill &&
+                    g_session.kv_tokens.size() == prefix_len &&
+                    zenz_common_prefix_length(g_session.kv_tokens, batched->prompt) == prefix_len) {
+                    batched->stage = BatchedRequest::Stage::Ready;
+                }
+            }
+        };
+        const auto fork_ready = [&] {
+            for (auto &batched: live) {
+                if (batched->stage == BatchedRequest::Stage::Ready && !free_seqs.empty()) {
+                    batched->seq = free_seqs.back();
+                    free_seqs.pop_back();
+                    llama_kv_cache_seq_cp(ctx, 0, batched->seq, -1, -1);
+                    batched->stage = BatchedRequest::Stage::Running;
+                }
+            }
+        };
+        const auto any_ready = [&live] {
+            return std::any_of(live.begin(), live.end(), [](const std::unique_ptr<BatchedRequest> &batched) {
+                return batched->stage == BatchedRequest::Stage::Ready;
+            });
+        };
+
+        for (;;) {
+            // 同じ種類の新しいリクエストや cancelCurrent に割り込まれたリクエストを外す。
+            for (auto &batched: live) {
+                const auto kind = (size_t) batched->request->kind;
+                if (g_scheduler.kind_generations[kind].load(std::memory_order_acquire) != batched->generation ||
+                    g_scheduler.kind_mailboxes[kind].load(std::memory_order_acquire) != nullptr) {
+                    finish_batched_request_locked(env, ctx, *batched, true, free_seqs);
+                }
+            }
+            erase_finished();
 
-        AbortRequestState abort_state{request_seq};
-        llama_set_abort_callback(ctx, abort_if_stale, &abort_state);
+            for (size_t kind = 0; kind < kScheduledKinds; ++kind) {
+                ScheduledRequest *request = g_scheduler.kind_mailboxes[kind].exchange(nullptr, std::memory_order_acq_rel);
+                if (!request) {
+                    continue;
+                }
+                // 世代は取り出した後に読まず、投函時の値を使う (scheduler_worker_main と同じ)。
+                auto batched = make_batched_request_locked(env, request, request->generation);
+                ++n_admitted;
+                if (!batching) {
+                    fallback.push_back(std::move(batched));
+                } else if (batched_request_trivial(*batched)) {
+                    finish_batched_request_locked(env, ctx, *batched, false, free_seqs);
+                } else {
+                    live.push_back(std::move(batched));
+                }
+            }
+            if (live.empty()) {
+                break;
+            }
 
-        auto prompt_tokens = tokenize_text(pre_prompt, /*add_bos=*/false, /*add_eos=*/false);
-        if (prompt_tokens.empty()) {
-            llama_set_abort_callback(ctx, never_abort, nullptr);
-            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
-            return result_array;
-        }
+            // 1. seq 0 が揃ったリクエストをフォークし、フォーク待ちがいなければ次のプロンプトのプレフィルを始める。
+            mark_ready();
+            fork_ready();
+            BatchedRequest *target = nullptr;
+            if (!any_ready()) {
+                for (auto &batched: live) {
+                    if (batched->stage == BatchedRequest::Stage::Prefill) {
+                        target = batched.get();
+                        break;
+                    }
+                }
+                if (target && !target->prefill_started) {
+                    target->prefill_from = reuse_session_prefix_locked(ctx, target->prompt, target->prompt.size() - 1);
+                    target->prefill_started = true;
+                    mark_ready();
+                    fork_ready();
+                    if (target->stage != BatchedRequest::Stage::Prefill) {
+                        target = nullptr;
+                    }
+                }
+            }
 
-        if (!prefill_prompt_prefix_locked(ctx, prompt_tokens)) {
-            LOGE("scoreCandidates: failed to prefill prompt prefix");
-            llama_set_abort_callback(ctx, never_abort, nullptr);
-            env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
-            return result_array;
-        }
+            // 2. 実行中のリクエストの次のトークン
+            batch.n_tokens = 0;
+            for (auto &batched: live) {
+                batched->row = -1;
+                if (batched->stage == BatchedRequest::Stage::Running &&
+                    add_batched_request_tokens_locked(ctx, *batched, batch, n_batch, free_seqs)) {
+                    finish_batched_request_locked(env, ctx, *batched, false, free_seqs);
+                }
+            }
 
-        std::vector<std::vector<llama_token>> candidate_tokens_list((size_t) candidate_count);
-        for (jsize i = 0; i < candidate_count; ++i) {
-            if (candidate_strings[(size_t) i].empty()) {
-                continue;
+            // 3. 残りの枠でプロンプト接頭辞のチャンク (出力なし)
+            const size_t n_past = g_session.kv_tokens.size();
+            size_t n_prefill = 0;
+            if (target) {
+                n_prefill = std::min({
+                        target->prompt.size() - 1 - n_past,
+                        n_batch - (size_t) batch.n_tokens,
+                        chunk > 0 ? chunk : n_batch
+                });
+                for (size_t i = 0; i < n_prefill; ++i) {
+                    batch_add_token(batch, target->prompt[n_past + i], (llama_pos) (n_past + i), 0, false);
+                }
             }
-            candidate_tokens_list[(size_t) i] = tokenize_text(
-                    preprocess_text(candidate_strings[(size_t) i]),
-                    /*add_bos=*/false,
-                    /*add_eos=*/false
-            );
-        }
 
-        for (jsize i = 0; i < candidate_count; ++i) {
-            if (is_request_stale(request_seq)) {
+            if (batch.n_tokens == 0) {
+                erase_finished();
+                if (live.empty()) {
+                    continue;
+                }
+                // 空きの seq がなく、どのリクエストも進められない
+                LOGE("continuous batching: no request can make progress");
                 break;
             }
-            if (candidate_tokens_list[(size_t) i].empty()) {
-                scores[(size_t) i] = -INFINITY;
-                continue;
+
+            const auto started = std::chrono::steady_clock::now();
+            const int rc = decode_batch_locked(ctx, batch);
+            if (rc != 0) {
+                LOGE("continuous batching: llama_decode failed: %d", rc);
+                // 書きかけのプレフィルのセルを捨てる (各リクエストの seq は 1 件ずつの経路に回すときに捨てる)。
+                if (!llama_kv_cache_seq_rm(ctx, 0, (llama_pos) n_past, -1)) {
+                    llama_kv_cache_clear(ctx);
+                    g_session.kv_tokens.clear();
+                }
+                g_session.kv_fragmented = true;
+                break;
+            }
+            last_batch_tokens = (size_t) batch.n_tokens;
+            g_decode_cost.record(last_batch_tokens, std::chrono::duration<double, std::micro>(
+                    std::chrono::steady_clock::now() - started).count());
+            ++n_decodes;
+            n_decoded_tokens += last_batch_tokens;
+
+            if (n_prefill > 0) {
+                g_session.kv_tokens.insert(g_session.kv_tokens.end(),
+                                           target->prompt.begin() + (ptrdiff_t) n_past,
+                                           target->prompt.begin() + (ptrdiff_t) (n_past + n_prefill));
+                const size_t total = target->prompt.size() - 1 - target->prefill_from;
+                if (chunk > 0 && total > chunk) {
+                    g_scheduler.running = target->request;
+                    report_prefill_progress(g_session.kv_tokens.size() - target->prefill_from, total);
+                    g_scheduler.running = nullptr;
+                }
+            }
+            for (auto &batched: live) {
+                if (batched->request && batched->stage == BatchedRequest::Stage::Running &&
+                    read_batched_request_rows_locked(ctx, *batched, last_batch_tokens, free_seqs)) {
+                    finish_batched_request_locked(env, ctx, *batched, false, free_seqs);
+                }
             }
+            erase_finished();
+        }
 
-            scores[(size_t) i] = score_candidate_avg_logprob_reuse_prompt_locked(
-                    ctx,
-                    prompt_tokens,
-                    candidate_tokens_list[(size_t) i],
-                    request_seq
-            );
+        // 続けられなかったリクエストは 1 件ずつの経路に回す。
+        for (auto &batched: live) {
+            release_batched_seqs_locked(ctx, *batched, free_seqs);
+            fallback.push_back(std::move(batched));
+        }
+        live.clear();
+        if (batching) {
+            llama_batch_free(batch);
         }
-        llama_set_abort_callback(ctx, never_abort, nullptr);
     }
 
-    env->SetFloatArrayRegion(result_array, 0, candidate_count, scores.data());
-    return result_array;
+    if (n_decodes > 0) {
+        LOGI("continuous batching: %zu requests in %zu decodes (%zu tokens)", n_admitted, n_decodes, n_decoded_tokens);
+    }
+    for (auto &batched: fallback) {
+        ScheduledRequest *request = batched->request;
+        const auto kind = (size_t) request->kind;
+        const auto superseded = [kind, &batched] {
+            return g_scheduler.kind_generations[kind].load(std::memory_order_acquire) != batched->generation ||
+                   g_scheduler.kind_mailboxes[kind].load(std::memory_order_acquire) != nullptr;
+        };
+        // 1 件ずつの経路でも、同じ種類の新しいリクエストが届けば is_request_stale で打ち切れるようにする
+        // (継続バッチングでは投函しても g_request_seq は進まない)。
+        bool truncated = false;
+        jobject result = nullptr;
+        if (!superseded()) {
+            t_scheduler_generation = &g_scheduler.kind_generations[kind];
+            t_scheduled_generation = batched->generation;
+            result = run_scheduled_request(env, *request, truncated);
+            t_scheduler_generation = nullptr;
+            t_scheduled_generation = 0;
+        }
+        const bool stale = superseded();
+        const bool partial = stale && g_soft_cancel_enabled.load(std::memory_order_relaxed);
+        finish_scheduled_request(env, request, stale && !partial ? nullptr : result, stale, truncated);
+        if (result) {
+            env->DeleteLocalRef(result);
+        }
+    }
+}
+
+static void scheduler_worker_main() {
+    JNIEnv *env = nullptr;
+    if (g_scheduler.vm->AttachCurrentThreadAsDaemon(&env, nullptr) != JNI_OK || !env) {
+        LOGE("scheduler: failed to attach the worker thread");
+        return;
+    }
+    t_on_scheduler_worker = true;
+    g_scheduler.worker_env = env;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(g_scheduler.wake_mutex);
+            g_scheduler.wake.wait(lock, [] {
+                return g_scheduler.mailbox.load(std::memory_order_acquire) != nullptr || batched_requests_pending();
+            });
+        }
+        if (batched_requests_pending()) {
+            run_batched_requests(env);
+            continue;
+        }
+        ScheduledRequest *request = g_scheduler.mailbox.exchange(nullptr, std::memory_order_acq_rel);
+        if (!request) {
+            continue;
+        }
+        // 世代は取り出した後に読まず、投函時の値を使う。取り出した後に届いたリクエストの世代を
+        // 自分のものと取り違えると、古いリクエストが割り込まれずに最後まで走ってしまう。
+        const uint64_t generation = request->generation;
+        if (g_scheduler.mailbox.load(std::memory_order_acquire) != nullptr ||
+            generation != g_scheduler.generation.load(std::memory_order_acquire)) {
+            // 取り出す間に次のリクエストが届いたか、取り消された
+            finish_scheduled_request(env, request, nullptr, true);
+            continue;
+        }
+        g_scheduler.running = request;
+        t_scheduler_generation = &g_scheduler.generation;
+        t_scheduled_generation = generation;
+        bool truncated = false;
+        jobject result = run_scheduled_request(env, *request, truncated);
+        t_scheduler_generation = nullptr;
+        t_scheduled_generation = 0;
+        g_scheduler.running = nullptr;
+        // 実行中に新しいリクエストが来ていれば、途中で打ち切られた結果なので結果としては返さない
+        // (ソフトキャンセルなら途中結果として渡す)
+        const bool superseded = generation != g_scheduler.generation.load(std::memory_order_acquire);
+        const bool partial = superseded && g_soft_cancel_enabled.load(std::memory_order_relaxed);
+        finish_scheduled_request(env, request, superseded && !partial ? nullptr : result, superseded, truncated);
+        if (result) {
+            env->DeleteLocalRef(result);
+        }
+    }
+}
+
+static void submit_scheduled_request(
+        JNIEnv *env,
+        ScheduledKind kind,
+        jlong request_id,
+        std::initializer_list<jobject> args,
+        jint int_arg,
+        jint deadline_ms,
+        jobject callback
+) {
+    if (!callback) {
+        LOGE("scheduler: callback is null");
+        return;
+    }
+    std::call_once(g_scheduler.started, [env] {
+        env->GetJavaVM(&g_scheduler.vm);
+        std::thread(scheduler_worker_main).detach();
+    });
+
+    auto *request = new ScheduledRequest{
+            kind, request_id, env->NewGlobalRef(callback), {}, int_arg, deadline_ms, std::chrono::steady_clock::now()};
+    for (jobject arg: args) {
+        request->args.push_back(arg ? env->NewGlobalRef(arg) : nullptr);
+    }
+
+    // 投函より先に世代を進め、実行中のリクエストを止める (郵便受けのリクエストは置き換える)。
+    // 連続バッチングでは同じ種類のリクエストだけを置き換え、他の種類のリクエストは止めない。
+    ScheduledRequest *previous;
+    if (g_continuous_batching_enabled.load(std::memory_order_relaxed)) {
+        request->generation = g_scheduler.kind_generations[(size_t) kind].fetch_add(1, std::memory_order_acq_rel) + 1;
+        previous = g_scheduler.kind_mailboxes[(size_t) kind].exchange(request, std::memory_order_acq_rel);
+    } else {
+        request->generation = g_scheduler.generation.fetch_add(1, std::memory_order_acq_rel) + 1;
+        g_request_seq.fetch_add(1, std::memory_order_relaxed);
+        previous = g_scheduler.mailbox.exchange(request, std::memory_order_acq_rel);
+    }
+    if (previous) {
+        finish_scheduled_request(env, previous, nullptr, true);
+    }
+    {
+        std::lock_guard<std::mutex> lock(g_scheduler.wake_mutex);
+    }
+    g_scheduler.wake.notify_one();
 }
 
 extern "C"
-JNIEXPORT jfloatArray JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_scoreCandidates(
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_submitGenerateV32(
         JNIEnv *env,
         jobject /* thiz */,
+        jlong jRequestId,
         jstring jProfile,
         jstring jTopic,
         jstring jStyle,
         jstring jPreference,
         jstring jLeftContext,
+        jstring jRightContext,
         jstring jInput,
-        jobjectArray jCandidates
+        jint maxTokens,
+        jint jDeadlineMs,
+        jobject jCallback
 ) {
-    return score_candidates_with_context(
+    submit_scheduled_request(
             env,
-            jProfile,
-            jTopic,
-            jStyle,
-            jPreference,
-            jLeftContext,
-            nullptr,
-            jInput,
-            jCandidates
+            ScheduledKind::Generate,
+            jRequestId,
+            {jProfile, jTopic, jStyle, jPreference, jLeftContext, jRightContext, jInput},
+            maxTokens,
+            jDeadlineMs,
+            jCallback
     );
 }
 
 extern "C"
-JNIEXPORT jfloatArray JNICALL
-Java_com_kazumaproject_zenz_ZenzEngine_scoreCandidatesV32(
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_submitCandidateEvaluateV32(
         JNIEnv *env,
         jobject /* thiz */,
+        jlong jRequestId,
         jstring jProfile,
         jstring jTopic,
         jstring jStyle,
@@ -1303,17 +6927,45 @@ Java_com_kazumaproject_zenz_ZenzEngine_scoreCandidatesV32(
         jstring jLeftContext,
         jstring jRightContext,
         jstring jInput,
-        jobjectArray jCandidates
+        jstring jCandidate,
+        jint jDeadlineMs,
+        jobject jCallback
 ) {
-    return score_candidates_with_context(
+    submit_scheduled_request(
             env,
-            jProfile,
-            jTopic,
-            jStyle,
-            jPreference,
-            jLeftContext,
-            jRightContext,
-            jInput,
-            jCandidates
+            ScheduledKind::Evaluate,
+            jRequestId,
+            {jProfile, jTopic, jStyle, jPreference, jLeftContext, jRightContext, jInput, jCandidate},
+            0,
+            jDeadlineMs,
+            jCallback
+    );
+}
+
+extern "C"
+JNIEXPORT void JNICALL
+Java_com_kazumaproject_zenz_ZenzEngine_submitScoreCandidatesV32(
+        JNIEnv *env,
+        jobject /* thiz */,
+        jlong jRequestId,
+        jstring jProfile,
+        jstring jTopic,
+        jstring jStyle,
+        jstring jPreference,
+        jstring jLeftContext,
+        jstring jRightContext,
+        jstring jInput,
+        jobjectArray jCandidates,
+        jint jDeadlineMs,
+        jobject jCallback
+) {
+    submit_scheduled_request(
+            env,
+            ScheduledKind::Score,
+            jRequestId,
+            {jProfile, jTopic, jStyle, jPreference, jLeftContext, jRightContext, jInput, jCandidates},
+            0,
+            jDeadlineMs,
+            jCallback
     );
 }
@@ -0,0 +1,91 @@
+#include "zenz_cpu.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+
+// ファイルの先頭の整数を読む。読めなければ false。
+static bool read_long(const std::string &path, long &value) {
+    std::ifstream in(path);
+    if (!in) {
+        return false;
+    }
+    long v;
+    if (!(in >> v)) {
+        return false;
+    }
+    value = v;
+    return true;
+}
+
+// "cpu<数字>" なら CPU 番号を返す。それ以外 ("cpufreq" "cpuidle" など) は -1。
+static int parse_cpu_dir_name(const char *name) {
+    if (strncmp(name, "cpu", 3) != 0 || name[3] == '\0') {
+        return -1;
+    }
+    int cpu = 0;
+    for (const char *p = name + 3; *p; ++p) {
+        if (*p < '0' || *p > '9') {
+            return -1;
+        }
+        cpu = cpu * 10 + (*p - '0');
+    }
+    return cpu;
+}
+
+std::vector<ZenzCpuInfo> zenz_read_cpu_info(const std::string &sysfs_root) {
+    std::vector<ZenzCpuInfo> cpus;
+    const std::string cpu_root = sysfs_root + "/devices/system/cpu";
+    DIR *dir = opendir(cpu_root.c_str());
+    if (!dir) {
+        return cpus;
+    }
+    while (dirent *entry = readdir(dir)) {
+        const int cpu = parse_cpu_dir_name(entry->d_name);
+        if (cpu < 0) {
+            continue;
+        }
+        const std::string base = cpu_root + "/" + entry->d_name;
+        long online = 1;
+        if (read_long(base + "/online", online) && online == 0) {
+            continue;
+        }
+        long max_freq = 0;
+        if (!read_long(base + "/cpufreq/cpuinfo_max_freq", max_freq) &&
+            !read_long(base + "/cpu_capacity", max_freq)) {
+            continue;
+        }
+        if (max_freq > 0) {
+            cpus.push_back(ZenzCpuInfo{cpu, max_freq});
+        }
+    }
+    closedir(dir);
+    std::sort(cpus.begin(), cpus.end(), [](const ZenzCpuInfo &lhs, const ZenzCpuInfo &rhs) {
+        return lhs.cpu < rhs.cpu;
+    });
+    return cpus;
+}
+
+std::vector<int> zenz_performance_cpus(const std::string &sysfs_root) {
+    const auto cpus = zenz_read_cpu_info(sysfs_root);
+    std::vector<int> out;
+    if (cpus.empty()) {
+        return out;
+    }
+    const long slowest = std::min_element(cpus.begin(), cpus.end(), [](const ZenzCpuInfo &lhs, const ZenzCpuInfo &rhs) {
+        return lhs.max_freq < rhs.max_freq;
+    })->max_freq;
+    for (const auto &info: cpus) {
+        if (info.max_freq > slowest) {
+            out.push_back(info.cpu);
+        }
+    }
+    if (out.empty()) {
+        for (const auto &info: cpus) {
+            out.push_back(info.cpu);
+        }
+    }
+    return out;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// sysfs から CPU の構成を読む (ARM の big.LITTLE などで性能コアを選ぶため)。
+// テストでは偽の sysfs を作って sysfs_root に渡す。実機では "/sys"。
+
+// CPU ごとの最大周波数 (kHz)。cpufreq/cpuinfo_max_freq がなければ cpu_capacity を使う。
+// オフラインの CPU と、どちらも読めない CPU は含めない。CPU 番号の昇順。
+struct ZenzCpuInfo {
+    int cpu;
+    long max_freq;
+};
+
+std::vector<ZenzCpuInfo> zenz_read_cpu_info(const std::string &sysfs_root);
+
+// 性能コアの CPU 番号 (昇順)。最大周波数が最も低いクラスタ (LITTLE) を除いたもの。
+// すべての CPU が同じ周波数なら全 CPU、何も読めなければ空を返す。
+std::vector<int> zenz_performance_cpus(const std::string &sysfs_root);
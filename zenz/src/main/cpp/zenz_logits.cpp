@@ -0,0 +1,401 @@
+#include "zenz_logits.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define ZENZ_LOGITS_NEON 1
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define ZENZ_LOGITS_AVX2 1
+#endif
+
+// 64 要素 (256 バイト) ずつ、まずブロックの最大値を求め、走行中の最大値が更新されたときだけ
+// それまでの和を exp(旧最大 - 新最大) 倍してから、ブロックの exp(x - 最大値) を足す。
+// ブロックは L1 に載ったまま 2 回読むだけなので、メモリは 1 回しか走査しない。
+static constexpr int32_t kBlock = 64;
+
+// expf(x) の下限。これより小さい入力 (-inf を含む) は 0 にする。
+static constexpr float kExpMinInput = -87.33654f;
+static constexpr float kExpMaxInput = 88.37626f;
+
+static ZenzLogitStats finish_stats(float max_logit, float sum_exp, int32_t argmax) {
+    ZenzLogitStats stats;
+    stats.max_logit = max_logit;
+    stats.argmax = argmax;
+    stats.log_sum_exp = max_logit == -INFINITY ? -INFINITY : max_logit + logf(sum_exp);
+    return stats;
+}
+
+// x[begin, end) の最大値とその最初の位置。
+static float scalar_block_max(const float *x, int32_t begin, int32_t end, int32_t &argmax) {
+    float block_max = -INFINITY;
+    argmax = begin;
+    for (int32_t i = begin; i < end; ++i) {
+        if (x[i] > block_max) {
+            block_max = x[i];
+            argmax = i;
+        }
+    }
+    return block_max;
+}
+
+ZenzLogitStats zenz_logit_stats_scalar(const float *x, int32_t n) {
+    float m = -INFINITY;
+    float s = 0.0f;
+    int32_t argmax = 0;
+    for (int32_t begin = 0; begin < n; begin += kBlock) {
+        const int32_t end = std::min(n, begin + kBlock);
+        int32_t block_arg;
+        const float block_max = scalar_block_max(x, begin, end, block_arg);
+        if (block_max > m) {
+            s = m == -INFINITY ? 0.0f : s * expf(m - block_max);
+            m = block_max;
+            argmax = block_arg;
+        }
+        if (m == -INFINITY) {
+            continue;
+        }
+        // ブロックごとに小計してから足し、長い語彙での丸め誤差の蓄積を抑える
+        float block_sum = 0.0f;
+        for (int32_t i = begin; i < end; ++i) {
+            block_sum += expf(x[i] - m);
+        }
+        s += block_sum;
+    }
+    return finish_stats(m, s, argmax);
+}
+
+#if !ZENZ_LOGITS_NEON
+static int32_t argmax_scalar(const float *x, int32_t n) {
+    int32_t argmax;
+    scalar_block_max(x, 0, n, argmax);
+    return argmax;
+}
+#endif
+
+#if ZENZ_LOGITS_NEON
+
+// Cephes の expf と同じ多項式近似 (相対誤差 2e-7 程度)。
+static inline float32x4_t exp_neon(float32x4_t x) {
+    // x >= kExpMinInput (NaN は除く) のレーンだけ残す
+    const uint32x4_t keep = vcgeq_f32(x, vdupq_n_f32(kExpMinInput));
+    x = vminq_f32(x, vdupq_n_f32(kExpMaxInput));
+    x = vmaxq_f32(x, vdupq_n_f32(kExpMinInput));
+
+    const float32x4_t n = vrndnq_f32(vmulq_f32(x, vdupq_n_f32(1.44269504088896341f)));
+    float32x4_t r = vfmsq_f32(x, n, vdupq_n_f32(0.693359375f));
+    r = vfmsq_f32(r, n, vdupq_n_f32(-2.12194440e-4f));
+
+    float32x4_t p = vdupq_n_f32(1.9875691500e-4f);
+    p = vfmaq_f32(vdupq_n_f32(1.3981999507e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(8.3334519073e-3f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(4.1665795894e-2f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(1.6666665459e-1f), p, r);
+    p = vfmaq_f32(vdupq_n_f32(5.0000001201e-1f), p, r);
+    const float32x4_t r2 = vmulq_f32(r, r);
+    p = vfmaq_f32(vaddq_f32(r, vdupq_n_f32(1.0f)), p, r2);
+
+    const int32x4_t pow2n = vshlq_n_s32(vaddq_s32(vcvtq_s32_f32(n), vdupq_n_s32(127)), 23);
+    const float32x4_t y = vmulq_f32(p, vreinterpretq_f32_s32(pow2n));
+    return vreinterpretq_f32_u32(vandq_u32(vreinterpretq_u32_f32(y), keep));
+}
+
+static inline float block_max_neon(const float *x) {
+    float32x4_t m0 = vld1q_f32(x);
+    float32x4_t m1 = vld1q_f32(x + 4);
+    float32x4_t m2 = vld1q_f32(x + 8);
+    float32x4_t m3 = vld1q_f32(x + 12);
+    for (int32_t i = 16; i < kBlock; i += 16) {
+        m0 = vmaxq_f32(m0, vld1q_f32(x + i));
+        m1 = vmaxq_f32(m1, vld1q_f32(x + i + 4));
+        m2 = vmaxq_f32(m2, vld1q_f32(x + i + 8));
+        m3 = vmaxq_f32(m3, vld1q_f32(x + i + 12));
+    }
+    return vmaxvq_f32(vmaxq_f32(vmaxq_f32(m0, m1), vmaxq_f32(m2, m3)));
+}
+
+static ZenzLogitStats stats_neon(const float *x, int32_t n) {
+    float m = -INFINITY;
+    int32_t argmax = 0;
+    float32x4_t s0 = vdupq_n_f32(0.0f);
+    float32x4_t s1 = vdupq_n_f32(0.0f);
+    const int32_t n_full = n - n % kBlock;
+    for (int32_t begin = 0; begin < n_full; begin += kBlock) {
+        const float *block = x + begin;
+        const float block_max = block_max_neon(block);
+        if (block_max > m) {
+            const float scale = m == -INFINITY ? 0.0f : expf(m - block_max);
+            s0 = vmulq_n_f32(s0, scale);
+            s1 = vmulq_n_f32(s1, scale);
+            m = block_max;
+            scalar_block_max(x, begin, begin + kBlock, argmax);
+        }
+        if (m == -INFINITY) {
+            continue;
+        }
+        const float32x4_t mv = vdupq_n_f32(m);
+        for (int32_t i = 0; i < kBlock; i += 8) {
+            s0 = vaddq_f32(s0, exp_neon(vsubq_f32(vld1q_f32(block + i), mv)));
+            s1 = vaddq_f32(s1, exp_neon(vsubq_f32(vld1q_f32(block + i + 4), mv)));
+        }
+    }
+
+    float s = vaddvq_f32(vaddq_f32(s0, s1));
+    if (n_full < n) {
+        int32_t tail_arg;
+        const float tail_max = scalar_block_max(x, n_full, n, tail_arg);
+        if (tail_max > m) {
+            s = m == -INFINITY ? 0.0f : s * expf(m - tail_max);
+            m = tail_max;
+            argmax = tail_arg;
+        }
+        if (m != -INFINITY) {
+            for (int32_t i = n_full; i < n; ++i) {
+                s += expf(x[i] - m);
+            }
+        }
+    }
+    return finish_stats(m, s, argmax);
+}
+
+static int32_t argmax_neon(const float *x, int32_t n) {
+    float m = -INFINITY;
+    int32_t argmax = 0;
+    const int32_t n_full = n - n % kBlock;
+    for (int32_t begin = 0; begin < n_full; begin += kBlock) {
+        const float block_max = block_max_neon(x + begin);
+        if (block_max > m) {
+            m = block_max;
+            scalar_block_max(x, begin, begin + kBlock, argmax);
+        }
+    }
+    if (n_full < n) {
+        int32_t tail_arg;
+        if (scalar_block_max(x, n_full, n, tail_arg) > m) {
+            argmax = tail_arg;
+        }
+    }
+    return argmax;
+}
+
+#endif  // ZENZ_LOGITS_NEON
+
+#if ZENZ_LOGITS_AVX2
+
+#define ZENZ_AVX2_TARGET __attribute__((target("avx2,fma")))
+
+ZENZ_AVX2_TARGET
+static inline __m256 exp_avx2(__m256 x) {
+    // x >= kExpMinInput (NaN は除く) のレーンだけ残す
+    const __m256 keep = _mm256_cmp_ps(x, _mm256_set1_ps(kExpMinInput), _CMP_GE_OQ);
+    x = _mm256_min_ps(x, _mm256_set1_ps(kExpMaxInput));
+    x = _mm256_max_ps(x, _mm256_set1_ps(kExpMinInput));
+
+    const __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504088896341f)),
+                                     _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fnmadd_ps(n, _mm256_set1_ps(-2.12194440e-4f), r);
+
+    __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    const __m256 r2 = _mm256_mul_ps(r, r);
+    p = _mm256_fmadd_ps(p, r2, _mm256_add_ps(r, _mm256_set1_ps(1.0f)));
+
+    const __m256i pow2n = _mm256_slli_epi32(
+            _mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    const __m256 y = _mm256_mul_ps(p, _mm256_castsi256_ps(pow2n));
+    return _mm256_and_ps(y, keep);
+}
+
+ZENZ_AVX2_TARGET
+static inline float hmax_avx2(__m256 v) {
+    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+}
+
+ZENZ_AVX2_TARGET
+static inline float hsum_avx2(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+ZENZ_AVX2_TARGET
+static inline float block_max_avx2(const float *x) {
+    __m256 m0 = _mm256_loadu_ps(x);
+    __m256 m1 = _mm256_loadu_ps(x + 8);
+    __m256 m2 = _mm256_loadu_ps(x + 16);
+    __m256 m3 = _mm256_loadu_ps(x + 24);
+    for (int32_t i = 32; i < kBlock; i += 32) {
+        m0 = _mm256_max_ps(m0, _mm256_loadu_ps(x + i));
+        m1 = _mm256_max_ps(m1, _mm256_loadu_ps(x + i + 8));
+        m2 = _mm256_max_ps(m2, _mm256_loadu_ps(x + i + 16));
+        m3 = _mm256_max_ps(m3, _mm256_loadu_ps(x + i + 24));
+    }
+    return hmax_avx2(_mm256_max_ps(_mm256_max_ps(m0, m1), _mm256_max_ps(m2, m3)));
+}
+
+ZENZ_AVX2_TARGET
+static ZenzLogitStats stats_avx2(const float *x, int32_t n) {
+    float m = -INFINITY;
+    int32_t argmax = 0;
+    __m256 s0 = _mm256_setzero_ps();
+    __m256 s1 = _mm256_setzero_ps();
+    const int32_t n_full = n - n % kBlock;
+    for (int32_t begin = 0; begin < n_full; begin += kBlock) {
+        const float *block = x + begin;
+        const float block_max = block_max_avx2(block);
+        if (block_max > m) {
+            const __m256 scale = _mm256_set1_ps(m == -INFINITY ? 0.0f : expf(m - block_max));
+            s0 = _mm256_mul_ps(s0, scale);
+            s1 = _mm256_mul_ps(s1, scale);
+            m = block_max;
+            scalar_block_max(x, begin, begin + kBlock, argmax);
+        }
+        if (m == -INFINITY) {
+            continue;
+        }
+        const __m256 mv = _mm256_set1_ps(m);
+        for (int32_t i = 0; i < kBlock; i += 16) {
+            s0 = _mm256_add_ps(s0, exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(block + i), mv)));
+            s1 = _mm256_add_ps(s1, exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(block + i + 8), mv)));
+        }
+    }
+
+    float s = hsum_avx2(_mm256_add_ps(s0, s1));
+    if (n_full < n) {
+        int32_t tail_arg;
+        const float tail_max = scalar_block_max(x, n_full, n, tail_arg);
+        if (tail_max > m) {
+            s = m == -INFINITY ? 0.0f : s * expf(m - tail_max);
+            m = tail_max;
+            argmax = tail_arg;
+        }
+        if (m != -INFINITY) {
+            for (int32_t i = n_full; i < n; ++i) {
+                s += expf(x[i] - m);
+            }
+        }
+    }
+    return finish_stats(m, s, argmax);
+}
+
+ZENZ_AVX2_TARGET
+static int32_t argmax_avx2(const float *x, int32_t n) {
+    float m = -INFINITY;
+    int32_t argmax = 0;
+    const int32_t n_full = n - n % kBlock;
+    for (int32_t begin = 0; begin < n_full; begin += kBlock) {
+        const float block_max = block_max_avx2(x + begin);
+        if (block_max > m) {
+            m = block_max;
+            scalar_block_max(x, begin, begin + kBlock, argmax);
+        }
+    }
+    if (n_full < n) {
+        int32_t tail_arg;
+        if (scalar_block_max(x, n_full, n, tail_arg) > m) {
+            argmax = tail_arg;
+        }
+    }
+    return argmax;
+}
+
+static bool cpu_has_avx2() {
+    static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return has_avx2;
+}
+
+#endif  // ZENZ_LOGITS_AVX2
+
+ZenzLogitStats zenz_logit_stats(const float *logits, int32_t n_vocab) {
+#if ZENZ_LOGITS_NEON
+    return stats_neon(logits, n_vocab);
+#else
+#if ZENZ_LOGITS_AVX2
+    if (cpu_has_avx2()) {
+        return stats_avx2(logits, n_vocab);
+    }
+#endif
+    return zenz_logit_stats_scalar(logits, n_vocab);
+#endif
+}
+
+int32_t zenz_logit_argmax(const float *logits, int32_t n_vocab) {
+#if ZENZ_LOGITS_NEON
+    return argmax_neon(logits, n_vocab);
+#else
+#if ZENZ_LOGITS_AVX2
+    if (cpu_has_avx2()) {
+        return argmax_avx2(logits, n_vocab);
+    }
+#endif
+    return argmax_scalar(logits, n_vocab);
+#endif
+}
+
+const char *zenz_logit_kernel_name() {
+#if ZENZ_LOGITS_NEON
+    return "neon";
+#else
+#if ZENZ_LOGITS_AVX2
+    if (cpu_has_avx2()) {
+        return "avx2";
+    }
+#endif
+    return "scalar";
+#endif
+}
+
+// スレッド 1 本あたりこれだけの要素がないと、スレッドを起こす時間の方が長くなる。
+static constexpr size_t kMinElementsPerThread = (size_t) 1 << 16;
+
+void zenz_logit_stats_rows(
+        const float *const *rows,
+        size_t n_rows,
+        int32_t n_vocab,
+        ZenzLogitStats *out,
+        int n_threads
+) {
+    const size_t total = n_rows * (size_t) std::max(n_vocab, 0);
+    const size_t n_workers = std::min({
+            (size_t) std::max(n_threads, 1),
+            n_rows,
+            std::max(total / kMinElementsPerThread, (size_t) 1)
+    });
+    if (n_workers <= 1) {
+        for (size_t i = 0; i < n_rows; ++i) {
+            out[i] = zenz_logit_stats(rows[i], n_vocab);
+        }
+        return;
+    }
+
+    std::atomic<size_t> next_row{0};
+    auto work = [&]() {
+        for (size_t i = next_row.fetch_add(1, std::memory_order_relaxed); i < n_rows;
+             i = next_row.fetch_add(1, std::memory_order_relaxed)) {
+            out[i] = zenz_logit_stats(rows[i], n_vocab);
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(n_workers - 1);
+    for (size_t t = 1; t < n_workers; ++t) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (auto &worker: workers) {
+        worker.join();
+    }
+}
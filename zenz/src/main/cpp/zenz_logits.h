@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// 語彙サイズの logits 行を 1 パスで要約するカーネル。
+// arm64 では NEON、x86_64 では実行時に AVX2 + FMA が使えればそれを使い、それ以外はスカラーで計算する。
+
+// logits 1 行 (n_vocab 個) の要約。logits[t] - log_sum_exp が t の対数確率になる。
+struct ZenzLogitStats {
+    float max_logit;
+    float log_sum_exp;
+    int32_t argmax;  // 同値なら ID の小さい方
+};
+
+// 最大値・argmax・log-sum-exp を 1 回の走査で求める (オンラインで最大値を更新しながら exp を足す)。
+ZenzLogitStats zenz_logit_stats(const float *logits, int32_t n_vocab);
+
+// argmax だけを求める (同値なら ID の小さい方)。
+int32_t zenz_logit_argmax(const float *logits, int32_t n_vocab);
+
+// 複数の行をまとめて要約する。要素数が多い場合は最大 n_threads スレッドで行を分担する。
+void zenz_logit_stats_rows(
+        const float *const *rows,
+        size_t n_rows,
+        int32_t n_vocab,
+        ZenzLogitStats *out,
+        int n_threads
+);
+
+// SIMD を使わない実装 (精度テストとベンチマークの比較用)。
+ZenzLogitStats zenz_logit_stats_scalar(const float *logits, int32_t n_vocab);
+
+// 実際に使われる実装の名前 ("neon" / "avx2" / "scalar")。
+const char *zenz_logit_kernel_name();
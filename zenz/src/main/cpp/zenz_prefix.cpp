@@ -0,0 +1,21 @@
+#include "zenz_prefix.h"
+
+#include <algorithm>
+
+size_t zenz_common_prefix_length(const std::vector<int32_t> &lhs, const std::vector<int32_t> &rhs) {
+    const size_t limit = std::min(lhs.size(), rhs.size());
+    size_t n = 0;
+    while (n < limit && lhs[n] == rhs[n]) {
+        ++n;
+    }
+    return n;
+}
+
+ZenzPrefixReuse zenz_plan_prefix_reuse(
+        const std::vector<int32_t> &kv_tokens,
+        const std::vector<int32_t> &tokens,
+        size_t max_reuse
+) {
+    const size_t keep = std::min(zenz_common_prefix_length(kv_tokens, tokens), std::min(max_reuse, tokens.size()));
+    return ZenzPrefixReuse{keep, keep < kv_tokens.size(), tokens.size() - keep};
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// セッションの KV に載っているトークン列を、次のプロンプトにどこまで使い回すかを決める。
+// トークンは llama_token と同じ int32_t で扱う (llama.cpp には依存しない)。
+
+// 2 つのトークン列の最長共通接頭辞の長さ。
+size_t zenz_common_prefix_length(const std::vector<int32_t> &lhs, const std::vector<int32_t> &rhs);
+
+// KV を新しいプロンプトに合わせる手順。
+struct ZenzPrefixReuse {
+    size_t keep;      // KV に残すトークン数。プロンプトの tokens[keep..] をデコードすればよい
+    bool trim;        // KV の keep 番目以降を捨てる必要があるか
+    size_t n_decode;  // デコードし直すトークン数 (tokens.size() - keep)
+};
+
+// kv_tokens と tokens の最長共通接頭辞を、最大 max_reuse トークンまで残す。
+// 最後のトークンの logits が要る呼び出し側は max_reuse を tokens.size() - 1 にする。
+ZenzPrefixReuse zenz_plan_prefix_reuse(
+        const std::vector<int32_t> &kv_tokens,
+        const std::vector<int32_t> &tokens,
+        size_t max_reuse
+);
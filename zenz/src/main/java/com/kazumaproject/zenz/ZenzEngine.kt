@@ -7,15 +7,262 @@ object ZenzEngine {
         System.loadLibrary("zenz")
     }
 
+    /** Leaves the weights to be paged in by the first decode. */
+    const val WEIGHT_RESIDENCY_NONE = 0
+
+    /**
+     * Reads the model file into the page cache during warmup, before the first decode, and
+     * waits until every page is resident.
+     */
+    const val WEIGHT_RESIDENCY_WILLNEED = 1
+
+    /** Locks the mapped weights in memory while the model loads (subject to RLIMIT_MEMLOCK). */
+    const val WEIGHT_RESIDENCY_LOCK = 2
+
+    /** KV cache element types for [setContextConfig] (ggml_type values). */
+    const val KV_CACHE_TYPE_F32 = 0
+    const val KV_CACHE_TYPE_F16 = 1
+    const val KV_CACHE_TYPE_Q4_0 = 2
+    const val KV_CACHE_TYPE_Q8_0 = 8
+
+    /**
+     * Loads the model. With warmup enabled (the default, see [setWarmupConfig]) it then starts
+     * a background warmup and returns without waiting for it. The warmup creates the context
+     * and runs one prefill and one decode step of typical shape. Use [awaitWarmup] as the
+     * readiness handle. A request that arrives earlier interrupts the warmup and runs at once.
+     */
     external fun initModel(modelPath: String): Boolean
     external fun cancelCurrent()
     external fun closeModel()
 
+    /**
+     * Configures the warmup started by later [initModel] calls. [weightResidency] is one of
+     * [WEIGHT_RESIDENCY_NONE], [WEIGHT_RESIDENCY_WILLNEED] (the default) and
+     * [WEIGHT_RESIDENCY_LOCK].
+     */
+    external fun setWarmupConfig(enabled: Boolean, weightResidency: Int)
+
+    /**
+     * Waits up to [timeoutMs] (0 to poll) for the loaded model to finish its warmup.
+     * Returns true once a model is loaded and warm, or as soon as it is loaded when warmup is
+     * disabled. Returns false on timeout or when no model is loaded.
+     */
+    external fun awaitWarmup(timeoutMs: Long): Boolean
+
+    /**
+     * Returns `[pageInMs, contextMs, decodeMs, totalMs]` of the last warmup. `pageInMs` is the
+     * time until every page of the model file was resident, measured only with
+     * [WEIGHT_RESIDENCY_WILLNEED]. A step that did not run or was interrupted, and every entry
+     * before the warmup finishes, reads -1.
+     */
+    external fun getWarmupTimings(): LongArray
+
+    /**
+     * Loads a small GGUF with the same vocabulary as the main model as a speculative draft
+     * model. Call after [initModel]. It proposes up to [maxDraftTokens] tokens per step, and the
+     * main model verifies them in one decode, so the greedy output does not change.
+     * Returns false if the file cannot be loaded or its vocabulary does not match.
+     */
+    external fun initDraftModel(modelPath: String, maxDraftTokens: Int): Boolean
+    external fun closeDraftModel()
+
+    /**
+     * Drafts with the first [layers] layers of the main model itself when no draft model is
+     * loaded. 0 disables it, and a negative value picks the depth from measured acceptance and
+     * draft cost. The main model still verifies every draft, so the output does not change.
+     */
+    external fun setSelfSpeculativeLayers(layers: Int)
+
+    /** Returns the depth currently used for self-speculative drafts (0 when not drafting). */
+    external fun getSelfSpeculativeLayers(): Int
+
+    /**
+     * Defragments the reused KV cache while no request holds the native session.
+     * Returns false when the session is busy or there is nothing to compact.
+     */
+    external fun defragSessionIfIdle(): Boolean
+
+    /**
+     * Pauses the persistent ggml worker threads while no request holds the native session, so
+     * they stop polling between keystrokes. The next request resumes them. Returns false when
+     * the session is busy or the threads are already paused.
+     */
+    external fun pauseThreadpoolIfIdle(): Boolean
+
+    /**
+     * Returns the CPU ids of the performance cores: every online core except the cluster with
+     * the lowest maximum frequency, or all cores on a homogeneous SoC. Empty when sysfs cannot
+     * be read.
+     */
+    external fun getPerformanceCpus(): IntArray
+
+    /**
+     * Configures the persistent ggml threadpool shared by inference requests. Workers are
+     * pinned to [cpus] (empty leaves placement to the scheduler), run at [priority]
+     * (0 = normal, 1 = medium, 2 = high, 3 = realtime) and spin for [pollLevel] (0-100)
+     * before sleeping. Takes effect on the next request.
+     */
+    external fun setThreadpoolConfig(cpus: IntArray, priority: Int, pollLevel: Int)
+
+    /**
+     * Tunes the thread counts of generation prefill and single-token decode independently
+     * (enabled by default). Each phase measures its tokens/sec online and hill-climbs between 1
+     * and the nThreads passed to [setRuntimeConfig]. [prefillThreads] and [decodeThreads] are
+     * counts learned earlier (0 when unknown) and are tried first. Disabling restores the
+     * [setRuntimeConfig] thread count. Output does not change.
+     */
+    external fun setAdaptiveThreadCounts(enabled: Boolean, prefillThreads: Int, decodeThreads: Int)
+
+    /** Returns the learned [prefill, decode] thread counts; 0 for a phase not measured yet. */
+    external fun getAdaptiveThreadCounts(): IntArray
+
     external fun setRuntimeConfig(
         nCtx: Int,
         nThreads: Int
     )
 
+    /**
+     * Sets every context parameter that decides its memory footprint. [nBatch] of 0 or less
+     * uses [nCtx], [nUbatch] of 0 or less uses min(512, nBatch) and [nSeqMax] of 0 or less
+     * uses 16. [typeK] and [typeV] are `KV_CACHE_TYPE_*` values; a quantized V cache needs
+     * [flashAttention], and a type the loaded model cannot use falls back to F16 when the
+     * context is created (see [getContextMemoryStats]). [setRuntimeConfig] keeps these
+     * settings. Takes effect on the next request.
+     */
+    external fun setContextConfig(
+        nCtx: Int,
+        nThreads: Int,
+        nBatch: Int,
+        nUbatch: Int,
+        nSeqMax: Int,
+        typeK: Int,
+        typeV: Int,
+        flashAttention: Boolean
+    )
+
+    /**
+     * Returns `[kvBytes, computeBytes, nCtx, nBatch, nUbatch, nSeqMax, typeK, typeV,
+     * flashAttention]` of the current context, or of the one the next request would create.
+     * `computeBytes` is an estimate from the model shape. Both sizes are -1 without a model.
+     */
+    external fun getContextMemoryStats(): LongArray
+
+    /**
+     * Sizes the context from the workload when [enabled] (off by default): the batch sizes given
+     * to the model are tracked, and [resizeContextIfIdle] recreates the context with the
+     * smallest n_ubatch that still runs 95% of the tokens in one graph. [memoryCapBytes] (0 or
+     * less for none) caps the KV cache plus compute buffer even when sizing is disabled, by
+     * lowering n_ubatch and then n_ctx. n_ctx is kept at twice the longest request seen (prompt
+     * plus the tokens it may generate or score) and never below the longest prompt. A longer
+     * request is still counted when it does not fit, and [resizeContextIfIdle] then grows n_ctx
+     * back. The n_ctx and n_ubatch passed to [setContextConfig] are upper bounds; n_batch is
+     * passed through unchanged, and llama.cpp limits it to n_ctx.
+     */
+    external fun setContextSizing(enabled: Boolean, memoryCapBytes: Long)
+
+    /**
+     * Refits the context to the tracked workload if no request is running. Returns true when the
+     * context was recreated; the next request then decodes its prompt from scratch.
+     */
+    external fun resizeContextIfIdle(): Boolean
+
+    /**
+     * Returns `[batches, p95BatchTokens, peakPositions, fittedUbatch, minCtx, longestPrompt]` of
+     * the tracked workload; values not known yet are 0.
+     */
+    external fun getContextSizingStats(): LongArray
+
+    /**
+     * Prefills prompts longer than [tokens] tokens in chunks of that size (128 by default; 0 or
+     * less decodes the whole prompt at once). A newer request or [cancelCurrent] stops the
+     * prefill between chunks, and the chunks already decoded stay in the KV cache for the next
+     * request. Output does not change.
+     */
+    external fun setPrefillChunkSize(tokens: Int)
+
+    /**
+     * Returns `[decodedTokens, totalTokens]` of the latest prompt prefill. Both are 0 before the
+     * first prefill.
+     */
+    external fun getPrefillProgress(): IntArray
+
+    /**
+     * Scores all candidates of [scoreCandidates] in one multi-sequence decode when enabled
+     * (default), instead of one decode per candidate. Token prefixes shared by several
+     * candidates are decoded once.
+     */
+    external fun setBatchedScoringEnabled(enabled: Boolean)
+
+    /**
+     * Scores candidates without copying full logits rows out of the model (default): the decode
+     * returns only the final hidden states, and a small graph on the output head computes the
+     * expected token log-probability, argmax and log-sum-exp for each position.
+     */
+    external fun setInGraphScoringEnabled(enabled: Boolean)
+
+    /**
+     * Computes greedy steps and candidate scores over a shortlist of the vocabulary (kana, kanji,
+     * Japanese and ASCII punctuation, and control tokens) instead of the whole output head.
+     * Requests that need a token outside the shortlist use the full head. Greedy steps are checked
+     * against the full head at the end of the generation and redone from the first mismatch, so
+     * generated text is the same as without the shortlist. The scoring head is chosen once
+     * per request, so all candidates of one call are scored against the same vocabulary. Scores
+     * are normalized over the shortlist, so they are slightly higher than full-vocabulary scores.
+     * Disabled by default.
+     */
+    external fun setVocabShortlistEnabled(enabled: Boolean)
+
+    /**
+     * Enables draft-model-free speculative decoding (default): generation drafts the
+     * continuation of the trailing n-gram from the prompt, the tokens generated so far and
+     * recently committed text, and verifies several drafted tokens per decode.
+     */
+    external fun setNgramDraftingEnabled(enabled: Boolean)
+
+    /**
+     * Restricts generateWithContext* to tokens whose readings can continue the kana input, and
+     * stops as soon as the whole input has been consumed. Kanji and other characters without a
+     * known reading may consume one to five kana each. Disabled by default.
+     */
+    external fun setReadingConstrainedDecodingEnabled(enabled: Boolean)
+
+    /** Adds committed text to the native ring buffer used for n-gram drafting. */
+    external fun recordCommittedText(text: String)
+
+    /**
+     * Returns `[draftedTokens, acceptedTokens]` accumulated by speculative decoding.
+     * The counters are cleared after reading when [reset] is true.
+     */
+    external fun getSpeculativeStats(reset: Boolean): LongArray
+
+    /**
+     * Keeps the work of requests that are superseded or cancelled (disabled by default).
+     * Generation returns the tokens it has already produced instead of an empty string,
+     * evaluation with completion keeps its FIX result, and scoring returns the scores it has
+     * finished with NaN for the rest. A later generation with the same prompt and input
+     * continues from the aborted output and reuses its KV cache instead of decoding it again.
+     */
+    external fun setSoftCancelEnabled(enabled: Boolean)
+
+    /**
+     * Returns `[abortedRequests, promptTokensDone, outputTokensDone, resumedTokens]`
+     * accumulated over aborted requests. The two "done" counts say how far those requests got.
+     * resumedTokens counts the aborted output that later generations continued from.
+     * The counters are cleared after reading when [reset] is true.
+     */
+    external fun getAbortStats(reset: Boolean): LongArray
+
+    /**
+     * Runs the submit* requests of different kinds together (disabled by default).
+     * A generation, an evaluation and a scoring request share one context. Each has its own
+     * sequence forked from the cached prompt prefix, and every decode batches the next tokens
+     * of all of them, so a score no longer waits for a long generation to finish.
+     * Latest-wins then applies per kind: a new request replaces only a pending or running
+     * request of the same kind, and [cancelCurrent] still stops all of them.
+     * The batched path skips drafting and computes every row over the full vocabulary.
+     */
+    external fun setContinuousBatchingEnabled(enabled: Boolean)
+
     external fun generate(
         prompt: String,
         maxTokens: Int
@@ -48,6 +295,24 @@ object ZenzEngine {
         maxTokens: Int
     ): String
 
+    /**
+     * Converts with a beam search of [beamWidth] beams that share the prompt KV cache, and
+     * returns up to `scores.size` distinct strings, best first. The score (sum of token log
+     * probabilities) of each returned string is written to [scores] in the same order.
+     */
+    external fun generateNBestV32(
+        profile: String,
+        topic: String,
+        style: String,
+        preference: String,
+        leftContext: String,
+        rightContext: String,
+        input: String,
+        maxTokens: Int,
+        beamWidth: Int,
+        scores: FloatArray
+    ): Array<String>
+
     external fun candidateEvaluate(
         profile: String?,
         topic: String?,
@@ -69,6 +334,41 @@ object ZenzEngine {
         candidate: String
     ): String
 
+    /**
+     * Same as [candidateEvaluateV32], but when the candidate needs a fix the native side keeps
+     * the verified KV cache and continues greedy decoding up to [maxTokens] tokens. That result
+     * is returned as `COMPLETE:<prefix>\u001F<result>`.
+     */
+    external fun candidateEvaluateAndCompleteV32(
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String,
+        candidate: String,
+        maxTokens: Int
+    ): String
+
+    /**
+     * Verifies several drafts (e.g. the top dictionary candidates) in one batched decode.
+     * Each element has the same format as [candidateEvaluateAndCompleteV32] and follows the
+     * order of [candidates]. When no draft passes and [maxTokens] > 0, only the draft with the
+     * longest accepted prefix is continued and returned as `COMPLETE:`.
+     */
+    external fun candidateEvaluateDraftsV32(
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String,
+        candidates: Array<String>,
+        maxTokens: Int
+    ): Array<String>
+
     external fun scoreCandidates(
         profile: String?,
         topic: String?,
@@ -89,4 +389,128 @@ object ZenzEngine {
         input: String?,
         candidates: Array<String>
     ): FloatArray
+
+    /**
+     * Finds only the best [topK] candidates with a branch-and-bound search. Candidates that
+     * cannot reach the top [topK] stop being decoded and are returned as NaN; the scores of the
+     * top [topK] match [scoreCandidates].
+     */
+    external fun rankCandidates(
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        input: String,
+        candidates: Array<String>,
+        topK: Int
+    ): FloatArray
+
+    external fun rankCandidatesV32(
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String?,
+        candidates: Array<String>,
+        topK: Int
+    ): FloatArray
+
+    /**
+     * Receives the results of the submit* requests. Called on the native scheduler thread.
+     */
+    interface RequestCallback {
+        /**
+         * [result] is a String for [submitGenerateV32] and [submitCandidateEvaluateV32], and a
+         * FloatArray for [submitScoreCandidatesV32], matching their synchronous counterparts.
+         * [truncated] is true when the request ran out of its deadline and [result] holds only
+         * the part it finished.
+         */
+        fun onResult(requestId: Long, result: Any?, truncated: Boolean)
+
+        /**
+         * The request was replaced by a newer submission or cancelled by [cancelCurrent]
+         * before it finished. No result follows.
+         */
+        fun onSuperseded(requestId: Long)
+
+        /**
+         * With [setSoftCancelEnabled], a request that was superseded or cancelled mid-run passes
+         * what it finished just before [onSuperseded]. The result has the same type as
+         * [onResult].
+         */
+        fun onPartialResult(requestId: Long, result: Any?) {}
+
+        /**
+         * Reports that [decoded] of the [total] prompt tokens have been prefilled. Called after
+         * each prefill chunk of a long prompt.
+         */
+        fun onPrefillProgress(requestId: Long, decoded: Int, total: Int) {}
+    }
+
+    /**
+     * Runs [generateWithContextAndConditionsV32] on the native scheduler thread and returns
+     * immediately. Only the latest submission runs: a newer submit replaces a request that has
+     * not started, and stops a running one at the end of its current prefill chunk (see
+     * [setPrefillChunkSize]), so the shared prompt prefix stays in the KV cache for the newer
+     * request.
+     *
+     * When [deadlineMs] > 0, the request gets that many milliseconds from submission. The
+     * engine estimates the cost of each decode from recent requests, skips draft verification
+     * that would not fit, and stops generating when the next token would miss the deadline;
+     * the text generated so far is returned as truncated. An empty truncated result means
+     * the prompt prefill did not finish; the decoded part stays cached for the next request.
+     */
+    external fun submitGenerateV32(
+        requestId: Long,
+        profile: String,
+        topic: String,
+        style: String,
+        preference: String,
+        leftContext: String,
+        rightContext: String,
+        input: String,
+        maxTokens: Int,
+        deadlineMs: Int,
+        callback: RequestCallback
+    )
+
+    /**
+     * Scheduled version of [candidateEvaluateV32]; see [submitGenerateV32]. A truncated result
+     * is "ERROR".
+     */
+    external fun submitCandidateEvaluateV32(
+        requestId: Long,
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String,
+        candidate: String,
+        deadlineMs: Int,
+        callback: RequestCallback
+    )
+
+    /**
+     * Scheduled version of [scoreCandidatesV32]; see [submitGenerateV32]. With a deadline,
+     * candidates are scored in order as long as the scoring decode fits (the first one
+     * always is), and the rest are returned as NaN.
+     */
+    external fun submitScoreCandidatesV32(
+        requestId: Long,
+        profile: String?,
+        topic: String?,
+        style: String?,
+        preference: String?,
+        leftContext: String?,
+        rightContext: String?,
+        input: String?,
+        candidates: Array<String>,
+        deadlineMs: Int,
+        callback: RequestCallback
+    )
 }
@@ -0,0 +1,115 @@
+// zenz_cpu の性能コア選択を、一時ディレクトリに作った偽の sysfs で確かめるテスト。
+
+#include "zenz_cpu.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+static int g_failures = 0;
+
+#define EXPECT(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            std::fprintf(stderr, __VA_ARGS__); \
+            std::fprintf(stderr, "\n"); \
+            ++g_failures; \
+        } \
+    } while (0)
+
+static void make_dirs(const std::string &path) {
+    for (size_t pos = 1; pos <= path.size(); ++pos) {
+        if (pos == path.size() || path[pos] == '/') {
+            mkdir(path.substr(0, pos).c_str(), 0755);
+        }
+    }
+}
+
+static void write_file(const std::string &path, const std::string &content) {
+    make_dirs(path.substr(0, path.rfind('/')));
+    FILE *f = std::fopen(path.c_str(), "w");
+    if (!f) {
+        std::fprintf(stderr, "cannot write %s\n", path.c_str());
+        std::exit(2);
+    }
+    std::fputs(content.c_str(), f);
+    std::fclose(f);
+}
+
+// 偽の sysfs を作る。max_freqs[i] が 0 なら cpufreq を置かない。
+static std::string make_sysfs(const char *name, const std::vector<long> &max_freqs) {
+    char templ[] = "/tmp/zenz_cpu_test_XXXXXX";
+    const char *dir = mkdtemp(templ);
+    if (!dir) {
+        std::fprintf(stderr, "mkdtemp failed\n");
+        std::exit(2);
+    }
+    const std::string root = std::string(dir) + "/" + name;
+    const std::string cpu_root = root + "/devices/system/cpu";
+    make_dirs(cpu_root + "/cpufreq");
+    make_dirs(cpu_root + "/cpuidle");
+    write_file(cpu_root + "/online", "0-" + std::to_string(max_freqs.size() - 1) + "\n");
+    for (size_t i = 0; i < max_freqs.size(); ++i) {
+        const std::string base = cpu_root + "/cpu" + std::to_string(i);
+        make_dirs(base);
+        if (max_freqs[i] > 0) {
+            write_file(base + "/cpufreq/cpuinfo_max_freq", std::to_string(max_freqs[i]) + "\n");
+        }
+    }
+    return root;
+}
+
+static std::string to_string(const std::vector<int> &cpus) {
+    std::string out;
+    for (int cpu: cpus) {
+        out += (out.empty() ? "" : ",") + std::to_string(cpu);
+    }
+    return "[" + out + "]";
+}
+
+static void expect_cpus(const char *label, const std::string &root, const std::vector<int> &expected) {
+    const auto actual = zenz_performance_cpus(root);
+    EXPECT(actual == expected, "%s: %s, expected %s", label, to_string(actual).c_str(),
+           to_string(expected).c_str());
+}
+
+int main() {
+    // 4 LITTLE + 3 big + 1 prime: LITTLE 以外を選ぶ
+    const auto tri = make_sysfs("tri", {1800000, 1800000, 1800000, 1800000, 2400000, 2400000, 2400000, 3000000});
+    expect_cpus("big.LITTLE+prime", tri, {4, 5, 6, 7});
+
+    // 全コア同じ周波数なら全部
+    const auto homogeneous = make_sysfs("homogeneous", {2000000, 2000000, 2000000, 2000000});
+    expect_cpus("homogeneous", homogeneous, {0, 1, 2, 3});
+
+    // オフラインのコアは選ばない (cpu0 には online ファイルがないのが普通)
+    const auto offline = make_sysfs("offline", {1700000, 1700000, 2800000, 2800000});
+    write_file(offline + "/devices/system/cpu/cpu3/online", "0\n");
+    write_file(offline + "/devices/system/cpu/cpu2/online", "1\n");
+    expect_cpus("offline", offline, {2});
+
+    // cpufreq がなければ cpu_capacity を使う
+    const auto capacity = make_sysfs("capacity", {0, 0, 0, 0});
+    for (int i = 0; i < 4; ++i) {
+        write_file(capacity + "/devices/system/cpu/cpu" + std::to_string(i) + "/cpu_capacity",
+                   i < 2 ? "512\n" : "1024\n");
+    }
+    expect_cpus("capacity", capacity, {2, 3});
+
+    // どちらも読めないコアは除き、何も読めなければ空
+    const auto partial = make_sysfs("partial", {0, 1500000, 2500000});
+    expect_cpus("partial", partial, {2});
+    expect_cpus("unreadable", make_sysfs("unreadable", {0, 0}), {});
+    expect_cpus("missing", "/nonexistent/zenz_cpu_test", {});
+
+    // 2 桁の CPU 番号も数値順に並ぶ
+    std::vector<long> many(12, 1000000);
+    many[10] = many[11] = 2000000;
+    expect_cpus("two-digit", make_sysfs("many", many), {10, 11});
+
+    std::printf("zenz_cpu_test: %s\n", g_failures == 0 ? "OK" : "FAILED");
+    return g_failures == 0 ? 0 : 1;
+}
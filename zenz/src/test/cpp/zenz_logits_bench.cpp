@@ -0,0 +1,108 @@
+// 語彙サイズの logits 行の要約 (argmax + log-sum-exp) のマイクロベンチマーク。
+//   zenz_logits_bench [n_vocab] [n_rows] [n_threads]
+// これまでのスカラー実装 (argmax と double の exp の 2 パス) と、zenz_logits のカーネルを比べる。
+
+#include "zenz_logits.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+static float reference_stats(const float *logits, int32_t n_vocab, int32_t &argmax) {
+    argmax = 0;
+    float max_logit = logits[0];
+    for (int32_t tid = 1; tid < n_vocab; ++tid) {
+        if (logits[tid] > max_logit) {
+            max_logit = logits[tid];
+            argmax = tid;
+        }
+    }
+    double sum_exp = 0.0;
+    for (int32_t tid = 0; tid < n_vocab; ++tid) {
+        sum_exp += exp((double) logits[tid] - (double) max_logit);
+    }
+    return max_logit + (float) log(sum_exp);
+}
+
+template<typename F>
+static double best_of_us(int repeats, F &&body) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; ++r) {
+        const auto started = std::chrono::steady_clock::now();
+        body();
+        const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - started).count();
+        best = std::min(best, us);
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    const int32_t n_vocab = argc > 1 ? std::atoi(argv[1]) : 6000;
+    const size_t n_rows = argc > 2 ? (size_t) std::atoi(argv[2]) : 32;
+    const int n_threads = argc > 3 ? std::atoi(argv[3]) : 4;
+    const int repeats = 50;
+
+    std::mt19937 rng(1);
+    std::normal_distribution<float> normal(0.0f, 4.0f);
+    std::vector<float> logits((size_t) n_vocab * n_rows);
+    for (auto &v: logits) {
+        v = normal(rng);
+    }
+    std::vector<const float *> rows;
+    for (size_t i = 0; i < n_rows; ++i) {
+        rows.push_back(logits.data() + i * (size_t) n_vocab);
+    }
+
+    volatile float sink = 0.0f;
+    const double reference_us = best_of_us(repeats, [&] {
+        for (const float *row: rows) {
+            int32_t argmax;
+            sink = sink + reference_stats(row, n_vocab, argmax) + (float) argmax;
+        }
+    });
+    const double scalar_us = best_of_us(repeats, [&] {
+        for (const float *row: rows) {
+            sink = sink + zenz_logit_stats_scalar(row, n_vocab).log_sum_exp;
+        }
+    });
+    const double kernel_us = best_of_us(repeats, [&] {
+        for (const float *row: rows) {
+            sink = sink + zenz_logit_stats(row, n_vocab).log_sum_exp;
+        }
+    });
+    std::vector<ZenzLogitStats> out(n_rows);
+    const double rows_us = best_of_us(repeats, [&] {
+        zenz_logit_stats_rows(rows.data(), n_rows, n_vocab, out.data(), n_threads);
+        sink = sink + out[0].log_sum_exp;
+    });
+    const double argmax_reference_us = best_of_us(repeats, [&] {
+        for (const float *row: rows) {
+            int32_t argmax = 0;
+            for (int32_t tid = 1; tid < n_vocab; ++tid) {
+                if (row[tid] > row[argmax]) {
+                    argmax = tid;
+                }
+            }
+            sink = sink + (float) argmax;
+        }
+    });
+    const double argmax_us = best_of_us(repeats, [&] {
+        for (const float *row: rows) {
+            sink = sink + (float) zenz_logit_argmax(row, n_vocab);
+        }
+    });
+
+    std::printf("n_vocab=%d rows=%zu kernel=%s\n", n_vocab, n_rows, zenz_logit_kernel_name());
+    std::printf("  stats  reference (2 pass, double exp): %9.1f us\n", reference_us);
+    std::printf("  stats  zenz_logit_stats_scalar:        %9.1f us\n", scalar_us);
+    std::printf("  stats  zenz_logit_stats:               %9.1f us (x%.1f)\n", kernel_us, reference_us / kernel_us);
+    std::printf("  stats  zenz_logit_stats_rows (%d thr):  %9.1f us (x%.1f)\n", n_threads, rows_us,
+                reference_us / rows_us);
+    std::printf("  argmax reference:                      %9.1f us\n", argmax_reference_us);
+    std::printf("  argmax zenz_logit_argmax:              %9.1f us (x%.1f)\n", argmax_us,
+                argmax_reference_us / argmax_us);
+    return 0;
+}
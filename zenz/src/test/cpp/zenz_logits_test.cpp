@@ -0,0 +1,138 @@
+// zenz_logits のカーネルを、これまで zenz_bridge.cpp で使っていたスカラー実装
+// (argmax と double の log-sum-exp の 2 パス) と比べる精度テスト。
+
+#include "zenz_logits.h"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+static int g_failures = 0;
+
+#define EXPECT(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            std::fprintf(stderr, __VA_ARGS__); \
+            std::fprintf(stderr, "\n"); \
+            ++g_failures; \
+        } \
+    } while (0)
+
+static int32_t reference_argmax(const float *logits, int32_t n_vocab) {
+    int32_t best_id = 0;
+    float best_logit = logits[0];
+    for (int32_t tid = 1; tid < n_vocab; ++tid) {
+        if (logits[tid] > best_logit) {
+            best_logit = logits[tid];
+            best_id = tid;
+        }
+    }
+    return best_id;
+}
+
+static double reference_log_sum_exp(const float *logits, int32_t n_vocab) {
+    float max_logit = logits[reference_argmax(logits, n_vocab)];
+    if (max_logit == -INFINITY) {
+        return -INFINITY;
+    }
+    double sum_exp = 0.0;
+    for (int32_t tid = 0; tid < n_vocab; ++tid) {
+        sum_exp += exp((double) logits[tid] - (double) max_logit);
+    }
+    return max_logit + log(sum_exp);
+}
+
+static void check_row(const char *label, const std::vector<float> &row) {
+    const auto n = (int32_t) row.size();
+    const int32_t expected_argmax = reference_argmax(row.data(), n);
+    const double expected_lse = reference_log_sum_exp(row.data(), n);
+
+    const ZenzLogitStats kernels[] = {zenz_logit_stats(row.data(), n), zenz_logit_stats_scalar(row.data(), n)};
+    for (const auto &stats: kernels) {
+        EXPECT(stats.argmax == expected_argmax, "%s n=%d: argmax %d, expected %d", label, n, stats.argmax,
+               expected_argmax);
+        EXPECT(stats.max_logit == row[(size_t) expected_argmax], "%s n=%d: max_logit %g", label, n,
+               stats.max_logit);
+        if (std::isinf(expected_lse)) {
+            EXPECT(stats.log_sum_exp == (float) expected_lse, "%s n=%d: log_sum_exp %g, expected %g", label, n,
+                   stats.log_sum_exp, expected_lse);
+        } else {
+            const double tolerance = 2e-6 * std::max(1.0, std::fabs(expected_lse)) + 2e-6;
+            EXPECT(std::fabs(stats.log_sum_exp - expected_lse) <= tolerance,
+                   "%s n=%d: log_sum_exp %.9g, expected %.9g", label, n, stats.log_sum_exp, expected_lse);
+        }
+    }
+    EXPECT(zenz_logit_argmax(row.data(), n) == expected_argmax, "%s n=%d: zenz_logit_argmax", label, n);
+}
+
+int main() {
+    std::mt19937 rng(12345);
+    std::normal_distribution<float> normal(0.0f, 4.0f);
+    const int32_t sizes[] = {1, 2, 7, 63, 64, 65, 127, 1000, 6000, 6001, 32000};
+
+    for (int32_t n: sizes) {
+        for (int trial = 0; trial < 20; ++trial) {
+            std::vector<float> row((size_t) n);
+            for (auto &v: row) {
+                v = normal(rng);
+            }
+            check_row("normal", row);
+
+            // 離れた位置に同じ最大値を置くと、ID の小さい方を選ぶ
+            if (n >= 2) {
+                std::uniform_int_distribution<int32_t> pick(0, n - 1);
+                const int32_t a = pick(rng);
+                const int32_t b = pick(rng);
+                row[(size_t) a] = 50.0f;
+                row[(size_t) b] = 50.0f;
+                check_row("tie", row);
+            }
+
+            // 最大値が後ろのブロックほど大きくなる (和のスケールを何度も直す)
+            for (int32_t i = 0; i < n; ++i) {
+                row[(size_t) i] = (float) i * 0.01f + normal(rng) * 0.1f;
+            }
+            check_row("increasing", row);
+
+            // exp がアンダーフローする差と -inf (マスクされたトークン)
+            for (int32_t i = 0; i < n; ++i) {
+                row[(size_t) i] = i % 3 == 0 ? -INFINITY : normal(rng) * 40.0f;
+            }
+            row[(size_t) (n - 1)] = 30.0f;
+            check_row("wide", row);
+
+            // exp(x) が float で溢れる大きさの logits
+            for (auto &v: row) {
+                v = 1000.0f + normal(rng);
+            }
+            check_row("large", row);
+        }
+        std::vector<float> masked((size_t) n, -INFINITY);
+        check_row("all-masked", masked);
+    }
+
+    // 複数行・複数スレッドでも 1 行ずつと同じ結果になる
+    const int32_t n_vocab = 6000;
+    std::vector<std::vector<float>> rows(40, std::vector<float>((size_t) n_vocab));
+    std::vector<const float *> row_ptrs;
+    for (auto &row: rows) {
+        for (auto &v: row) {
+            v = normal(rng);
+        }
+        row_ptrs.push_back(row.data());
+    }
+    for (int n_threads: {1, 4}) {
+        std::vector<ZenzLogitStats> out(rows.size());
+        zenz_logit_stats_rows(row_ptrs.data(), row_ptrs.size(), n_vocab, out.data(), n_threads);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            const ZenzLogitStats single = zenz_logit_stats(row_ptrs[i], n_vocab);
+            EXPECT(out[i].argmax == single.argmax && out[i].log_sum_exp == single.log_sum_exp,
+                   "rows n_threads=%d row=%zu differs from the single-row kernel", n_threads, i);
+        }
+    }
+
+    std::printf("zenz_logits_test (%s): %s\n", zenz_logit_kernel_name(), g_failures == 0 ? "OK" : "FAILED");
+    return g_failures == 0 ? 0 : 1;
+}
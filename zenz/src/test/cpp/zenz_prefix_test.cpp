@@ -0,0 +1,70 @@
+// zenz_prefix の KV 接頭辞再利用の判断 (共通接頭辞・切り詰め位置・デコードし直す範囲) のテスト。
+
+#include "zenz_prefix.h"
+
+#include <cstdio>
+#include <vector>
+
+static int g_failures = 0;
+
+#define EXPECT(cond, ...) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            std::fprintf(stderr, __VA_ARGS__); \
+            std::fprintf(stderr, "\n"); \
+            ++g_failures; \
+        } \
+    } while (0)
+
+using Tokens = std::vector<int32_t>;
+
+static void expect_plan(
+        const char *name,
+        const Tokens &kv_tokens,
+        const Tokens &tokens,
+        size_t max_reuse,
+        size_t keep,
+        bool trim
+) {
+    const ZenzPrefixReuse plan = zenz_plan_prefix_reuse(kv_tokens, tokens, max_reuse);
+    EXPECT(plan.keep == keep, "%s: keep %zu, expected %zu", name, plan.keep, keep);
+    EXPECT(plan.trim == trim, "%s: trim %d, expected %d", name, plan.trim, trim);
+    EXPECT(plan.n_decode == tokens.size() - keep, "%s: n_decode %zu, expected %zu",
+           name, plan.n_decode, tokens.size() - keep);
+}
+
+int main() {
+    EXPECT(zenz_common_prefix_length({}, {1, 2}) == 0, "empty");
+    EXPECT(zenz_common_prefix_length({1, 2, 3}, {1, 2, 4}) == 2, "diverging");
+    EXPECT(zenz_common_prefix_length({1, 2}, {1, 2, 3}) == 2, "lhs is a prefix");
+    EXPECT(zenz_common_prefix_length({1, 2, 3}, {1, 2}) == 2, "rhs is a prefix");
+    EXPECT(zenz_common_prefix_length({5, 2}, {1, 2}) == 0, "first token differs");
+
+    // 空の KV からはプロンプト全体をデコードする
+    expect_plan("cold", {}, {1, 2, 3}, 2, 0, false);
+
+    // 同じプロンプトでも最後のトークンは logits のためにデコードし直す
+    expect_plan("same prompt", {1, 2, 3}, {1, 2, 3}, 2, 2, true);
+    expect_plan("same prompt, logits not needed", {1, 2, 3}, {1, 2, 3}, 3, 3, false);
+
+    // 前回のプロンプトに続けて入力が伸びた場合は KV をそのまま使い、差分だけデコードする
+    expect_plan("appended", {1, 2, 3}, {1, 2, 3, 4, 5}, 4, 3, false);
+
+    // 前回の生成結果が KV の後ろに残っていれば、共通接頭辞より後ろを捨てる
+    expect_plan("previous output", {1, 2, 3, 7, 8}, {1, 2, 3, 4}, 3, 3, true);
+
+    // 途中で分かれたら分かれた位置まで戻す
+    expect_plan("edited", {1, 2, 3, 4, 5}, {1, 2, 9, 4, 5}, 4, 2, true);
+    expect_plan("first token differs", {9, 2, 3}, {1, 2, 3}, 2, 0, true);
+
+    // max_reuse で再利用を打ち切る (候補の採点で logits を取り始める位置など)
+    expect_plan("capped", {1, 2, 3, 4}, {1, 2, 3, 4, 5}, 1, 1, true);
+    expect_plan("no reuse", {1, 2}, {1, 2}, 0, 0, true);
+
+    // max_reuse がプロンプトより長くても、プロンプトを超えては残さない
+    expect_plan("prompt shorter than kv", {1, 2, 3, 4}, {1, 2}, 10, 2, true);
+
+    std::printf("zenz_prefix_test: %s\n", g_failures == 0 ? "OK" : "FAILED");
+    return g_failures == 0 ? 0 : 1;
+}